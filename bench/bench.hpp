@@ -0,0 +1,65 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// Helpers shared by the benchmarks.
+//
+
+#ifndef MOOVOO_BENCH_INCLUDED
+#define MOOVOO_BENCH_INCLUDED
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+
+inline std::vector<uint8_t> bench_read_file(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    printf("could not read %s\n", path.c_str());
+    exit(1);
+  }
+  return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+// The best time in seconds of several runs of fn().
+template <class Fn>
+double bench_seconds(int runs, Fn fn) {
+  double best = 1e30;
+  for (int i = 0; i != runs; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+    best = std::min(best, t.count());
+  }
+  return best;
+}
+
+inline void bench_report(const char *name, size_t bytes, double seconds) {
+  printf("%-32s %10.2f MB %10.4f s %10.1f MB/s\n", name, bytes * 1e-6, seconds, bytes * 1e-6 / seconds);
+}
+
+// A large mmCIF made by repeating the _atom_site rows of a small one.
+inline std::vector<uint8_t> bench_repeat_atom_site(const std::vector<uint8_t> &cif, int copies) {
+  std::string text(cif.begin(), cif.end());
+  size_t rows = text.find("\nATOM ");
+  size_t hetatm = text.find("\nHETATM");
+  if (hetatm < rows) rows = hetatm;
+  if (rows == std::string::npos) return cif;
+  rows += 1;
+  size_t end = text.find("\n#", rows);
+  end = end == std::string::npos ? text.size() : end + 1;
+
+  std::string result = text.substr(0, rows);
+  for (int i = 0; i != copies; ++i) result += text.substr(rows, end - rows);
+  result += text.substr(end);
+  return std::vector<uint8_t>(result.begin(), result.end());
+}
+
+#endif
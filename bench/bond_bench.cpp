@@ -0,0 +1,116 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// spatial_order and bond_finder: the time to sort atoms along a curve and
+// to find bonds in file, Morton, Hilbert and random order. Every order
+// must find the same bonds as file order.
+//
+//   bond_bench molecules [copies per axis]
+//
+
+#include <gilgamesh/decoders/pdb_decoder.hpp>
+#include <gilgamesh/spatial_order.hpp>
+#include <gilgamesh/bond_finder.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <random>
+#include "bench.hpp"
+
+using gilgamesh::spatial_order;
+
+typedef std::vector<std::pair<int, int> > bond_list;
+
+// The bonds as original indices, lower first, sorted.
+static bond_list original_bonds(const gilgamesh::bond_finder &finder, const std::vector<int> &order) {
+  bond_list result;
+  for (auto &b : finder.bonds()) {
+    int from = order[b.first], to = order[b.second];
+    result.emplace_back(std::min(from, to), std::max(from, to));
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+static void bench_molecule(const char *name, const std::vector<glm::vec3> &pos, const std::vector<float> &radii) {
+  printf("%s: %d atoms\n", name, (int)pos.size());
+  printf("                       order s    1 thread s   all threads s   bonds\n");
+  unsigned threads = gilgamesh::hardware_threads();
+
+  std::vector<int> file_order(pos.size());
+  for (size_t i = 0; i != pos.size(); ++i) file_order[i] = (int)i;
+  bond_list expected = original_bonds(gilgamesh::bond_finder(pos, radii, 0.4f, 0.4f, threads), file_order);
+
+  std::vector<int> random_order = file_order;
+  std::shuffle(random_order.begin(), random_order.end(), std::mt19937(1));
+
+  enum kind { file, morton, hilbert, random };
+  struct run { const char *name; kind k; };
+  for (run r : { run{ "file", file }, run{ "morton", morton }, run{ "hilbert", hilbert }, run{ "random", random } }) {
+    std::vector<int> order;
+    std::vector<glm::vec3> sorted_pos;
+    std::vector<float> sorted_radii;
+    double order_seconds = bench_seconds(3, [&]() {
+      if (r.k == morton || r.k == hilbert) {
+        spatial_order so(pos, r.k == morton ? spatial_order::curve::morton : spatial_order::curve::hilbert);
+        order = so.order();
+      } else {
+        order = r.k == file ? file_order : random_order;
+      }
+      sorted_pos.resize(pos.size());
+      sorted_radii.resize(pos.size());
+      for (size_t i = 0; i != order.size(); ++i) {
+        sorted_pos[i] = pos[order[i]];
+        sorted_radii[i] = radii[order[i]];
+      }
+    });
+
+    gilgamesh::bond_finder finder;
+    double one_seconds = bench_seconds(3, [&]() {
+      finder = gilgamesh::bond_finder(sorted_pos, sorted_radii, 0.4f, 0.4f, 1);
+    });
+    double all_seconds = bench_seconds(3, [&]() {
+      finder = gilgamesh::bond_finder(sorted_pos, sorted_radii, 0.4f, 0.4f, threads);
+    });
+
+    bool same = original_bonds(finder, order) == expected;
+    printf("  %-18s %9.4f %12.4f %15.4f %9d%s\n", r.name, order_seconds, one_seconds, all_seconds, (int)finder.bonds().size(), same ? "" : "  WRONG BONDS");
+    if (!same) exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  int copies = argc > 2 ? atoi(argv[2]) : 3;
+
+  std::vector<uint8_t> text = bench_read_file(dir + "/5wsn.pdb");
+  gilgamesh::pdb_decoder pdb(text.data(), text.data() + text.size());
+  std::vector<glm::vec3> pos;
+  std::vector<float> radii;
+  glm::vec3 min(1e9f), max(-1e9f);
+  for (auto &a : pdb.allAtoms()) {
+    pos.push_back(a.pos());
+    radii.push_back(a.covalentRadius());
+    min = glm::min(min, a.pos());
+    max = glm::max(max, a.pos());
+  }
+  bench_molecule("5wsn", pos, radii);
+
+  // A crystal of copies, one after another in the file, as a large structure would be.
+  glm::vec3 step = max - min + glm::vec3(5);
+  std::vector<glm::vec3> crystal_pos;
+  std::vector<float> crystal_radii;
+  for (int z = 0; z != copies; ++z) {
+    for (int y = 0; y != copies; ++y) {
+      for (int x = 0; x != copies; ++x) {
+        for (size_t i = 0; i != pos.size(); ++i) {
+          crystal_pos.push_back(pos[i] + glm::vec3(x, y, z) * step);
+          crystal_radii.push_back(radii[i]);
+        }
+      }
+    }
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "5wsn x %d", copies * copies * copies);
+  bench_molecule(name, crystal_pos, crystal_radii);
+  return 0;
+}
@@ -0,0 +1,85 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// brotli decoding speed, one-shot and streamed, against the reference
+// decoder where it was found. Streams are made with the reference encoder.
+//
+//   brotli_bench molecules [copies]
+//
+
+#include <andyzip/brotli_decoder.hpp>
+#include <brotli/encode.h>
+#include "bench.hpp"
+
+#ifdef BENCH_BROTLIDEC
+  #include <brotli/decode.h>
+#endif
+
+using andyzip::brotli_decoder;
+using andyzip::brotli_decoder_state;
+
+static std::vector<uint8_t> encode(const std::vector<uint8_t> &text, int quality) {
+  size_t size = BrotliEncoderMaxCompressedSize(text.size());
+  std::vector<uint8_t> result(size);
+  BrotliEncoderCompress(quality, 22, BROTLI_MODE_GENERIC, text.size(), text.data(), &size, result.data());
+  result.resize(size);
+  return result;
+}
+
+static void bench_file(const char *name, const std::vector<uint8_t> &text) {
+  for (int quality : { 5, 9, 11 }) {
+    std::vector<uint8_t> encoded = encode(text, quality);
+    printf("%s q%d, %d%% of the text\n", name, quality, (int)(encoded.size() * 100 / text.size()));
+
+    std::vector<uint8_t> decoded(text.size());
+    bool ok = true;
+    brotli_decoder decoder;
+    double seconds = bench_seconds(5, [&]() {
+      brotli_decoder_state state;
+      state.src = (const char *)encoded.data();
+      state.bitptr_max = (uint32_t)(encoded.size() * 8);
+      state.dest = (char *)decoded.data();
+      state.dest_max = (char *)decoded.data() + decoded.size();
+      ok &= decoder.decode(state) == brotli_decoder_state::error_code::end;
+    });
+    bench_report("andyzip decode", text.size(), seconds);
+    if (!ok || decoded != text) printf("  andyzip decode does not match the text\n");
+
+    // The state keeps its ring between runs, as a loader decoding many files would.
+    brotli_decoder_state state;
+    size_t size = 0;
+    seconds = bench_seconds(5, [&]() {
+      state.src = (const char *)encoded.data();
+      state.bitptr = 0;
+      state.bitptr_max = (uint32_t)(encoded.size() * 8);
+      size = 0;
+      ok &= decoder.decode_stream(state, [&](const uint8_t *b, const uint8_t *e) {
+        ok &= size + (e - b) <= text.size() && !memcmp(text.data() + size, b, e - b);
+        size += e - b;
+        return true;
+      }) == brotli_decoder_state::error_code::end;
+    });
+    bench_report("andyzip decode_stream", text.size(), seconds);
+    if (!ok || size != text.size()) printf("  andyzip decode_stream does not match the text\n");
+
+    #ifdef BENCH_BROTLIDEC
+      seconds = bench_seconds(5, [&]() {
+        size_t decoded_size = decoded.size();
+        BrotliDecoderDecompress(encoded.size(), encoded.data(), &decoded_size, decoded.data());
+      });
+      bench_report("reference decode", text.size(), seconds);
+    #endif
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  int copies = argc > 2 ? atoi(argv[2]) : 60;
+
+  std::vector<uint8_t> cif = bench_read_file(dir + "/2tgt.cif");
+  bench_file("5wsn.pdb", bench_read_file(dir + "/5wsn.pdb"));
+  bench_file("2tgt.cif", cif);
+  bench_file("2tgt.cif atom_site repeated", bench_repeat_atom_site(cif, copies));
+  return 0;
+}
@@ -0,0 +1,38 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// mmCIF decoding speed. cif_bench uses the SSE2/AVX2 row tokenizer where the
+// compiler allows it, cif_bench_scalar is built with GILGAMESH_NO_SIMD.
+//
+//   cif_bench molecules [copies]
+//
+
+#include <gilgamesh/decoders/pdb_decoder.hpp>
+#include "bench.hpp"
+
+using gilgamesh::pdb_decoder;
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  int copies = argc > 2 ? atoi(argv[2]) : 60;
+
+  #if defined(GILGAMESH_AVX2)
+    const char *simd = "avx2";
+  #elif defined(GILGAMESH_SSE2)
+    const char *simd = "sse2";
+  #else
+    const char *simd = "scalar";
+  #endif
+
+  std::vector<uint8_t> cif = bench_repeat_atom_site(bench_read_file(dir + "/2tgt.cif"), copies);
+  size_t atoms = 0;
+  double seconds = bench_seconds(5, [&]() {
+    pdb_decoder decoder(cif.data(), cif.data() + cif.size());
+    atoms = decoder.allAtoms().size();
+  });
+
+  printf("%s tokenizer, %d copies of 2tgt's atom_site, %d atoms\n", simd, copies, (int)atoms);
+  bench_report("pdb_decoder cif", cif.size(), seconds);
+  return 0;
+}
@@ -0,0 +1,121 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// deflate decoding and encoding speed, against zlib where it was found.
+// Encoding is timed on 1, 2, 4 and 8 threads, and on all the hardware threads
+// if there are more. Exits with 1 if the thread counts disagree or any
+// stream does not decode to its text.
+//
+//   deflate_bench molecules [copies]
+//
+
+#include <andyzip/deflate_decoder.hpp>
+#include <andyzip/deflate_encoder.hpp>
+#include <gilgamesh/parallel.hpp>
+#include "bench.hpp"
+
+#ifdef BENCH_ZLIB
+  #include <zlib.h>
+
+  // Raw deflate, as deflate_encoder writes.
+  static std::vector<uint8_t> zlib_encode(const std::vector<uint8_t> &src, int level) {
+    z_stream z{};
+    deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    std::vector<uint8_t> dest(deflateBound(&z, (uLong)src.size()));
+    z.next_in = (Bytef *)src.data();
+    z.avail_in = (uInt)src.size();
+    z.next_out = dest.data();
+    z.avail_out = (uInt)dest.size();
+    deflate(&z, Z_FINISH);
+    dest.resize(z.total_out);
+    deflateEnd(&z);
+    return dest;
+  }
+
+  static bool zlib_decode(std::vector<uint8_t> &dest, const std::vector<uint8_t> &src) {
+    z_stream z{};
+    inflateInit2(&z, -15);
+    z.next_in = (Bytef *)src.data();
+    z.avail_in = (uInt)src.size();
+    z.next_out = dest.data();
+    z.avail_out = (uInt)dest.size();
+    int result = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    return result == Z_STREAM_END;
+  }
+#endif
+
+static void bench_file(const char *name, const std::vector<uint8_t> &text) {
+  printf("%s\n", name);
+  andyzip::deflate_encoder encoder(6);
+  std::vector<uint8_t> encoded;
+  double seconds = bench_seconds(3, [&]() {
+    encoded.clear();
+    encoder.encode(encoded, text.data(), text.data() + text.size(), 1);
+  });
+  bench_report("andyzip encode -6, 1 thread", text.size(), seconds);
+  printf("  %d%% of the text\n", (int)(encoded.size() * 100 / text.size()));
+
+  // Each thread count must write the same stream as one thread does.
+  std::vector<unsigned> thread_counts = { 2, 4, 8 };
+  if (gilgamesh::hardware_threads() > 8) thread_counts.push_back(gilgamesh::hardware_threads());
+  for (unsigned threads : thread_counts) {
+    std::vector<uint8_t> threaded;
+    seconds = bench_seconds(3, [&]() {
+      threaded.clear();
+      encoder.encode(threaded, text.data(), text.data() + text.size(), threads);
+    });
+    char label[64];
+    snprintf(label, sizeof(label), "andyzip encode -6, %u threads", threads);
+    bench_report(label, text.size(), seconds);
+    if (threaded != encoded) {
+      printf("  the stream from %u threads differs from the one from 1 thread\n", threads);
+      exit(1);
+    }
+  }
+
+  andyzip::deflate_decoder decoder;
+  std::vector<uint8_t> decoded(text.size());
+  bool ok = true;
+  auto decode = [&](const std::vector<uint8_t> &src) {
+    ok &= decoder.decode(decoded.data(), decoded.data() + decoded.size(), src.data(), src.data() + src.size());
+  };
+  seconds = bench_seconds(5, [&]() { decode(encoded); });
+  bench_report("andyzip decode", text.size(), seconds);
+  if (!ok || decoded != text) {
+    printf("  andyzip decode does not match the text\n");
+    exit(1);
+  }
+
+  #ifdef BENCH_ZLIB
+    std::vector<uint8_t> zlib = zlib_encode(text, 6);
+    seconds = bench_seconds(5, [&]() { decode(zlib); });
+    bench_report("andyzip decode of zlib -6", text.size(), seconds);
+    if (!ok || decoded != text) {
+      printf("  andyzip decode of zlib does not match the text\n");
+      exit(1);
+    }
+
+    seconds = bench_seconds(5, [&]() { ok &= zlib_decode(decoded, zlib); });
+    bench_report("zlib decode of zlib -6", text.size(), seconds);
+
+    // zlib must also read what andyzip writes.
+    std::fill(decoded.begin(), decoded.end(), 0);
+    if (!zlib_decode(decoded, encoded) || decoded != text) {
+      printf("  zlib decode of andyzip does not match the text\n");
+      exit(1);
+    }
+  #endif
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  int copies = argc > 2 ? atoi(argv[2]) : 60;
+
+  std::vector<uint8_t> cif = bench_read_file(dir + "/2tgt.cif");
+  bench_file("5wsn.pdb", bench_read_file(dir + "/5wsn.pdb"));
+  bench_file("2tgt.cif", cif);
+  bench_file("2tgt.cif atom_site repeated", bench_repeat_atom_site(cif, copies));
+  return 0;
+}
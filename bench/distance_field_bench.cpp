@@ -0,0 +1,75 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// distance_field: the error of the sweep and of the exact transform against
+// brute force at random grid points, and the time each takes.
+//
+//   distance_field_bench molecules [samples]
+//
+
+#include <gilgamesh/decoders/pdb_decoder.hpp>
+#include <gilgamesh/distance_field.hpp>
+#include <random>
+#include "bench.hpp"
+
+using gilgamesh::distance_field;
+
+static void bench_molecule(const char *name, const std::vector<uint8_t> &text, float spacing, int samples) {
+  gilgamesh::pdb_decoder pdb(text.data(), text.data() + text.size());
+  std::vector<glm::vec3> pos;
+  std::vector<float> radii;
+  glm::vec3 min(1e9f), max(-1e9f);
+  for (auto &a : pdb.atoms("", true, true)) {
+    pos.push_back(a.pos());
+    radii.push_back(a.vanDerVaalsRadius());
+    min = glm::min(min, a.pos());
+    max = glm::max(max, a.pos());
+  }
+  min -= glm::vec3(4);
+  max += glm::vec3(4);
+  glm::ivec3 dim = glm::ivec3((max - min) / spacing) + 1;
+  size_t size = (size_t)dim.x * dim.y * dim.z;
+  printf("%s: %d atoms, %dx%dx%d grid at %.2fA\n", name, (int)pos.size(), dim.x, dim.y, dim.z, spacing);
+  printf("                     mean err   max err   wrong region   seconds\n");
+
+  // The same random grid points for each method.
+  std::mt19937 gen(1);
+  std::vector<int> points(samples);
+  for (int &p : points) p = (int)(gen() % size);
+
+  struct run { const char *name; distance_field::method m; unsigned threads; };
+  unsigned threads = gilgamesh::hardware_threads();
+  for (run r : { run{ "sweep", distance_field::method::sweep, 1 }, run{ "exact", distance_field::method::exact, 1 }, run{ "exact all threads", distance_field::method::exact, threads } }) {
+    distance_field field;
+    double seconds = bench_seconds(3, [&]() {
+      field = distance_field(dim.x, dim.y, dim.z, spacing, min, pos, radii, r.m, r.threads);
+    });
+
+    double total_error = 0, max_error = 0;
+    int wrong = 0;
+    for (int p : points) {
+      int x = p % dim.x, y = p / dim.x % dim.y, z = p / (dim.x * dim.y);
+      glm::vec3 xyz = min + glm::vec3(x, y, z) * spacing;
+      float best = 1e30f;
+      for (size_t i = 0; i != pos.size(); ++i) {
+        best = std::min(best, glm::length(pos[i] - xyz) - radii[i]);
+      }
+      int pindex = field.pindices()[p];
+      float found = pindex < 0 ? 1e30f : glm::length(pos[pindex] - xyz) - radii[pindex];
+      double error = std::min(std::abs((double)field.distances()[p] - best), 1e6);
+      total_error += error;
+      max_error = std::max(max_error, error);
+      wrong += found > best + 1e-4f;
+    }
+    printf("  %-18s %9.3f %9.3f %13.1f%% %9.4f\n", r.name, total_error / samples, max_error, wrong * 100.0 / samples, seconds);
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  int samples = argc > 2 ? atoi(argv[2]) : 20000;
+  bench_molecule("5wsn", bench_read_file(dir + "/5wsn.pdb"), 1.0f, samples);
+  bench_molecule("2tgt", bench_read_file(dir + "/2tgt.cif"), 0.5f, samples);
+  return 0;
+}
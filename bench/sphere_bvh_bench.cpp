@@ -0,0 +1,133 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// sphere_bvh: the time to build the tree over copies of 5wsn and to pick,
+// pick4, find the nearest atom and refit after moves, per query. Some picks
+// are checked against brute force; exits with 1 if one is wrong.
+//
+//   sphere_bvh_bench molecules [millions of atoms]
+//
+
+#include <gilgamesh/sphere_bvh.hpp>
+#include <gilgamesh/decoders/pdb_decoder.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <random>
+#include "bench.hpp"
+
+using gilgamesh::sphere_bvh;
+
+// Copies of the atoms of a molecule on a cubic lattice until there are n of them.
+static void tile(const gilgamesh::pdb_decoder &pdb, size_t n, std::vector<glm::vec3> &centres, std::vector<float> &radii) {
+  glm::vec3 lo(1e38f), hi(-1e38f);
+  for (auto &a : pdb.allAtoms()) {
+    lo = glm::min(lo, a.pos());
+    hi = glm::max(hi, a.pos());
+  }
+  glm::vec3 step = hi - lo + 2.0f;
+  int per_axis = (int)std::ceil(std::cbrt((double)n / pdb.allAtoms().size()));
+  for (int copy = 0; centres.size() < n; ++copy) {
+    glm::vec3 offset = glm::vec3(copy % per_axis, copy / per_axis % per_axis, copy / (per_axis * per_axis)) * step;
+    for (auto &a : pdb.allAtoms()) {
+      if (centres.size() == n) break;
+      centres.push_back(a.pos() + offset);
+      radii.push_back(a.vanDerVaalsRadius());
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  size_t n = (size_t)((argc > 2 ? atof(argv[2]) : 10.0) * 1e6);
+
+  std::vector<uint8_t> text = bench_read_file(dir + "/5wsn.pdb");
+  gilgamesh::pdb_decoder pdb(text.data(), text.data() + text.size());
+  std::vector<glm::vec3> centres;
+  std::vector<float> radii;
+  tile(pdb, n, centres, radii);
+  glm::vec3 lo(1e38f), hi(-1e38f);
+  for (auto &c : centres) {
+    lo = glm::min(lo, c);
+    hi = glm::max(hi, c);
+  }
+  printf("%d atoms\n", (int)centres.size());
+
+  sphere_bvh bvh;
+  std::vector<unsigned> thread_counts = { 1 };
+  if (gilgamesh::hardware_threads() > 1) thread_counts.push_back(gilgamesh::hardware_threads());
+  for (unsigned threads : thread_counts) {
+    double seconds = bench_seconds(1, [&]() { bvh = sphere_bvh(centres, radii, threads); });
+    char label[64];
+    snprintf(label, sizeof(label), "build, %u thread%s", threads, threads == 1 ? "" : "s");
+    printf("  %-28s %10.3f s\n", label, seconds);
+  }
+
+  // Rays from a camera in front of the atoms through random points on their far side, as a click would be.
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> unit(0, 1);
+  glm::vec3 eye = (lo + hi) * 0.5f - glm::vec3(0, 0, (hi.z - lo.z) + glm::length(hi - lo));
+  const int num_rays = 10000;
+  std::vector<glm::vec3> dirs;
+  for (int i = 0; i != num_rays; ++i) {
+    glm::vec3 target(lo.x + (hi.x - lo.x) * unit(rng), lo.y + (hi.y - lo.y) * unit(rng), hi.z);
+    dirs.push_back(glm::normalize(target - eye));
+  }
+
+  std::vector<int> hits(num_rays);
+  std::vector<float> distances(num_rays);
+  double pick_seconds = bench_seconds(3, [&]() {
+    for (int i = 0; i != num_rays; ++i) hits[i] = bvh.pick(eye, dirs[i], distances[i]);
+  });
+  int num_hits = (int)std::count_if(hits.begin(), hits.end(), [](int h) { return h != -1; });
+  printf("  pick                         %10.2f us  %d of %d rays hit\n", pick_seconds * 1e6 / num_rays, num_hits, num_rays);
+
+  std::vector<int> hits4(num_rays);
+  std::vector<float> distances4(num_rays);
+  double pick4_seconds = bench_seconds(3, [&]() {
+    for (int i = 0; i + 4 <= num_rays; i += 4) bvh.pick4(eye, &dirs[i], &hits4[i], &distances4[i]);
+  });
+  printf("  pick4, per ray               %10.2f us\n", pick4_seconds * 1e6 / num_rays);
+
+  // A few picks against every atom.
+  for (int i = 0; i != num_rays; i += num_rays / 16) {
+    glm::vec3 dir = dirs[i];
+    float best = 1e38f;
+    for (size_t j = 0; j != centres.size(); ++j) {
+      glm::vec3 c = centres[j] - eye;
+      float b = glm::dot(c, dir);
+      glm::vec3 perp = c - dir * b;
+      float q = radii[j] * radii[j] - glm::dot(perp, perp);
+      if (q >= 0 && b - std::sqrt(q) > 0) best = std::min(best, b - std::sqrt(q));
+    }
+    bool pick_ok = best == 1e38f ? hits[i] == -1 : hits[i] != -1 && distances[i] == best;
+    bool pick4_ok = best == 1e38f ? hits4[i] == -1 : hits4[i] != -1 && std::abs(distances4[i] - best) <= 1e-5f * (1 + best);
+    if (!pick_ok || !pick4_ok) {
+      printf("  ray %d: %s found %g, expected %g\n", i, pick_ok ? "pick4" : "pick", pick_ok ? distances4[i] : distances[i], best);
+      return 1;
+    }
+  }
+
+  std::vector<glm::vec3> points;
+  for (int i = 0; i != num_rays; ++i) points.push_back(lo + (hi - lo) * glm::vec3(unit(rng), unit(rng), unit(rng)));
+  volatile int found = 0;
+  double nearest_seconds = bench_seconds(3, [&]() {
+    for (auto &p : points) {
+      float distance;
+      found = bvh.nearest(p, 1e30f, distance);
+    }
+  });
+  printf("  nearest                      %10.2f us\n", nearest_seconds * 1e6 / num_rays);
+
+  // Move a thousand atoms a little, as dragging a selection does, and refit.
+  const int num_moved = 1000;
+  std::uniform_int_distribution<int> atom(0, (int)centres.size() - 1);
+  double refit_seconds = bench_seconds(3, [&]() {
+    for (int m = 0; m != num_moved; ++m) {
+      int i = atom(rng);
+      bvh.move(i, bvh.centre(i) + glm::vec3(0.1f, 0, 0));
+    }
+    bvh.refit();
+  });
+  printf("  move and refit %d atoms     %10.2f us\n", num_moved, refit_seconds * 1e6);
+  return 0;
+}
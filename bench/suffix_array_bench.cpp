@@ -0,0 +1,77 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// suffix_array (SA-IS) against a plain sort of the suffixes: first that the
+// suffix and LCP arrays match on random strings, then the speed on molecules.
+//
+//   suffix_array_bench molecules [copies]
+//
+
+#include <andyzip/deflate_encoder.hpp>
+#include <random>
+#include "bench.hpp"
+
+typedef andyzip::suffix_array<> suffix_array;
+
+// The suffixes of [src, src + size) sorted by comparing them, the empty one first.
+static std::vector<uint32_t> naive_suffix_array(const uint8_t *src, size_t size) {
+  std::vector<uint32_t> sa(size + 1);
+  for (size_t i = 0; i != size + 1; ++i) sa[i] = (uint32_t)i;
+  std::sort(sa.begin(), sa.end(), [src, size](uint32_t a, uint32_t b) {
+    size_t n = size - std::max(a, b);
+    int cmp = memcmp(src + a, src + b, n);
+    return cmp ? cmp < 0 : a > b;
+  });
+  return sa;
+}
+
+static size_t common_prefix(const uint8_t *src, size_t size, size_t a, size_t b) {
+  size_t n = 0;
+  while (a + n < size && b + n < size && src[a + n] == src[b + n]) ++n;
+  return n;
+}
+
+// Random strings of every length up to 200 over alphabets of 1 to 256 symbols.
+static int check_random(int count) {
+  std::mt19937 gen(1);
+  int failures = 0;
+  for (int t = 0; t != count; ++t) {
+    size_t size = gen() % 201;
+    unsigned alphabet = t % 4 == 0 ? 256 : 1 + gen() % 4;
+    std::vector<uint8_t> s(size);
+    for (auto &c : s) c = (uint8_t)('a' + gen() % alphabet);
+
+    suffix_array sa(s.data(), s.data() + size);
+    std::vector<uint32_t> expected = naive_suffix_array(s.data(), size);
+    bool ok = sa.size() == size + 1;
+    for (size_t i = 0; ok && i != size + 1; ++i) {
+      ok = sa.addr(i) == expected[i] && sa.rank(expected[i]) == i;
+      if (i) ok = ok && sa.lcp(i) == common_prefix(s.data(), size, expected[i - 1], expected[i]);
+    }
+    failures += !ok;
+  }
+  printf("%d of %d random strings differ from a plain sort\n", failures, count);
+  return failures;
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  int copies = argc > 2 ? atoi(argv[2]) : 60;
+
+  int failures = check_random(20000);
+
+  std::vector<uint8_t> big = bench_repeat_atom_site(bench_read_file(dir + "/2tgt.cif"), copies);
+  for (size_t size : { (size_t)1 << 18, (size_t)1 << 20, big.size() }) {
+    size = std::min(size, big.size());
+    const uint8_t *src = big.data();
+    printf("first %d bytes of 2tgt.cif atom_site repeated\n", (int)size);
+    bench_report("SA-IS", size, bench_seconds(3, [&]() { suffix_array sa(src, src + size, false); }));
+    bench_report("SA-IS and LCP", size, bench_seconds(3, [&]() { suffix_array sa(src, src + size, true); }));
+    // The plain sort compares long repeats byte by byte, so only time it on the small size.
+    if (size <= (1 << 18)) {
+      bench_report("plain sort", size, bench_seconds(1, [&]() { naive_suffix_array(src, size); }));
+    }
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,118 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// zipfile_reader::extract_all on 1, 2, 4 and 8 threads, and on all the
+// hardware threads if there are more, over a zip of many deflated molecules.
+// Also the speed of crc32. Exits with 1 if a file fails or comes out wrong.
+//
+//   zip_bench molecules [files]
+//
+
+#include <andyzip/zipfile_reader.hpp>
+#include <andyzip/deflate_encoder.hpp>
+#include <gilgamesh/parallel.hpp>
+#include "bench.hpp"
+
+static void put2(std::vector<uint8_t> &dest, size_t v) {
+  dest.push_back((uint8_t)v);
+  dest.push_back((uint8_t)(v >> 8));
+}
+
+static void put4(std::vector<uint8_t> &dest, uint32_t v) {
+  put2(dest, v & 0xffff);
+  put2(dest, v >> 16);
+}
+
+// A zip of deflated files, with the local and central headers zip writes.
+static std::vector<uint8_t> make_zip(const std::vector<std::pair<std::string, const std::vector<uint8_t> *> > &files) {
+  std::vector<uint8_t> zip, dir;
+  andyzip::deflate_encoder encoder(6);
+  for (auto &f : files) {
+    const std::vector<uint8_t> &text = *f.second;
+    std::vector<uint8_t> data;
+    encoder.encode(data, text.data(), text.data() + text.size(), gilgamesh::hardware_threads());
+    uint32_t crc = andyzip::crc32(text.data(), text.data() + text.size());
+    uint32_t offset = (uint32_t)zip.size();
+    for (std::vector<uint8_t> *h : { &zip, &dir }) {
+      put4(*h, h == &zip ? 0x04034b50 : 0x02014b50);
+      if (h == &dir) put2(*h, 20);
+      put2(*h, 20);
+      put2(*h, 0);
+      put2(*h, 8);
+      put4(*h, 0);
+      put4(*h, crc);
+      put4(*h, (uint32_t)data.size());
+      put4(*h, (uint32_t)text.size());
+      put2(*h, f.first.size());
+      put2(*h, 0);
+      if (h == &dir) {
+        put2(*h, 0);
+        put2(*h, 0);
+        put2(*h, 0);
+        put4(*h, 0);
+        put4(*h, offset);
+      }
+      h->insert(h->end(), f.first.begin(), f.first.end());
+    }
+    zip.insert(zip.end(), data.begin(), data.end());
+  }
+  size_t dir_offset = zip.size();
+  zip.insert(zip.end(), dir.begin(), dir.end());
+  put4(zip, 0x06054b50);
+  put2(zip, 0);
+  put2(zip, 0);
+  put2(zip, files.size());
+  put2(zip, files.size());
+  put4(zip, (uint32_t)dir.size());
+  put4(zip, (uint32_t)dir_offset);
+  put2(zip, 0);
+  return zip;
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  int num_files = argc > 2 ? atoi(argv[2]) : 64;
+
+  std::vector<uint8_t> pdb = bench_read_file(dir + "/5wsn.pdb");
+  std::vector<uint8_t> cif = bench_read_file(dir + "/2tgt.cif");
+  std::vector<std::pair<std::string, const std::vector<uint8_t> *> > files;
+  size_t total = 0;
+  uint64_t expected_sum = 0;
+  for (int i = 0; i != num_files; ++i) {
+    const std::vector<uint8_t> *text = i % 2 ? &cif : &pdb;
+    files.emplace_back(std::to_string(i) + (i % 2 ? ".cif" : ".pdb"), text);
+    total += text->size();
+    expected_sum += andyzip::crc32(text->data(), text->data() + text->size());
+  }
+  std::vector<uint8_t> zip = make_zip(files);
+  printf("%d files, %.2f MB in a %.2f MB zip\n", num_files, total * 1e-6, zip.size() * 1e-6);
+
+  zipfile_reader reader(zip.data(), zip.data() + zip.size());
+  std::vector<unsigned> thread_counts = { 1, 2, 4, 8 };
+  if (gilgamesh::hardware_threads() > 8) thread_counts.push_back(gilgamesh::hardware_threads());
+  for (unsigned threads : thread_counts) {
+    std::atomic<uint64_t> sum(0);
+    std::vector<std::string> failed;
+    double seconds = bench_seconds(3, [&]() {
+      sum = 0;
+      failed = reader.extract_all(
+        [](const zipfile_reader::entry &) { return true; },
+        [&sum](const zipfile_reader::entry &e, const uint8_t *, const uint8_t *) { sum += e.crc; },
+        threads
+      );
+    });
+    char label[64];
+    snprintf(label, sizeof(label), "extract_all, %u thread%s", threads, threads == 1 ? "" : "s");
+    bench_report(label, total, seconds);
+    if (!failed.empty() || sum != expected_sum) {
+      printf("  %d files failed or were missed\n", (int)failed.size());
+      return 1;
+    }
+  }
+
+  volatile uint32_t crc = 0;
+  double seconds = bench_seconds(5, [&]() { crc = andyzip::crc32(pdb.data(), pdb.data() + pdb.size()); });
+  bench_report("crc32", pdb.size(), seconds);
+  return 0;
+}
@@ -3,7 +3,6 @@ import io
 import sys
 import ssl
 import urllib
-from PIL import Image
 import http.server
 
 import moovoo
@@ -15,10 +14,10 @@ SIZE=(1200, 800)
 class moovoo_server(http.server.HTTPServer):
   def __init__(s, addr, handler):
     http.server.HTTPServer.__init__(s, addr, handler)
-    s.ctxt = moovoo.Context()
-    s.modelBytes = open("../molecules/2tgt.cif", "rb").read()
+    s.ctxt = moovoo.Context("Headless")
+    s.modelBytes = open(os.path.join(os.path.dirname(os.path.abspath(__file__)), "../molecules/2tgt.cif"), "rb").read()
     s.model = moovoo.Model(s.ctxt, s.modelBytes)
-    s.view = moovoo.View(s.ctxt, s.model, SIZE[0], SIZE[1])
+    s.view = moovoo.View(s.ctxt, "Headless", s.model, SIZE)
 
 class moovoo_handler(http.server.BaseHTTPRequestHandler):
   def do_GET(s):
@@ -37,20 +36,24 @@ class moovoo_handler(http.server.BaseHTTPRequestHandler):
       s.send_header("Expires", "0")
       s.send_header("Cache-Control", "no-cache, private")
       s.send_header("Pragma", "no-cache")
-      s.send_header("Content-Type", "multipart/x-mixed-replace; boundary=--BoundaryString");
+      stream = moovoo.FrameStream(s.server.view, s.server.model, "jpeg", 80)
+      s.send_header("Content-Type", stream.content_type())
       s.end_headers()
-      while True:
-        data = s.server.view.render(s.server.ctxt, s.server.model)
-        pilimg = Image.frombuffer("RGBA", SIZE, data, "raw", "RGBA", 0, 1)
-        stream = io.BytesIO()
-        pilimg.save(stream, "PNG")
-        b = stream.getbuffer()
-        s.wfile.write(b"--BoundaryString\r\nContent-type: image/png\r\nContent-Length: %d\r\n\r\n" % len(b))
-        s.wfile.write(b)
+      try:
+        while True:
+          # Frames are only sent when the picture changes, but browsers show a part
+          # only when the next one starts, so send the picture again when idle.
+          data = stream.next(1.0)
+          if data:
+            s.wfile.write(data)
+          else:
+            stream.key_frame()
+      except (BrokenPipeError, ConnectionResetError):
+        pass
 
 def main(argv):
   ip = "0.0.0.0"
-  port = 8000
+  port = int(argv[1]) if len(argv) > 1 else 8000
   httpd = moovoo_server((ip, port), moovoo_handler)
   #httpd.socket = ssl.wrap_socket (httpd.socket, certfile='cert.pem', server_side=True)
   while True:
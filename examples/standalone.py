@@ -5,8 +5,12 @@ size = (1200, 1024)
 ctxt = mv.Context()
 
 
-modelBytes = open("../molecules/2tgt.cif", "rb").read()
-model = mv.Model(ctxt, modelBytes)
+# Load on another thread, reporting progress. mv.Model(ctxt, file) loads in place,
+# decoding the file as it is read; bytes objects work for both.
+loader = mv.Model.load_async(ctxt, "../molecules/2tgt.cif")
+while not loader.wait(0.25):
+  print("%s %.0f%%" % (loader.stage(), loader.fraction() * 100))
+model = loader.result()
 view = mv.View(ctxt, "Window", model, size)
 
 ##data = view.render(ctxt, model)
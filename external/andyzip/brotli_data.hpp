@@ -157,6 +157,12 @@ namespace andyzip {
       "",FermentAll,",",
       "",FermentAll,"(",
       "",FermentAll,". ",
+      " ",FermentAll,".",
+      "",FermentAll,"='",
+      " ",FermentAll,". ",
+      " ",FermentFirst,"=\"",
+      " ",FermentAll,"='",
+      " ",FermentFirst,"='",
     };
 
     struct PrefixCodeRange {
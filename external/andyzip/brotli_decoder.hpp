@@ -15,11 +15,20 @@
 
 #include <andyzip/huffman_table.hpp>
 
+#include <cstdio>
 #include <cstdint>
 #include <cstring>
 #include <vector>
 #include <array>
 #include <algorithm>
+#include <memory>
+
+// Define ANDYZIP_ZONE(name) and ANDYZIP_ZONE_ITEMS(n) before including this to time
+// the decoder (see gilgamesh/zone_tracer.hpp).
+#ifndef ANDYZIP_ZONE
+  #define ANDYZIP_ZONE(name)
+  #define ANDYZIP_ZONE_ITEMS(n)
+#endif
 
 #include <andyzip/brotli_data.hpp>
 
@@ -32,6 +41,7 @@ namespace andyzip {
       end = 3,
       huffman_length_error = 4,
       context_map_error = 5,
+      stopped = 6,
     };
 
     enum {
@@ -39,6 +49,9 @@ namespace andyzip {
       dump_bits = 0,
     };
 
+    /// bitptr counts bits in 32 bits, so a source may be up to this many bytes.
+    static const std::uint32_t max_src_bytes = (1u << 29) - 1;
+
     FILE *log_file = nullptr;
     const char *src = nullptr;
     std::uint32_t bitptr = 0;
@@ -52,10 +65,12 @@ namespace andyzip {
     int block_type[3];
     int block_len[3];
     uint8_t context_mode[max_types];
-    uint8_t literal_context_map[256]; // todo: what is the max size?
-    uint8_t distance_context_map[256];
+    uint8_t literal_context_map[max_types << 6];
+    uint8_t distance_context_map[max_types << 2];
     uint64_t bytes_written = 0;
-    std::vector<uint8_t> ring_buffer;
+    // not initialised, so that only the pages of the window actually used are touched.
+    std::unique_ptr<uint8_t[]> ring_buffer;
+    size_t ring_buffer_size = 0;
     andyzip::huffman_table<256+2> block_type_tables[3];
     andyzip::huffman_table<26> block_count_tables[3];
 
@@ -68,16 +83,29 @@ namespace andyzip {
       return value;
     }
 
+    // bits past bitptr_max read as zero.
     int peek(int bits) {
-      //if (bitptr + bits > bitptr_max) { error = error_code::need_more_input; return 0; }
       auto i = bitptr >> 3, j = bitptr & 7;
-      int value = (int)( (unsigned&)src[i] >> j ) & ( (1u << bits) - 1 );
+      std::uint32_t word = 0;
+      if (i + 4 <= (bitptr_max >> 3)) {
+        memcpy(&word, src + i, 4);
+      } else {
+        for (std::uint32_t k = 0; k != 4 && i + k < (bitptr_max >> 3); ++k) {
+          word |= (std::uint32_t)(uint8_t)src[i + k] << (k * 8);
+        }
+      }
+      int value = (int)( word >> j ) & ( (1u << bits) - 1 );
       return value;
     }
 
     void drop(int bits) {
       bitptr += bits;
     }
+
+    // true if we have read past the end of the input.
+    bool overrun() const {
+      return bitptr > bitptr_max;
+    }
   };
 
   class brotli_decoder {
@@ -89,6 +117,7 @@ namespace andyzip {
       block_len_symbols = 26,
 
       num_distance_short_codes = 16,
+      max_distance_alphabet_size = num_distance_short_codes + (15 << 3) + (48 << 3),
     };
     typedef brotli_decoder_state::error_code error_code;
 
@@ -109,10 +138,15 @@ namespace andyzip {
         return w13 + 17;
       }
 
-      auto w47 = s.read(4);
+      auto w46 = s.read(3);
       if (s.error != error_code::ok) return 0; 
+      if (w46 == 1) {
+        // large windows are not part of RFC 7932.
+        s.error = error_code::syntax_error;
+        return 0;
+      }
 
-      return w47 ? w47 + 10 - 2 : 17;
+      return w46 ? w46 + 8 : 17;
     }
 
     // read a value from 1 to 256
@@ -174,6 +208,13 @@ namespace andyzip {
         for (int i = 0; i != num_symbols; ++i) {
           symbols[i] = (uint16_t)s.read(alphabet_bits);
           if (debug) fprintf(s.log_file, "[ReadSimpleHuffmanSymbols] s->symbols_lists_array[i] = %d\n", symbols[i]);
+          // symbols must be in the alphabet and different.
+          bool bad = symbols[i] >= alphabet_size;
+          for (int j = 0; j != i; ++j) bad |= symbols[j] == symbols[i];
+          if (bad) {
+            s.error = error_code::huffman_length_error;
+            return;
+          }
         }
         if (debug) fprintf(s.log_file, "[ReadHuffmanCode] s->symbol = %d\n", num_symbols-1);
         static const uint8_t simple_lengths[][4] = {
@@ -184,6 +225,10 @@ namespace andyzip {
           {1, 2, 3, 3},
         };
         int tree_select = num_symbols == 4 ? s.read(1) : 0;
+        // codes of the same length are given to the symbols in order of value.
+        static const uint8_t first_sorted[][2] = { {0, 1}, {0, 2}, {1, 3}, {0, 4}, {2, 4} };
+        auto &sorted = first_sorted[num_symbols - 1 + tree_select];
+        std::sort(symbols + sorted[0], symbols + sorted[1]);
         table.init(simple_lengths[num_symbols - 1 + tree_select], symbols, num_symbols);
       } else {
         // 3.5.  Complex Prefix Codes
@@ -294,7 +339,8 @@ namespace andyzip {
               }
             }
           }
-          if (space > 32768) {
+          // the code must be complete, so that every bit pattern decodes to a symbol.
+          if (space != 32768) {
             if (debug) fprintf(s.log_file, "bad5\n");
             s.error = error_code::huffman_length_error;
             return;
@@ -333,7 +379,7 @@ namespace andyzip {
       int last = s.last_block_type[index];
 
       int block_type = code == 0 ? last : code == 1 ? cur + 1 : code - 2;
-      if (block_type > num_types) {
+      if (block_type >= num_types) {
         block_type -= num_types;
       }
 
@@ -359,7 +405,7 @@ namespace andyzip {
         int rlemax = (bits & 1) ? (bits >> 1) + 1 : 0;
         s.drop((bits & 1) ? 5 : 1);
         if (debug) fprintf(s.log_file, "[DecodeContextMap] s->max_run_length_prefix = %d\n", rlemax);
-        andyzip::huffman_table<256> table;
+        andyzip::huffman_table<256+16> table;
         read_huffman_code(s, table, num_trees + rlemax);
         if (s.error != error_code::ok) return;
         for (int i = 0; i != context_map_size;) {
@@ -396,7 +442,7 @@ namespace andyzip {
       }
     }
 
-    int transform_dictionary_word(char *buffer, const uint8_t *src, int transform_idx, int copy_len, int ringbuffer_mask) {
+    static int transform_dictionary_word(char *buffer, const uint8_t *src, int transform_idx, int copy_len) {
       char *dest = buffer;
       auto &t = brotli_data::table[transform_idx];
       for (const char *psrc = t.prefix; *psrc; ++psrc) {
@@ -411,8 +457,8 @@ namespace andyzip {
       }
 
       // fermentation (aka. case conversion)
+      uint8_t fermented[24];
       if (t.id == brotli_data::FermentFirst || t.id == brotli_data::FermentAll) {
-        uint8_t fermented[24];
         if (copy_len <= 24) {
           memcpy(fermented, src, copy_len);
         }
@@ -431,7 +477,7 @@ namespace andyzip {
             i += 2;
           } else {
             if (i + 2 < copy_len) {
-              fermented[i+2] ^= 32;
+              fermented[i+2] ^= 5;
             }
             i += 3;
           }
@@ -440,7 +486,8 @@ namespace andyzip {
         src = fermented;
       }
 
-      for (int i = 0; i != copy_len; ++i) {
+      // omitting more than the whole word leaves nothing.
+      for (int i = 0; i < copy_len; ++i) {
         *dest++ = *src++;
       }
 
@@ -450,65 +497,188 @@ namespace andyzip {
 
       return (int)(dest - buffer);
     }
-  public:
-    brotli_decoder() {
+
+    // Copy size bytes from `from` to dest. If distance < size, from is dest - distance
+    // and the copy repeats the last distance bytes, doubling the piece each time.
+    // Otherwise the bytes are moved in one piece: in the ring, a distance close to the
+    // window size can read the slots that the end of the copy writes.
+    static void copy_back(uint8_t *dest, const uint8_t *from, size_t distance, size_t size) {
+      if (distance >= size) {
+        memmove(dest, from, size);
+        return;
+      }
+      for (size_t done = 0; done != size; ) {
+        size_t n = std::min(size - done, distance + done);
+        memcpy(dest + done, from, n);
+        done += n;
+      }
     }
 
-    // decode some input bits and return -1 if we need more input.
-    brotli_decoder_state::error_code decode(brotli_decoder_state &s) {
-      typedef brotli_decoder_state::error_code error_code;
-      // https://tools.ietf.org/html/rfc7932
-      s.error = error_code::ok;
+    // Output for decode_stream: a ring the size of the window. Bytes are passed
+    // to fn in chunks of at most chunk_size before they can be overwritten.
+    template <class Fn>
+    class ring_output {
+    public:
+      ring_output(brotli_decoder_state &s, uint8_t *ring, size_t ring_size, size_t chunk_size, Fn &fn) :
+        s_(s), ring_(ring), mask_(ring_size - 1), chunk_size_(chunk_size), fn_(fn)
+      {
+      }
 
-      // read window size
-      unsigned lg_window_size = read_window_size(s);
-      if (s.error != error_code::ok) return s.error;
-      s.max_backward_distance = (1 << lg_window_size) - window_gap;
-      if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->window_bits = %d\n", lg_window_size);
-      if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->pos = %d\n", 0);
+      uint64_t pos = 0;
 
-      s.ring_buffer.resize(1 << lg_window_size);
-      int ringbuffer_mask = (1 << lg_window_size) - 1;
+      bool begin_meta_block(size_t) { return true; }
 
-      //  do
-      {
+      uint8_t back(size_t distance) const { return ring_[(pos - distance) & mask_]; }
+
+      // get up to size contiguous bytes to write to, then commit() the ones used.
+      uint8_t *reserve(size_t size, size_t &available) {
+        size_t offset = (size_t)(pos & mask_);
+        available = std::min(std::min(size, room()), mask_ + 1 - offset);
+        return ring_ + offset;
+      }
+
+      void commit(size_t size) { pos += size; }
+
+      void write(const uint8_t *src, size_t size) {
+        while (size) {
+          size_t offset = (size_t)(pos & mask_);
+          size_t n = std::min(std::min(size, room()), mask_ + 1 - offset);
+          memcpy(ring_ + offset, src, n);
+          pos += n;
+          src += n;
+          size -= n;
+        }
+      }
+
+      void copy(size_t distance, size_t size) {
+        while (size) {
+          // stop at the end of the ring; the pieces only overlap if from < to.
+          size_t from = (size_t)((pos - distance) & mask_), to = (size_t)(pos & mask_);
+          size_t n = std::min(std::min(size, room()), mask_ + 1 - std::max(from, to));
+          copy_back(ring_ + to, ring_ + from, distance, n);
+          pos += n;
+          size -= n;
+        }
+      }
+
+      void flush() {
+        while (flushed_ != pos && s_.error == error_code::ok) {
+          size_t offset = (size_t)(flushed_ & mask_);
+          size_t size = (size_t)std::min((uint64_t)(mask_ + 1 - offset), pos - flushed_);
+          if (!fn_((const uint8_t *)ring_ + offset, (const uint8_t *)ring_ + offset + size)) {
+            s_.error = error_code::stopped;
+          }
+          flushed_ += size;
+        }
+        // after an error, drop the rest so that the decoder can finish its command.
+        flushed_ = pos;
+      }
+    private:
+      // bytes we can write before we must flush.
+      size_t room() {
+        if (pos - flushed_ == chunk_size_) flush();
+        return chunk_size_ - (size_t)(pos - flushed_);
+      }
+
+      brotli_decoder_state &s_;
+      uint8_t *ring_;
+      size_t mask_;
+      size_t chunk_size_;
+      Fn &fn_;
+      uint64_t flushed_ = 0;
+    };
+
+    // Output for decode: the whole of [begin, end) is addressable,
+    // so meta-blocks are checked for size once and then written directly.
+    class flat_output {
+    public:
+      flat_output(brotli_decoder_state &s, uint8_t *begin, uint8_t *end) : s_(s), begin_(begin), end_(end) {
+      }
+
+      uint64_t pos = 0;
+
+      bool begin_meta_block(size_t size) {
+        if ((size_t)(end_ - begin_) - pos < size) {
+          s_.error = error_code::syntax_error;
+          return false;
+        }
+        return true;
+      }
+
+      uint8_t back(size_t distance) const { return begin_[pos - distance]; }
+
+      uint8_t *reserve(size_t size, size_t &available) {
+        available = size;
+        return begin_ + pos;
+      }
+
+      void commit(size_t size) { pos += size; }
+
+      void write(const uint8_t *src, size_t size) {
+        memcpy(begin_ + pos, src, size);
+        pos += size;
+      }
+
+      void copy(size_t distance, size_t size) {
+        copy_back(begin_ + pos, begin_ + pos - distance, distance, size);
+        pos += size;
+      }
+    private:
+      brotli_decoder_state &s_;
+      uint8_t *begin_;
+      uint8_t *end_;
+    };
+
+    // Decode the meta-blocks that follow the window size.
+    template <class Output>
+    void decode_meta_blocks(brotli_decoder_state &s, Output &out) {
+      // the last four distances carry over from one meta-block to the next.
+      int last_distances[4] = { 16, 15, 11, 4 };
+      int last_distance_idx = 0;
+
+      // for each meta-block
+      for (int is_last = 0; !is_last && s.error == error_code::ok;) {
           // read ISLAST bit
-          int is_last = s.read(1);
-          if (s.error != error_code::ok) return s.error;
+          is_last = s.read(1);
 
           // if ISLAST
           if (is_last) {
             //  read ISLASTEMPTY bit
-            int is_last_empty = s.read(1);
-            if (s.error != error_code::ok) return s.error;
-
             //  if ISLASTEMPTY break from loop
-            if (is_last_empty) { s.error = error_code::end; return s.error; }
+            if (s.read(1)) break;
           }
 
           // read MNIBBLES
           int nibbles_code = s.read(2);
-          if (s.error != error_code::ok) return s.error;
 
           // if MNIBBLES is zero
           int mlen = 0;
           if (nibbles_code == 3) {
             //  verify reserved bit is zero
+            if (s.read(1)) { s.error = error_code::syntax_error; break; }
             //  read MSKIPLEN
+            int skip_bytes = s.read(2);
+            std::uint32_t skip_len = 0;
+            for (int i = 0; i != skip_bytes; ++i) {
+              skip_len |= (std::uint32_t)s.read(8) << (i*8);
+            }
+            if (skip_bytes) ++skip_len;
             //  skip any bits up to the next byte boundary
             //  skip MSKIPLEN bytes
             //  continue to the next meta-block
-            s.error = error_code::syntax_error;
-            return s.error;
+            s.bitptr = ((s.bitptr + 7) & ~7u) + skip_len * 8;
+            if (s.overrun()) s.error = error_code::need_more_input;
+            continue;
           } else {
             //  read MLEN
             for (int i = 0; i != nibbles_code + 4; ++i) {
               int val = s.read(4);
-              if (s.error != error_code::ok) return s.error;
               mlen |= val << (i*4);
             }
             ++mlen;
           }
+          uint64_t meta_block_end = out.pos + mlen;
+          if (!out.begin_meta_block(mlen)) break;
 
           // if not ISLAST
           if (!is_last) {
@@ -519,25 +689,22 @@ namespace andyzip {
               // skip any bits up to the next byte boundary
               // copy MLEN bytes of compressed data as literals
               // continue to the next meta-block
-              s.error = error_code::syntax_error;
-              return s.error;
+              s.bitptr = (s.bitptr + 7) & ~7u;
+              if ((uint64_t)s.bitptr + (uint64_t)mlen * 8 > s.bitptr_max) { s.error = error_code::need_more_input; break; }
+              out.write((const uint8_t *)s.src + s.bitptr / 8, mlen);
+              s.bitptr += mlen * 8;
+              continue;
             }
           }
 
           if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->is_last_metablock = %d\n", is_last);
           if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->meta_block_remaining_len = %d\n", mlen);
-          if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->is_metadata = %d\n", 0);
-          if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->is_uncompressed = %d\n", 0);
-
-          enum {
-            idx_L, idx_I, idx_D
-          };
 
           // loop for each three block categories (i = L, I, D)
           for (int i = 0; i != 3; ++i) {
             //  read NBLTYPESi
             int nbltypesi = read_256(s);
-            if (s.error != error_code::ok) return s.error;
+            if (s.error != error_code::ok) return;
             if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->num_block_types[s->loop_counter] = %d\n", nbltypesi);
 
             s.num_types[i] = nbltypesi;
@@ -546,10 +713,10 @@ namespace andyzip {
             if (nbltypesi >= 2) {
               // read prefix code for block types, HTREE_BTYPE_i
               read_huffman_code(s, s.block_type_tables[i], nbltypesi + 2);
-              if (s.error != error_code::ok) return s.error;
+              if (s.error != error_code::ok) return;
               // read prefix code for block counts, HTREE_BLEN_i
               read_huffman_code(s, s.block_count_tables[i], block_len_symbols);
-              if (s.error != error_code::ok) return s.error;
+              if (s.error != error_code::ok) return;
               // read block count, BLEN_i
               s.block_len[i] = read_block_length(s, i);
               // set block type, BTYPE_i to 0
@@ -567,61 +734,57 @@ namespace andyzip {
 
           // read NPOSTFIX and NDIRECT
           int pbits = s.read(6);
-          if (s.error != error_code::ok) return s.error;
           int NPOSTFIX = pbits & 3;
           int NDIRECT = (pbits >> 2) << NPOSTFIX;
-          if (s.error != error_code::ok) return s.error;
           if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->num_direct_distance_codes = %d\n", NDIRECT + 16);
           if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->distance_postfix_bits = %d\n", NPOSTFIX);
 
           // read array of literal context modes, CMODE[]
           for (int i = 0; i != s.num_types[idx_L]; ++i) {
-            int ctxt = s.read(2) * 2;
-            if (s.error != error_code::ok) return s.error;
+            int ctxt = s.read(2);
             s.context_mode[i & (brotli_decoder_state::max_types-1)] = ctxt;
             if (debug) fprintf(s.log_file, "[ReadContextModes] s->context_modes[%d] = %d\n", i, s.context_mode[i]);
           }
 
           // read NTREESL
           int num_literal_htrees = read_256(s);
-          if (s.error != error_code::ok) return s.error;
+          if (s.error != error_code::ok) return;
           read_context_map(s, s.literal_context_map, s.num_types[idx_L] << literal_context_bits, num_literal_htrees);
-          if (s.error != error_code::ok) return s.error;
+          if (s.error != error_code::ok) return;
 
           // read NTREESD
           int num_distance_htrees = read_256(s);
-          if (s.error != error_code::ok) return s.error;
+          if (s.error != error_code::ok) return;
           read_context_map(s, s.distance_context_map, s.num_types[idx_D] << distance_context_bits, num_distance_htrees);
-          if (s.error != error_code::ok) return s.error;
+          if (s.error != error_code::ok) return;
 
           // read array of literal prefix codes, HTREEL[]
           std::vector<andyzip::huffman_table<256>> literal_tables(num_literal_htrees);
           for (int i = 0; i != literal_tables.size(); ++i) {
             read_huffman_code(s, literal_tables[i], 256);
-            if (s.error != error_code::ok) return s.error;
+            if (s.error != error_code::ok) return;
           }
 
           // read array of insert-and-copy length prefix codes, HTREEI[]
           std::vector<andyzip::huffman_table<704>> iandc_tables(s.num_types[idx_I]);
           for (int i = 0; i != iandc_tables.size(); ++i) {
             read_huffman_code(s, iandc_tables[i], 704);
-            if (s.error != error_code::ok) return s.error;
+            if (s.error != error_code::ok) return;
           }
 
           // read array of distance prefix codes, HTREED[]
-          static const int max_distance_alphabet_size = num_distance_short_codes + (15 << 3) + (48 << 3);
-          std::vector<andyzip::huffman_table<256>> distance_tables(num_distance_htrees);
+          std::vector<andyzip::huffman_table<max_distance_alphabet_size>> distance_tables(num_distance_htrees);
           int distance_alphabet_size = 16 + NDIRECT + (48 << NPOSTFIX);
           for (int i = 0; i != distance_tables.size(); ++i) {
             read_huffman_code(s, distance_tables[i], distance_alphabet_size);
-            if (s.error != error_code::ok) return s.error;
+            if (s.error != error_code::ok) return;
           }
 
           // do
-          int last_distances[4] = { 16, 15, 11, 4 };
-          int last_distance_idx = 0;
+          while (out.pos < meta_block_end) {
+            if (s.error != error_code::ok) break;
+            if (s.overrun()) { s.error = error_code::need_more_input; break; }
 
-          for (int pos = 0; pos < mlen; ) {
             //  if BLEN_I is zero
             if (s.block_len[idx_I] == 0) {
               read_block_switch_command(s, idx_I);
@@ -644,54 +807,54 @@ namespace andyzip {
               cmd.copy_len_offset + 
               (cmd.copy_len_extra_bits ? s.read(cmd.copy_len_extra_bits) : 0)
             ;
-            //if (debug) fprintf(s.log_file, "{%d %d %d %d} %d\n", last_distances[0], last_distances[1], last_distances[2], last_distances[3], last_distance_idx);
-            if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] pos = %d insert = %d copy = %d\n", pos, insert_len, copy_len);
+            if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] pos = %d insert = %d copy = %d\n", (int)out.pos, insert_len, copy_len);
 
             //  loop for ILEN
-            int p2 = pos < 2 ? 0 : s.ring_buffer[(pos - 2) & ringbuffer_mask];
-            int p1 = pos < 1 ? 0 : s.ring_buffer[(pos - 1) & ringbuffer_mask];
-            for (int i = 0; i != insert_len && pos < mlen; ++i) {
-              // if BLEN_L is zero
-              if (s.block_len[idx_L] == 0) {
-                read_block_switch_command(s, idx_L);
+            int p2 = out.pos < 2 ? 0 : out.back(2);
+            int p1 = out.pos < 1 ? 0 : out.back(1);
+            for (size_t todo = (size_t)std::min((uint64_t)insert_len, meta_block_end - out.pos); todo; ) {
+              size_t available;
+              uint8_t *dest = out.reserve(todo, available);
+              for (size_t i = 0; i != available; ++i) {
+                // if BLEN_L is zero
+                if (s.block_len[idx_L] == 0) {
+                  read_block_switch_command(s, idx_L);
+                }
+                // decrement BLEN_L
+                s.block_len[idx_L]--;
+
+                // look up context mode CMODE[BTYPE_L]
+                uint8_t cmode = s.context_mode[s.block_type[idx_L]];
+
+                // compute context ID, CIDL from last two uncompressed bytes
+                // 7.1.  Context Modes and Context ID Lookup for Literals
+                // For LSB6:    Context ID = p1 & 0x3f
+                // For MSB6:    Context ID = p1 >> 2
+                // For UTF8:    Context ID = Lut0[p1] | Lut1[p2]
+                // For Signed:  Context ID = (Lut2[p1] << 3) | Lut2[p2]
+                int context_id =
+                  cmode < 2 ? (p1 >> cmode*2) & 63 :
+                  cmode == 2 ? brotli_data::Lut0[p1] | brotli_data::Lut1[p2] : (brotli_data::Lut2[p1] << 3) | brotli_data::Lut2[p2]
+                ;
+
+                // read literal using HTREEL[CMAPL[64*BTYPE_L + CIDL]]
+                int peek16 = s.peek(16);
+                int table = s.literal_context_map[64 * s.block_type[idx_L] + context_id];
+                auto lit = literal_tables[table].decode(peek16);
+                s.drop(lit.first);
+
+                // write literal to uncompressed stream
+                uint8_t value = (uint8_t)lit.second;
+                dest[i] = value;
+                p2 = p1;
+                p1 = value;
               }
-              // decrement BLEN_L
-              s.block_len[idx_L]--;
-
-              // look up context mode CMODE[BTYPE_L]
-              uint8_t cmode = s.context_mode[s.block_type[idx_L]];
-
-              // compute context ID, CIDL from last two uncompressed bytes
-              // 7.1.  Context Modes and Context ID Lookup for Literals
-              // For LSB6:    Context ID = p1 & 0x3f
-              // For MSB6:    Context ID = p1 >> 2
-              // For UTF8:    Context ID = Lut0[p1] | Lut1[p2]
-              // For Signed:  Context ID = (Lut2[p1] << 3) | Lut2[p2]
-              int context_id =
-                cmode < 2 ? (p1 >> cmode*2) & 63 :
-                cmode == 2 ? brotli_data::Lut0[p1] | brotli_data::Lut1[p2] : (brotli_data::Lut2[p1] << 3) | brotli_data::Lut2[p2]
-              ;
-              if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] context = %d\n", context_id);
-
-              // read literal using HTREEL[CMAPL[64*BTYPE_L + CIDL]]
-              int peek16 = s.peek(16);
-              if (debug) fprintf(s.log_file, "%04x\n", peek16);
-              int table = s.literal_context_map[64 * s.block_type[idx_L] + context_id];
-              if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] s->context_map_slice[context] = %d\n", table);
-              auto lit = literal_tables[table].decode(peek16);
-              s.drop(lit.first);
-
-              // write literal to uncompressed stream
-              uint8_t value = (uint8_t)lit.second;
-              if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] s->ringbuffer[%d] = %d\n", pos, value);
-              s.ring_buffer[pos & ringbuffer_mask] = value;
-              p2 = p1;
-              p1 = value;
-              pos++;
+              out.commit(available);
+              todo -= available;
             }
 
             // if number of uncompressed bytes produced in the loop for
-            if (pos >= mlen) {
+            if (out.pos >= meta_block_end) {
               // this meta-block is MLEN, then break from loop (in this
               // case the copy length is ignored and can have any value)
               break;
@@ -701,10 +864,13 @@ namespace andyzip {
 
             // if distance code is implicit zero from insert-and-copy code
             int distance = 0;
+            int max_distance = (int)std::min((uint64_t)s.max_backward_distance, out.pos);
             bool is_dictionary_ref = false;
             if (cmd.distance_code == 0) {
-              // set backward distance to the last distance
+              // set backward distance to the last distance.
+              // Early in the stream this may reach back before the start, making it a dictionary reference.
               distance = last_distances[(last_distance_idx-1) & 3];
+              is_dictionary_ref = distance > max_distance;
             } else {
               // if BLEN_D is zero
               if (s.block_len[idx_D] == 0) {
@@ -738,7 +904,12 @@ namespace andyzip {
                 distance = ((offset + dextra) << NPOSTFIX) + lcode + NDIRECT + 1;
               }
 
-              is_dictionary_ref = distance > pos;
+              if (distance <= 0) {
+                s.error = error_code::syntax_error;
+                break;
+              }
+
+              is_dictionary_ref = distance > max_distance;
 
               // if distance code is not zero,
               if (dcode != 0 && !is_dictionary_ref) {
@@ -747,47 +918,98 @@ namespace andyzip {
                 last_distances[last_distance_idx++ & 3] = distance;
               }
             }
-            if (insert_len) if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] s->meta_block_remaining_len = %d\n", mlen - pos);
-            if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] pos = %d distance = %d\n", pos, distance);
+            if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] pos = %d distance = %d\n", (int)out.pos, distance);
   
             //  if distance is less than the max allowed distance plus one
             if (!is_dictionary_ref) {
               // move backwards distance bytes in the uncompressed data,
               // and copy CLEN bytes from this position to
               // the uncompressed stream
-              for (int i = 0; i != copy_len; ++i) {
-                s.ring_buffer[pos & ringbuffer_mask] = s.ring_buffer[(pos-distance) & ringbuffer_mask];
-                ++pos;
+              if (out.pos + copy_len > meta_block_end) {
+                s.error = error_code::syntax_error;
+                break;
               }
+              out.copy(distance, copy_len);
             } else {
               if (copy_len < 4 || copy_len > 24) {
                 s.error = error_code::syntax_error;
-                return s.error;
+                break;
               }
               // look up the static dictionary word, transform the word as
               // directed, and copy the result to the uncompressed stream
               int offset = brotli_data::kBrotliDictionaryOffsetsByLength[copy_len];
-              int word_id = distance - pos - 1;
+              int word_id = distance - max_distance - 1;
               uint8_t shift = brotli_data::kBrotliDictionarySizeBitsByLength[copy_len];
               int word_idx = word_id & ((1 << shift)-1);
               int transform_idx = word_id >> shift;
+              if (transform_idx >= (int)(sizeof(brotli_data::table) / sizeof(brotli_data::table[0]))) {
+                s.error = error_code::syntax_error;
+                break;
+              }
               const uint8_t *src = brotli_data::kBrotliDictionary + offset + word_idx * copy_len;
               char buffer[128];
-              int len = transform_dictionary_word(buffer, src, transform_idx, copy_len, ringbuffer_mask);
+              int len = transform_dictionary_word(buffer, src, transform_idx, copy_len);
               if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] dictionary word: [%.*s]\n", len, buffer);
-              for (int i = 0; i != len; ++i) {
-                s.ring_buffer[pos & ringbuffer_mask] = buffer[i];
-                ++pos;
+              if (out.pos + len > meta_block_end) {
+                s.error = error_code::syntax_error;
+                break;
               }
+              out.write((const uint8_t *)buffer, len);
             }
-            if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] s->meta_block_remaining_len = %d\n", mlen - pos);
           } // while number of uncompressed bytes for this meta-block < MLEN
-          s.bytes_written += mlen;
+          if (s.overrun()) s.error = error_code::need_more_input;
       } //  while not ISLAST
 
-      return s.error;
     }
 
+  public:
+    brotli_decoder() {
+    }
+
+    /// Decode a whole brotli stream from s.src, which is s.bitptr_max bits long.
+    /// The output goes through s.ring_buffer, which is the size of the stream's window,
+    /// and is passed to fn(begin, end) in pieces of at most chunk_size bytes.
+    /// fn may return false to stop early.
+    /// Returns error_code::end when the whole stream has been decoded.
+    template <class Fn>
+    error_code decode_stream(brotli_decoder_state &s, Fn fn, size_t chunk_size = 0x40000) {
+      ANDYZIP_ZONE("brotli_decoder::decode_stream");
+      ANDYZIP_ZONE_ITEMS(s.bitptr_max / 8);
+      // https://tools.ietf.org/html/rfc7932
+      s.error = error_code::ok;
+      unsigned lg_window_size = read_window_size(s);
+      if (s.error != error_code::ok) return s.error;
+      s.max_backward_distance = (1 << lg_window_size) - window_gap;
+
+      size_t ring_size = (size_t)1 << lg_window_size;
+      if (s.ring_buffer_size != ring_size) {
+        s.ring_buffer.reset(new uint8_t[ring_size]);
+        s.ring_buffer_size = ring_size;
+      }
+      ring_output<Fn> out(s, s.ring_buffer.get(), ring_size, std::max((size_t)1, std::min(chunk_size, ring_size)), fn);
+      decode_meta_blocks(s, out);
+      if (s.error == error_code::ok) {
+        out.flush();
+      }
+      s.bytes_written = out.pos;
+      return s.error == error_code::ok ? error_code::end : s.error;
+    }
+
+    /// Decode a whole brotli stream from s.src into [s.dest, s.dest_max).
+    /// Returns error_code::end if the output fits exactly.
+    error_code decode(brotli_decoder_state &s) {
+      s.error = error_code::ok;
+      unsigned lg_window_size = read_window_size(s);
+      if (s.error != error_code::ok) return s.error;
+      s.max_backward_distance = (1 << lg_window_size) - window_gap;
+
+      flat_output out(s, (uint8_t *)s.dest, (uint8_t *)s.dest_max);
+      decode_meta_blocks(s, out);
+      s.dest += out.pos;
+      s.bytes_written = out.pos;
+      if (s.error != error_code::ok) return s.error;
+      return s.dest != s.dest_max ? error_code::syntax_error : error_code::end;
+    }
   };
 
 }
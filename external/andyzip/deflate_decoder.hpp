@@ -9,13 +9,45 @@
 #define ANDYZIP_DEFLATE_DECODER_HPP_
 
 #include <cstdint>
+#include <cstddef>
+#include <cstdio>
 #include <cstring>
+#include <vector>
+#include <algorithm>
+
+// Define ANDYZIP_ZONE(name) and ANDYZIP_ZONE_ITEMS(n) before including this to time
+// the decoder (see gilgamesh/zone_tracer.hpp).
+#ifndef ANDYZIP_ZONE
+  #define ANDYZIP_ZONE(name)
+  #define ANDYZIP_ZONE_ITEMS(n)
+#endif
 
 namespace andyzip {
 
   class deflate_decoder {
     enum { debug = 0 };
 
+    enum {
+      lit_fast_bits = 11,
+      dist_fast_bits = 9,
+    };
+
+    // Fast table entries decode the next lit_fast_bits of input in one lookup.
+    // bits 0-3: bits used, 4-5: kind, 6-7: number of literals,
+    // literals: 8-15 first, 16-23 second; lengths: 8-16 base, 17-19 extra bits.
+    enum {
+      fast_literal = 0 << 4,
+      fast_length = 1 << 4,
+      fast_end = 2 << 4,
+      fast_slow = 3 << 4,
+      fast_kind_mask = 3 << 4,
+    };
+
+    // Distance entries: bits 0-3: bits used, 4-7: extra bits, 8-23: base.
+    enum : uint32_t {
+      dist_slow = 1u << 31,
+    };
+
     struct huffman_table {
       uint8_t min_lit_length;
       uint8_t max_lit_length;
@@ -31,6 +63,10 @@ namespace andyzip {
       uint16_t dist_codes[32];
       uint16_t dist_limits[18];
       uint16_t dist_base[18];
+
+      // built from the canonical tables above by build_fast().
+      uint32_t lit_fast[1 << lit_fast_bits];
+      uint32_t dist_fast[1 << dist_fast_bits];
     };
 
     huffman_table fixed_;
@@ -140,18 +176,26 @@ namespace andyzip {
     }
 
     /// peek a fixed number of little-endian bits from the bitstream
+    /// bits past src_max read as zero.
     /// note: this will have to be fixed on PPC and other big-endian devices
-    static unsigned peek(const uint8_t *src, unsigned bitptr, unsigned bits, const char *name) {
-      unsigned i = bitptr >> 3, j = bitptr & 7;
-      unsigned value = ( (unsigned&)src[i] >> j ) & ( (1u << bits) - 1 );
+    static unsigned peek(const uint8_t *src, const uint8_t *src_max, unsigned bitptr, unsigned bits, const char *name) {
+      const uint8_t *p = src + (bitptr >> 3);
+      unsigned j = bitptr & 7;
+      uint32_t word = 0;
+      if (src_max - p >= 4) {
+        memcpy(&word, p, sizeof(word));
+      } else {
+        for (int i = 0; i < 4 && p + i < src_max; ++i) word |= (uint32_t)p[i] << (i * 8);
+      }
+      unsigned value = ( word >> j ) & ( (1u << bits) - 1 );
       if (debug && name) dump_bits(value, bits, name);
       return value;
     }
 
     unsigned decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) const {
       bitptr = ( bitptr + 7 ) & ~7;
-      unsigned bytes_to_copy = peek(src, bitptr, 16, "bytes_to_copy");
-      unsigned clength = peek(src, bitptr + 16, 16, "store length check");
+      unsigned bytes_to_copy = peek(src, src_max, bitptr, 16, "bytes_to_copy");
+      unsigned clength = peek(src, src_max, bitptr + 16, 16, "store length check");
       bitptr += 32;
 
       if (bytes_to_copy != (clength^0xffff)) return ~0;
@@ -164,101 +208,266 @@ namespace andyzip {
       return bitptr;
     }
 
-    static unsigned decode_lz77(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr, const huffman_table *table_) {
-      for(;;) {
-        if (src + bitptr/8 > src_max) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > table_->lit_limits[index]) {
-          index++;
-        }
-        unsigned length = table_->min_lit_length + index;
+    // Canonical decode of a code of up to 16 bits (value is the next 16 bits reversed).
+    // Returns the code length, which is more than max_length for an invalid code.
+    static unsigned decode_slow(unsigned value, unsigned min_length, unsigned max_length, const uint16_t *codes, const uint16_t *limits, const uint16_t *base, unsigned &code) {
+      unsigned index = 0;
+      while (value > limits[index]) {
+        index++;
+      }
+      unsigned length = min_length + index;
+      if (length <= max_length) {
         unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = table_->lit_codes[offset - table_->lit_base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "code");
-
-        if (code < 256) {
-          if (dest+1 > dest_max) return ~0;
-          *dest++ = code;
-          if (debug) printf("%02x\n", code);
-        } else if (code == 256) {
-          return bitptr;
-        } else {
-          unsigned block_length;
-          unsigned distance;
-          {
-            if (debug) printf("[%d]\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
-            };
-            static const uint8_t base[] = {
-              3-3, 4-3, 5-3, 6-3, 7-3, 8-3, 9-3, 10-3,
-              11-3, 13-3, 15-3, 17-3, 19-3, 23-3, 27-3, 31-3,
-              35-3, 43-3, 51-3, 59-3, 67-3, 83-3, 99-3, 115-3,
-              131-3, 163-3, 195-3, 227-3, 258-3,
-            };
-            if (code-257 > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code-257 ];
-            block_length = base[ code-257 ] + 3 + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
+        code = codes[offset - base[index]];
+      }
+      return length;
+    }
+
+    static void build_fast(huffman_table &t) {
+      static const uint8_t length_extra[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+      };
+      static const uint16_t length_base[] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+      };
+      static const uint8_t dist_extra[] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+      };
+      static const uint16_t dist_base[] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+      };
+
+      // one symbol per entry. Bits beyond the table are zero, which gives the
+      // right answer for any code that fits and a long code for any that does not.
+      for (unsigned i = 0; i != (1 << lit_fast_bits); ++i) {
+        unsigned code = 0;
+        unsigned length = decode_slow(rev16((uint16_t)i), t.min_lit_length, t.max_lit_length, t.lit_codes, t.lit_limits, t.lit_base, code);
+        uint32_t entry = fast_slow;
+        if (length <= lit_fast_bits) {
+          if (code < 256) {
+            entry = length | fast_literal | 1 << 6 | code << 8;
+          } else if (code == 256) {
+            entry = length | fast_end;
+          } else if (code < 257 + sizeof(length_base)/sizeof(length_base[0])) {
+            entry = length | fast_length | length_base[code-257] << 8 | length_extra[code-257] << 17;
           }
-          {
-            //if (src + (bitptr + table_->max_dist_length)/8 > src_max ) return ~0;
-            unsigned peek16 = peek(src, bitptr, 16, NULL);
-            unsigned value = rev16(peek16);
-            unsigned index = 0;
-            while (value > table_->dist_limits[index]) {
-              index++;
-            }
-            unsigned length = table_->min_dist_length + index;
-            unsigned offset = ( value >> ( 16 - length ) );
-            unsigned code = table_->dist_codes[offset - table_->dist_base[index]];
-            bitptr += length;
-
-            if (debug) printf("{%d}\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 0, 0, 0,
-            };
-            static const uint16_t base[] = {
-              1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
-            };
-            if (code > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code ];
-            distance = base[ code ] + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
+        }
+        t.lit_fast[i] = entry;
+      }
+
+      // pair up literals whose codes fit together.
+      // i >> length is below i, so going down it is still a single literal.
+      for (unsigned i = (1 << lit_fast_bits); i-- != 0; ) {
+        uint32_t first = t.lit_fast[i];
+        if ((first & (fast_kind_mask | 0xc0)) != (fast_literal | 1 << 6)) continue;
+        unsigned length = first & 15;
+        uint32_t second = t.lit_fast[i >> length];
+        if ((second & (fast_kind_mask | 0xc0)) != (fast_literal | 1 << 6) || length + (second & 15) > lit_fast_bits) continue;
+        t.lit_fast[i] = (length + (second & 15)) | fast_literal | 2 << 6 | (first & 0xff00) | (second & 0xff00) << 8;
+      }
+
+      for (unsigned i = 0; i != (1 << dist_fast_bits); ++i) {
+        unsigned code = 0;
+        unsigned length = decode_slow(rev16((uint16_t)i), t.min_dist_length, t.max_dist_length, t.dist_codes, t.dist_limits, t.dist_base, code);
+        uint32_t entry = dist_slow;
+        if (length <= dist_fast_bits && code < sizeof(dist_base)/sizeof(dist_base[0])) {
+          entry = length | dist_extra[code] << 4 | dist_base[code] << 8;
+        }
+        t.dist_fast[i] = entry;
+      }
+    }
+
+    static bool build_tables(huffman_table &t, uint8_t *lengths, unsigned num_lit_codes, unsigned num_dist_codes) {
+      if(
+        !build_huffman(lengths, num_lit_codes, t.min_lit_length, t.max_lit_length, t.lit_codes, t.lit_limits, t.lit_base) ||
+        !build_huffman(lengths+num_lit_codes, num_dist_codes, t.min_dist_length, t.max_dist_length, t.dist_codes, t.dist_limits, t.dist_base)
+      ) {
+        return false;
+      }
+      build_fast(t);
+      return true;
+    }
+
+    // Holds up to 64 bits of input, refilled eight bytes at a time.
+    // Past the end of the input it reads zeros; the caller checks for overrun.
+    struct bit_buffer {
+      const uint8_t *src;
+      const uint8_t *src_max;
+      const uint8_t *p;
+      uint64_t bits = 0;
+      unsigned count = 0;
+
+      bit_buffer(const uint8_t *src, const uint8_t *src_max, unsigned bitptr) : src(src), src_max(src_max), p(src + bitptr / 8) {
+        refill();
+        drop(bitptr & 7);
+      }
+
+      // afterwards there are at least 56 bits in the buffer.
+      void refill() {
+        if (src_max - p >= 8) {
+          uint64_t word;
+          memcpy(&word, p, sizeof(word));
+          bits |= word << count;
+          p += (63 - count) >> 3;
+          count |= 56;
+        } else {
+          while (count <= 56) {
+            bits |= (uint64_t)(p < src_max ? *p : 0) << count;
+            ++p;
+            count += 8;
           }
+        }
+      }
 
-          if (debug) printf("length=%d distance=%d\n", block_length, distance);
+      unsigned peek(unsigned n) const { return (unsigned)bits & ((1u << n) - 1); }
+      void drop(unsigned n) { bits >>= n; count -= n; }
+      unsigned bitptr() const { return (unsigned)((p - src) * 8 - count); }
+      bool overrun() const { return (size_t)(p - src) * 8 - count > (size_t)(src_max - src) * 8; }
+    };
 
-          if (dest+block_length > dest_max) return ~0;
+    // Decode literals and matches until the end of block code.
+    // [dest_begin, dest) is the output so far, which matches may refer to.
+    // If paused is given, stop at a symbol boundary once dest has passed dest_pause.
+    static unsigned decode_lz77(uint8_t *&dest_ref, uint8_t *dest_begin, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr, const huffman_table *table_, uint8_t *dest_pause = nullptr, bool *paused = nullptr) {
+      // room for the longest match plus the overrun of an eight byte copy.
+      static const ptrdiff_t fast_margin = 258 + 8;
 
-          for(unsigned i = 0; i != block_length; ++i) {
-            dest[0] = dest[-(int)distance];
-            dest++;
+      bit_buffer in(src, src_max, bitptr);
+      uint8_t *dest = dest_ref;
+      unsigned result = ~0;
+      for(;;) {
+        if (paused && dest > dest_pause) { *paused = true; result = in.bitptr(); break; }
+        if (in.overrun()) break;
+        in.refill();
+        bool room = dest_max - dest >= fast_margin;
+
+        uint32_t entry = table_->lit_fast[in.peek(lit_fast_bits)];
+        unsigned code_length = entry & 15;
+        unsigned kind = entry & fast_kind_mask;
+        if (kind == fast_literal) {
+          in.drop(code_length);
+          unsigned num_literals = (entry >> 6) & 3;
+          if (room) {
+            dest[0] = (uint8_t)(entry >> 8);
+            dest[1] = (uint8_t)(entry >> 16);
+          } else {
+            if (dest_max - dest < (ptrdiff_t)num_literals) break;
+            dest[0] = (uint8_t)(entry >> 8);
+            if (num_literals == 2) dest[1] = (uint8_t)(entry >> 16);
           }
+          dest += num_literals;
+          continue;
+        }
+
+        unsigned block_length;
+        if (kind == fast_slow) {
+          // codes longer than the table
+          unsigned code;
+          code_length = decode_slow(rev16((uint16_t)in.peek(16)), table_->min_lit_length, table_->max_lit_length, table_->lit_codes, table_->lit_limits, table_->lit_base, code);
+          if (code_length > table_->max_lit_length) break;
+          in.drop(code_length);
+          if (code < 256) {
+            if (dest == dest_max) break;
+            *dest++ = (uint8_t)code;
+            continue;
+          } else if (code == 256) {
+            result = in.bitptr();
+            break;
+          }
+          // entries for long length codes are rare enough to build on the fly.
+          static const uint8_t extra[] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+          };
+          static const uint16_t base[] = {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+          };
+          if (code - 257 >= sizeof(base)/sizeof(base[0])) break;
+          entry = base[code-257] << 8 | extra[code-257] << 17;
+        } else if (kind == fast_end) {
+          in.drop(code_length);
+          result = in.bitptr();
+          break;
+        } else {
+          in.drop(code_length);
+        }
+
+        unsigned extra_length = (entry >> 17) & 7;
+        block_length = ((entry >> 8) & 0x1ff) + in.peek(extra_length);
+        in.drop(extra_length);
+
+        uint32_t dist = table_->dist_fast[in.peek(dist_fast_bits)];
+        if (dist & dist_slow) {
+          static const uint8_t extra[] = {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+          };
+          static const uint16_t base[] = {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+          };
+          unsigned code;
+          unsigned length = decode_slow(rev16((uint16_t)in.peek(16)), table_->min_dist_length, table_->max_dist_length, table_->dist_codes, table_->dist_limits, table_->dist_base, code);
+          if (length > table_->max_dist_length || code >= sizeof(base)/sizeof(base[0])) break;
+          dist = length | extra[code] << 4 | base[code] << 8;
+        }
+        in.drop(dist & 15);
+        unsigned dist_extra = (dist >> 4) & 15;
+        size_t distance = (dist >> 8) + in.peek(dist_extra);
+        in.drop(dist_extra);
+
+        if (debug) printf("length=%d distance=%d\n", block_length, (int)distance);
+        if (distance > (size_t)(dest - dest_begin)) break;
+
+        const uint8_t *from = dest - distance;
+        if (room) {
+          uint8_t *end = dest + block_length;
+          if (distance >= 8) {
+            // eight bytes at a time; the source is always at least eight bytes behind.
+            do {
+              memcpy(dest, from, 8);
+              dest += 8;
+              from += 8;
+            } while (dest < end);
+          } else if (distance == 1) {
+            memset(dest, *from, block_length);
+          } else {
+            for (unsigned i = 0; i != block_length; ++i) {
+              dest[i] = from[i];
+            }
+          }
+          dest = end;
+        } else {
+          if ((size_t)(dest_max - dest) < block_length) break;
+          for (unsigned i = 0; i != block_length; ++i) {
+            dest[i] = from[i];
+          }
+          dest += block_length;
         }
       }
+      dest_ref = dest;
+      return in.overrun() ? ~0u : result;
     }
 
-    unsigned decode_fixed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) const {
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &fixed_);
+    unsigned decode_fixed(uint8_t *&dest, uint8_t *dest_begin, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) const {
+      return decode_lz77(dest, dest_begin, dest_max, src, src_max, bitptr, &fixed_);
     }
 
-    unsigned decode_variable(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) const {
-      unsigned num_lit_codes = peek(src, bitptr, 5, "num_lit_codes") + 257;
-      unsigned num_dist_codes = peek(src, bitptr+5, 5, "num_dist_codes") + 1;
-      unsigned num_length_codes = peek(src, bitptr+10, 4, "num_length_codes") + 4;
+    // read the code lengths of a dynamic block and build its tables.
+    static unsigned read_tables(huffman_table &var, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
+      unsigned num_lit_codes = peek(src, src_max, bitptr, 5, "num_lit_codes") + 257;
+      unsigned num_dist_codes = peek(src, src_max, bitptr+5, 5, "num_dist_codes") + 1;
+      unsigned num_length_codes = peek(src, src_max, bitptr+10, 4, "num_length_codes") + 4;
       
       bitptr += 14;
 
+      // peek reads zeros past the end, so only check that we have not gone past it.
+      size_t max_bitptr = (size_t)(src_max - src) * 8;
       uint8_t lengths[288 + 32];
       memset(lengths, 0, 20);
-      if (src + bitptr/8 + num_length_codes > src_max ) return ~0;
+      if (bitptr + num_length_codes * 3 > max_bitptr) return ~0;
       for (unsigned i = 0; i != num_length_codes; ++i) {
         static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
-        lengths[order[i]] = peek(src, bitptr, 3, "length code lenghs");
+        lengths[order[i]] = peek(src, src_max, bitptr, 3, "length code lenghs");
         bitptr += 3;
       }
       
@@ -271,41 +480,32 @@ namespace andyzip {
       
       unsigned todo = num_lit_codes + num_dist_codes;
       for(unsigned done = 0; done < todo;) {
-        if (src + bitptr/8 + max_length > src_max ) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > limits[index]) {
-          index++;
-        }
-        unsigned length = min_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = codes[offset - base[index]];
+        unsigned peek16 = peek(src, src_max, bitptr, 16, NULL);
+        unsigned code = 0;
+        unsigned length = decode_slow(rev16(peek16), min_length, max_length, codes, limits, base, code);
+        if (length > max_length) return ~0;
         bitptr += length;
         if (debug) dump_bits(peek16, length, "length");
         //fprintf(source_.debug(), "code=%03x\n", code);
         unsigned copy = 1;
         if (code < 16) {
         } else if(code == 16) {
-          if (src + (bitptr+2)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 2, NULL) + 3;
+          copy = peek(src, src_max, bitptr, 2, NULL) + 3;
           bitptr += 2;
           if (done == 0) return ~0;
           code = lengths[ done-1 ];
         } else if(code == 17) {
-          if (src + (bitptr+3)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 3, NULL) + 3;
+          copy = peek(src, src_max, bitptr, 3, NULL) + 3;
           bitptr += 3;
           code = 0;
         } else if(code == 18) {
-          if (src + (bitptr+7)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 7, NULL) + 11;
+          copy = peek(src, src_max, bitptr, 7, NULL) + 11;
           bitptr += 7;
           code = 0;
         } else {
           return ~0;
         }
-        if (done + copy > todo) return ~0;
+        if (bitptr > max_bitptr || done + copy > todo) return ~0;
         do {
           lengths[done++] = code;
         } while( --copy );
@@ -313,14 +513,17 @@ namespace andyzip {
 
       if (debug) printf("lengths done\n");
 
-      huffman_table var;
-      if(
-        !build_huffman(lengths, num_lit_codes, var.min_lit_length, var.max_lit_length, var.lit_codes, var.lit_limits, var.lit_base) ||
-        !build_huffman(lengths+num_lit_codes, num_dist_codes, var.min_dist_length, var.max_dist_length, var.dist_codes, var.dist_limits, var.dist_base)
-      ) {
+      if (!build_tables(var, lengths, num_lit_codes, num_dist_codes)) {
         return ~0;
       }
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &var);
+      return bitptr;
+    }
+
+    unsigned decode_variable(uint8_t *&dest, uint8_t *dest_begin, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) const {
+      huffman_table var;
+      bitptr = read_tables(var, src, src_max, bitptr);
+      if (bitptr == ~0u) return ~0;
+      return decode_lz77(dest, dest_begin, dest_max, src, src_max, bitptr, &var);
     }
   public:
     deflate_decoder() {
@@ -333,9 +536,13 @@ namespace andyzip {
       memset(dist_lengths, 5, 32);
       build_huffman(lit_lengths, 288, fixed_.min_lit_length, fixed_.max_lit_length, fixed_.lit_codes, fixed_.lit_limits, fixed_.lit_base);
       build_huffman(dist_lengths, 32, fixed_.min_dist_length, fixed_.max_dist_length, fixed_.dist_codes, fixed_.dist_limits, fixed_.dist_base);
+      build_fast(fixed_);
     }
 
     bool decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) const {
+      ANDYZIP_ZONE("deflate_decoder::decode");
+      ANDYZIP_ZONE_ITEMS(dest_max - dest);
+      uint8_t *dest_begin = dest;
       unsigned bitptr = 0;
       unsigned is_last_block;
 
@@ -346,14 +553,14 @@ namespace andyzip {
         bitptr %= 8;
 
         // three bits determine kind and exit condition
-        is_last_block = peek(src, bitptr, 1, "deflate last") != 0;
-        unsigned kind = peek(src, bitptr + 1, 2, "deflate kind");
+        is_last_block = peek(src, src_max, bitptr, 1, "deflate last") != 0;
+        unsigned kind = peek(src, src_max, bitptr + 1, 2, "deflate kind");
 
         bitptr += 3;
         switch (kind) {
         case 0: bitptr = decode_uncompressed(dest, dest_max, src, src_max, bitptr); break;
-        case 1: bitptr = decode_fixed(dest, dest_max, src, src_max, bitptr); break;
-        case 2: bitptr = decode_variable(dest, dest_max, src, src_max, bitptr); break;
+        case 1: bitptr = decode_fixed(dest, dest_begin, dest_max, src, src_max, bitptr); break;
+        case 2: bitptr = decode_variable(dest, dest_begin, dest_max, src, src_max, bitptr); break;
         default: return false;
         }
       } while( !is_last_block && bitptr != ~0);
@@ -361,6 +568,86 @@ namespace andyzip {
       if (debug) printf("%p %p\n", src + bitptr / 8, src_max);
       return is_last_block && bitptr != ~0 && dest == dest_max;
     }
+
+    /// Decode a deflate stream of unknown length.
+    /// Output is passed to fn(begin, end) in pieces of about chunk_size bytes;
+    /// only the last 32K of output is kept for back references.
+    /// fn may return false to stop early.
+    /// Returns the first byte after the stream, or nullptr on error or if stopped.
+    template <class Fn>
+    const uint8_t *decode_stream(const uint8_t *src, const uint8_t *src_max, Fn fn, size_t chunk_size = 0x40000) const {
+      ANDYZIP_ZONE("deflate_decoder::decode_stream");
+      ANDYZIP_ZONE_ITEMS(src_max - src);
+      static const size_t history = 0x8000;
+      static const size_t max_match = 258;
+
+      // [buffer, start) holds history, [start, dest) is output not yet passed to fn.
+      std::vector<uint8_t> buffer(history + chunk_size + max_match);
+      uint8_t *start = buffer.data() + history;
+      uint8_t *dest = start;
+      uint8_t *dest_pause = start + chunk_size;
+      uint8_t *dest_max = buffer.data() + buffer.size();
+
+      huffman_table var;
+      const huffman_table *table = nullptr;
+      unsigned bitptr = 0;
+      unsigned kind = 0;
+      unsigned stored_bytes = 0;
+      bool is_last_block = false;
+      bool in_block = false;
+
+      for (;;) {
+        src += bitptr / 8;
+        bitptr %= 8;
+
+        if (!in_block) {
+          if (is_last_block) break;
+          if (src >= src_max) return nullptr;
+          is_last_block = peek(src, src_max, bitptr, 1, "deflate last") != 0;
+          kind = peek(src, src_max, bitptr + 1, 2, "deflate kind");
+          bitptr += 3;
+          switch (kind) {
+            case 0: {
+              bitptr = ( bitptr + 7 ) & ~7;
+              if (src + bitptr/8 + 4 > src_max) return nullptr;
+              stored_bytes = peek(src, src_max, bitptr, 16, "bytes_to_copy");
+              if (stored_bytes != (peek(src, src_max, bitptr + 16, 16, "store length check")^0xffff)) return nullptr;
+              bitptr += 32;
+            } break;
+            case 1: table = &fixed_; break;
+            case 2: {
+              table = &var;
+              bitptr = read_tables(var, src, src_max, bitptr);
+              if (bitptr == ~0u) return nullptr;
+            } break;
+            default: return nullptr;
+          }
+          in_block = true;
+        } else if (kind == 0) {
+          size_t bytes = std::min((size_t)stored_bytes, (size_t)(dest_max - dest));
+          if (src + bitptr/8 + bytes > src_max) return nullptr;
+          memcpy(dest, src + bitptr/8, bytes);
+          dest += bytes;
+          bitptr += (unsigned)bytes * 8;
+          stored_bytes -= (unsigned)bytes;
+          in_block = stored_bytes != 0;
+        } else {
+          bool paused = false;
+          bitptr = decode_lz77(dest, buffer.data(), dest_max, src, src_max, bitptr, table, dest_pause, &paused);
+          if (bitptr == ~0u) return nullptr;
+          in_block = paused;
+        }
+
+        if (dest > dest_pause) {
+          if (!fn((const uint8_t *)start, (const uint8_t *)dest)) return nullptr;
+          memmove(buffer.data(), dest - history, history);
+          dest = start;
+        }
+      }
+
+      if (dest != start && !fn((const uint8_t *)start, (const uint8_t *)dest)) return nullptr;
+      return src + (bitptr + 7) / 8;
+    }
   };
 
 }
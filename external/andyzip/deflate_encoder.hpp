@@ -8,117 +8,198 @@
 #ifndef MINIZIP_DEFLATE_ENCODER_INCLUDED
 #define MINIZIP_DEFLATE_ENCODER_INCLUDED
 
+#include <andyzip/huffman_table.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <thread>
+#include <atomic>
 #include <algorithm>
+#include <memory>
 
 namespace andyzip {
+  /// Suffix array of a string, built in linear time by induced sorting (SA-IS).
+  ///
+  /// Nong, G.; Zhang, S.; Chan, W. H. (2009). Linear Suffix Array Construction by Almost Pure Induced-Sorting.
+  /// Data Compression Conference, pp. 193-202. doi:10.1109/DCC.2009.42.
+  ///
+  /// The empty suffix is included, so there are size+1 entries. The Allocator
+  /// is used for the result and for all the scratch space of the sort.
   template <class CharType=uint8_t, class AddrType=uint32_t, class Allocator=std::allocator<char>>
   class suffix_array {
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<AddrType> addr_allocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<bool> bool_allocator;
+    typedef std::vector<AddrType, addr_allocator> addr_vector;
 
   public:
     typedef AddrType addr_type;
     typedef CharType char_type;
 
-    suffix_array(const char_type *src, const char_type *src_max) {
+    /// Sort the suffixes of [src, src_max). The lcp array is optional as it
+    /// takes as much time again.
+    suffix_array(const char_type *src, const char_type *src_max, bool build_lcp = true, const Allocator &alloc = Allocator()) :
+      addresses_(addr_allocator(alloc)), longest_common_prefix_(addr_allocator(alloc)), addr_to_sa_(addr_allocator(alloc))
+    {
       size_t size = src_max - src;
 
-      struct sorter_t {
-        addr_type group;
-        addr_type next_group;
-        addr_type addr;
-      };
+      size_t upper = 0;
+      for (size_t i = 0; i != size; ++i) {
+        upper = std::max(upper, (size_t)src[i]);
+      }
 
-      std::vector<sorter_t, Allocator> sorter(size + 1);
-      addr_to_sa_.resize(size + 1);
+      // the empty suffix sorts first.
+      addresses_.resize(size + 1);
+      addresses_[0] = (addr_type)size;
+      sais(addresses_.data() + 1, src, size, upper, alloc);
 
+      addr_to_sa_.resize(size + 1);
       for (size_t i = 0; i != size+1; ++i) {
-        sorter_t &s = sorter[i];
-        s.group = i == size ? 0 : src[i];
-        s.next_group = i == size ? 0 : 1;
-        s.addr = (addr_type)i;
+        addr_to_sa_[addresses_[i]] = (addr_type)i;
       }
 
-      auto sort_by_group_and_next = [](const sorter_t &a, const sorter_t &b) {
-        return a.group < b.group + (a.next_group < b.next_group);
-      };
-
-      auto debug_dump = [src, &sorter](const char *msg, size_t h) {
-        printf("\n%s h=%d\n", msg, (int)h);
-        for (size_t i = 0; i != sorter.size(); ++i) {
-        //for (size_t i = 0; i != 4; ++i) {
-          auto &s = sorter[i];
-          printf("%4d %12d %4d %4d %s\n", (int)i, (int)s.group, (int)s.next_group, (int)s.addr, (char*)src + s.addr);
-        }
-      };
+      if (!build_lcp) return;
 
-      // todo: limit work to parts of the array not yet complete.
-      constexpr bool debug = false;
-      for (size_t h = 1; ; h *= 2) {
-        // sort by group
-        std::sort(sorter.begin(), sorter.end(), sort_by_group_and_next);
-
-        int finished = 1;
-        for (size_t i = 0; i != size+1;) {
-          auto si = sorter[i];
-          size_t j = i+1;
-          sorter[i].group = (addr_type)i;
-          int done = 0;
-          for (; j != size+1 && sorter[j].group == si.group && sorter[j].next_group == si.next_group; ++j) {
-            sorter[j].group = (addr_type)i;
-            done = 1;
+      // Kasai, T.; Lee, G.; Arimura, H.; Arikawa, S.; Park, K. (2001). Linear-Time Longest-Common-Prefix Computation in Suffix Arrays and Its Applications.
+      // Proceedings of the 12th Annual Symposium on Combinatorial Pattern Matching. Lecture Notes in Computer Science. 2089. pp. 181-192. doi:10.1007/3-540-48194-X_17. ISBN 978-3-540-42271-6.
+      longest_common_prefix_.resize(size+1);
+      addr_type h = 0;
+      for (size_t i = 0; i != size; ++i) {
+        addr_type r = addr_to_sa_[i];
+        if (r > 0) {
+          addr_type j = addresses_[r-1];
+          while (i + h < size && j + h < size && src[i+h] == src[j+h]) {
+            ++h;
           }
-          finished &= !done;
-          i = j;
+          longest_common_prefix_[r] = h;
+          h -= h > 0;
         }
+      }
+    }
 
-        if (debug) debug_dump("built group numbers", h);
+    /// address of the i'th suffix in sorted order. addr(0) is the empty suffix.
+    addr_type addr(size_t i) const { return addresses_[i]; }
 
-        for (size_t i = 0; i != size+1; ++i) {
-          addr_to_sa_[sorter[i].addr] = i;
-        }
+    /// length of the prefix shared by the suffixes at addr(i-1) and addr(i).
+    /// Only available if build_lcp was set.
+    addr_type lcp(size_t i) const { return longest_common_prefix_[i]; }
 
-        if (finished) break;
+    /// position of the suffix at address i in sorted order.
+    addr_type rank(size_t i) const { return addr_to_sa_[i]; }
 
-        for (size_t i = 0; i != size+1; ++i) {
-          sorter_t &s = sorter[i];
-          s.next_group = s.addr < size - h ? sorter[addr_to_sa_[s.addr + h]].group : 0;
+    /// number of suffixes, including the empty one.
+    size_t size() const { return addresses_.size(); }
+  private:
+    // Sort the n non-empty suffixes of s, whose symbols are all <= upper, into sa.
+    template <class Symbol>
+    static void sais(addr_type *sa, const Symbol *s, size_t n, size_t upper, const Allocator &alloc) {
+      static const addr_type empty = ~(addr_type)0;
+      if (n <= 2) {
+        if (n) sa[0] = 0;
+        if (n == 2) {
+          sa[s[0] < s[1] ? 0 : 1] = 0;
+          sa[s[0] < s[1] ? 1 : 0] = 1;
         }
+        return;
+      }
+
+      addr_allocator addr_alloc(alloc);
 
-        if (debug) debug_dump("set next_group", h);
+      // s-type suffixes are smaller than the suffix after them, l-type larger.
+      std::vector<bool, bool_allocator> is_s(n, false, bool_allocator(alloc));
+      for (size_t i = n - 1; i-- != 0; ) {
+        is_s[i] = s[i] == s[i+1] ? is_s[i+1] : s[i] < s[i+1];
       }
 
-      addresses_.resize(size+1);
-      for (size_t i = 0; i != size+1; ++i) {
-        addresses_[i] = sorter[i].addr;
+      // start of the l-type and s-type parts of each bucket.
+      addr_vector l_start(upper + 2, 0, addr_alloc);
+      addr_vector s_start(upper + 1, 0, addr_alloc);
+      for (size_t i = 0; i != n; ++i) {
+        if (is_s[i]) l_start[s[i] + 1]++; else s_start[s[i]]++;
+      }
+      for (size_t c = 0; c <= upper; ++c) {
+        s_start[c] += l_start[c];
+        l_start[c+1] += s_start[c];
       }
 
-      sorter.resize(0);
-      sorter.shrink_to_fit();
+      addr_vector bucket(upper + 2, 0, addr_alloc);
 
-      // Kasai, T.; Lee, G.; Arimura, H.; Arikawa, S.; Park, K. (2001). Linear-Time Longest-Common-Prefix Computation in Suffix Arrays and Its Applications.
-      // Proceedings of the 12th Annual Symposium on Combinatorial Pattern Matching. Lecture Notes in Computer Science. 2089. pp. 181192. doi:10.1007/3-540-48194-X_17. ISBN 978-3-540-42271-6.
-      longest_common_prefix_.resize(size+1);
-      addr_type h = 0;
-      for (size_t i = 0; i != sorter.size(); ++i) {
-        addr_type r = addr_to_sa_[i];
-        if (r > 0) {
-          addr_type j = addresses_[r-1];
-          while (src[i+h] == src[j+h]) {
-            ++h;
+      // place the lms suffixes in the given order, then induce the rest.
+      auto induce = [&](const addr_type *lms, size_t num_lms) {
+        std::fill(sa, sa + n, empty);
+        std::copy(s_start.begin(), s_start.end(), bucket.begin());
+        for (size_t i = 0; i != num_lms; ++i) {
+          sa[bucket[s[lms[i]]]++] = lms[i];
+        }
+        std::copy(l_start.begin(), l_start.end(), bucket.begin());
+        sa[bucket[s[n-1]]++] = (addr_type)(n-1);
+        for (size_t i = 0; i != n; ++i) {
+          addr_type v = sa[i];
+          if (v != empty && v >= 1 && !is_s[v-1]) {
+            sa[bucket[s[v-1]]++] = v-1;
           }
-          longest_common_prefix_[r] = h;
-          h -= h > 0;
+        }
+        std::copy(l_start.begin(), l_start.end(), bucket.begin());
+        for (size_t i = n; i-- != 0; ) {
+          addr_type v = sa[i];
+          if (v != empty && v >= 1 && is_s[v-1]) {
+            sa[--bucket[s[v-1]+1]] = v-1;
+          }
+        }
+      };
+
+      // leftmost s-type positions, in text order.
+      addr_vector lms_index(n + 1, empty, addr_alloc);
+      addr_vector lms(addr_alloc);
+      for (size_t i = 1; i != n; ++i) {
+        if (!is_s[i-1] && is_s[i]) {
+          lms_index[i] = (addr_type)lms.size();
+          lms.push_back((addr_type)i);
         }
       }
-    }
+      size_t num_lms = lms.size();
 
-    auto addr(size_t i) const { return addresses_[i]; }
-    auto lcp(size_t i) const { return longest_common_prefix_[i]; }
-    auto rank(size_t i) const { return addr_to_sa_[i]; }
-  private:
+      induce(lms.data(), num_lms);
+      if (!num_lms) return;
+
+      // the lms substrings are now sorted; name them and sort the names recursively.
+      addr_vector sorted_lms(addr_alloc);
+      sorted_lms.reserve(num_lms);
+      for (size_t i = 0; i != n; ++i) {
+        if (lms_index[sa[i]] != empty) sorted_lms.push_back(sa[i]);
+      }
+
+      addr_vector names(num_lms, 0, addr_alloc);
+      size_t name = 0;
+      for (size_t i = 1; i != num_lms; ++i) {
+        size_t l = sorted_lms[i-1], r = sorted_lms[i];
+        size_t end_l = lms_index[l] + 1 < num_lms ? lms[lms_index[l] + 1] : n;
+        size_t end_r = lms_index[r] + 1 < num_lms ? lms[lms_index[r] + 1] : n;
+        bool same = end_l - l == end_r - r;
+        for (; same && l != end_l; ++l, ++r) {
+          same = s[l] == s[r];
+        }
+        if (same && (l == n || s[l] != s[r])) same = false;
+        name += !same;
+        names[lms_index[sorted_lms[i]]] = (addr_type)name;
+      }
+
+      addr_vector sub_sa(num_lms, 0, addr_alloc);
+      sais(sub_sa.data(), names.data(), num_lms, name, alloc);
+      for (size_t i = 0; i != num_lms; ++i) {
+        sorted_lms[i] = lms[sub_sa[i]];
+      }
+
+      // release what we can before the final pass.
+      names = addr_vector(addr_alloc);
+      sub_sa = addr_vector(addr_alloc);
+      induce(sorted_lms.data(), num_lms);
+    }
 
-    std::vector<addr_type, Allocator> addresses_;
-    std::vector<addr_type, Allocator> longest_common_prefix_;
-    std::vector<addr_type, Allocator> addr_to_sa_;
+    addr_vector addresses_;
+    addr_vector longest_common_prefix_;
+    addr_vector addr_to_sa_;
   };
 
   class old_suffix_array {
@@ -237,34 +318,467 @@ namespace andyzip {
     std::vector<sorter_t> sorter;
   };
 
+  /// Raw deflate (RFC 1951) encoder.
+  ///
+  /// Matches come from a suffix array of each chunk and the window before it,
+  /// with one step of lazy matching. Blocks use dynamic Huffman codes unless
+  /// fixed codes or a stored block would be smaller.
+  ///
+  /// Chunks of the input are compressed independently and joined with sync
+  /// flushes (an empty stored block), so they may be compressed on many
+  /// threads. The output is the same for any number of threads.
   class deflate_encoder {
-  public:
-    deflate_encoder() {
+    enum {
+      window_size = 0x8000,
+      min_match = 3,
+      max_match = 258,
+      chunk_size = 0x20000,
+      max_block_tokens = 0x8000,
+      max_stored = 0xffff,
+      num_lit_codes = 286,
+      num_fixed_codes = 288,
+      num_dist_codes = 30,
+      num_length_codes = 19,
+    };
+
+    // a literal if distance is zero, otherwise a match.
+    struct token {
+      uint16_t value;
+      uint16_t distance;
+    };
+
+    class bit_writer {
+    public:
+      bit_writer(std::vector<uint8_t> &dest) : dest_(dest) {
+      }
+
+      void put(unsigned value, unsigned bits) {
+        bits_ |= (uint64_t)value << count_;
+        count_ += bits;
+        if (count_ >= 32) {
+          uint8_t bytes[4] = { (uint8_t)bits_, (uint8_t)(bits_ >> 8), (uint8_t)(bits_ >> 16), (uint8_t)(bits_ >> 24) };
+          dest_.insert(dest_.end(), bytes, bytes + 4);
+          bits_ >>= 32;
+          count_ -= 32;
+        }
+      }
+
+      // pad to a byte boundary and write out the remaining bits.
+      void align() {
+        for (; count_ > 0; count_ -= std::min(count_, 8u)) {
+          dest_.push_back((uint8_t)bits_);
+          bits_ >>= 8;
+        }
+        count_ = 0;
+      }
+
+      void bytes(const uint8_t *src, size_t size) {
+        dest_.insert(dest_.end(), src, src + size);
+      }
+    private:
+      std::vector<uint8_t> &dest_;
+      uint64_t bits_ = 0;
+      unsigned count_ = 0;
+    };
+
+    static const uint8_t *length_extra() {
+      static const uint8_t table[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+      };
+      return table;
+    }
+
+    static const uint16_t *length_base() {
+      static const uint16_t table[] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+      };
+      return table;
+    }
+
+    static const uint8_t *dist_extra() {
+      static const uint8_t table[] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+      };
+      return table;
+    }
+
+    static const uint16_t *dist_base() {
+      static const uint16_t table[] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+      };
+      return table;
+    }
+
+    static unsigned dist_code(unsigned distance) {
+      unsigned value = distance - 1;
+      if (value < 4) return value;
+      unsigned log2 = 2;
+      while (value >> (log2 + 1)) ++log2;
+      return log2 * 2 + ((value >> (log2 - 1)) & 1);
     }
 
-    bool encode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) const {
-      size_t block_size = 0x10000;
-      FILE *log = fopen("1.txt", "wb");
-
-      while (src != src_max) {
-        size_t size = std::min((size_t)(src_max - src), block_size);
-        suffix_array<uint8_t, uint32_t> sa(src, src + size);
-        for (size_t i = 0; i != size; ++i) {
-          size_t addr = sa.addr(i);
-          char buf[12];
-          size_t k = 0;
-          for (size_t j = std::max(1u, addr)-1; k != 10 && j != size; ++j) {
-            buf[k++] = src[j] < ' ' || src[j] >= 0x7f  ? '.' : src[j];
+    // Huffman code lengths for freq[0..num_symbols) of at most max_length bits.
+    // Unused symbols get zero. There are always at least two codes.
+    static void build_lengths(uint8_t *lengths, const uint32_t *freq, unsigned num_symbols, unsigned max_length) {
+      std::vector<unsigned> symbols;
+      for (unsigned i = 0; i != num_symbols; ++i) {
+        lengths[i] = 0;
+        if (freq[i]) symbols.push_back(i);
+      }
+      if (symbols.size() < 2) {
+        unsigned symbol = symbols.empty() ? 0 : symbols[0];
+        lengths[symbol] = 1;
+        lengths[symbol ? 0 : 1] = 1;
+        return;
+      }
+
+      // least frequent first.
+      std::stable_sort(symbols.begin(), symbols.end(), [freq](unsigned a, unsigned b) { return freq[a] < freq[b]; });
+
+      // Two queue Huffman construction: leaves in order, then internal nodes in order of creation.
+      size_t n = symbols.size();
+      std::vector<uint64_t> weight(n * 2);
+      std::vector<unsigned> parent(n * 2);
+      for (size_t i = 0; i != n; ++i) weight[i] = freq[symbols[i]];
+      size_t leaf = 0, node = n, next = n;
+      auto pop = [&]() {
+        return leaf < n && (node == next || weight[leaf] <= weight[node]) ? leaf++ : node++;
+      };
+      for (; next != n * 2 - 1; ++next) {
+        size_t a = pop(), b = pop();
+        weight[next] = weight[a] + weight[b];
+        parent[a] = parent[b] = (unsigned)next;
+      }
+
+      // depths, root first.
+      unsigned num_codes[32] = {};
+      std::vector<unsigned> depth(n * 2);
+      for (size_t i = n * 2 - 2; i-- != 0; ) {
+        depth[i] = depth[parent[i]] + 1;
+        if (i < n) num_codes[std::min(depth[i], 31u)]++;
+      }
+
+      // move codes that are too long up the tree, keeping the Kraft sum at one.
+      for (unsigned i = max_length + 1; i != 32; ++i) {
+        num_codes[max_length] += num_codes[i];
+      }
+      uint32_t total = 0;
+      for (unsigned i = max_length; i != 0; --i) {
+        total += num_codes[i] << (max_length - i);
+      }
+      for (; total > (1u << max_length); --total) {
+        num_codes[max_length]--;
+        for (unsigned i = max_length - 1; i != 0; --i) {
+          if (num_codes[i]) {
+            num_codes[i]--;
+            num_codes[i+1] += 2;
+            break;
           }
-          buf[k] = 0;
-          fprintf(log, "%8d <%s>\n", i, buf);
         }
-        break;
-        src += size;
       }
-      return false;
+
+      // the rarest symbols get the longest codes.
+      size_t i = 0;
+      for (unsigned length = max_length; length != 0; --length) {
+        for (unsigned j = 0; j != num_codes[length]; ++j) {
+          lengths[symbols[i++]] = (uint8_t)length;
+        }
+      }
+    }
+
+    // bit reversed canonical codes for the lengths.
+    static void build_codes(uint16_t *codes, const uint8_t *lengths, unsigned num_symbols) {
+      unsigned num_codes[16] = {};
+      for (unsigned i = 0; i != num_symbols; ++i) num_codes[lengths[i]]++;
+      num_codes[0] = 0;
+      unsigned next[16];
+      unsigned code = 0;
+      for (unsigned length = 1; length != 16; ++length) {
+        code = (code + num_codes[length-1]) << 1;
+        next[length] = code;
+      }
+      for (unsigned i = 0; i != num_symbols; ++i) {
+        unsigned length = lengths[i];
+        codes[i] = length ? rev16((uint16_t)next[length]++) >> (16 - length) : 0;
+      }
+    }
+
+    // Find the longest earlier match for pos within the window by walking
+    // out from pos in the suffix array. The running minimum of the lcp
+    // is the length of the match with each neighbour.
+    unsigned find_match(const suffix_array<uint8_t, uint32_t> &sa, size_t pos, size_t size, unsigned &distance) const {
+      unsigned max_length = (unsigned)std::min((size_t)max_match, size - pos);
+      if (max_length < min_match) return 0;
+
+      size_t rank = sa.rank(pos);
+      unsigned best = 0;
+      for (int dir = -1; dir <= 1; dir += 2) {
+        unsigned lcp = max_length;
+        size_t k = rank;
+        for (unsigned step = 0; step != max_steps_; ++step) {
+          if (dir < 0) {
+            if (k == 0) break;
+            lcp = std::min(lcp, (unsigned)sa.lcp(k--));
+          } else {
+            if (k + 1 == sa.size()) break;
+            lcp = std::min(lcp, (unsigned)sa.lcp(++k));
+          }
+          if (lcp <= best || lcp < min_match) break;
+          size_t addr = sa.addr(k);
+          if (addr < pos && pos - addr <= window_size) {
+            best = lcp;
+            distance = (unsigned)(pos - addr);
+            if (best == max_length) break;
+          }
+        }
+      }
+
+      // a short match a long way back costs more than three literals.
+      return best == min_match && distance > 4096 ? 0 : best;
+    }
+
+    // Convert [begin, end) of src to tokens. Matches may reach back to src.
+    void find_tokens(std::vector<token> &tokens, const uint8_t *src, const uint8_t *begin, const uint8_t *end) const {
+      suffix_array<uint8_t, uint32_t> sa(src, end);
+      size_t size = end - src;
+      size_t pos = begin - src;
+
+      unsigned distance = 0;
+      unsigned length = find_match(sa, pos, size, distance);
+      while (pos != size) {
+        if (length >= min_match) {
+          // if the next byte starts a longer match, emit a literal instead.
+          unsigned next_distance = 0;
+          unsigned next_length = length < lazy_limit_ && pos + 1 != size ? find_match(sa, pos + 1, size, next_distance) : 0;
+          if (next_length > length) {
+            tokens.push_back(token{src[pos++], 0});
+            length = next_length;
+            distance = next_distance;
+            continue;
+          }
+          tokens.push_back(token{(uint16_t)length, (uint16_t)distance});
+          pos += length;
+        } else {
+          tokens.push_back(token{src[pos++], 0});
+        }
+        length = pos != size ? find_match(sa, pos, size, distance) : 0;
+      }
+    }
+
+    // Write one block of tokens covering [src, src_max).
+    static void write_block(bit_writer &out, const token *begin, const token *end, const uint8_t *src, const uint8_t *src_max, bool final) {
+      uint32_t lit_freq[num_lit_codes] = {};
+      uint32_t dist_freq[num_dist_codes] = {};
+      lit_freq[256] = 1;
+      uint8_t length_code[max_match + 1];
+      for (unsigned code = 0; code != 29; ++code) {
+        unsigned top = code == 28 ? max_match + 1 : length_base()[code + 1];
+        for (unsigned length = length_base()[code]; length != top; ++length) length_code[length] = (uint8_t)code;
+      }
+      for (const token *t = begin; t != end; ++t) {
+        if (t->distance) {
+          lit_freq[257 + length_code[t->value]]++;
+          dist_freq[dist_code(t->distance)]++;
+        } else {
+          lit_freq[t->value]++;
+        }
+      }
+
+      uint8_t lit_lengths[num_fixed_codes];
+      uint8_t dist_lengths[num_dist_codes];
+      build_lengths(lit_lengths, lit_freq, num_lit_codes, 15);
+      build_lengths(dist_lengths, dist_freq, num_dist_codes, 15);
+      unsigned num_lit = num_lit_codes, num_dist = num_dist_codes;
+      while (num_lit > 257 && !lit_lengths[num_lit-1]) --num_lit;
+      while (num_dist > 1 && !dist_lengths[num_dist-1]) --num_dist;
+      uint8_t lengths[num_lit_codes + num_dist_codes];
+      memcpy(lengths, lit_lengths, num_lit);
+      memcpy(lengths + num_lit, dist_lengths, num_dist);
+
+      // run length code the code lengths with 16 (repeat), 17 and 18 (zeros).
+      std::vector<uint16_t> runs;
+      uint32_t run_freq[num_length_codes] = {};
+      for (unsigned i = 0, n = num_lit + num_dist; i != n; ) {
+        unsigned value = lengths[i], j = i + 1;
+        while (j != n && lengths[j] == value) ++j;
+        unsigned count = j - i;
+        i = j;
+        if (value == 0) {
+          for (; count >= 11; count -= std::min(count, 138u)) {
+            runs.push_back((uint16_t)(18 | (std::min(count, 138u) - 11) << 8));
+          }
+          if (count >= 3) {
+            runs.push_back((uint16_t)(17 | (count - 3) << 8));
+            count = 0;
+          }
+        } else {
+          runs.push_back((uint16_t)value);
+          for (--count; count >= 3; count -= std::min(count, 6u)) {
+            runs.push_back((uint16_t)(16 | (std::min(count, 6u) - 3) << 8));
+          }
+        }
+        for (; count; --count) runs.push_back((uint16_t)value);
+      }
+      for (auto r : runs) run_freq[r & 0xff]++;
+
+      static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+      static const uint8_t run_extra[] = { 2, 3, 7 };
+      uint8_t run_lengths[num_length_codes];
+      build_lengths(run_lengths, run_freq, num_length_codes, 7);
+      unsigned num_run = num_length_codes;
+      while (num_run > 4 && !run_lengths[order[num_run-1]]) --num_run;
+
+      // sizes in bits of each kind of block.
+      size_t extra_bits = 0;
+      for (unsigned i = 0; i != 29; ++i) extra_bits += (size_t)lit_freq[257 + i] * length_extra()[i];
+      for (unsigned i = 0; i != num_dist_codes; ++i) extra_bits += (size_t)dist_freq[i] * dist_extra()[i];
+      size_t dynamic_bits = 3 + 14 + num_run * 3 + extra_bits;
+      for (unsigned i = 0; i != num_length_codes; ++i) dynamic_bits += (size_t)run_freq[i] * (run_lengths[i] + (i >= 16 ? run_extra[i-16] : 0));
+      size_t fixed_bits = 3 + extra_bits;
+      for (unsigned i = 0; i != num_lit_codes; ++i) {
+        dynamic_bits += (size_t)lit_freq[i] * lit_lengths[i];
+        fixed_bits += (size_t)lit_freq[i] * (i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+      }
+      for (unsigned i = 0; i != num_dist_codes; ++i) {
+        dynamic_bits += (size_t)dist_freq[i] * dist_lengths[i];
+        fixed_bits += (size_t)dist_freq[i] * 5;
+      }
+      size_t size = src_max - src;
+      size_t stored_bits = (size + (size / max_stored + 1) * 5) * 8 + 7;
+
+      if (stored_bits <= dynamic_bits && stored_bits <= fixed_bits) {
+        do {
+          size_t bytes = std::min(size, (size_t)max_stored);
+          size -= bytes;
+          out.put(final && !size ? 1 : 0, 3);
+          out.align();
+          out.put((unsigned)bytes | (unsigned)(bytes ^ 0xffff) << 16, 32);
+          out.bytes(src, bytes);
+          src += bytes;
+        } while (size);
+        return;
+      }
+
+      uint16_t lit_codes[num_fixed_codes];
+      uint16_t dist_codes[num_dist_codes];
+      unsigned num_codes = num_lit_codes;
+      if (fixed_bits <= dynamic_bits) {
+        // the fixed code includes two symbols that are never used.
+        num_codes = num_fixed_codes;
+        for (unsigned i = 0; i != num_fixed_codes; ++i) lit_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+        memset(dist_lengths, 5, num_dist_codes);
+        out.put(final | 1 << 1, 3);
+      } else {
+        uint16_t run_codes[num_length_codes];
+        build_codes(run_codes, run_lengths, num_length_codes);
+        out.put(final | 2 << 1, 3);
+        out.put(num_lit - 257, 5);
+        out.put(num_dist - 1, 5);
+        out.put(num_run - 4, 4);
+        for (unsigned i = 0; i != num_run; ++i) out.put(run_lengths[order[i]], 3);
+        for (auto r : runs) {
+          unsigned code = r & 0xff;
+          out.put(run_codes[code], run_lengths[code]);
+          if (code >= 16) out.put(r >> 8, run_extra[code-16]);
+        }
+      }
+      build_codes(lit_codes, lit_lengths, num_codes);
+      build_codes(dist_codes, dist_lengths, num_dist_codes);
+
+      for (const token *t = begin; t != end; ++t) {
+        if (t->distance) {
+          unsigned lcode = length_code[t->value];
+          out.put(lit_codes[257 + lcode], lit_lengths[257 + lcode]);
+          out.put(t->value - length_base()[lcode], length_extra()[lcode]);
+          unsigned dcode = dist_code(t->distance);
+          out.put(dist_codes[dcode], dist_lengths[dcode]);
+          out.put(t->distance - dist_base()[dcode], dist_extra()[dcode]);
+        } else {
+          out.put(lit_codes[t->value], lit_lengths[t->value]);
+        }
+      }
+      out.put(lit_codes[256], lit_lengths[256]);
+    }
+
+    // Compress [begin, end), using up to a window of history before begin.
+    // Unless this is the last chunk, end with a sync flush so that the
+    // next chunk starts on a byte boundary.
+    void encode_chunk(std::vector<uint8_t> &dest, const uint8_t *src, const uint8_t *begin, const uint8_t *end, bool final) const {
+      std::vector<token> tokens;
+      find_tokens(tokens, begin - std::min((ptrdiff_t)window_size, begin - src), begin, end);
+
+      bit_writer out(dest);
+      const uint8_t *block_src = begin;
+      size_t i = 0;
+      do {
+        size_t j = std::min(tokens.size(), i + max_block_tokens);
+        const uint8_t *block_end = block_src;
+        for (size_t k = i; k != j; ++k) block_end += tokens[k].distance ? tokens[k].value : 1;
+        write_block(out, tokens.data() + i, tokens.data() + j, block_src, block_end, final && j == tokens.size());
+        block_src = block_end;
+        i = j;
+      } while (i != tokens.size());
+
+      if (!final) {
+        out.put(0, 3);
+        out.align();
+        out.put(0xffff0000, 32);
+      }
+      out.align();
+    }
+  public:
+    /// level 1 (fastest) to 9 (smallest).
+    deflate_encoder(int level = 6) {
+      static const unsigned steps[] = { 4, 8, 16, 16, 32, 64, 128, 256, 1024 };
+      static const unsigned lazy[] = { 0, 0, 0, 8, 16, 32, 64, 258, 258 };
+      level = std::max(1, std::min(level, 9));
+      max_steps_ = steps[level-1];
+      lazy_limit_ = lazy[level-1];
+    }
+
+    /// Upper bound on the size of the output for size bytes of input.
+    static size_t max_encoded_size(size_t size) {
+      return size + (size >> 12) + 64;
+    }
+
+    /// Compress [src, src_max), appending a raw deflate stream to dest.
+    void encode(std::vector<uint8_t> &dest, const uint8_t *src, const uint8_t *src_max, unsigned num_threads = 1) const {
+      size_t num_chunks = std::max((size_t)1, (size_t)(src_max - src + chunk_size - 1) / chunk_size);
+      std::vector<std::vector<uint8_t>> chunks(num_chunks);
+      auto encode_one = [&](size_t i) {
+        const uint8_t *begin = src + i * chunk_size;
+        const uint8_t *end = i == num_chunks - 1 ? src_max : begin + chunk_size;
+        encode_chunk(chunks[i], src, begin, end, i == num_chunks - 1);
+      };
+
+      if (num_threads <= 1 || num_chunks == 1) {
+        for (size_t i = 0; i != num_chunks; ++i) encode_one(i);
+      } else {
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+          for (size_t i; (i = next++) < num_chunks; ) encode_one(i);
+        };
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < num_threads && i < num_chunks; ++i) threads.emplace_back(worker);
+        worker();
+        for (auto &t : threads) t.join();
+      }
+
+      for (auto &c : chunks) dest.insert(dest.end(), c.begin(), c.end());
+    }
+
+    /// Compress [src, src_max) into [dest, dest_max) as a raw deflate stream.
+    /// Returns the end of the output or nullptr if it did not fit.
+    uint8_t *encode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned num_threads = 1) const {
+      std::vector<uint8_t> result;
+      encode(result, src, src_max, num_threads);
+      if (result.size() > (size_t)(dest_max - dest)) return nullptr;
+      memcpy(dest, result.data(), result.size());
+      return dest + result.size();
     }
   private:
+    unsigned max_steps_;
+    unsigned lazy_limit_;
   };
 }
 
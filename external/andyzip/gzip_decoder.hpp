@@ -0,0 +1,89 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gzip decoder (RFC 1952)
+//
+// A gzip file is one or more members, each a header, a deflate stream
+// and a trailer holding the CRC and size of the member.
+//
+
+#ifndef ANDYZIP_GZIP_DECODER_HPP_
+#define ANDYZIP_GZIP_DECODER_HPP_
+
+#include <andyzip/deflate_decoder.hpp>
+#include <andyzip/crc32.hpp>
+
+namespace andyzip {
+
+  class gzip_decoder {
+    enum {
+      FTEXT = 1, FHCRC = 2, FEXTRA = 4, FNAME = 8, FCOMMENT = 16,
+      trailer_size = 8,
+    };
+
+    deflate_decoder deflate_;
+
+    static unsigned u2(const uint8_t *p) { return p[0] | p[1] << 8; }
+    static uint32_t u4(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+    // skip the member header, returning the start of the deflate stream or nullptr.
+    static const uint8_t *skip_header(const uint8_t *src, const uint8_t *src_max) {
+      if (src_max - src < 10 || !is_gzip(src, src_max) || src[2] != 8) return nullptr;
+      unsigned flags = src[3];
+      src += 10;
+      if (flags & FEXTRA) {
+        if (src_max - src < 2) return nullptr;
+        unsigned xlen = u2(src);
+        if ((size_t)(src_max - src) < 2 + xlen) return nullptr;
+        src += 2 + xlen;
+      }
+      if (flags & FNAME) {
+        src = (const uint8_t *)memchr(src, 0, src_max - src);
+        if (!src++) return nullptr;
+      }
+      if (flags & FCOMMENT) {
+        src = (const uint8_t *)memchr(src, 0, src_max - src);
+        if (!src++) return nullptr;
+      }
+      if (flags & FHCRC) {
+        src += 2;
+      }
+      return src <= src_max ? src : nullptr;
+    }
+
+  public:
+    gzip_decoder() {
+    }
+
+    /// True if [src, src_max) starts with the gzip magic number.
+    static bool is_gzip(const uint8_t *src, const uint8_t *src_max) {
+      return src_max - src >= 2 && src[0] == 0x1f && src[1] == 0x8b;
+    }
+
+    /// Decode all the members of a gzip file, passing the output to fn(begin, end) in pieces.
+    /// fn may return false to stop early.
+    /// The CRC and size in each trailer are checked.
+    template <class Fn>
+    bool decode_stream(const uint8_t *src, const uint8_t *src_max, Fn fn) const {
+      do {
+        src = skip_header(src, src_max);
+        if (!src || src_max - src < trailer_size) return false;
+
+        uint32_t size = 0;
+        uint32_t crc = 0;
+        src = deflate_.decode_stream(src, src_max - trailer_size, [&size, &crc, &fn](const uint8_t *b, const uint8_t *e) {
+          size += (uint32_t)(e - b);
+          crc = crc32(b, e, crc);
+          return fn(b, e);
+        });
+        if (!src || src_max - src < trailer_size || u4(src) != crc || u4(src + 4) != size) return false;
+        src += trailer_size;
+      } while (is_gzip(src, src_max));
+      return true;
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,281 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: files of flat arrays
+//
+// An array file is a small header and a table followed by arrays of plain
+// structs, each aligned to a cache line. Once mapped into memory the arrays
+// can be used in place without any parsing or copying.
+//
+// The header carries a format version chosen by the application and a key,
+// usually a hash of the data the arrays were made from. A file with a
+// different version or key is treated as missing.
+//
+
+#ifndef GILGAMESH_ARRAY_FILE_INCLUDED
+#define GILGAMESH_ARRAY_FILE_INCLUDED
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+
+namespace gilgamesh {
+
+  namespace detail {
+    inline uint64_t hash_mix(uint64_t h, uint64_t v) {
+      h ^= v * 0xC2B2AE3D27D4EB4Full;
+      h = (h << 31) | (h >> 33);
+      return h * 0x9E3779B97F4A7C15ull;
+    }
+
+    inline uint64_t hash_load(const uint8_t *p) {
+      uint64_t v;
+      memcpy(&v, p, sizeof(v));
+      return v;
+    }
+  }
+
+  /// A fast 64 bit hash for cache keys (not cryptographic).
+  /// Four independent lanes keep the multiplier busy so this runs at several GB/s.
+  /// Data may be added in pieces of any size; the result is the same as hash_bytes().
+  class byte_hasher {
+  public:
+    byte_hasher(uint64_t seed = 0) {
+      h_[0] = seed + 0x9E3779B97F4A7C15ull;
+      h_[1] = seed + 0xC2B2AE3D27D4EB4Full;
+      h_[2] = seed;
+      h_[3] = seed - 0x9E3779B97F4A7C15ull;
+    }
+
+    void update(const void *data, size_t size) {
+      const uint8_t *p = (const uint8_t *)data;
+      const uint8_t *end = p + size;
+      size_ += size;
+      if (num_buffered_) {
+        size_t n = std::min((size_t)(32 - num_buffered_), size);
+        memcpy(buffer_ + num_buffered_, p, n);
+        num_buffered_ += n;
+        p += n;
+        if (num_buffered_ != 32) return;
+        block(buffer_);
+        num_buffered_ = 0;
+      }
+      for (; end - p >= 32; p += 32) {
+        block(p);
+      }
+      memcpy(buffer_, p, end - p);
+      num_buffered_ = end - p;
+    }
+
+    uint64_t digest() const {
+      uint64_t h = detail::hash_mix(detail::hash_mix(detail::hash_mix(detail::hash_mix(size_, h_[0]), h_[1]), h_[2]), h_[3]);
+      const uint8_t *p = buffer_;
+      const uint8_t *end = buffer_ + num_buffered_;
+      for (; end - p >= 8; p += 8) {
+        h = detail::hash_mix(h, detail::hash_load(p));
+      }
+      if (p != end) {
+        uint64_t v = 0;
+        memcpy(&v, p, end - p);
+        h = detail::hash_mix(h, v);
+      }
+      h ^= h >> 33;
+      h *= 0xFF51AFD7ED558CCDull;
+      h ^= h >> 29;
+      return h;
+    }
+
+  private:
+    void block(const uint8_t *p) {
+      h_[0] = detail::hash_mix(h_[0], detail::hash_load(p));
+      h_[1] = detail::hash_mix(h_[1], detail::hash_load(p + 8));
+      h_[2] = detail::hash_mix(h_[2], detail::hash_load(p + 16));
+      h_[3] = detail::hash_mix(h_[3], detail::hash_load(p + 24));
+    }
+
+    uint64_t h_[4];
+    uint64_t size_ = 0;
+    uint8_t buffer_[32];
+    size_t num_buffered_ = 0;
+  };
+
+  /// Hash a block of memory with byte_hasher.
+  inline uint64_t hash_bytes(const void *data, size_t size, uint64_t seed = 0) {
+    byte_hasher hasher(seed);
+    hasher.update(data, size);
+    return hasher.digest();
+  }
+
+  namespace detail {
+    struct array_file_header {
+      char magic[8];
+      uint32_t version;
+      uint32_t num_arrays;
+      uint64_t key;
+      uint64_t file_size;
+    };
+
+    struct array_file_entry {
+      uint32_t tag;
+      uint32_t elem_size;
+      uint64_t offset;
+      uint64_t count;
+    };
+
+    static const char array_file_magic[8] = { 'g', 'g', 'a', 'r', 'r', 'a', 'y', 1 };
+    static const size_t array_file_alignment = 64;
+  }
+
+  /// Collects arrays and writes them as an array file.
+  /// The arrays are not copied, so they must live until the file is written.
+  class array_file_writer {
+  public:
+    array_file_writer(uint32_t version, uint64_t key) : version_(version), key_(key) {
+    }
+
+    /// Add an array of plain structs. Tags are chosen by the application.
+    template <class Type>
+    void add(uint32_t tag, const Type *data, size_t count) {
+      arrays_.push_back(array{tag, (uint32_t)sizeof(Type), (const uint8_t *)data, count});
+    }
+
+    template <class Type, class Allocator>
+    void add(uint32_t tag, const std::vector<Type, Allocator> &value) {
+      add(tag, value.data(), value.size());
+    }
+
+    /// Build the file in memory.
+    std::vector<uint8_t> bytes() const {
+      std::vector<uint8_t> result;
+      write_to([&result](const void *data, size_t size) {
+        result.insert(result.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+        return true;
+      });
+      return result;
+    }
+
+    /// Write the file. It is written under a temporary name and renamed
+    /// so that other readers never see a partial file.
+    bool write(const std::string &path) const {
+      auto now = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+      std::string tmp_path = path + "." + std::to_string((unsigned long long)hash_bytes(&now, sizeof(now), (uint64_t)(size_t)this)) + ".tmp";
+      bool ok;
+      {
+        std::ofstream file(tmp_path, std::ios::binary);
+        ok = file.good() && write_to([&file](const void *data, size_t size) {
+          file.write((const char *)data, (std::streamsize)size);
+          return file.good();
+        });
+      }
+      if (ok && std::rename(tmp_path.c_str(), path.c_str()) == 0) {
+        return true;
+      }
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+
+  private:
+    struct array {
+      uint32_t tag;
+      uint32_t elem_size;
+      const uint8_t *data;
+      size_t count;
+    };
+
+    static uint64_t align(uint64_t offset) {
+      return (offset + detail::array_file_alignment - 1) & ~(uint64_t)(detail::array_file_alignment - 1);
+    }
+
+    template <class Out>
+    bool write_to(Out out) const {
+      std::vector<detail::array_file_entry> entries;
+      uint64_t offset = align(sizeof(detail::array_file_header) + sizeof(detail::array_file_entry) * arrays_.size());
+      for (auto &a : arrays_) {
+        entries.push_back(detail::array_file_entry{a.tag, a.elem_size, offset, a.count});
+        offset = align(offset + a.elem_size * a.count);
+      }
+
+      detail::array_file_header header{};
+      memcpy(header.magic, detail::array_file_magic, sizeof(header.magic));
+      header.version = version_;
+      header.num_arrays = (uint32_t)arrays_.size();
+      header.key = key_;
+      header.file_size = offset;
+
+      static const uint8_t zeros[detail::array_file_alignment] = {};
+      uint64_t pos = sizeof(header) + sizeof(detail::array_file_entry) * entries.size();
+      if (!out(&header, sizeof(header))) return false;
+      if (!entries.empty() && !out(entries.data(), sizeof(detail::array_file_entry) * entries.size())) return false;
+      for (size_t i = 0; i != arrays_.size(); ++i) {
+        if (!out(zeros, entries[i].offset - pos)) return false;
+        size_t size = arrays_[i].elem_size * arrays_[i].count;
+        if (size && !out(arrays_[i].data, size)) return false;
+        pos = entries[i].offset + size;
+      }
+      return out(zeros, header.file_size - pos);
+    }
+
+    std::vector<array> arrays_;
+    uint32_t version_;
+    uint64_t key_;
+  };
+
+  /// Reads arrays in place from an array file in memory (usually a mapped_file).
+  class array_file {
+  public:
+    array_file() {
+    }
+
+    /// Check the header and table of [begin, end).
+    /// If the version or key do not match, or the file is damaged, valid() is false.
+    array_file(const uint8_t *begin, const uint8_t *end, uint32_t version, uint64_t key) {
+      size_t size = end - begin;
+      detail::array_file_header header;
+      if (!begin || size < sizeof(header)) return;
+      memcpy(&header, begin, sizeof(header));
+      if (memcmp(header.magic, detail::array_file_magic, sizeof(header.magic))) return;
+      if (header.version != version || header.key != key || header.file_size != size) return;
+      if (header.num_arrays > (size - sizeof(header)) / sizeof(detail::array_file_entry)) return;
+
+      const detail::array_file_entry *entries = (const detail::array_file_entry *)(begin + sizeof(header));
+      for (uint32_t i = 0; i != header.num_arrays; ++i) {
+        const detail::array_file_entry &e = entries[i];
+        if (e.offset % detail::array_file_alignment || e.offset > size) return;
+        if (e.elem_size && e.count > (size - e.offset) / e.elem_size) return;
+      }
+
+      begin_ = begin;
+      entries_ = entries;
+      num_arrays_ = header.num_arrays;
+    }
+
+    bool valid() const { return begin_ != nullptr; }
+
+    /// Get an array by tag. Returns nullptr if it is missing or has a different element size.
+    template <class Type>
+    const Type *get(uint32_t tag, size_t &count) const {
+      for (uint32_t i = 0; i != num_arrays_; ++i) {
+        const detail::array_file_entry &e = entries_[i];
+        if (e.tag == tag && e.elem_size == sizeof(Type)) {
+          count = (size_t)e.count;
+          return (const Type *)(begin_ + e.offset);
+        }
+      }
+      count = 0;
+      return nullptr;
+    }
+
+  private:
+    const uint8_t *begin_ = nullptr;
+    const detail::array_file_entry *entries_ = nullptr;
+    uint32_t num_arrays_ = 0;
+  };
+}
+
+#endif
@@ -0,0 +1,226 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: compressed bitset class
+//
+// A set of atom indices as a bitset split into blocks of 4096 bits.
+// Blocks that are all clear or all set take no storage, which suits
+// selections of chains and residues as these are runs of atoms.
+// Operations on two sets work a block at a time and skip the empty and
+// full blocks.
+//
+
+#ifndef GILGAMESH_ATOM_BITSET_INCLUDED
+#define GILGAMESH_ATOM_BITSET_INCLUDED
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+namespace gilgamesh {
+
+  class atom_bitset {
+  public:
+    static const int block_words = 64;
+    static const size_t block_bits = block_words * 64;
+
+    atom_bitset() {
+    }
+
+    /// A set of size bits, all clear or all set.
+    atom_bitset(size_t size, bool value) : size_(size), blocks_(num_blocks(size), value ? full_block : empty_block) {
+    }
+
+    /// Compress a plain bitset of (size + 63) / 64 words. Bits past size must be clear.
+    atom_bitset(const std::vector<uint64_t> &words, size_t size) : size_(size) {
+      size_t nb = num_blocks(size);
+      blocks_.reserve(nb);
+      uint64_t block[block_words];
+      for (size_t b = 0; b != nb; ++b) {
+        size_t first = b * block_words;
+        size_t n = std::min((size_t)block_words, words.size() - first);
+        std::copy(words.begin() + first, words.begin() + first + n, block);
+        std::fill(block + n, block + block_words, 0);
+        append(block, b);
+      }
+    }
+
+    /// Number of bits, set or not.
+    size_t size() const { return size_; }
+
+    bool test(size_t i) const {
+      int32_t b = blocks_[i / block_bits];
+      if (b < 0) return b == full_block;
+      return (words_[(size_t)b * block_words + i % block_bits / 64] >> (i % 64) & 1) != 0;
+    }
+
+    /// Number of set bits.
+    size_t count() const {
+      size_t result = 0;
+      for (size_t b = 0; b != blocks_.size(); ++b) {
+        if (blocks_[b] == full_block) {
+          result += std::min((size_t)block_bits, size_ - b * block_bits);
+        } else if (blocks_[b] >= 0) {
+          const uint64_t *w = words_.data() + (size_t)blocks_[b] * block_words;
+          for (int i = 0; i != block_words; ++i) result += popcount(w[i]);
+        }
+      }
+      return result;
+    }
+
+    /// Call fn(i) for each set bit in order.
+    template <class Fn>
+    void for_each(Fn fn) const {
+      for (size_t b = 0; b != blocks_.size(); ++b) {
+        size_t base = b * block_bits;
+        if (blocks_[b] == full_block) {
+          size_t end = std::min(base + (size_t)block_bits, size_);
+          for (size_t i = base; i != end; ++i) fn(i);
+        } else if (blocks_[b] >= 0) {
+          const uint64_t *w = words_.data() + (size_t)blocks_[b] * block_words;
+          for (int i = 0; i != block_words; ++i) {
+            for (uint64_t bits = w[i]; bits; bits &= bits - 1) {
+              fn(base + i * 64 + lowest_bit(bits));
+            }
+          }
+        }
+      }
+    }
+
+    /// The set as a plain bitset of (size + 63) / 64 words.
+    std::vector<uint64_t> words() const {
+      std::vector<uint64_t> result((size_ + 63) / 64);
+      for (size_t b = 0; b != blocks_.size(); ++b) {
+        size_t first = b * block_words;
+        size_t n = std::min((size_t)block_words, result.size() - first);
+        if (blocks_[b] == full_block) {
+          for (size_t i = 0; i != n; ++i) result[first + i] = valid_bits(first + i);
+        } else if (blocks_[b] >= 0) {
+          std::copy(words_.begin() + (size_t)blocks_[b] * block_words, words_.begin() + (size_t)blocks_[b] * block_words + n, result.begin() + first);
+        }
+      }
+      return result;
+    }
+
+    /// Memory used by the bits.
+    size_t bytes() const { return blocks_.size() * sizeof(int32_t) + words_.size() * sizeof(uint64_t); }
+
+    atom_bitset operator&(const atom_bitset &rhs) const {
+      return combine(rhs, [](uint64_t a, uint64_t b) { return a & b; }, empty_block, full_block);
+    }
+
+    atom_bitset operator|(const atom_bitset &rhs) const {
+      return combine(rhs, [](uint64_t a, uint64_t b) { return a | b; }, full_block, empty_block);
+    }
+
+    atom_bitset operator~() const {
+      atom_bitset result;
+      result.size_ = size_;
+      result.blocks_.reserve(blocks_.size());
+      uint64_t block[block_words];
+      for (size_t b = 0; b != blocks_.size(); ++b) {
+        if (blocks_[b] < 0) {
+          result.blocks_.push_back(blocks_[b] == full_block ? empty_block : full_block);
+        } else {
+          const uint64_t *w = words_.data() + (size_t)blocks_[b] * block_words;
+          for (int i = 0; i != block_words; ++i) block[i] = ~w[i] & valid_bits(b * block_words + i);
+          result.append(block, b);
+        }
+      }
+      return result;
+    }
+
+    /// Bit counting helpers.
+    static int popcount(uint64_t x) {
+      #if defined(__GNUC__)
+        return __builtin_popcountll(x);
+      #else
+        x = x - ((x >> 1) & 0x5555555555555555ull);
+        x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+        x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+        return (int)((x * 0x0101010101010101ull) >> 56);
+      #endif
+    }
+
+    static int lowest_bit(uint64_t x) {
+      #if defined(__GNUC__)
+        return __builtin_ctzll(x);
+      #else
+        int n = 0;
+        while (!(x & 1)) { x >>= 1; ++n; }
+        return n;
+      #endif
+    }
+
+  private:
+    enum : int32_t { empty_block = -1, full_block = -2 };
+
+    static size_t num_blocks(size_t size) { return (size + block_bits - 1) / block_bits; }
+
+    // the bits of word w that are inside the set.
+    uint64_t valid_bits(size_t w) const {
+      size_t first = w * 64;
+      return first + 64 <= size_ ? ~(uint64_t)0 : first >= size_ ? 0 : ((uint64_t)1 << (size_ - first)) - 1;
+    }
+
+    // add block b, storing it only if it is neither empty nor full.
+    void append(const uint64_t *block, size_t b) {
+      uint64_t any = 0, all = ~(uint64_t)0;
+      for (int i = 0; i != block_words; ++i) {
+        any |= block[i];
+        all &= block[i] | ~valid_bits(b * block_words + i);
+      }
+      if (!any) {
+        blocks_.push_back(empty_block);
+      } else if (all == ~(uint64_t)0) {
+        blocks_.push_back(full_block);
+      } else {
+        blocks_.push_back((int32_t)(words_.size() / block_words));
+        words_.insert(words_.end(), block, block + block_words);
+      }
+    }
+
+    // Combine two sets of the same size. A dominant block gives a dominant block (eg. empty for and)
+    // and an identity block gives the other block unchanged (eg. full for and).
+    template <class Op>
+    atom_bitset combine(const atom_bitset &rhs, Op op, int32_t dominant, int32_t identity) const {
+      atom_bitset result;
+      result.size_ = size_;
+      result.blocks_.reserve(blocks_.size());
+      uint64_t block[block_words];
+      for (size_t b = 0; b != blocks_.size(); ++b) {
+        int32_t lb = blocks_[b], rb = rhs.blocks_[b];
+        if (lb == dominant || rb == dominant) {
+          result.blocks_.push_back(dominant);
+        } else if (lb == identity) {
+          result.copy_block(rhs, rb);
+        } else if (rb == identity) {
+          result.copy_block(*this, lb);
+        } else {
+          const uint64_t *lw = words_.data() + (size_t)lb * block_words;
+          const uint64_t *rw = rhs.words_.data() + (size_t)rb * block_words;
+          for (int i = 0; i != block_words; ++i) block[i] = op(lw[i], rw[i]);
+          result.append(block, b);
+        }
+      }
+      return result;
+    }
+
+    void copy_block(const atom_bitset &from, int32_t fb) {
+      if (fb < 0) {
+        blocks_.push_back(fb);
+      } else {
+        blocks_.push_back((int32_t)(words_.size() / block_words));
+        words_.insert(words_.end(), from.words_.begin() + (size_t)fb * block_words, from.words_.begin() + (size_t)(fb + 1) * block_words);
+      }
+    }
+
+    size_t size_ = 0;
+    std::vector<int32_t> blocks_;
+    std::vector<uint64_t> words_;
+  };
+}
+
+#endif
@@ -0,0 +1,121 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: atom grid class
+//
+// A spatial index of points: a grid of cells with the points sorted by
+// cell, so the points of a cell are a range and the points near a place
+// are a few ranges. Build it once and use it for many queries.
+//
+
+#ifndef GILGAMESH_ATOM_GRID_INCLUDED
+#define GILGAMESH_ATOM_GRID_INCLUDED
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+namespace gilgamesh {
+
+  class atom_grid {
+  public:
+    atom_grid() {
+    }
+
+    /// Index points with cells of about cell_size.
+    explicit atom_grid(const std::vector<glm::vec3> &points, float cell_size = 3.0f) {
+      int num_points = (int)points.size();
+      glm::vec3 max(-1e38f);
+      min_ = glm::vec3(1e38f);
+      for (auto &p : points) {
+        min_ = glm::min(min_, p);
+        max = glm::max(max, p);
+      }
+      if (num_points == 0) min_ = max = glm::vec3(0);
+
+      // Stray atoms or widely spaced molecules could make a huge grid of empty cells,
+      // so keep to about two cells per point.
+      glm::vec3 extent = max - min_;
+      double cells = (double)(extent.x / cell_size + 1) * (extent.y / cell_size + 1) * (extent.z / cell_size + 1);
+      if (cells > num_points * 2.0 + 64) {
+        cell_size *= (float)std::cbrt(cells / (num_points * 2.0 + 64));
+      }
+      cell_size_ = cell_size;
+      dims_ = glm::ivec3(extent / cell_size) + 1;
+
+      std::vector<int> cell(num_points);
+      cell_start_.assign(num_cells() + 1, 0);
+      for (int i = 0; i != num_points; ++i) {
+        cell[i] = cell_of(points[i]);
+        cell_start_[cell[i] + 1]++;
+      }
+      for (int c = 0; c != num_cells(); ++c) {
+        cell_start_[c + 1] += cell_start_[c];
+      }
+      order_.resize(num_points);
+      sorted_.resize(num_points);
+      std::vector<int> fill(cell_start_.begin(), cell_start_.end() - 1);
+      for (int i = 0; i != num_points; ++i) {
+        int s = fill[cell[i]]++;
+        order_[s] = i;
+        sorted_[s] = points[i];
+      }
+    }
+
+    glm::ivec3 dims() const { return dims_; }
+    int num_cells() const { return dims_.x * dims_.y * dims_.z; }
+    float cell_size() const { return cell_size_; }
+
+    /// The cell containing p, clamped to the grid.
+    glm::ivec3 cell_xyz(glm::vec3 p) const { return glm::clamp(glm::ivec3(glm::floor((p - min_) / cell_size_)), glm::ivec3(0), dims_ - 1); }
+    int cell_of(glm::vec3 p) const { glm::ivec3 c = cell_xyz(p); return (c.z * dims_.y + c.y) * dims_.x + c.x; }
+
+    /// Entries [cell_begin(c), cell_end(c)) of order() and sorted() are the points in cell c.
+    int cell_begin(int cell) const { return cell_start_[cell]; }
+    int cell_end(int cell) const { return cell_start_[cell + 1]; }
+
+    /// Point indices and positions in cell order.
+    const std::vector<int> &order() const { return order_; }
+    const std::vector<glm::vec3> &sorted() const { return sorted_; }
+
+    /// Call fn(index) for each point no further than radius from p.
+    template <class Fn>
+    void for_each_near(glm::vec3 p, float radius, Fn fn) const {
+      any_near(p, radius, [&fn](int index) { fn(index); return false; });
+    }
+
+    /// True if pred(index) is true for any point no further than radius from p.
+    /// Stops at the first.
+    template <class Pred>
+    bool any_near(glm::vec3 p, float radius, Pred pred) const {
+      if (order_.empty()) return false;
+      glm::ivec3 lo = cell_xyz(p - radius);
+      glm::ivec3 hi = cell_xyz(p + radius);
+      float r2 = radius * radius;
+      for (int z = lo.z; z <= hi.z; ++z) {
+        for (int y = lo.y; y <= hi.y; ++y) {
+          // The cells of a row are next to each other in the sorted points.
+          int row = (z * dims_.y + y) * dims_.x;
+          for (int j = cell_start_[row + lo.x]; j != cell_start_[row + hi.x + 1]; ++j) {
+            glm::vec3 d = sorted_[j] - p;
+            if (glm::dot(d, d) <= r2 && pred(order_[j])) return true;
+          }
+        }
+      }
+      return false;
+    }
+
+  private:
+    glm::vec3 min_ = glm::vec3(0);
+    float cell_size_ = 1;
+    glm::ivec3 dims_ = glm::ivec3(0);
+    std::vector<int> cell_start_;
+    std::vector<int> order_;
+    std::vector<glm::vec3> sorted_;
+  };
+}
+
+#endif
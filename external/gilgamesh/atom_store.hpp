@@ -0,0 +1,287 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: atom store class
+//
+// The atoms of a molecule as columns rather than structs, so that a scan of
+// the positions, say, only touches the positions.
+//
+// Atom, residue and element names are interned: each column holds a small
+// index into a table of packed names (see pdb_decoder::name_id).
+// Residues and chains are tables of offsets (CSR), so the atoms of a residue
+// or the residues of a chain are a range and need not be searched for.
+//
+// Columns that only the loader needs, such as serial numbers, B-factors and
+// model numbers, are optional.
+//
+
+#ifndef GILGAMESH_ATOM_STORE_INCLUDED
+#define GILGAMESH_ATOM_STORE_INCLUDED
+
+#include <gilgamesh/decoders/pdb_decoder.hpp>
+#include <gilgamesh/array_file.hpp>
+#include <glm/glm.hpp>
+#include <unordered_map>
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace gilgamesh {
+
+  class atom_store {
+  public:
+    /// A range of atoms or residues.
+    struct range {
+      int begin;
+      int end;
+      int size() const { return end - begin; }
+    };
+
+    atom_store() {
+    }
+
+    /// Build the columns from decoded atoms, usually pdb_decoder::allAtoms().
+    /// A new residue starts when the residue number, insertion code, chain, HETATM flag or model changes,
+    /// and a new chain when the chain or model changes.
+    explicit atom_store(const std::vector<pdb_decoder::atom> &atoms, bool cold_columns = false) {
+      std::unordered_map<uint32_t, uint16_t> names;
+      std::unordered_map<uint16_t, uint8_t> elements;
+      size_t num_atoms = atoms.size();
+      pos_.reserve(num_atoms);
+      atom_name_.reserve(num_atoms);
+      element_.reserve(num_atoms);
+      alt_loc_.reserve(num_atoms);
+      if (cold_columns) {
+        serial_.reserve(num_atoms);
+        occupancy_.reserve(num_atoms);
+        temp_factor_.reserve(num_atoms);
+        charge_.reserve(num_atoms);
+        model_.reserve(num_atoms);
+      }
+
+      for (size_t i = 0; i != num_atoms; ++i) {
+        const pdb_decoder::atom &a = atoms[i];
+        bool new_chain = i == 0 || a.chainID() != atoms[i-1].chainID() || a.model() != atoms[i-1].model();
+        if (new_chain || a.resSeq() != atoms[i-1].resSeq() || a.iCode() != atoms[i-1].iCode() || a.is_hetatom() != atoms[i-1].is_hetatom()) {
+          if (new_chain) {
+            chain_start_.push_back((int)residue_name_.size());
+            chain_id_.push_back(a.chainID());
+          }
+          residue_start_.push_back((int)i);
+          residue_name_.push_back(intern(names, names_, a.resId()));
+          res_seq_.push_back(a.resSeq());
+          i_code_.push_back(a.iCode());
+          het_.push_back(a.is_hetatom());
+        }
+
+        pos_.push_back(a.pos());
+        atom_name_.push_back(intern(names, names_, a.atomId()));
+        element_.push_back(intern(elements, elements_, a.elementId()));
+        alt_loc_.push_back(a.altLoc());
+        if (cold_columns) {
+          serial_.push_back(a.serial());
+          occupancy_.push_back(a.occupancy());
+          temp_factor_.push_back(a.tempFactor());
+          std::string charge = a.charge();
+          charge_.push_back((uint16_t)((uint8_t)charge[0] | (uint8_t)charge[1] << 8));
+          model_.push_back(a.model());
+        }
+      }
+      residue_start_.push_back((int)num_atoms);
+      chain_start_.push_back((int)residue_name_.size());
+    }
+
+    size_t size() const { return pos_.size(); }
+    size_t num_residues() const { return residue_name_.size(); }
+    size_t num_chains() const { return chain_id_.size(); }
+
+    /// Atom columns.
+    const std::vector<glm::vec3> &pos() const { return pos_; }
+    glm::vec3 pos(int atom) const { return pos_[atom]; }
+    uint32_t atom_id(int atom) const { return names_[atom_name_[atom]]; }
+    uint16_t element_id(int atom) const { return elements_[element_[atom]]; }
+    char alt_loc(int atom) const { return alt_loc_[atom]; }
+
+    /// The interned columns and the tables of packed names they index.
+    const std::vector<uint16_t> &atom_names() const { return atom_name_; }
+    const std::vector<uint8_t> &elements() const { return element_; }
+    const std::vector<uint16_t> &residue_names() const { return residue_name_; }
+    const std::vector<uint32_t> &name_table() const { return names_; }
+    const std::vector<uint16_t> &element_table() const { return elements_; }
+
+    /// Cold columns, empty unless asked for.
+    bool has_cold_columns() const { return !serial_.empty(); }
+    int serial(int atom) const { return serial_[atom]; }
+    float occupancy(int atom) const { return occupancy_[atom]; }
+    float temp_factor(int atom) const { return temp_factor_[atom]; }
+    std::string charge(int atom) const { return std::string{(char)(charge_[atom] & 0xff), (char)(charge_[atom] >> 8)}; }
+    int model(int atom) const { return model_[atom]; }
+
+    /// Residue table.
+    range residue_atoms(int residue) const { return range{residue_start_[residue], residue_start_[residue+1]}; }
+    uint32_t residue_id(int residue) const { return names_[residue_name_[residue]]; }
+    int res_seq(int residue) const { return res_seq_[residue]; }
+    char i_code(int residue) const { return i_code_[residue]; }
+    bool is_hetatom(int residue) const { return het_[residue] != 0; }
+    int residue_of(int atom) const { return (int)(std::upper_bound(residue_start_.begin(), residue_start_.end(), atom) - residue_start_.begin()) - 1; }
+
+    /// Chain table. A chain is a run of residues with the same chain ID and model,
+    /// so a chain whose HETATMs come at the end of the file appears twice.
+    range chain_residues(int chain) const { return range{chain_start_[chain], chain_start_[chain+1]}; }
+    range chain_atoms(int chain) const { return range{residue_start_[chain_start_[chain]], residue_start_[chain_start_[chain+1]]}; }
+    char chain_id(int chain) const { return chain_id_[chain]; }
+    int chain_of(int atom) const {
+      int residue = residue_of(atom);
+      return (int)(std::upper_bound(chain_start_.begin(), chain_start_.end(), residue) - chain_start_.begin()) - 1;
+    }
+
+    /// The ranges of atoms in the given chains (eg. "ABCD"), without copying them.
+    std::vector<range> select_chains(const std::string &chains, bool use_hetatoms = false) const {
+      std::vector<range> result;
+      for (int c = 0; c != (int)num_chains(); ++c) {
+        if (chains.find(chain_id_[c]) == std::string::npos) continue;
+        range residues = chain_residues(c);
+        for (int r = residues.begin; r != residues.end; ++r) {
+          if (het_[r] && !use_hetatoms) continue;
+          range atoms = residue_atoms(r);
+          if (!result.empty() && result.back().end == atoms.begin) {
+            result.back().end = atoms.end;
+          } else {
+            result.push_back(atoms);
+          }
+        }
+      }
+      return result;
+    }
+
+    /// Memory used by the columns.
+    size_t bytes() const {
+      return
+        pos_.size() * sizeof(glm::vec3) + atom_name_.size() * sizeof(uint16_t) + element_.size() + alt_loc_.size() +
+        serial_.size() * sizeof(int) + occupancy_.size() * sizeof(float) + temp_factor_.size() * sizeof(float) + charge_.size() * sizeof(uint16_t) + model_.size() * sizeof(int) +
+        residue_start_.size() * sizeof(int) + residue_name_.size() * sizeof(uint16_t) + res_seq_.size() * sizeof(int) + i_code_.size() + het_.size() +
+        chain_start_.size() * sizeof(int) + chain_id_.size() + names_.size() * sizeof(uint32_t) + elements_.size() * sizeof(uint16_t)
+      ;
+    }
+
+    /// Add the columns, less the cold ones, to an array file using tags [first_tag, first_tag + num_tags).
+    void write(array_file_writer &writer, uint32_t first_tag) const {
+      uint32_t tag = first_tag;
+      writer.add(tag++, pos_);
+      writer.add(tag++, atom_name_);
+      writer.add(tag++, element_);
+      writer.add(tag++, alt_loc_);
+      writer.add(tag++, residue_start_);
+      writer.add(tag++, residue_name_);
+      writer.add(tag++, res_seq_);
+      writer.add(tag++, i_code_);
+      writer.add(tag++, het_);
+      writer.add(tag++, chain_start_);
+      writer.add(tag++, chain_id_);
+      writer.add(tag++, names_);
+      writer.add(tag++, elements_);
+    }
+
+    /// Read the columns written by write().
+    /// Returns false if any are missing or they do not fit together (see consistent()).
+    bool read(const array_file &file, uint32_t first_tag) {
+      uint32_t tag = first_tag;
+      bool ok = true;
+      ok &= read(file, tag++, pos_);
+      ok &= read(file, tag++, atom_name_);
+      ok &= read(file, tag++, element_);
+      ok &= read(file, tag++, alt_loc_);
+      ok &= read(file, tag++, residue_start_);
+      ok &= read(file, tag++, residue_name_);
+      ok &= read(file, tag++, res_seq_);
+      ok &= read(file, tag++, i_code_);
+      ok &= read(file, tag++, het_);
+      ok &= read(file, tag++, chain_start_);
+      ok &= read(file, tag++, chain_id_);
+      ok &= read(file, tag++, names_);
+      ok &= read(file, tag++, elements_);
+      return ok && consistent();
+    }
+
+    static const uint32_t num_tags = 13;
+
+    /// Check that the columns have matching sizes, the residue and chain tables
+    /// are ascending ranges that cover every atom and every name index is in its table.
+    bool consistent() const {
+      size_t num_atoms = pos_.size();
+      if (atom_name_.size() != num_atoms || element_.size() != num_atoms || alt_loc_.size() != num_atoms) return false;
+      if (residue_start_.empty() || chain_start_.empty()) return false;
+
+      size_t num_residues = residue_start_.size() - 1;
+      if (residue_name_.size() != num_residues || res_seq_.size() != num_residues || i_code_.size() != num_residues || het_.size() != num_residues) return false;
+      if (chain_id_.size() != chain_start_.size() - 1) return false;
+      if (!ascending(residue_start_, num_atoms) || !ascending(chain_start_, num_residues)) return false;
+
+      for (uint16_t n : atom_name_) if (n >= names_.size()) return false;
+      for (uint16_t n : residue_name_) if (n >= names_.size()) return false;
+      for (uint8_t e : element_) if (e >= elements_.size()) return false;
+      return true;
+    }
+
+  private:
+    // Offsets from 0 to last that never go down.
+    static bool ascending(const std::vector<int> &offsets, size_t last) {
+      if (offsets.front() != 0 || (size_t)offsets.back() != last) return false;
+      for (size_t i = 1; i < offsets.size(); ++i) {
+        if (offsets[i] < offsets[i-1]) return false;
+      }
+      return true;
+    }
+
+    template <class Key, class Index>
+    static Index intern(std::unordered_map<Key, Index> &map, std::vector<Key> &table, Key key) {
+      auto i = map.find(key);
+      if (i != map.end()) return i->second;
+      if (table.size() > (Index)~(Index)0) throw std::runtime_error("atom_store: too many distinct names");
+      Index index = (Index)table.size();
+      map.emplace(key, index);
+      table.push_back(key);
+      return index;
+    }
+
+    template <class Type>
+    static bool read(const array_file &file, uint32_t tag, std::vector<Type> &column) {
+      size_t count = 0;
+      const Type *data = file.get<Type>(tag, count);
+      column.assign(data, data + (data ? count : 0));
+      return data != nullptr;
+    }
+
+    // atoms
+    std::vector<glm::vec3> pos_;
+    std::vector<uint16_t> atom_name_;
+    std::vector<uint8_t> element_;
+    std::vector<char> alt_loc_;
+
+    // optional atom columns
+    std::vector<int> serial_;
+    std::vector<float> occupancy_;
+    std::vector<float> temp_factor_;
+    std::vector<uint16_t> charge_;
+    std::vector<int> model_;
+
+    // residues: atoms [residue_start_[r], residue_start_[r+1])
+    std::vector<int> residue_start_;
+    std::vector<uint16_t> residue_name_;
+    std::vector<int> res_seq_;
+    std::vector<char> i_code_;
+    std::vector<uint8_t> het_;
+
+    // chains: residues [chain_start_[c], chain_start_[c+1])
+    std::vector<int> chain_start_;
+    std::vector<char> chain_id_;
+
+    // interned names
+    std::vector<uint32_t> names_;
+    std::vector<uint16_t> elements_;
+  };
+}
+
+#endif
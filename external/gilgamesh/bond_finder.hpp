@@ -0,0 +1,173 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: bond finder class
+//
+// Two atoms are taken to be bonded if they are closer than the sum of their
+// covalent radii plus a tolerance. This works for ligands, waters and
+// modified residues that no residue template knows about.
+//
+// The atoms are binned into a grid of cells as wide as the longest possible
+// bond, so each atom need only be tested against the atoms of the cells
+// next to it. The cells are sorted x fastest, so three neighbouring cells in
+// a row are one run of atoms and each atom checks five runs: the rest of its
+// own row and the four rows ahead of it.
+//
+
+#ifndef GILGAMESH_BOND_FINDER_INCLUDED
+#define GILGAMESH_BOND_FINDER_INCLUDED
+
+#include <glm/glm.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+  #include <emmintrin.h>
+#endif
+
+namespace gilgamesh {
+
+  class bond_finder {
+  public:
+    bond_finder() {
+    }
+
+    /// Find the pairs of points closer than the sum of their radii plus tolerance
+    /// and further apart than min_distance (to skip alternate positions of the same atom).
+    bond_finder(const std::vector<glm::vec3> &points, const std::vector<float> &radii, float tolerance = 0.4f, float min_distance = 0.4f, unsigned num_threads = 1) {
+      int num_points = (int)points.size();
+      if (num_points == 0) return;
+
+      float max_radius = *std::max_element(radii.begin(), radii.end());
+      float cell_size = std::max(max_radius * 2 + tolerance, 0.1f);
+      glm::vec3 min(1e38f);
+      glm::vec3 max(-1e38f);
+      for (auto &p : points) {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+      }
+
+      // A few stray atoms far from the rest could make a huge grid, so limit the number of cells.
+      glm::vec3 extent = max - min;
+      double cells = (double)(extent.x / cell_size + 1) * (extent.y / cell_size + 1) * (extent.z / cell_size + 1);
+      if (cells > num_points * 8.0) {
+        cell_size *= (float)std::cbrt(cells / (num_points * 8.0));
+      }
+      glm::ivec3 dims = glm::ivec3(extent / cell_size) + 1;
+      size_t num_cells = (size_t)dims.x * dims.y * dims.z;
+
+      // Sort the points by cell.
+      std::vector<uint32_t> cell(num_points);
+      std::vector<int> cell_start(num_cells + 1);
+      for (int i = 0; i != num_points; ++i) {
+        glm::ivec3 c = glm::min(glm::ivec3((points[i] - min) / cell_size), dims - 1);
+        cell[i] = (uint32_t)(((size_t)c.z * dims.y + c.y) * dims.x + c.x);
+        cell_start[cell[i] + 1]++;
+      }
+      for (size_t c = 0; c != num_cells; ++c) {
+        cell_start[c + 1] += cell_start[c];
+      }
+      std::vector<int> order(num_points);
+      std::vector<float> x(num_points), y(num_points), z(num_points), r(num_points);
+      {
+        std::vector<int> fill(cell_start.begin(), cell_start.end() - 1);
+        for (int i = 0; i != num_points; ++i) {
+          int s = fill[cell[i]]++;
+          order[s] = i;
+          x[s] = points[i].x;
+          y[s] = points[i].y;
+          z[s] = points[i].z;
+          r[s] = radii[i] + tolerance * 0.5f;
+        }
+      }
+
+      // Each task takes a run of rows of cells.
+      int num_rows = dims.y * dims.z;
+      int num_tasks = std::min(num_rows, (int)num_threads * 8);
+      std::vector<std::vector<std::pair<int, int> > > found(num_tasks);
+      parallel_for(num_tasks, num_threads, [&](int task) {
+        std::vector<std::pair<int, int> > &result = found[task];
+        int row_end = (int)((int64_t)num_rows * (task + 1) / num_tasks);
+        for (int row = (int)((int64_t)num_rows * task / num_tasks); row != row_end; ++row) {
+          int cy = row % dims.y;
+          int cz = row / dims.y;
+
+          // The runs of atoms in the rows ahead: (y+1, z), (y-1, z+1), (y, z+1), (y+1, z+1).
+          static const int ahead[4][2] = { { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+          for (int cx = 0; cx != dims.x; ++cx) {
+            int runs[5][2];
+            int num_runs = 1;
+            for (auto &a : ahead) {
+              int ny = cy + a[0], nz = cz + a[1];
+              if (ny < 0 || ny >= dims.y || nz >= dims.z) continue;
+              size_t first = ((size_t)nz * dims.y + ny) * dims.x;
+              runs[num_runs][0] = cell_start[first + std::max(cx - 1, 0)];
+              runs[num_runs][1] = cell_start[first + std::min(cx + 1, dims.x - 1) + 1];
+              ++num_runs;
+            }
+
+            size_t c = ((size_t)cz * dims.y + cy) * dims.x + cx;
+            int run_end = cell_start[c + std::min(1, dims.x - 1 - cx) + 1];
+            for (int i = cell_start[c]; i != cell_start[c + 1]; ++i) {
+              runs[0][0] = i + 1;
+              runs[0][1] = run_end;
+              for (int k = 0; k != num_runs; ++k) {
+                check(i, runs[k][0], runs[k][1], x.data(), y.data(), z.data(), r.data(), min_distance * min_distance, order.data(), result);
+              }
+            }
+          }
+        }
+      });
+
+      for (auto &f : found) {
+        bonds_.insert(bonds_.end(), f.begin(), f.end());
+      }
+      std::sort(bonds_.begin(), bonds_.end());
+    }
+
+    /// Pairs of point indices (i, j) with i < j, sorted.
+    const std::vector<std::pair<int, int> > &bonds() const { return bonds_; }
+
+  private:
+    static void add(int i, int j, const int *order, std::vector<std::pair<int, int> > &result) {
+      int a = order[i], b = order[j];
+      result.emplace_back(std::min(a, b), std::max(a, b));
+    }
+
+    // test sorted point i against sorted points [begin, end). r holds the radii plus half the tolerance.
+    static void check(int i, int begin, int end, const float *x, const float *y, const float *z, const float *r, float min2, const int *order, std::vector<std::pair<int, int> > &result) {
+      float xi = x[i], yi = y[i], zi = z[i], ri = r[i];
+      int j = begin;
+      #if defined(__SSE2__) || defined(_M_X64)
+        __m128 vx = _mm_set1_ps(xi), vy = _mm_set1_ps(yi), vz = _mm_set1_ps(zi), vr = _mm_set1_ps(ri), vmin2 = _mm_set1_ps(min2);
+        for (; j + 4 <= end; j += 4) {
+          __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + j), vx);
+          __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + j), vy);
+          __m128 dz = _mm_sub_ps(_mm_loadu_ps(z + j), vz);
+          __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+          __m128 limit = _mm_add_ps(_mm_loadu_ps(r + j), vr);
+          __m128 hit = _mm_and_ps(_mm_cmplt_ps(d2, _mm_mul_ps(limit, limit)), _mm_cmpgt_ps(d2, vmin2));
+          if (int mask = _mm_movemask_ps(hit)) {
+            for (int k = 0; k != 4; ++k) {
+              if (mask >> k & 1) add(i, j + k, order, result);
+            }
+          }
+        }
+      #endif
+      for (; j < end; ++j) {
+        float dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+        float d2 = dx * dx + dy * dy + dz * dz;
+        float limit = r[j] + ri;
+        if (d2 < limit * limit && d2 > min2) add(i, j, order, result);
+      }
+    }
+
+    std::vector<std::pair<int, int> > bonds_;
+  };
+}
+
+#endif
@@ -0,0 +1,123 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: a ring of buffers between two threads
+//
+// One thread writes bytes (say, a decompressor) and another reads them
+// (say, a parser). The writer waits when every buffer is full and the
+// reader when every buffer is empty, so the two run side by side in a
+// fixed amount of memory.
+//
+
+#ifndef GILGAMESH_BUFFER_RING_INCLUDED
+#define GILGAMESH_BUFFER_RING_INCLUDED
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+namespace gilgamesh {
+
+  class buffer_ring {
+  public:
+    buffer_ring(size_t num_buffers = 4, size_t buffer_size = 0x100000) : buffer_size_(buffer_size) {
+      buffers_.resize(std::max(num_buffers, (size_t)2));
+      for (auto &b : buffers_) b.data.resize(buffer_size);
+    }
+
+    buffer_ring(const buffer_ring &) = delete;
+    buffer_ring &operator=(const buffer_ring &) = delete;
+
+    /// Writer: copy [begin, end) into the ring.
+    /// Returns false if the reader has stopped.
+    bool write(const uint8_t *begin, const uint8_t *end) {
+      while (begin != end) {
+        if (fill_ == 0) {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cv_.wait(lock, [this]() { return head_ - tail_ != buffers_.size() || stopped_; });
+          if (stopped_) return false;
+        }
+        buffer &b = buffers_[head_ % buffers_.size()];
+        size_t bytes = std::min((size_t)(end - begin), buffer_size_ - fill_);
+        memcpy(b.data.data() + fill_, begin, bytes);
+        fill_ += bytes;
+        begin += bytes;
+        if (fill_ == buffer_size_) publish();
+      }
+      return true;
+    }
+
+    /// Writer: there is no more data. ok is returned to the reader by read().
+    void close(bool ok = true) {
+      if (fill_) publish();
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+      ok_ = ok;
+      cv_.notify_all();
+    }
+
+    /// Reader: call fn(begin, end) for each buffer in turn until the writer closes the ring.
+    /// If fn returns false, the writer is stopped.
+    /// Returns false if stopped, otherwise the value passed to close().
+    template <class Fn>
+    bool read(Fn fn) {
+      for (;;) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return tail_ != head_ || closed_; });
+        if (tail_ == head_) return ok_;
+        buffer &b = buffers_[tail_ % buffers_.size()];
+        lock.unlock();
+
+        bool more = fn((const uint8_t *)b.data.data(), (const uint8_t *)b.data.data() + b.size);
+
+        lock.lock();
+        ++tail_;
+        if (!more) stopped_ = true;
+        cv_.notify_all();
+        if (!more) return false;
+      }
+    }
+
+    /// Reader: stop the writer without reading any more.
+    void stop() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+      cv_.notify_all();
+    }
+
+  private:
+    struct buffer {
+      std::vector<uint8_t> data;
+      size_t size = 0;
+    };
+
+    // hand the buffer being written to the reader.
+    void publish() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffers_[head_ % buffers_.size()].size = fill_;
+      ++head_;
+      fill_ = 0;
+      cv_.notify_all();
+    }
+
+    std::vector<buffer> buffers_;
+    size_t buffer_size_;
+
+    // buffers [tail_, head_) are full; only the writer touches fill_.
+    size_t head_ = 0;
+    size_t tail_ = 0;
+    size_t fill_ = 0;
+    bool closed_ = false;
+    bool ok_ = true;
+    bool stopped_ = false;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+  };
+}
+
+#endif
@@ -16,8 +16,27 @@
 #include <cstring>
 #include <vector>
 #include <cmath>
+#include <array>
+#include <algorithm>
+
+// Define GILGAMESH_NO_SIMD to use the byte loops instead, for comparison.
+#if defined(__AVX2__) && !defined(GILGAMESH_NO_SIMD)
+  #define GILGAMESH_AVX2
+  #include <immintrin.h>
+#endif
+
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(GILGAMESH_NO_SIMD)
+  #define GILGAMESH_SSE2
+  #include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+  #include <intrin.h>
+#endif
 
 #include <glm/glm.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <gilgamesh/zone_tracer.hpp>
 
 
 // https://en.wikipedia.org/wiki/Protein_Data_Bank_(file_format)
@@ -33,9 +52,6 @@ namespace gilgamesh {
       glm::vec3 pos_;
       int serial_;
       int resSeq_;
-      float x_;
-      float y_;
-      float z_;
       float occupancy_;
       float tempFactor_;
       std::array<char, 4> atomName_;
@@ -46,26 +62,32 @@ namespace gilgamesh {
       char iCode_;
       bool is_hetatom_;
       char altLoc_;
+      int model_;
 
     public:
       atom() {
       }
 
-      atom(const uint8_t *p, const uint8_t *eol, bool is_hetatom) : is_hetatom_(is_hetatom) {
-        serial_ = atoi(p - 1 + 7, p + 11);
-        read(atomName_, p - 1 + 13, p + 16);
-        altLoc_ = (char)p[-1+17];
-        read(resName_, p - 1 + 18, p + 20);
-        chainID_ = (char)p[-1+22];
-        resSeq_ = atoi(p - 1 + 23, p + 26);
-        iCode_ = (char)p[-1+27];
-        pos_.x = atof(p - 1 + 31, p + 38);
-        pos_.y = atof(p - 1 + 39, p + 46);
-        pos_.z = atof(p - 1 + 47, p + 54);
-        occupancy_ = atof(p - 1 + 55, p + 60);
-        tempFactor_ = atof(p - 1 + 61, p + 66);
-        read(element_, p - 1 + 77, p + 78);
-        read(charge_, p - 1 + 79, p + 80);
+      // Lines often stop early, after the coordinates say, so every field stops at eol.
+      // The model is set by the decoder from the MODEL records.
+      atom(const uint8_t *p, const uint8_t *eol, bool is_hetatom) : is_hetatom_(is_hetatom), model_(0) {
+        // The start of (1-based) column c, and the character in it.
+        auto col = [p, eol](int c) { return c - 1 < eol - p ? p + c - 1 : eol; };
+        auto chr = [p, eol](int c) { return c - 1 < eol - p ? (char)p[c - 1] : ' '; };
+        serial_ = atoi(col(7), col(12));
+        read(atomName_, col(13), col(17));
+        altLoc_ = chr(17);
+        read(resName_, col(18), col(21));
+        chainID_ = chr(22);
+        resSeq_ = atoi(col(23), col(27));
+        iCode_ = chr(27);
+        pos_.x = atof(col(31), col(39));
+        pos_.y = atof(col(39), col(47));
+        pos_.z = atof(col(47), col(55));
+        occupancy_ = atof(col(55), col(61));
+        tempFactor_ = atof(col(61), col(67));
+        read(element_, col(77), col(79));
+        read(charge_, col(79), col(81));
       }
 
       // http://www.wwpdb.org/documentation/file-format-content/format33/sect9.html#ATOM
@@ -100,6 +122,14 @@ namespace gilgamesh {
       std::string element() const { return std::string(element_.begin(), element_.end()); }
       std::string charge() const { return std::string(charge_.begin(), charge_.end()); }
 
+      /// The serial number of the MODEL record (pdbx_PDB_model_num in mmCIF), or 0 outside models.
+      /// NMR files have many models of the same atoms, one on top of the other.
+      int model() const { return model_; }
+
+      /// Atom and residue names packed into 32 bits by name_id().
+      uint32_t atomId() const { return pack(atomName_); }
+      uint32_t resId() const { return pack(resName_); }
+
       bool resNameIs(const char *name) const { return compare(resName_, name); }
       bool atomNameIs(const char *name) const { return compare(atomName_, name); }
       bool elementIs(const char *name) const { return compare(element_, name); }
@@ -131,7 +161,15 @@ namespace gilgamesh {
         }
       }
 
-      glm::vec4 colorByElement() const {
+      glm::vec4 colorByElement() const { return colorByElement(elementId()); }
+      float vanDerVaalsRadius() const { return vanDerVaalsRadius(elementId()); }
+      float covalentRadius() const { return covalentRadius(elementId()); }
+      bool isWater() const { return isWater(resId()); }
+
+      /// The element symbol packed into 16 bits, first character lowest.
+      uint16_t elementId() const { return (uint16_t)((uint8_t)element_[0] | (uint8_t)element_[1] << 8); }
+
+      static glm::vec4 colorByElement(uint16_t element) {
         // https://en.wikipedia.org/wiki/CPK_coloring
 
         struct data_t { char name[4]; uint32_t color; };
@@ -146,8 +184,8 @@ namespace gilgamesh {
           "K", 0x8F40D4, "CA", 0x3DFF00,
         };
 
-        char e0 = element_[0];
-        char e1 = element_[1];
+        char e0 = (char)(element & 0xff);
+        char e1 = (char)(element >> 8);
         uint32_t color = 0xdd77ff;
         for (const data_t &d : jmol) {
           if (e0 == d.name[0] && e1 == d.name[1]) {
@@ -158,7 +196,7 @@ namespace gilgamesh {
         return glm::vec4((color >> 16) * (1.0f/255), ((color >> 8)&0xff) * (1.0f/255), (color & 0xff) * (1.0f/255), 1.0f);
       }
 
-      float vanDerVaalsRadius() const {
+      static float vanDerVaalsRadius(uint16_t element) {
         // https://en.wikipedia.org/wiki/Atomic_radii_of_the_elements_(data_page)
 
         struct data_t { char name[4]; short vdv; };
@@ -173,8 +211,8 @@ namespace gilgamesh {
           "BI", 207, "PO", 197, "AT", 202, "RN", 220, "FR", 348, "RA", 283, "U", 186,
         };
 
-        char e0 = element_[0];
-        char e1 = element_[1];
+        char e0 = (char)(element & 0xff);
+        char e1 = (char)(element >> 8);
         for (const data_t &d : data) {
           if (e0 == d.name[0] && e1 == d.name[1]) {
             return d.vdv * 0.01f;
@@ -182,167 +220,117 @@ namespace gilgamesh {
         }
         return 1.2f;
       }
+
+      static float covalentRadius(uint16_t element) {
+        // Cordero et al. 2008, https://doi.org/10.1039/B801115J
+
+        struct data_t { char name[4]; short radius; };
+
+        static const data_t data[] = {
+          "H", 31, "C", 76, "N", 71, "O", 66, "S", 105, "P", 107, "HE", 28, "LI", 128, "BE", 96, "B", 84,
+          "F", 57, "NE", 58, "NA", 166, "MG", 141, "AL", 121, "SI", 111, "CL", 102, "AR", 106, "K", 203,
+          "CA", 176, "SC", 170, "TI", 160, "V", 153, "CR", 139, "MN", 139, "FE", 132, "CO", 126, "NI", 124,
+          "CU", 132, "ZN", 122, "GA", 122, "GE", 120, "AS", 119, "SE", 120, "BR", 120, "KR", 116, "RB", 220,
+          "SR", 195, "MO", 154, "RU", 146, "RH", 142, "PD", 139, "AG", 145, "CD", 144, "IN", 142, "SN", 139,
+          "SB", 139, "TE", 138, "I", 139, "XE", 140, "CS", 244, "BA", 215, "W", 162, "OS", 144, "IR", 141,
+          "PT", 136, "AU", 136, "HG", 132, "TL", 145, "PB", 146, "BI", 148, "U", 196,
+        };
+
+        char e0 = (char)(element & 0xff);
+        char e1 = (char)(element >> 8);
+        for (const data_t &d : data) {
+          if (e0 == d.name[0] && e1 == d.name[1]) {
+            return d.radius * 0.01f;
+          }
+        }
+        return 0.76f;
+      }
+
+      static bool isWater(uint32_t res_id) {
+        return res_id == name_id("HOH") || res_id == name_id("WAT") || res_id == name_id("DOD");
+      }
     };
 
 
+    /// Pack a name of up to four characters into 32 bits, first character lowest.
+    static constexpr uint32_t name_id(const char *name, int i = 0) {
+      return i == 4 || !name[i] ? 0 : (uint32_t)(uint8_t)name[i] << (i * 8) | name_id(name, i + 1);
+    }
+
+    /// The name packed by name_id().
+    static std::string nameString(uint32_t id) {
+      std::string result;
+      for (; id; id >>= 8) result.push_back((char)(id & 0xff));
+      return result;
+    }
+
     pdb_decoder() {
     }
 
-    pdb_decoder(const uint8_t *begin, const uint8_t *end) {
-      glm::mat4 biomt;
-
-      if (begin + 5 <= end && !memcmp(begin, "HEADE", 5)) {
-        // PDB format
-        for (const uint8_t *p = begin; p != end; ) {
-          const uint8_t *eol = p;
-          while (eol != end && *eol != '\n') ++eol;
-          const uint8_t *next_p = eol != end ? eol + 1 : end;
-          while (eol != p && (*eol == '\r' || *eol == '\n')) --eol;
-          if (p != eol) {
-            switch (*p) {
-              case 'A': {
-                if (p + 5 < eol && !memcmp(p, "ATOM  ", 6)) {
-                  atoms_.emplace_back(p, eol, false);
-                }
-              } break;
-              case 'H': {
-                if (p + 5 < eol && !memcmp(p, "HETATM", 6)) {
-                  atoms_.emplace_back(p, eol, true);
-                }
-              } break;
-              case 'C': {
-                if (p + 5 < eol && !memcmp(p, "CONECT", 6)) {
-                  // COLUMNS       DATA  TYPE      FIELD        DEFINITION
-                  // -------------------------------------------------------------------------
-                  //  1 -  6        Record name    "CONECT"
-                  //  7 - 11       Integer        serial       Atom  serial number
-                  //  12 - 16        Integer        serial       Serial number of bonded atom
-                  //  17 - 21        Integer        serial       Serial  number of bonded atom
-                  //  22 - 26        Integer        serial       Serial number of bonded atom
-                  //  27 - 31        Integer        serial       Serial number of bonded atom
-                  int a0 = atoi(p + 1 + 7, p + 11);
-                  int a1 = atoi(p + 1 + 12, p + 16);
-                  int a2 = atoi(p + 1 + 17, p + 21);
-                  int a3 = atoi(p + 1 + 22, p + 26);
-                  int a4 = atoi(p + 1 + 27, p + 31);
-                  if (a0 && a1) connections_.emplace_back(a0, a1);
-                  if (a0 && a2) connections_.emplace_back(a0, a2);
-                  if (a0 && a3) connections_.emplace_back(a0, a3);
-                  if (a0 && a4) connections_.emplace_back(a0, a4);
-                }
-              } break;
-              case 'R': {
-                if (p + 18 < eol && !memcmp(p, "REMARK 350   BIOMT", 18)) {
-                  int row, inst;
-                  float x, y, z, w;
-                  sscanf((char*)p + 18, "%d %d %f %f %f %f", &row, &inst, &x, &y, &z, &w);
-                  //printf("%d %d %f %f %f %f\n", row, inst, x, y, z, w);
-                  if (row >= 1 && row <= 3) {
-                    biomt[0][row-1] = x;
-                    biomt[1][row-1] = y;
-                    biomt[2][row-1] = z;
-                    biomt[3][row-1] = w;
-                  }
-                  if (row == 3) {
-                    //printf("%s\n", glm::to_string(biomt).c_str());
-                    instanceMatrices_.push_back(biomt);
-                  }
-                }
-              } break;
-            }
-          }
-          p = next_p;
-        }
-      } else {
-        // CIF format (very liberal parser!)
-        for (const uint8_t *p = begin; p != end; ++p) {
-          // Skip whitespace.
-          for(;;) {
-            while (p != end && *p <= ' ') {
-              ++p;
-            }
-            if (p != end && *p == '#') {
-              // Comment.
-              while (p != end && *p != '\r' && *p != '\n') {
-                ++p;
-              }
-            } else {
-              break;
-            }
-          }
+    /// Make a decoder for use with feed() and finish().
+    explicit pdb_decoder(unsigned num_threads) : num_threads_(num_threads) {
+    }
 
-          // Read token
-          if (p == end) break;
+    /// Decode a PDB or CIF file.
+    /// If num_threads > 1, PDB files are split into chunks of lines which are decoded in parallel.
+    /// The result is identical to the serial decoder.
+    pdb_decoder(const uint8_t *begin, const uint8_t *end, unsigned num_threads = 1) : num_threads_(num_threads) {
+      feed(begin, end);
+      finish();
+    }
 
-          if (*p == ';' && p != begin && (p[-1] == '\n' || p[-1] == '\r')) {
-            auto b = ++p;
-            for (;;) {
-              if (p == end) break;
-              if (*p == ';' && (p[-1] == '\n' || p[-1] == '\r')) break;
-              ++p;
-            }
-            cif_value(b, p);
-            p += p != end;
-          } if (*p == '\'' || *p == '"') {
-            auto delim = *p++;
-            auto b = p;
-            while (p != end && *p != delim) {
-              ++p;
-            }
-            cif_value(b, p);
-            p += p != end;
-          } else {
-            auto b = p;
-            while (p != end && *p >= '!') {
-              ++p;
-            }
-            switch (*b) {
-              case 'd': case 'D': {
-                if (p - b >= 5 && (b[1] | 0x20) == 'a' && (b[2] | 0x20) == 't' && (b[3] | 0x20) == 'a' && b[4] == '_') {
-                  cif_endloop();
-                  cif_data(b, p);
-                } else {
-                  cif_value(b, p);
-                }
-              } break;
-              case 's': case 'S': {
-                if (p - b >= 5 && (b[1] | 0x20) == 'a' && (b[2] | 0x20) == 'v' && (b[3] | 0x20) == 'e' && b[4] == '_') {
-                  cif_endloop();
-                  cif_save(b, p);
-                } else if (p - b >= 5 && (b[1] | 0x20) == 't' && (b[2] | 0x20) == 'o' && (b[3] | 0x20) == 'p' && b[4] == '_') {
-                  cif_endloop();
-                  cif_stop(b, p);
-                } else {
-                  cif_value(b, p);
-                }
-              } break;
-              case 'g': case 'G': {
-                if (p - b == 7 && (b[1] | 0x20) == 'l' && (b[2] | 0x20) == 'o' && (b[3] | 0x20) == 'b' && (b[4] | 0x20) == 'a' && (b[5] | 0x20) == 'l' && b[6] == '_') {
-                  cif_endloop();
-                  cif_global();
-                } else {
-                  cif_value(b, p);
-                }
-              } break;
-              case 'l': case 'L': {
-                if (p - b == 5 && (b[1] | 0x20) == 'o' && (b[2] | 0x20) == 'o' && (b[3] | 0x20) == 'p' && b[4] == '_') {
-                  cif_endloop();
-                  cif_loop();
-                } else {
-                  cif_value(b, p);
-                }
-              } break;
-              case '_': {
-                cif_endloop();
-                cif_tag(b, p);
-              } break;
-              default: {
-                cif_value(b, p);
-              } break;
-            }
-          }
+    /// Decode the next piece of a file.
+    /// The chunks may split lines and tokens anywhere; partial lines are kept
+    /// until the rest arrives, so only a little of the text is held at once.
+    void feed(const uint8_t *begin, const uint8_t *end) {
+      GILGAMESH_ZONE("pdb_decoder::feed");
+      GILGAMESH_ZONE_ITEMS(end - begin);
+      if (format_ == format_unknown) {
+        // We need the first few bytes to tell PDB from CIF.
+        if (pending_.empty() && end - begin >= 5) {
+          format_ = !memcmp(begin, "HEADE", 5) ? format_pdb : format_cif;
+        } else {
+          pending_.insert(pending_.end(), begin, end);
+          if (pending_.size() < 5) return;
+          format_ = !memcmp(pending_.data(), "HEADE", 5) ? format_pdb : format_cif;
+          std::vector<uint8_t> first;
+          first.swap(pending_);
+          feed(first.data(), first.data() + first.size());
+          return;
         }
       }
+
+      // Complete the leftovers of the last chunk, usually with one more line.
+      // If that is not enough (a long text field, say), add the whole chunk.
+      while (!pending_.empty() && begin != end) {
+        const uint8_t *next = find_byte(begin, end, '\n');
+        next += next != end;
+        if (pending_stuck_) next = end;
+        pending_.insert(pending_.end(), begin, next);
+        begin = next;
+        const uint8_t *cut = decode_chunk(pending_.data(), pending_.data() + pending_.size(), false);
+        pending_stuck_ = cut == pending_.data();
+        pending_.erase(pending_.begin(), pending_.begin() + (cut - pending_.data()));
+      }
+
+      if (begin != end) {
+        const uint8_t *cut = decode_chunk(begin, end, false);
+        pending_.assign(cut, end);
+        pending_stuck_ = false;
+      }
+    }
+
+    /// Decode anything left over after the last call to feed().
+    void finish() {
+      GILGAMESH_ZONE("pdb_decoder::finish");
+      if (format_ == format_unknown) {
+        format_ = pending_.size() >= 5 && !memcmp(pending_.data(), "HEADE", 5) ? format_pdb : format_cif;
+      }
+      if (!pending_.empty()) {
+        decode_chunk(pending_.data(), pending_.data() + pending_.size(), true);
+      }
+      std::vector<uint8_t>().swap(pending_);
+      pending_stuck_ = false;
     }
 
     /// Get the atoms in a set of chains.
@@ -389,187 +377,41 @@ namespace gilgamesh {
 
     /// Use knowledge of the chemistry to add connections to a list.
     int addImplicitConnections(const std::vector<atom> &atoms, std::vector<std::pair<int, int> > &out, size_t bidx, size_t eidx, int prevC, bool is_ca) const {
-      static const char table[][5] = {
-        "ASP",
-          "CB", "CG",
-          "CG", "OD1",
-          "CG", "OD2",
-          "!",
-        "ALA",
-          "!",
-        "CYS",
-          "CB", "SG",
-          "!",
-        "GLU",
-          "CB", "CG",
-          "CG", "CD",
-          "CD", "OE1",
-          "CD", "OE2",
-          "!",
-        "PHE",
-          "CB", "CG",
-          "CG", "CD1",
-          "CG", "CD2",
-          "CD1", "CE1",
-          "CD2", "CE2",
-          "CE1", "CZ",
-          "CE2", "CZ",
-          "!",
-        "GLY",
-          "!",
-        "HIS",
-          "CB", "CG",
-          "CG", "ND1",
-          "CG", "CD2",
-          "ND1", "CE1",
-          "CD2", "NE2",
-          "CE1", "NE2",
-          "!",
-        "ILE",
-          "CB", "CG1",
-          "CB", "CG2",
-          "CG1", "CD1",
-          "!",
-        "LYS",
-          "CB", "CG",
-          "CG", "CD",
-          "CD", "CE",
-          "CE", "NZ",
-          "!",
-        "LEU",
-          "CB", "CG",
-          "CG", "CD1",
-          "CG", "CD2",
-          "!",
-        "MET",
-          "CB", "CG",
-          "CG", "SD",
-          "SD", "CE",
-          "!",
-        "ASN",
-          "CB", "CG",
-          "CG", "OD1",
-          "CG", "ND2",
-          "!",
-        "PRO",
-          "CB", "CG",
-          "CG", "CD",
-          "!",
-        "GLN",
-          "CB", "CG",
-          "CG", "CD",
-          "CD", "OE1",
-          "CD", "NE2",
-          "!",
-        "ARG",
-          "CB", "CG",
-          "CG", "CD",
-          "CD", "NE",
-          "NE", "CZ",
-          "CZ", "NH1",
-          "CZ", "NH2",
-          "!",
-        "SER",
-          "CB", "OG",
-          "!",
-        "THR",
-          "CB", "OG1",
-          "CB", "CG2",
-          "!",
-        "VAL",
-          "CB", "CG1",
-          "CB", "CG2",
-          "!",
-        "TRP",
-          "CB", "CG",
-          "CG", "CD1",
-          "CG", "CD2",
-          "CD1", "NE1",
-          "CD2", "CE3",
-          "NE1", "CE2",
-          "CE2", "CZ2",
-          "CE3", "CZ3",
-          "CZ2", "CH2",
-          "CZ3", "CH2",
-          "!",
-        "TYR",
-          "CB", "CG",
-          "CG", "CD1",
-          "CG", "CD2",
-          "CD1", "CE1",
-          "CD2", "CE2",
-          "CE1", "CZ",
-          "CE2", "CZ",
-          "CZ", "OH",
-          "!",
-        "A",
-          "C1'", "N9",
-          "N9", "C8",
-          "C8", "N7",
-          "N7", "C5",
-          "C5", "C6",
-          "C6", "N6",
-          "C6", "N1",
-          "N1", "C2",
-          "C2", "N3",
-          "N3", "C4",
-          "C4", "N9",
-          "C4", "C5",
-          "!",
-        "C",
-          "C1'", "N1",
-          "N1", "C2",
-          "C2", "O2",
-          "C2", "N3",
-          "N3", "C4",
-          "C4", "N4",
-          "C4", "C5",
-          "C5", "C6",
-          "C6", "N1",
-          "!",
-        "G",
-          "C1'", "N9",
-          "C1'", "N9",
-          "N9", "C8",
-          "C8", "N7",
-          "N7", "C5",
-          "C5", "C6",
-          "C6", "O6",
-          "C6", "N1",
-          "N1", "C2",
-          "C2", "N3",
-          "N3", "C4",
-          "C4", "N9",
-          "C4", "C5",
-          "!",
-        "U",
-          "C1'", "N1",
-          "N1", "C2",
-          "C2", "O2",
-          "C2", "N3",
-          "N3", "C4",
-          "C4", "O4",
-          "C4", "C5",
-          "C5", "C6",
-          "C6", "N1",
-          "!",
-        ""
-      };
+      GILGAMESH_ZONE("pdb_decoder::addImplicitConnections");
+      GILGAMESH_ZONE_ITEMS(eidx - bidx);
+      return connectResidue([&atoms](size_t i) { return atoms[i].atomId(); }, atoms[bidx].resId(), out, bidx, eidx, prevC, is_ca);
+    }
 
-      if (atoms[bidx].resNameIs("A") || atoms[bidx].resNameIs("C") || atoms[bidx].resNameIs("G") || atoms[bidx].resNameIs("U")) {
-        int P_idx = findAtom(atoms, bidx, eidx, "P");
-        int OP1_idx = findAtom(atoms, bidx, eidx, "OP1");
-        int OP2_idx = findAtom(atoms, bidx, eidx, "OP2");
-        int O5d_idx = findAtom(atoms, bidx, eidx, "O5'");
-        int C5d_idx = findAtom(atoms, bidx, eidx, "C5'");
-        int C4d_idx = findAtom(atoms, bidx, eidx, "C4'");
-        int O4d_idx = findAtom(atoms, bidx, eidx, "O4'");
-        int C3d_idx = findAtom(atoms, bidx, eidx, "C3'");
-        int O3d_idx = findAtom(atoms, bidx, eidx, "O3'");
-        int C2d_idx = findAtom(atoms, bidx, eidx, "C2'");
-        int O2d_idx = findAtom(atoms, bidx, eidx, "O2'");
-        int C1d_idx = findAtom(atoms, bidx, eidx, "C1'");
+    /// Add the connections of a residue of atoms [bidx, eidx) whose atom names are atom_id(i) and residue name is res_id.
+    template <class AtomId>
+    static int connectResidue(AtomId atom_id, uint32_t res_id, std::vector<std::pair<int, int> > &out, size_t bidx, size_t eidx, int prevC, bool is_ca) {
+      const residue_templates &templates = residue_templates::get();
 
+      // The first atom in the residue with each name the templates use.
+      int slot_atom[residue_templates::max_slots];
+      std::fill(slot_atom, slot_atom + templates.num_slots(), -1);
+      for (size_t i = bidx; i != eidx; ++i) {
+        int slot = templates.slot(atom_id(i));
+        if (slot != -1 && slot_atom[slot] == -1) slot_atom[slot] = (int)i;
+      }
+      auto find = [&templates, &slot_atom](uint32_t id) {
+        int slot = templates.slot(id);
+        return slot == -1 ? -1 : slot_atom[slot];
+      };
+
+      if (res_id == name_id("A") || res_id == name_id("C") || res_id == name_id("G") || res_id == name_id("U")) {
+        int P_idx = find(name_id("P"));
+        int OP1_idx = find(name_id("OP1"));
+        int OP2_idx = find(name_id("OP2"));
+        int O5d_idx = find(name_id("O5'"));
+        int C5d_idx = find(name_id("C5'"));
+        int C4d_idx = find(name_id("C4'"));
+        int O4d_idx = find(name_id("O4'"));
+        int C3d_idx = find(name_id("C3'"));
+        int O3d_idx = find(name_id("O3'"));
+        int C2d_idx = find(name_id("C2'"));
+        int O2d_idx = find(name_id("O2'"));
+        int C1d_idx = find(name_id("C1'"));
         if (O5d_idx != -1 && C5d_idx != -1 && C4d_idx != -1 && O4d_idx != -1 && C3d_idx != -1 && O3d_idx != -1 && C2d_idx != -1 && O2d_idx != -1 && C1d_idx != -1) {
           if (P_idx != -1) {
             if (prevC != -1) out.emplace_back(prevC, P_idx);
@@ -594,16 +436,14 @@ namespace gilgamesh {
           return -1;
         }
       } else {
-        int N_idx = findAtom(atoms, bidx, eidx, "N");
-        int C_idx = findAtom(atoms, bidx, eidx, "C");
-        int O_idx = findAtom(atoms, bidx, eidx, "O");
-        int CA_idx = findAtom(atoms, bidx, eidx, "CA");
-        int CB_idx = findAtom(atoms, bidx, eidx, "CB");
-
-        //printf("find %s N%d C%d O%d CA%d CB%d\n", atoms[bidx].resName().c_str(), N_idx, C_idx, O_idx, CA_idx, CB_idx);
+        int N_idx = find(name_id("N"));
+        int C_idx = find(name_id("C"));
+        int O_idx = find(name_id("O"));
+        int CA_idx = find(name_id("CA"));
+        int CB_idx = find(name_id("CB"));
 
         if (N_idx == -1 || C_idx == -1 || CA_idx == -1) {
-          printf("addImplicitConnections: bad %s N%d C%d O%d CA%d CB%d\n", atoms[bidx].resName().c_str(), N_idx, C_idx, O_idx, CA_idx, CB_idx);
+          printf("addImplicitConnections: bad %s N%d C%d O%d CA%d CB%d\n", nameString(res_id).c_str(), N_idx, C_idx, O_idx, CA_idx, CB_idx);
           return -1;
         }
 
@@ -634,43 +474,22 @@ namespace gilgamesh {
         }
       }
 
-      //printf("!%s\n", atoms[bidx].resName().c_str());
-      bool found = false;
-      for (size_t i = 0; table[i][0];) {
-        //printf("%d -%s\n", (int)i, table[i]);
-        if (atoms[bidx].resNameIs(table[i])) {
-          const char *res_name = table[i];
-          ++i;
-          while (table[i][0] != '!') {
-            //printf("  %s %s\n", table[i], table[i+1]);
-            int from = findAtom(atoms, bidx, eidx, table[i]);
-            int to = findAtom(atoms, bidx, eidx, table[i+1]);
-            i += 2;
-            //printf("  %d..%d\n", from, to);
-            if (from != -1 && to != -1) {
-              out.emplace_back(from, to);
-            } else {
-              //int resSeq = atoms[bidx].resSeq();
-              //printf("Unexpected chemistry in %s/%d: %s %d   %s %d\n", res_name, resSeq, table[i-2], from, table[i-1], to);
-            }
-          }
-          found = true;
-          break;
-        } else {
-          ++i;
-          while (table[i][0] != '!') {
-            //printf("skip  %s %s\n", table[i], table[i+1]);
-            i += 2;
-          }
-          i++;
-        }
-      }
-      if (!found) {
+      const uint32_t *bond = templates.bonds(res_id);
+      if (!bond) {
         printf("not found\n");
+        return prevC;
+      }
+      for (; *bond; bond += 2) {
+        int from = find(bond[0]);
+        int to = find(bond[1]);
+        if (from != -1 && to != -1) {
+          out.emplace_back(from, to);
+        }
       }
 
       return prevC;
     }
+
     // return the index of the next resiude
     size_t nextResidue(const std::vector<atom> &atoms, size_t bidx) const {
       int resSeq = atoms[bidx].resSeq();
@@ -697,7 +516,810 @@ namespace gilgamesh {
     // Some PDB files contain instance information for the molecules. 
     const std::vector<glm::mat4> &instanceMatrices() const { return instanceMatrices_; }
 
+    /// Pairs of atom serial numbers from CONECT records.
+    const std::vector<std::pair<int, int> > &connections() const { return connections_; }
+
+    /// All the atoms in file order.
+    const std::vector<atom> &allAtoms() const { return atoms_; }
+
   private:
+    // Bonds within the standard residues, keyed by packed names.
+    // Each residue name is followed by pairs of atom names and a zero.
+    // The backbones are joined in addImplicitConnections.
+    static const uint32_t *residue_table() {
+      static constexpr uint32_t table[] = {
+        name_id("ASP"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("OD1"),
+          name_id("CG"), name_id("OD2"),
+          0,
+        name_id("ALA"),
+          0,
+        name_id("CYS"),
+          name_id("CB"), name_id("SG"),
+          0,
+        name_id("GLU"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("CD"),
+          name_id("CD"), name_id("OE1"),
+          name_id("CD"), name_id("OE2"),
+          0,
+        name_id("PHE"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("CD1"),
+          name_id("CG"), name_id("CD2"),
+          name_id("CD1"), name_id("CE1"),
+          name_id("CD2"), name_id("CE2"),
+          name_id("CE1"), name_id("CZ"),
+          name_id("CE2"), name_id("CZ"),
+          0,
+        name_id("GLY"),
+          0,
+        name_id("HIS"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("ND1"),
+          name_id("CG"), name_id("CD2"),
+          name_id("ND1"), name_id("CE1"),
+          name_id("CD2"), name_id("NE2"),
+          name_id("CE1"), name_id("NE2"),
+          0,
+        name_id("ILE"),
+          name_id("CB"), name_id("CG1"),
+          name_id("CB"), name_id("CG2"),
+          name_id("CG1"), name_id("CD1"),
+          0,
+        name_id("LYS"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("CD"),
+          name_id("CD"), name_id("CE"),
+          name_id("CE"), name_id("NZ"),
+          0,
+        name_id("LEU"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("CD1"),
+          name_id("CG"), name_id("CD2"),
+          0,
+        name_id("MET"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("SD"),
+          name_id("SD"), name_id("CE"),
+          0,
+        name_id("ASN"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("OD1"),
+          name_id("CG"), name_id("ND2"),
+          0,
+        name_id("PRO"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("CD"),
+          0,
+        name_id("GLN"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("CD"),
+          name_id("CD"), name_id("OE1"),
+          name_id("CD"), name_id("NE2"),
+          0,
+        name_id("ARG"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("CD"),
+          name_id("CD"), name_id("NE"),
+          name_id("NE"), name_id("CZ"),
+          name_id("CZ"), name_id("NH1"),
+          name_id("CZ"), name_id("NH2"),
+          0,
+        name_id("SER"),
+          name_id("CB"), name_id("OG"),
+          0,
+        name_id("THR"),
+          name_id("CB"), name_id("OG1"),
+          name_id("CB"), name_id("CG2"),
+          0,
+        name_id("VAL"),
+          name_id("CB"), name_id("CG1"),
+          name_id("CB"), name_id("CG2"),
+          0,
+        name_id("TRP"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("CD1"),
+          name_id("CG"), name_id("CD2"),
+          name_id("CD1"), name_id("NE1"),
+          name_id("CD2"), name_id("CE3"),
+          name_id("NE1"), name_id("CE2"),
+          name_id("CE2"), name_id("CZ2"),
+          name_id("CE3"), name_id("CZ3"),
+          name_id("CZ2"), name_id("CH2"),
+          name_id("CZ3"), name_id("CH2"),
+          0,
+        name_id("TYR"),
+          name_id("CB"), name_id("CG"),
+          name_id("CG"), name_id("CD1"),
+          name_id("CG"), name_id("CD2"),
+          name_id("CD1"), name_id("CE1"),
+          name_id("CD2"), name_id("CE2"),
+          name_id("CE1"), name_id("CZ"),
+          name_id("CE2"), name_id("CZ"),
+          name_id("CZ"), name_id("OH"),
+          0,
+        name_id("A"),
+          name_id("C1'"), name_id("N9"),
+          name_id("N9"), name_id("C8"),
+          name_id("C8"), name_id("N7"),
+          name_id("N7"), name_id("C5"),
+          name_id("C5"), name_id("C6"),
+          name_id("C6"), name_id("N6"),
+          name_id("C6"), name_id("N1"),
+          name_id("N1"), name_id("C2"),
+          name_id("C2"), name_id("N3"),
+          name_id("N3"), name_id("C4"),
+          name_id("C4"), name_id("N9"),
+          name_id("C4"), name_id("C5"),
+          0,
+        name_id("C"),
+          name_id("C1'"), name_id("N1"),
+          name_id("N1"), name_id("C2"),
+          name_id("C2"), name_id("O2"),
+          name_id("C2"), name_id("N3"),
+          name_id("N3"), name_id("C4"),
+          name_id("C4"), name_id("N4"),
+          name_id("C4"), name_id("C5"),
+          name_id("C5"), name_id("C6"),
+          name_id("C6"), name_id("N1"),
+          0,
+        name_id("G"),
+          name_id("C1'"), name_id("N9"),
+          name_id("C1'"), name_id("N9"),
+          name_id("N9"), name_id("C8"),
+          name_id("C8"), name_id("N7"),
+          name_id("N7"), name_id("C5"),
+          name_id("C5"), name_id("C6"),
+          name_id("C6"), name_id("O6"),
+          name_id("C6"), name_id("N1"),
+          name_id("N1"), name_id("C2"),
+          name_id("C2"), name_id("N3"),
+          name_id("N3"), name_id("C4"),
+          name_id("C4"), name_id("N9"),
+          name_id("C4"), name_id("C5"),
+          0,
+        name_id("U"),
+          name_id("C1'"), name_id("N1"),
+          name_id("N1"), name_id("C2"),
+          name_id("C2"), name_id("O2"),
+          name_id("C2"), name_id("N3"),
+          name_id("N3"), name_id("C4"),
+          name_id("C4"), name_id("O4"),
+          name_id("C4"), name_id("C5"),
+          name_id("C5"), name_id("C6"),
+          name_id("C6"), name_id("N1"),
+          0,
+        0
+      };
+      return table;
+    }
+
+    // Finds the templates of a residue and gives each atom name in them a small slot number
+    // so that a residue's atoms can be matched to its template in one pass.
+    class residue_templates {
+    public:
+      static const int max_slots = 128;
+
+      static const residue_templates &get() {
+        static const residue_templates templates;
+        return templates;
+      }
+
+      int num_slots() const { return num_slots_; }
+
+      /// The slot of an atom name, or -1 if no template uses it.
+      int slot(uint32_t id) const {
+        for (unsigned h = hash(id); ; h = (h + 1) & hash_mask) {
+          if (slots_[h] == -1) return -1;
+          if (slot_names_[h] == id) return slots_[h];
+        }
+      }
+
+      /// The zero terminated bond pairs of a residue, or nullptr if there is no template.
+      const uint32_t *bonds(uint32_t res_id) const {
+        for (unsigned h = hash(res_id); ; h = (h + 1) & hash_mask) {
+          if (!bonds_[h]) return nullptr;
+          if (residues_[h] == res_id) return bonds_[h];
+        }
+      }
+
+    private:
+      static const int hash_size = 512;
+      static const unsigned hash_mask = hash_size - 1;
+
+      static unsigned hash(uint32_t id) {
+        return (id * 0x9E3779B1u) >> 23;
+      }
+
+      residue_templates() {
+        std::fill(std::begin(slots_), std::end(slots_), -1);
+        std::fill(std::begin(bonds_), std::end(bonds_), nullptr);
+        static const char *const backbone[] = {
+          "N", "CA", "C", "O", "CB",
+          "P", "OP1", "OP2", "O5'", "C5'", "C4'", "O4'", "C3'", "O3'", "C2'", "O2'", "C1'",
+        };
+        for (const char *name : backbone) add_slot(name_id(name));
+        for (const uint32_t *p = residue_table(); *p; ++p) {
+          unsigned h = hash(*p);
+          while (bonds_[h]) h = (h + 1) & hash_mask;
+          residues_[h] = *p;
+          bonds_[h] = p + 1;
+          for (++p; *p; ++p) add_slot(*p);
+        }
+      }
+
+      void add_slot(uint32_t id) {
+        unsigned h = hash(id);
+        for (; slots_[h] != -1; h = (h + 1) & hash_mask) {
+          if (slot_names_[h] == id) return;
+        }
+        slot_names_[h] = id;
+        slots_[h] = num_slots_++;
+      }
+
+      int num_slots_ = 0;
+      uint32_t slot_names_[hash_size];
+      int slots_[hash_size];
+      uint32_t residues_[hash_size];
+      const uint32_t *bonds_[hash_size];
+    };
+
+    // One row of a REMARK 350 BIOMT matrix.
+    struct biomt_row {
+      int row;
+      float x, y, z, w;
+    };
+
+    // Non-atom records found in a range of PDB lines, kept in file order.
+    struct pdb_records {
+      std::vector<std::pair<int, int> > connections;
+      std::vector<biomt_row> biomt;
+      // (atoms in the range before the record, model serial) for MODEL, and 0 for ENDMDL.
+      std::vector<std::pair<size_t, int> > models;
+    };
+
+    // Return the position of the next newline or end.
+    static const uint8_t *line_end(const uint8_t *p, const uint8_t *end) {
+      const uint8_t *eol = (const uint8_t *)memchr(p, '\n', end - p);
+      return eol ? eol : end;
+    }
+
+    // Decode the PDB lines in [begin, end).
+    // Atoms are passed to atom_fn(p, eol, is_hetatom) and other records are appended to records.
+    template <class AtomFn>
+    static void decode_pdb_lines(const uint8_t *begin, const uint8_t *end, pdb_records &records, AtomFn atom_fn) {
+      size_t num_atoms = 0;
+      for (const uint8_t *p = begin; p != end; ) {
+        const uint8_t *eol = line_end(p, end);
+        const uint8_t *next_p = eol != end ? eol + 1 : end;
+        // eol is one past the last character, less the \r of CRLF.
+        while (eol != p && eol[-1] == '\r') --eol;
+        if (p != eol) {
+          switch (*p) {
+            case 'A': {
+              if (p + 5 < eol && !memcmp(p, "ATOM  ", 6)) {
+                atom_fn(p, eol, false);
+                ++num_atoms;
+              }
+            } break;
+            case 'H': {
+              if (p + 5 < eol && !memcmp(p, "HETATM", 6)) {
+                atom_fn(p, eol, true);
+                ++num_atoms;
+              }
+            } break;
+            case 'M': {
+              //  1 -  6       Record name   "MODEL "
+              // 11 - 14       Integer       serial        Model serial number.
+              // Some writers do not keep to the columns, so read the first number after the name.
+              if (p + 5 < eol && !memcmp(p, "MODEL ", 6)) {
+                records.models.emplace_back(num_atoms, atoi(p + 6, eol));
+              }
+            } break;
+            case 'E': {
+              if (p + 5 < eol && !memcmp(p, "ENDMDL", 6)) {
+                records.models.emplace_back(num_atoms, 0);
+              }
+            } break;
+            case 'C': {
+              if (p + 5 < eol && !memcmp(p, "CONECT", 6)) {
+                // COLUMNS       DATA  TYPE      FIELD        DEFINITION
+                // -------------------------------------------------------------------------
+                //  1 -  6        Record name    "CONECT"
+                //  7 - 11       Integer        serial       Atom  serial number
+                //  12 - 16        Integer        serial       Serial number of bonded atom
+                //  17 - 21        Integer        serial       Serial  number of bonded atom
+                //  22 - 26        Integer        serial       Serial number of bonded atom
+                //  27 - 31        Integer        serial       Serial number of bonded atom
+                // Short records stop at the last serial, so stop each field at the end of the line.
+                int a0 = atoi(p - 1 + 7, std::min(p + 11, eol));
+                int a1 = p - 1 + 12 < eol ? atoi(p - 1 + 12, std::min(p + 16, eol)) : 0;
+                int a2 = p - 1 + 17 < eol ? atoi(p - 1 + 17, std::min(p + 21, eol)) : 0;
+                int a3 = p - 1 + 22 < eol ? atoi(p - 1 + 22, std::min(p + 26, eol)) : 0;
+                int a4 = p - 1 + 27 < eol ? atoi(p - 1 + 27, std::min(p + 31, eol)) : 0;
+                if (a0 && a1) records.connections.emplace_back(a0, a1);
+                if (a0 && a2) records.connections.emplace_back(a0, a2);
+                if (a0 && a3) records.connections.emplace_back(a0, a3);
+                if (a0 && a4) records.connections.emplace_back(a0, a4);
+              }
+            } break;
+            case 'R': {
+              if (p + 18 < eol && !memcmp(p, "REMARK 350   BIOMT", 18)) {
+                // The line is not terminated, so copy it before scanning.
+                char text[96] = {};
+                memcpy(text, p + 18, std::min((size_t)(eol - p - 18), sizeof(text) - 1));
+                int row = 0, inst = 0;
+                biomt_row r{};
+                if (sscanf(text, "%d %d %f %f %f %f", &row, &inst, &r.x, &r.y, &r.z, &r.w) == 6) {
+                  r.row = row;
+                  records.biomt.push_back(r);
+                }
+              }
+            } break;
+          }
+        }
+        p = next_p;
+      }
+    }
+
+    // Count the ATOM and HETATM lines in [begin, end).
+    static size_t count_pdb_atoms(const uint8_t *begin, const uint8_t *end) {
+      size_t count = 0;
+      for (const uint8_t *p = begin; p != end; ) {
+        const uint8_t *eol = line_end(p, end);
+        const uint8_t *next_p = eol != end ? eol + 1 : end;
+        while (eol != p && eol[-1] == '\r') --eol;
+        if (p + 5 < eol && (!memcmp(p, "ATOM  ", 6) || !memcmp(p, "HETATM", 6))) {
+          ++count;
+        }
+        p = next_p;
+      }
+      return count;
+    }
+
+    // Decode as much of [begin, end) as we can and return where we stopped.
+    // If final is false, anything that might continue into the next chunk is left.
+    const uint8_t *decode_chunk(const uint8_t *begin, const uint8_t *end, bool final) {
+      if (format_ == format_pdb) {
+        const uint8_t *cut = end;
+        if (!final) {
+          while (cut != begin && cut[-1] != '\n') --cut;
+        }
+        if (num_threads_ > 1) {
+          decode_pdb_parallel(begin, cut, num_threads_);
+        } else {
+          pdb_records records;
+          size_t first_atom = atoms_.size();
+          decode_pdb_lines(begin, cut, records, [this](const uint8_t *p, const uint8_t *eol, bool is_hetatom) {
+            atoms_.emplace_back(p, eol, is_hetatom);
+          });
+          add_records(records, atoms_.data() + first_atom, atoms_.data() + atoms_.size());
+        }
+        return cut;
+      } else {
+        // CIF format (very liberal parser!)
+        const uint8_t *cut = decode_cif(begin, end, final);
+        if (cut != begin) {
+          line_start_ = cut[-1] == '\n' || cut[-1] == '\r';
+        }
+        return cut;
+      }
+    }
+
+    // Decode PDB lines on many threads.
+    // The buffer is split at line boundaries and each chunk writes its atoms to
+    // a pre-sized slot at the end of atoms_ so the order matches the serial decoder.
+    void decode_pdb_parallel(const uint8_t *begin, const uint8_t *end, unsigned num_threads) {
+      // Use a few chunks per thread to balance the load.
+      size_t size = end - begin;
+      size_t num_chunks = std::min((size_t)num_threads * 4, size / 4096 + 1);
+      std::vector<const uint8_t *> bounds(num_chunks + 1);
+      bounds[0] = begin;
+      bounds[num_chunks] = end;
+      for (size_t i = 1; i != num_chunks; ++i) {
+        const uint8_t *p = std::max(begin + size * i / num_chunks, bounds[i-1]);
+        const uint8_t *eol = line_end(p, end);
+        bounds[i] = eol != end ? eol + 1 : end;
+      }
+
+      // Count the atoms in each chunk and pre-size the output.
+      std::vector<size_t> offsets(num_chunks + 1);
+      parallel_for((int)num_chunks, num_threads, [&](int i) {
+        offsets[i+1] = count_pdb_atoms(bounds[i], bounds[i+1]);
+      });
+      for (size_t i = 0; i != num_chunks; ++i) {
+        offsets[i+1] += offsets[i];
+      }
+      size_t first_atom = atoms_.size();
+      atoms_.resize(first_atom + offsets[num_chunks]);
+
+      // Decode the chunks.
+      std::vector<pdb_records> records(num_chunks);
+      parallel_for((int)num_chunks, num_threads, [&](int i) {
+        atom *dest = atoms_.data() + first_atom + offsets[i];
+        decode_pdb_lines(bounds[i], bounds[i+1], records[i], [&dest](const uint8_t *p, const uint8_t *eol, bool is_hetatom) {
+          *dest++ = atom(p, eol, is_hetatom);
+        });
+      });
+
+      // Merge the other records in file order.
+      for (size_t i = 0; i != num_chunks; ++i) {
+        atom *first = atoms_.data() + first_atom;
+        add_records(records[i], first + offsets[i], first + offsets[i+1]);
+      }
+    }
+
+    // Add connections and instance matrices from a range of lines and number the models of its atoms [first, last).
+    // BIOMT rows and models may span chunks, so the matrix under construction is kept in biomt_
+    // and the current model in model_.
+    void add_records(const pdb_records &records, atom *first, atom *last) {
+      atom *a = first;
+      for (auto &m : records.models) {
+        for (; a != first + m.first; ++a) a->model_ = model_;
+        model_ = m.second;
+      }
+      for (; a != last; ++a) a->model_ = model_;
+
+      connections_.insert(connections_.end(), records.connections.begin(), records.connections.end());
+      for (auto &r : records.biomt) {
+        if (r.row >= 1 && r.row <= 3) {
+          biomt_[0][r.row-1] = r.x;
+          biomt_[1][r.row-1] = r.y;
+          biomt_[2][r.row-1] = r.z;
+          biomt_[3][r.row-1] = r.w;
+        }
+        if (r.row == 3) {
+          //printf("%s\n", glm::to_string(biomt_).c_str());
+          instanceMatrices_.push_back(biomt_);
+        }
+      }
+    }
+
+    // Position of the lowest set bit of a non-zero mask.
+    static int first_bit(uint64_t mask) {
+      #if defined(_MSC_VER)
+        unsigned long idx;
+        _BitScanForward64(&idx, mask);
+        return (int)idx;
+      #else
+        return __builtin_ctzll(mask);
+      #endif
+    }
+
+    // Most of an mmCIF file is the _atom_site loop: one row per line, about
+    // twenty short tokens per row. Rather than testing a byte at a time, we
+    // classify 64 bytes at once (AVX2 or SSE2) into bit masks and find the
+    // token boundaries of a whole row with shifts and bit scans.
+    // Whitespace is any byte <= ' ', tested unsigned so that UTF-8 is not space.
+
+    #if defined(GILGAMESH_SSE2)
+    // Set bit i of spaces if p[i] is whitespace and bit i of specials if p[i] is a quote or '#'.
+    // Bytes at or past limit count as whitespace. Only bytes before end are read.
+    static void classify64(const uint8_t *p, const uint8_t *limit, const uint8_t *end, uint64_t &spaces, uint64_t &specials) {
+      if (end - p < 64) {
+        spaces = ~(uint64_t)0;
+        specials = 0;
+        for (int i = 0; i < limit - p && i != 64; ++i) {
+          uint8_t c = p[i];
+          if (c > ' ') spaces &= ~((uint64_t)1 << i);
+          if (c == '\'' || c == '"' || c == '#') specials |= (uint64_t)1 << i;
+        }
+        return;
+      }
+      #if defined(GILGAMESH_AVX2)
+        const __m256i space = _mm256_set1_epi8(' ');
+        const __m256i quote1 = _mm256_set1_epi8('\'');
+        const __m256i quote2 = _mm256_set1_epi8('"');
+        const __m256i hash = _mm256_set1_epi8('#');
+        uint64_t s = 0, x = 0;
+        for (int i = 0; i != 64; i += 32) {
+          __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+          __m256i sp = _mm256_cmpeq_epi8(_mm256_min_epu8(v, space), v);
+          __m256i sc = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote1), _mm256_cmpeq_epi8(v, quote2)), _mm256_cmpeq_epi8(v, hash));
+          s |= (uint64_t)(uint32_t)_mm256_movemask_epi8(sp) << i;
+          x |= (uint64_t)(uint32_t)_mm256_movemask_epi8(sc) << i;
+        }
+      #else
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i quote1 = _mm_set1_epi8('\'');
+        const __m128i quote2 = _mm_set1_epi8('"');
+        const __m128i hash = _mm_set1_epi8('#');
+        uint64_t s = 0, x = 0;
+        for (int i = 0; i != 64; i += 16) {
+          __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+          __m128i sp = _mm_cmpeq_epi8(_mm_min_epu8(v, space), v);
+          __m128i sc = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote1), _mm_cmpeq_epi8(v, quote2)), _mm_cmpeq_epi8(v, hash));
+          s |= (uint64_t)(uint32_t)_mm_movemask_epi8(sp) << i;
+          x |= (uint64_t)(uint32_t)_mm_movemask_epi8(sc) << i;
+        }
+      #endif
+      if (limit - p < 64) {
+        uint64_t valid = ((uint64_t)1 << (limit - p)) - 1;
+        s |= ~valid;
+        x &= valid;
+      }
+      spaces = s;
+      specials = x;
+    }
+
+    #endif
+
+    typedef std::pair<const uint8_t *, const uint8_t *> cif_value_range;
+
+    // Split the line [p, eol) into exactly num_cols unquoted tokens.
+    // Returns false if the line has a different number of tokens or contains
+    // quotes or comments, in which case the caller must use the general tokenizer.
+    static bool split_row(const uint8_t *p, const uint8_t *eol, const uint8_t *end, cif_value_range *row, size_t num_cols) {
+    #if defined(GILGAMESH_SSE2)
+      size_t num_starts = 0, num_ends = 0;
+      uint64_t carry = 1;
+      for (const uint8_t *q = p; q < eol; q += 64) {
+        uint64_t spaces, specials;
+        classify64(q, eol, end, spaces, specials);
+        if (specials) return false;
+        uint64_t prev = spaces << 1 | carry;
+        uint64_t starts = ~spaces & prev;
+        uint64_t ends = spaces & ~prev;
+        carry = spaces >> 63;
+        for (; starts; starts &= starts - 1) {
+          if (num_starts == num_cols) return false;
+          row[num_starts++].first = q + first_bit(starts);
+        }
+        for (; ends; ends &= ends - 1) {
+          row[num_ends++].second = q + first_bit(ends);
+        }
+      }
+      if (num_ends != num_starts) row[num_ends++].second = eol;
+      return num_starts == num_cols;
+    #else
+      // Without SIMD, a byte at a time is faster than building masks.
+      size_t num_tokens = 0;
+      for (const uint8_t *q = p; ; ) {
+        while (q != eol && *q <= ' ') ++q;
+        if (q == eol) break;
+        if (num_tokens == num_cols) return false;
+        const uint8_t *b = q;
+        for (; q != eol && *q > ' '; ++q) {
+          if (*q == '\'' || *q == '"' || *q == '#') return false;
+        }
+        row[num_tokens++] = cif_value_range(b, q);
+      }
+      return num_tokens == num_cols;
+    #endif
+    }
+
+    static const uint8_t *find_space(const uint8_t *p, const uint8_t *end) {
+      while (p != end && *p > ' ') ++p;
+      return p;
+    }
+
+    static const uint8_t *find_nonspace(const uint8_t *p, const uint8_t *end) {
+      while (p != end && *p <= ' ') ++p;
+      return p;
+    }
+
+    // Return the first byte equal to c in [p, end) or end.
+    static const uint8_t *find_byte(const uint8_t *p, const uint8_t *end, uint8_t c) {
+      const uint8_t *q = (const uint8_t *)memchr(p, c, end - p);
+      return q ? q : end;
+    }
+
+    // Skip whitespace and comments.
+    // Unless final is set, stop at a comment that might continue past end.
+    static const uint8_t *skip_space(const uint8_t *p, const uint8_t *end, bool final) {
+      for (;;) {
+        p = find_nonspace(p, end);
+        if (p == end || *p != '#') return p;
+        const uint8_t *eol = find_byte(p, end, '\n');
+        if (eol == end && !final) return p;
+        p = eol;
+      }
+    }
+
+    // A value or keyword. [b, e) excludes quotes and text field delimiters.
+    // If complete is false, the token runs into the end of the buffer.
+    struct cif_token {
+      const uint8_t *b;
+      const uint8_t *e;
+      const uint8_t *next;
+      bool quoted;
+      bool complete;
+    };
+
+    // Read the token starting at p, which must not be whitespace.
+    // line_start says if begin is at the start of a line.
+    static cif_token read_token(const uint8_t *p, const uint8_t *begin, const uint8_t *end, bool line_start) {
+      cif_token t;
+      if (*p == ';' && (p == begin ? line_start : p[-1] == '\n' || p[-1] == '\r')) {
+        // Text field: runs until a ';' at the start of a line.
+        const uint8_t *q = t.b = p + 1;
+        for (;;) {
+          q = find_byte(q, end, ';');
+          if (q == end || q[-1] == '\n' || q[-1] == '\r') break;
+          ++q;
+        }
+        t.e = q;
+        t.next = q + (q != end);
+        t.quoted = true;
+        t.complete = q != end;
+      } else if (*p == '\'' || *p == '"') {
+        // Quoted string: the closing quote must be followed by whitespace.
+        uint8_t delim = *p;
+        const uint8_t *q = t.b = p + 1;
+        for (;;) {
+          q = find_byte(q, end, delim);
+          if (q == end || q + 1 == end || q[1] <= ' ') break;
+          ++q;
+        }
+        t.e = q;
+        t.next = q + (q != end);
+        t.quoted = true;
+        t.complete = q != end && q + 1 != end;
+      } else {
+        t.b = p;
+        t.e = t.next = find_space(p, end);
+        t.quoted = false;
+        t.complete = t.e != end;
+      }
+      return t;
+    }
+
+    enum Keyword {
+      kw_none,
+      kw_data,
+      kw_save,
+      kw_stop,
+      kw_global,
+      kw_loop,
+    };
+
+    // Classify the reserved words of CIF (case insensitive).
+    static Keyword keyword(const uint8_t *b, const uint8_t *e) {
+      switch (*b) {
+        case 'd': case 'D': {
+          if (e - b >= 5 && (b[1] | 0x20) == 'a' && (b[2] | 0x20) == 't' && (b[3] | 0x20) == 'a' && b[4] == '_') return kw_data;
+        } break;
+        case 's': case 'S': {
+          if (e - b >= 5 && (b[1] | 0x20) == 'a' && (b[2] | 0x20) == 'v' && (b[3] | 0x20) == 'e' && b[4] == '_') return kw_save;
+          if (e - b >= 5 && (b[1] | 0x20) == 't' && (b[2] | 0x20) == 'o' && (b[3] | 0x20) == 'p' && b[4] == '_') return kw_stop;
+        } break;
+        case 'g': case 'G': {
+          if (e - b == 7 && (b[1] | 0x20) == 'l' && (b[2] | 0x20) == 'o' && (b[3] | 0x20) == 'b' && (b[4] | 0x20) == 'a' && (b[5] | 0x20) == 'l' && b[6] == '_') return kw_global;
+        } break;
+        case 'l': case 'L': {
+          if (e - b == 5 && (b[1] | 0x20) == 'o' && (b[2] | 0x20) == 'o' && (b[3] | 0x20) == 'p' && b[4] == '_') return kw_loop;
+        } break;
+      }
+      return kw_none;
+    }
+
+    // Decode CIF text and return where we stopped.
+    // Unless final is set, we stop before any token or row that might continue past end.
+    const uint8_t *decode_cif(const uint8_t *begin, const uint8_t *end, bool final) {
+      for (const uint8_t *p = begin; ; ) {
+        p = skip_space(p, end, final);
+        if (p == end || *p == '#') return p;
+
+        if (state_ == state_atom_site_rows || (state_ == state_looptags && *p != '_' && is_atom_site_loop())) {
+          // Values of an _atom_site loop are decoded a row at a time.
+          p = decode_atom_site_rows(p, begin, end, final);
+          if (state_ == state_atom_site_rows) return p;
+          continue;
+        }
+
+        cif_token t = read_token(p, begin, end, line_start_);
+        if (!t.complete && !final) return p;
+        p = t.next;
+        if (t.quoted) {
+          cif_value(t.b, t.e);
+        } else if (*t.b == '_') {
+          cif_endloop();
+          cif_tag(t.b, t.e);
+        } else {
+          switch (keyword(t.b, t.e)) {
+            case kw_none: cif_value(t.b, t.e); break;
+            case kw_data: cif_endloop(); cif_data(t.b, t.e); break;
+            case kw_save: cif_endloop(); cif_save(t.b, t.e); break;
+            case kw_stop: cif_endloop(); cif_stop(t.b, t.e); break;
+            case kw_global: cif_endloop(); cif_global(); break;
+            case kw_loop: cif_endloop(); cif_loop(); break;
+          }
+        }
+      }
+    }
+
+    bool is_atom_site_loop() const {
+      for (Tag tag : loop_tags_) {
+        if (tag != _unknown_tag) return true;
+      }
+      return false;
+    }
+
+    // Decode the rows of an _atom_site loop starting at p.
+    // The column of each field is found once from the loop tags and each
+    // row is then copied into an atom without looking at the tags again.
+    // Returns the start of the first token after the loop, or, if the rows
+    // reach end, the start of the unfinished row with state_ left as state_atom_site_rows.
+    const uint8_t *decode_atom_site_rows(const uint8_t *p, const uint8_t *begin, const uint8_t *end, bool final) {
+      typedef cif_value_range value;
+
+      // Missing fields read from an empty value in the last column.
+      static const uint8_t empty[] = { 0 };
+      size_t num_cols = loop_tags_.size();
+      std::vector<value> row(num_cols + 1, value(empty, empty));
+      size_t col[_unknown_tag];
+      for (size_t &c : col) c = num_cols;
+      for (size_t i = num_cols; i-- != 0; ) {
+        if (loop_tags_[i] != _unknown_tag) col[loop_tags_[i]] = i;
+      }
+
+      const value &group_PDB = row[col[_atom_site_group_PDB]];
+      const value &id = row[col[_atom_site_id]];
+      const value &type_symbol = row[col[_atom_site_type_symbol]];
+      const value &label_atom_id = row[col[_atom_site_label_atom_id]];
+      const value &label_alt_id = row[col[_atom_site_label_alt_id]];
+      const value &label_comp_id = row[col[_atom_site_label_comp_id]];
+      const value &label_asym_id = row[col[_atom_site_label_asym_id]];
+      const value &label_seq_id = row[col[_atom_site_label_seq_id]];
+      const value &ins_code = row[col[_atom_site_pdbx_PDB_ins_code]];
+      const value &Cartn_x = row[col[_atom_site_Cartn_x]];
+      const value &Cartn_y = row[col[_atom_site_Cartn_y]];
+      const value &Cartn_z = row[col[_atom_site_Cartn_z]];
+      const value &occupancy = row[col[_atom_site_occupancy]];
+      const value &B_iso = row[col[_atom_site_B_iso_or_equiv]];
+      const value &model_num = row[col[_atom_site_pdbx_PDB_model_num]];
+
+      state_ = state_atom_site_rows;
+      for (;;) {
+        p = skip_space(p, end, final);
+        if (p == end || *p == '#') return p;
+        const uint8_t *row_start = p;
+        const uint8_t *e = find_space(p, end);
+        if (e == end && !final) return row_start;
+        if (*p == '_' || keyword(p, e) != kw_none) {
+          state_ = state_dataitem;
+          return p;
+        }
+
+        const uint8_t *eol = find_byte(p, end, '\n');
+        if (eol == end && !final) return row_start;
+        if (*p != ';' && split_row(p, eol, end, row.data(), num_cols)) {
+          p = eol;
+        } else {
+          // Quoted values, comments and rows that span lines.
+          for (size_t i = 0; i != num_cols; ++i) {
+            p = skip_space(p, end, final);
+            if (p == end || *p == '#') return final ? end : row_start;
+            cif_token t = read_token(p, begin, end, line_start_);
+            if (!t.complete && !final) return row_start;
+            row[i] = value(t.b, t.e);
+            p = t.next;
+          }
+        }
+
+        atom a;
+        a.is_hetatom_ = *group_PDB.first == 'H';
+        a.serial_ = atoi(id.first, id.second);
+        read(a.element_, type_symbol.first, type_symbol.second);
+        read(a.atomName_, label_atom_id.first, label_atom_id.second);
+        a.altLoc_ = (char)*label_alt_id.first;
+        read(a.resName_, label_comp_id.first, label_comp_id.second);
+        a.chainID_ = (char)*label_asym_id.first;
+        a.resSeq_ = atoi(label_seq_id.first, label_seq_id.second);
+        a.iCode_ = (char)*ins_code.first;
+        a.pos_.x = atof(Cartn_x.first, Cartn_x.second);
+        a.pos_.y = atof(Cartn_y.first, Cartn_y.second);
+        a.pos_.z = atof(Cartn_z.first, Cartn_z.second);
+        a.occupancy_ = atof(occupancy.first, occupancy.second);
+        a.tempFactor_ = atof(B_iso.first, B_iso.second);
+        a.charge_.fill(0);
+        a.model_ = atoi(model_num.first, model_num.second);
+        atoms_.push_back(a);
+      }
+    }
+
     struct res {
       uint8_t *p;
       bool ok = false;
@@ -775,10 +1397,27 @@ namespace gilgamesh {
       state_dataitem,
       state_looptags,
       state_loopvalues,
+      state_atom_site_rows,
     };
  
     State state_ = state_dataitem;
 
+    enum Format {
+      format_unknown,
+      format_pdb,
+      format_cif,
+    };
+
+    Format format_ = format_unknown;
+    unsigned num_threads_ = 1;
+
+    // Text from the end of the last chunk that has not been decoded yet.
+    std::vector<uint8_t> pending_;
+    bool pending_stuck_ = false;
+
+    // True if the next chunk starts at the start of a line (for CIF text fields).
+    bool line_start_ = true;
+
     void cif_loop() {
       state_ = state_looptags;
       tag_idx_ = 0;
@@ -799,46 +1438,7 @@ namespace gilgamesh {
         state_ = state_loopvalues;
       }
 
-      static int times = 0;
-
       if (state_ == state_loopvalues) {
-        Tag tag = loop_tags_[tag_idx_];
-        if (tag == _atom_site_group_PDB) {
-          atoms_.push_back(atom{});
-        }
-        static atom dummy{};
-        atom &a = atoms_.empty() ? dummy : atoms_.back();
-        int len = int(e - b);
-        switch (tag) {
-          case _atom_site_group_PDB: a.is_hetatom_ = *b == 'H'; break;
-          case _atom_site_id: a.serial_ = atoi(b, e); break;
-          case _atom_site_type_symbol: read(a.element_, b, e); break;
-          case _atom_site_label_atom_id: read(a.atomName_, b, e); break;
-          case _atom_site_label_alt_id: a.altLoc_ = *b; break;
-          case _atom_site_label_comp_id: read(a.resName_, b, e); break;
-          case _atom_site_label_asym_id: a.chainID_ = *b; break;
-          case _atom_site_label_entity_id: break;
-          case _atom_site_label_seq_id: a.resSeq_ = atoi(b, e); break;
-          case _atom_site_pdbx_PDB_ins_code: a.iCode_ = (char)*b; break;
-          case _atom_site_Cartn_x: a.pos_.x = atof(b, e); break;
-          case _atom_site_Cartn_y: a.pos_.y = atof(b, e); break;
-          case _atom_site_Cartn_z: a.pos_.z = atof(b, e); break;
-          case _atom_site_occupancy: a.occupancy_ = atof(b, e); break;
-          case _atom_site_B_iso_or_equiv: break;
-          case _atom_site_Cartn_x_esd: break;
-          case _atom_site_Cartn_y_esd: break;
-          case _atom_site_Cartn_z_esd: break;
-          case _atom_site_occupancy_esd: break;
-          case _atom_site_B_iso_or_equiv_esd: break;
-          case _atom_site_pdbx_formal_charge: break;
-          case _atom_site_auth_seq_id: break;
-          case _atom_site_auth_comp_id: break;
-          case _atom_site_auth_asym_id: break;
-          case _atom_site_auth_atom_id: break;
-          case _atom_site_pdbx_PDB_model_num: break;
-          case _unknown_tag: break;
-        }
-        //std::cout << std::string(b, e) << " " << tag << " V\n";
         if (++tag_idx_ >= loop_tags_.size()) {
           tag_idx_ = 0;
         }
@@ -856,7 +1456,7 @@ namespace gilgamesh {
 
     Tag getTag(const uint8_t *b, const uint8_t *e) {
       if (e - b < 11 || memcmp(b, "_atom_site.", 11)) return _unknown_tag;
-      for (Tag tag = _atom_site_group_PDB; tag != _atom_site_pdbx_PDB_model_num; tag = Tag(int(tag)+1)) {
+      for (Tag tag = _atom_site_group_PDB; tag != _unknown_tag; tag = Tag(int(tag)+1)) {
         const char *tn = tagName(tag);
         size_t len = strlen(tn);
         if (e - b == len && !memcmp(b, tn, len)) {
@@ -880,6 +1480,10 @@ namespace gilgamesh {
       while (d != a.end()) *d++ = 0;
     }
 
+    static uint32_t pack(const std::array<char, 4> &a) {
+      return (uint32_t)(uint8_t)a[0] | (uint32_t)(uint8_t)a[1] << 8 | (uint32_t)(uint8_t)a[2] << 16 | (uint32_t)(uint8_t)a[3] << 24;
+    }
+
     template <class Array>
     static bool compare(const Array &a, const char *str) {
       auto s = a.begin();
@@ -924,6 +1528,8 @@ namespace gilgamesh {
     std::vector<atom> atoms_;
     std::vector<glm::mat4> instanceMatrices_;
     std::vector<std::pair<int, int> > connections_;
+    glm::mat4 biomt_;
+    int model_ = 0;
   };
 }
 
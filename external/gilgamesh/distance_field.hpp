@@ -13,25 +13,44 @@
 #define GILGAMESH_DISTANCE_FIELD_INCLUDED
 
 #include <glm/glm.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <gilgamesh/zone_tracer.hpp>
 #include <vector>
+#include <array>
 #include <algorithm>
+#include <limits>
+#include <cstdint>
 
 // Inspired by:
 // George J. Grevera The "dead reckoning" signed distance transform.
 // http://citeseerx.ist.psu.edu/viewdoc/download?doi=10.1.1.102.7988&rep=rep1&type=pdf
 //
+// Pedro F. Felzenszwalb and Daniel P. Huttenlocher. Distance Transforms of Sampled Functions.
+// http://cs.brown.edu/people/pfelzens/papers/dt-final.pdf
+//
 
 namespace gilgamesh {
 
   class distance_field {
   public:
+    /// How the seeds are spread over the grid.
+    enum class method {
+      /// Two serial passes of the dead reckoning sweep.
+      sweep,
+
+      /// Separable exact Euclidean transform, one axis at a time, with the lines of each axis shared between threads.
+      exact,
+    };
+
     distance_field() {
     }
 
     /// Construct a distance field from a set of points.
     /// Returns the distance for each 3D grid point and the index of the closest point
     /// (ie. the Voronoi region).
-    distance_field(int xdim, int ydim, int zdim, float grid_spacing, glm::vec3 min, const std::vector<glm::vec3> &points, const std::vector<float> &radii) {
+    /// With method::exact, each grid point takes the point whose seed is nearest;
+    /// the sweep only looks at its neighbours' choices and can miss it.
+    distance_field(int xdim, int ydim, int zdim, float grid_spacing, glm::vec3 min, const std::vector<glm::vec3> &points, const std::vector<float> &radii, method m = method::sweep, unsigned num_threads = 1) {
       int rmask = radii.size() == 1 ? 0 : -1;
 
       auto distance = [&points, &radii, rmask](int pindex, glm::vec3 pos) {
@@ -61,8 +80,12 @@ namespace gilgamesh {
         }
       }
 
-      // sweep the field up and down.
-      sweep(xdim, ydim, zdim, grid_spacing, min, int(points.size()), distance);
+      if (m == method::exact) {
+        exact(xdim, ydim, zdim, grid_spacing, min, distance, num_threads);
+      } else {
+        // sweep the field up and down.
+        sweep(xdim, ydim, zdim, grid_spacing, min, int(points.size()), distance);
+      }
     }
 
     /// Closest distance to points
@@ -72,9 +95,140 @@ namespace gilgamesh {
     std::vector<int> &pindices() { return pindices_; }
     
   private:
+    static const int32_t infinity = std::numeric_limits<int32_t>::max();
+
+    // Working space for transform_line, one per thread.
+    struct line_scratch {
+      std::vector<int32_t> g;
+      std::vector<int> seed;
+      std::vector<int> v;
+      std::vector<float> z;
+
+      line_scratch(int n) : g(n), seed(n), v(n), z(n + 1) {
+      }
+    };
+
+    // Exact squared distance transform of one line of n values (Felzenszwalb and Huttenlocher).
+    // f[i * stride] is the squared distance of the seed so far (or infinity) and p[i * stride] the seed.
+    // Afterwards they hold the minimum over j of f[j] + (i - j)^2 and the seed that gave it.
+    static void transform_line(int32_t *f, int *p, int n, size_t stride, line_scratch &scratch) {
+      int32_t *g = scratch.g.data();
+      int *seed = scratch.seed.data();
+      int *v = scratch.v.data();
+      float *z = scratch.z.data();
+
+      for (int i = 0; i != n; ++i) {
+        g[i] = f[i * stride];
+        seed[i] = p[i * stride];
+      }
+
+      // v[0..k] are the parabolas of the lower envelope; parabola k is lowest between z[k] and z[k+1].
+      int k = -1;
+      for (int q = 0; q != n; ++q) {
+        if (g[q] == infinity) continue;
+        float s = -std::numeric_limits<float>::infinity();
+        while (k >= 0) {
+          int64_t num = ((int64_t)g[q] + (int64_t)q * q) - ((int64_t)g[v[k]] + (int64_t)v[k] * v[k]);
+          s = (float)num / (float)(2 * (q - v[k]));
+          if (s > z[k]) break;
+          --k;
+        }
+        ++k;
+        v[k] = q;
+        z[k] = k == 0 ? -std::numeric_limits<float>::infinity() : s;
+      }
+
+      // no seeds on this line: leave it alone.
+      if (k < 0) return;
+      z[k+1] = std::numeric_limits<float>::infinity();
+
+      for (int i = 0, j = 0; i != n; ++i) {
+        while (z[j+1] < (float)i) ++j;
+        int d = i - v[j];
+        f[i * stride] = g[v[j]] + d * d;
+        p[i * stride] = seed[v[j]];
+      }
+    }
+
+    // Find the nearest seed to every grid point with one transform_line along each axis,
+    // then measure the actual distance to that point.
+    template<class DistanceFn>
+    void exact(int xdim, int ydim, int zdim, float grid_spacing, glm::vec3 min, DistanceFn &distance, unsigned num_threads) {
+      GILGAMESH_ZONE("distance_field::exact");
+      GILGAMESH_ZONE_ITEMS((uint64_t)xdim * ydim * zdim);
+      size_t size = (size_t)xdim * ydim * zdim;
+      std::vector<int32_t> f(size);
+      for (size_t i = 0; i != size; ++i) {
+        f[i] = pindices_[i] == -1 ? infinity : 0;
+      }
+
+      int32_t *fp = f.data();
+      int *pp = pindices_.data();
+      int max_dim = std::max(xdim, std::max(ydim, zdim));
+
+      // x and y lines are done a z slice at a time.
+      parallel_for(zdim, num_threads, [=](int z) {
+        line_scratch scratch(max_dim);
+        size_t slice = (size_t)z * xdim * ydim;
+        for (int y = 0; y != ydim; ++y) {
+          transform_line(fp + slice + (size_t)y * xdim, pp + slice + (size_t)y * xdim, xdim, 1, scratch);
+        }
+        for (int x = 0; x != xdim; ++x) {
+          transform_line(fp + slice + x, pp + slice + x, ydim, xdim, scratch);
+        }
+      });
+
+      // z lines a y row at a time.
+      parallel_for(ydim, num_threads, [=](int y) {
+        line_scratch scratch(max_dim);
+        for (int x = 0; x != xdim; ++x) {
+          size_t offset = (size_t)y * xdim + x;
+          transform_line(fp + offset, pp + offset, zdim, (size_t)xdim * ydim, scratch);
+        }
+      });
+
+      // Seeds are rounded to the grid and points that share a grid point lose their seed,
+      // so also try the points chosen by the six neighbours, measuring the actual distance.
+      // The choices are written to a copy so that the result does not depend on the thread order.
+      std::vector<int> nearest(size);
+      int *np = nearest.data();
+      float *dp = distances_.data();
+      parallel_for(zdim, num_threads, [=, &distance](int z) {
+        size_t index = (size_t)z * xdim * ydim;
+        for (int y = 0; y != ydim; ++y) {
+          for (int x = 0; x != xdim; ++x, ++index) {
+            glm::vec3 pos = min + glm::vec3(x, y, z) * grid_spacing;
+            int best = pp[index];
+            float best_d = best == -1 ? std::numeric_limits<float>::max() : distance(best, pos);
+            auto consider = [&](size_t other) {
+              int pindex = pp[other];
+              if (pindex != best && pindex != -1) {
+                float d = distance(pindex, pos);
+                if (d < best_d) {
+                  best = pindex;
+                  best_d = d;
+                }
+              }
+            };
+            if (x != 0) consider(index - 1);
+            if (x != xdim-1) consider(index + 1);
+            if (y != 0) consider(index - xdim);
+            if (y != ydim-1) consider(index + xdim);
+            if (z != 0) consider(index - (size_t)xdim * ydim);
+            if (z != zdim-1) consider(index + (size_t)xdim * ydim);
+            np[index] = best;
+            dp[index] = best_d;
+          }
+        }
+      });
+      pindices_.swap(nearest);
+    }
+
     // generalised bidirectional sweep for points, spheres or other primitives.
     template<class DistanceFn>
     void sweep(int xdim, int ydim, int zdim, float grid_spacing, glm::vec3 min, int num_objects, DistanceFn &distance) {
+      GILGAMESH_ZONE("distance_field::sweep");
+      GILGAMESH_ZONE_ITEMS((uint64_t)xdim * ydim * zdim);
       // Offsets for up to 13 adjacent locations.
       // Note that when scanning down, these offsets are negated.
       std::array<int, 13> offsets;
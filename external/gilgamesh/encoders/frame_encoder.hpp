@@ -0,0 +1,155 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: frame encoder class
+//
+// Compresses a sequence of RGBA frames for streaming, sending only what has
+// changed since the frame before.
+//
+// Whole frames: a frame with no changed pixels is not sent at all, and a
+// JPEG frame only encodes again the strips of sixteen rows that changed.
+//
+// Tiles: only the tiles that changed are sent, each as an image of its own,
+// in a record a client can paste onto its copy of the frame:
+//
+//   "MVTL", u16 width, u16 height, u16 num_tiles, u16 format (0 jpeg, 1 png)
+//   per tile: u16 x, u16 y, u16 w, u16 h, u32 size, then size bytes of image
+//
+// all little-endian.
+//
+
+#ifndef GILGAMESH_FRAME_ENCODER_INCLUDED
+#define GILGAMESH_FRAME_ENCODER_INCLUDED
+
+#include <gilgamesh/encoders/jpeg_encoder.hpp>
+#include <gilgamesh/encoders/png_encoder.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace gilgamesh {
+
+class frame_encoder {
+public:
+  enum class format { jpeg, png };
+
+  /// quality is the JPEG quality (1 to 100) or the PNG deflate level (1 to 9).
+  frame_encoder(format fmt = format::jpeg, int quality = 80, int tile_size = 64) :
+    format_(fmt), jpeg_(quality), png_(std::max(1, std::min(quality, 9))), tile_size_(tile_size)
+  {
+  }
+
+  format image_format() const { return format_; }
+
+  /// The next frame is sent whole, as if nothing had been sent before.
+  void key_frame() {
+    prev_.clear();
+  }
+
+  /// Append the frame as one image to dest.
+  /// Returns false, leaving dest alone, if nothing changed since the last frame.
+  bool encode_frame(std::vector<uint8_t> &dest, const uint32_t *pixels, int width, int height, unsigned num_threads = 1) {
+    const uint8_t *rgba = (const uint8_t*)pixels;
+    int stride = width * 4;
+    int strip_height = jpeg_encoder::strip_height();
+    int num_strips = jpeg_encoder::num_strips(height);
+    std::vector<int> dirty;
+    bool key = start_frame(width, height);
+    for (int s = 0; s != num_strips; ++s) {
+      if (key || changed(pixels, 0, s * strip_height, width, std::min(strip_height, height - s * strip_height))) dirty.push_back(s);
+    }
+    if (dirty.empty()) return false;
+
+    if (format_ == format::jpeg) {
+      strips_.resize(num_strips);
+      parallel_for((int)dirty.size(), num_threads, [&](int i) {
+        jpeg_.encode_strip(strips_[dirty[i]], rgba, width, height, stride, dirty[i]);
+      });
+      jpeg_.assemble(dest, width, height, strips_);
+    } else {
+      png_.encode(dest, rgba, width, height, stride, false, num_threads);
+    }
+    end_frame(pixels);
+    return true;
+  }
+
+  /// Append a record of the tiles that changed since the last frame to dest.
+  /// Returns false, leaving dest alone, if none did.
+  bool encode_tiles(std::vector<uint8_t> &dest, const uint32_t *pixels, int width, int height, unsigned num_threads = 1) {
+    struct tile { int x, y, w, h; std::vector<uint8_t> bytes; };
+    std::vector<tile> tiles;
+    bool key = start_frame(width, height);
+    for (int y = 0; y < height; y += tile_size_) {
+      for (int x = 0; x < width; x += tile_size_) {
+        int w = std::min(tile_size_, width - x), h = std::min(tile_size_, height - y);
+        if (key || changed(pixels, x, y, w, h)) tiles.push_back(tile{ x, y, w, h, std::vector<uint8_t>() });
+      }
+    }
+    if (tiles.empty()) return false;
+
+    parallel_for((int)tiles.size(), num_threads, [&](int i) {
+      tile &t = tiles[i];
+      const uint8_t *corner = (const uint8_t*)(pixels + (size_t)t.y * width + t.x);
+      if (format_ == format::jpeg) {
+        jpeg_.encode(t.bytes, corner, t.w, t.h, width * 4);
+      } else {
+        png_.encode(t.bytes, corner, t.w, t.h, width * 4);
+      }
+    });
+
+    auto put16 = [&dest](int v) { dest.push_back((uint8_t)v); dest.push_back((uint8_t)(v >> 8)); };
+    dest.insert(dest.end(), { 'M', 'V', 'T', 'L' });
+    put16(width);
+    put16(height);
+    put16((int)tiles.size());
+    put16(format_ == format::jpeg ? 0 : 1);
+    for (auto &t : tiles) {
+      put16(t.x);
+      put16(t.y);
+      put16(t.w);
+      put16(t.h);
+      put16((int)(t.bytes.size() & 0xffff));
+      put16((int)(t.bytes.size() >> 16));
+      dest.insert(dest.end(), t.bytes.begin(), t.bytes.end());
+    }
+    end_frame(pixels);
+    return true;
+  }
+
+private:
+  // Returns true if there is no previous frame of the same size to compare with.
+  bool start_frame(int width, int height) {
+    bool key = width != width_ || height != height_ || prev_.empty();
+    width_ = width;
+    height_ = height;
+    return key;
+  }
+
+  void end_frame(const uint32_t *pixels) {
+    prev_.assign(pixels, pixels + (size_t)width_ * height_);
+  }
+
+  bool changed(const uint32_t *pixels, int x, int y, int w, int h) const {
+    for (int row = y; row != y + h; ++row) {
+      size_t offset = (size_t)row * width_ + x;
+      if (memcmp(pixels + offset, prev_.data() + offset, w * sizeof(uint32_t))) return true;
+    }
+    return false;
+  }
+
+  format format_;
+  jpeg_encoder jpeg_;
+  png_encoder png_;
+  int tile_size_;
+  int width_ = 0;
+  int height_ = 0;
+  std::vector<uint32_t> prev_;
+  std::vector<std::vector<uint8_t> > strips_;
+};
+
+}
+
+#endif
@@ -0,0 +1,368 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: baseline JPEG encoder class
+//
+// YCbCr 4:2:0 with the example tables of the standard (Annex K), scaled by
+// quality as libjpeg does.
+//
+// Each strip of sixteen rows is a restart interval, so the strips can be
+// encoded on separate threads and joined with RST markers. A caller that
+// knows a strip has not changed since the last frame can keep its bytes and
+// skip it.
+//
+
+#ifndef GILGAMESH_JPEG_ENCODER_INCLUDED
+#define GILGAMESH_JPEG_ENCODER_INCLUDED
+
+#include <gilgamesh/parallel.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+namespace gilgamesh {
+
+class jpeg_encoder {
+public:
+  /// quality is 1 (smallest) to 100 (best).
+  explicit jpeg_encoder(int quality = 80) {
+    static const uint8_t luma[64] = {
+      16, 11, 10, 16, 24, 40, 51, 61,  12, 12, 14, 19, 26, 58, 60, 55,
+      14, 13, 16, 24, 40, 57, 69, 56,  14, 17, 22, 29, 51, 87, 80, 62,
+      18, 22, 37, 56, 68,109,103, 77,  24, 35, 55, 64, 81,104,113, 92,
+      49, 64, 78, 87,103,121,120,101,  72, 92, 95, 98,112,100,103, 99,
+    };
+    static const uint8_t chroma[64] = {
+      17, 18, 24, 47, 99, 99, 99, 99,  18, 21, 26, 66, 99, 99, 99, 99,
+      24, 26, 56, 99, 99, 99, 99, 99,  47, 66, 99, 99, 99, 99, 99, 99,
+      99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99,
+      99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99,
+    };
+    quality = std::max(1, std::min(quality, 100));
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (int i = 0; i != 64; ++i) {
+      quant_[0][i] = (uint8_t)std::max(1, std::min((luma[i] * scale + 50) / 100, 255));
+      quant_[1][i] = (uint8_t)std::max(1, std::min((chroma[i] * scale + 50) / 100, 255));
+    }
+
+    // The DCT basis with its scale factors, so that a row then a column pass gives the coefficients (A.3.3).
+    for (int u = 0; u != 8; ++u) {
+      for (int x = 0; x != 8; ++x) {
+        dct_[u][x] = (float)((u ? 0.5 : std::sqrt(0.125)) * std::cos((2 * x + 1) * u * 3.14159265358979 / 16));
+      }
+    }
+    for (int t = 0; t != 2; ++t) {
+      for (int i = 0; i != 64; ++i) recip_[t][i] = 1.0f / quant_[t][i];
+    }
+
+    make_codes(codes_[0], dc_luma_bits(), dc_luma_vals());
+    make_codes(codes_[1], ac_luma_bits(), ac_luma_vals());
+    make_codes(codes_[2], dc_chroma_bits(), dc_chroma_vals());
+    make_codes(codes_[3], ac_chroma_bits(), ac_chroma_vals());
+  }
+
+  static int strip_height() { return 16; }
+  static int num_strips(int height) { return (height + 15) / 16; }
+
+  /// Compress an RGBA image (four bytes a pixel, rows stride bytes apart), strips on up to num_threads threads.
+  void encode(std::vector<uint8_t> &dest, const uint8_t *rgba, int width, int height, int stride, unsigned num_threads = 1) const {
+    std::vector<std::vector<uint8_t> > strips(num_strips(height));
+    parallel_for((int)strips.size(), num_threads, [&](int strip) {
+      encode_strip(strips[strip], rgba, width, height, stride, strip);
+    });
+    assemble(dest, width, height, strips);
+  }
+
+  /// Compress rows [strip * 16, strip * 16 + 16) into an entropy coded segment, replacing dest.
+  void encode_strip(std::vector<uint8_t> &dest, const uint8_t *rgba, int width, int height, int stride, int strip) const {
+    dest.clear();
+    bit_writer out(dest);
+    int dc[3] = { 0, 0, 0 };
+    int y0 = strip * 16;
+    float ycc[3][16][16];
+    float block[64];
+    for (int x0 = 0; x0 < width; x0 += 16) {
+      // Convert the macroblock, repeating the last row and column past the edges.
+      for (int y = 0; y != 16; ++y) {
+        const uint8_t *row = rgba + (size_t)std::min(y0 + y, height - 1) * stride;
+        for (int x = 0; x != 16; ++x) {
+          const uint8_t *p = row + std::min(x0 + x, width - 1) * 4;
+          float r = p[0], g = p[1], b = p[2];
+          ycc[0][y][x] = 0.299f * r + 0.587f * g + 0.114f * b - 128;
+          ycc[1][y][x] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+          ycc[2][y][x] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+        }
+      }
+
+      for (int b = 0; b != 4; ++b) {
+        int bx = (b & 1) * 8, by = (b >> 1) * 8;
+        for (int y = 0; y != 8; ++y) {
+          for (int x = 0; x != 8; ++x) block[y * 8 + x] = ycc[0][by + y][bx + x];
+        }
+        encode_block(out, block, 0, dc[0]);
+      }
+      for (int c = 1; c != 3; ++c) {
+        for (int y = 0; y != 8; ++y) {
+          for (int x = 0; x != 8; ++x) {
+            block[y * 8 + x] = (ycc[c][y*2][x*2] + ycc[c][y*2][x*2+1] + ycc[c][y*2+1][x*2] + ycc[c][y*2+1][x*2+1]) * 0.25f;
+          }
+        }
+        encode_block(out, block, 1, dc[c]);
+      }
+    }
+    out.flush();
+  }
+
+  /// Write a JPEG file made of the strips from encode_strip, appending to dest.
+  void assemble(std::vector<uint8_t> &dest, int width, int height, const std::vector<std::vector<uint8_t> > &strips) const {
+    auto put16 = [&dest](int v) { dest.push_back((uint8_t)(v >> 8)); dest.push_back((uint8_t)v); };
+    auto marker = [&](int m, int length) { dest.push_back(0xff); dest.push_back((uint8_t)m); put16(length); };
+    size_t size = 0;
+    for (auto &s : strips) size += s.size() + 2;
+    dest.reserve(dest.size() + size + 1024);
+
+    dest.push_back(0xff);
+    dest.push_back(0xd8);
+
+    marker(0xdb, 2 + 65 * 2);
+    for (int t = 0; t != 2; ++t) {
+      dest.push_back((uint8_t)t);
+      for (int i = 0; i != 64; ++i) dest.push_back(quant_[t][zigzag()[i]]);
+    }
+
+    marker(0xc0, 17);
+    dest.push_back(8);
+    put16(height);
+    put16(width);
+    dest.push_back(3);
+    static const uint8_t components[3][3] = { { 1, 0x22, 0 }, { 2, 0x11, 1 }, { 3, 0x11, 1 } };
+    for (auto &c : components) dest.insert(dest.end(), c, c + 3);
+
+    const uint8_t *bits[4] = { dc_luma_bits(), ac_luma_bits(), dc_chroma_bits(), ac_chroma_bits() };
+    const uint8_t *vals[4] = { dc_luma_vals(), ac_luma_vals(), dc_chroma_vals(), ac_chroma_vals() };
+    static const uint8_t classes[4] = { 0x00, 0x10, 0x01, 0x11 };
+    for (int t = 0; t != 4; ++t) {
+      int num_vals = 0;
+      for (int i = 0; i != 16; ++i) num_vals += bits[t][i];
+      marker(0xc4, 2 + 1 + 16 + num_vals);
+      dest.push_back(classes[t]);
+      dest.insert(dest.end(), bits[t], bits[t] + 16);
+      dest.insert(dest.end(), vals[t], vals[t] + num_vals);
+    }
+
+    marker(0xdd, 4);
+    put16((width + 15) / 16);
+
+    marker(0xda, 12);
+    dest.push_back(3);
+    static const uint8_t scan[3][2] = { { 1, 0x00 }, { 2, 0x11 }, { 3, 0x11 } };
+    for (auto &c : scan) dest.insert(dest.end(), c, c + 2);
+    dest.push_back(0);
+    dest.push_back(63);
+    dest.push_back(0);
+
+    for (size_t i = 0; i != strips.size(); ++i) {
+      if (i) {
+        dest.push_back(0xff);
+        dest.push_back((uint8_t)(0xd0 + (i - 1) % 8));
+      }
+      dest.insert(dest.end(), strips[i].begin(), strips[i].end());
+    }
+
+    dest.push_back(0xff);
+    dest.push_back(0xd9);
+  }
+
+private:
+  struct code {
+    uint16_t bits;
+    uint8_t length;
+  };
+
+  class bit_writer {
+  public:
+    bit_writer(std::vector<uint8_t> &dest) : dest_(dest) {
+    }
+
+    void put(uint32_t bits, int length) {
+      acc_ = acc_ << length | (bits & ((1u << length) - 1));
+      num_bits_ += length;
+      while (num_bits_ >= 8) {
+        num_bits_ -= 8;
+        uint8_t byte = (uint8_t)(acc_ >> num_bits_);
+        dest_.push_back(byte);
+        if (byte == 0xff) dest_.push_back(0);
+      }
+    }
+
+    // Pad the last byte with ones.
+    void flush() {
+      if (num_bits_) put(0x7f, 8 - num_bits_);
+    }
+
+  private:
+    std::vector<uint8_t> &dest_;
+    uint32_t acc_ = 0;
+    int num_bits_ = 0;
+  };
+
+  void encode_block(bit_writer &out, const float *block, int table, int &prev_dc) const {
+    // Separable DCT: rows then columns.
+    float tmp[64], coef[64];
+    for (int y = 0; y != 8; ++y) {
+      for (int u = 0; u != 8; ++u) {
+        float sum = 0;
+        for (int x = 0; x != 8; ++x) sum += dct_[u][x] * block[y * 8 + x];
+        tmp[y * 8 + u] = sum;
+      }
+    }
+    for (int v = 0; v != 8; ++v) {
+      for (int u = 0; u != 8; ++u) {
+        float sum = 0;
+        for (int y = 0; y != 8; ++y) sum += dct_[v][y] * tmp[y * 8 + u];
+        coef[v * 8 + u] = sum;
+      }
+    }
+
+    int q[64];
+    for (int i = 0; i != 64; ++i) {
+      int n = zigzag()[i];
+      q[i] = (int)std::lround(coef[n] * recip_[table][n]);
+    }
+
+    const code *dc_codes = codes_[table * 2];
+    const code *ac_codes = codes_[table * 2 + 1];
+    int diff = q[0] - prev_dc;
+    prev_dc = q[0];
+    int size = category(diff);
+    out.put(dc_codes[size].bits, dc_codes[size].length);
+    if (size) out.put(diff < 0 ? diff - 1 : diff, size);
+
+    int run = 0;
+    for (int i = 1; i != 64; ++i) {
+      if (q[i] == 0) {
+        ++run;
+        continue;
+      }
+      while (run >= 16) {
+        out.put(ac_codes[0xf0].bits, ac_codes[0xf0].length);
+        run -= 16;
+      }
+      size = category(q[i]);
+      int symbol = run << 4 | size;
+      out.put(ac_codes[symbol].bits, ac_codes[symbol].length);
+      out.put(q[i] < 0 ? q[i] - 1 : q[i], size);
+      run = 0;
+    }
+    if (run) out.put(ac_codes[0].bits, ac_codes[0].length);
+  }
+
+  // Number of bits needed for the magnitude of v.
+  static int category(int v) {
+    unsigned a = (unsigned)(v < 0 ? -v : v);
+    int n = 0;
+    while (a) {
+      ++n;
+      a >>= 1;
+    }
+    return n;
+  }
+
+  // Canonical Huffman codes from the counts of codes of each length (Annex C).
+  static void make_codes(code *codes, const uint8_t *bits, const uint8_t *vals) {
+    uint16_t next = 0;
+    int k = 0;
+    for (int length = 1; length <= 16; ++length) {
+      for (int i = 0; i != bits[length - 1]; ++i) {
+        codes[vals[k++]] = code{ next++, (uint8_t)length };
+      }
+      next <<= 1;
+    }
+  }
+
+  uint8_t quant_[2][64];
+  float recip_[2][64];
+  float dct_[8][8];
+  code codes_[4][256] = {};
+
+  // Natural order index of each coefficient in zigzag order.
+  static const int *zigzag() {
+    static const int table[64] = {
+       0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+      12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+      35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+      58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+    };
+    return table;
+  }
+
+  static const uint8_t *dc_luma_bits() {
+    static const uint8_t table[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+    return table;
+  }
+
+  static const uint8_t *dc_luma_vals() {
+    static const uint8_t table[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+    return table;
+  }
+
+  static const uint8_t *dc_chroma_bits() {
+    static const uint8_t table[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+    return table;
+  }
+
+  static const uint8_t *dc_chroma_vals() {
+    static const uint8_t table[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+    return table;
+  }
+
+  static const uint8_t *ac_luma_bits() {
+    static const uint8_t table[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+    return table;
+  }
+
+  static const uint8_t *ac_luma_vals() {
+    static const uint8_t table[162] = {
+      0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+      0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+      0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+      0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+      0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+      0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+      0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+      0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+      0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+      0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+      0xf9, 0xfa,
+    };
+    return table;
+  }
+
+  static const uint8_t *ac_chroma_bits() {
+    static const uint8_t table[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+    return table;
+  }
+
+  static const uint8_t *ac_chroma_vals() {
+    static const uint8_t table[162] = {
+      0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+      0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+      0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+      0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+      0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+      0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+      0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+      0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+      0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+      0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+      0xf9, 0xfa,
+    };
+    return table;
+  }
+};
+
+}
+
+#endif
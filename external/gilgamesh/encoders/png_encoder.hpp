@@ -0,0 +1,149 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: PNG encoder class
+//
+// Rows are filtered in strips on many threads, each row taking whichever of
+// the Sub, Up and Paeth filters leaves the smallest residuals, and the
+// result is compressed with andyzip's deflate encoder, which also works in
+// chunks on many threads.
+//
+
+#ifndef GILGAMESH_PNG_ENCODER_INCLUDED
+#define GILGAMESH_PNG_ENCODER_INCLUDED
+
+#include <gilgamesh/parallel.hpp>
+#include <andyzip/deflate_encoder.hpp>
+#include <andyzip/crc32.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+namespace gilgamesh {
+
+class png_encoder {
+public:
+  /// level is the deflate level, 1 (fastest) to 9 (smallest).
+  explicit png_encoder(int level = 1) : deflate_(level) {
+  }
+
+  /// Compress an RGBA image (four bytes a pixel, rows stride bytes apart), appending to dest.
+  /// The alpha channel is left out unless alpha is set.
+  void encode(std::vector<uint8_t> &dest, const uint8_t *rgba, int width, int height, int stride, bool alpha = false, unsigned num_threads = 1) const {
+    int channels = alpha ? 4 : 3;
+    size_t row_bytes = (size_t)width * channels + 1;
+    std::vector<uint8_t> filtered(row_bytes * height);
+    int strip_rows = 32;
+    parallel_for((height + strip_rows - 1) / strip_rows, num_threads, [&](int strip) {
+      std::vector<uint8_t> row(row_bytes - 1), prev(row_bytes - 1);
+      int y0 = strip * strip_rows, y1 = std::min(y0 + strip_rows, height);
+      if (y0) pixels(prev.data(), rgba + (size_t)(y0 - 1) * stride, width, channels);
+      for (int y = y0; y != y1; ++y) {
+        pixels(row.data(), rgba + (size_t)y * stride, width, channels);
+        filter(filtered.data() + row_bytes * y, row.data(), y ? prev.data() : nullptr, row_bytes - 1, channels);
+        row.swap(prev);
+      }
+    });
+
+    auto put32 = [&dest](uint32_t v) {
+      for (int shift = 24; shift >= 0; shift -= 8) dest.push_back((uint8_t)(v >> shift));
+    };
+    auto chunk = [&](const char *type, const uint8_t *begin, const uint8_t *end) {
+      put32((uint32_t)(end - begin));
+      size_t start = dest.size();
+      dest.insert(dest.end(), type, type + 4);
+      dest.insert(dest.end(), begin, end);
+      put32(andyzip::crc32(dest.data() + start, dest.data() + dest.size()));
+    };
+
+    static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    dest.insert(dest.end(), signature, signature + 8);
+
+    uint8_t header[13] = {
+      (uint8_t)(width >> 24), (uint8_t)(width >> 16), (uint8_t)(width >> 8), (uint8_t)width,
+      (uint8_t)(height >> 24), (uint8_t)(height >> 16), (uint8_t)(height >> 8), (uint8_t)height,
+      8, (uint8_t)(alpha ? 6 : 2), 0, 0, 0
+    };
+    chunk("IHDR", header, header + 13);
+
+    // A zlib stream: header, raw deflate and the Adler-32 of the filtered rows.
+    std::vector<uint8_t> zlib = { 0x78, 0x01 };
+    deflate_.encode(zlib, filtered.data(), filtered.data() + filtered.size(), num_threads);
+    uint32_t check = adler32(filtered.data(), filtered.data() + filtered.size());
+    for (int shift = 24; shift >= 0; shift -= 8) zlib.push_back((uint8_t)(check >> shift));
+    chunk("IDAT", zlib.data(), zlib.data() + zlib.size());
+
+    chunk("IEND", nullptr, nullptr);
+  }
+
+private:
+  static void pixels(uint8_t *dest, const uint8_t *rgba, int width, int channels) {
+    if (channels == 4) {
+      std::copy(rgba, rgba + width * 4, dest);
+    } else {
+      for (int x = 0; x != width; ++x) {
+        *dest++ = rgba[x * 4 + 0];
+        *dest++ = rgba[x * 4 + 1];
+        *dest++ = rgba[x * 4 + 2];
+      }
+    }
+  }
+
+  // Write the filter type and residuals of a row. prev is null for the first row.
+  static void filter(uint8_t *dest, const uint8_t *row, const uint8_t *prev, size_t size, int bpp) {
+    if (!prev) {
+      dest[0] = 1;
+      for (size_t i = 0; i != size; ++i) dest[i + 1] = (uint8_t)(row[i] - (i >= (size_t)bpp ? row[i - bpp] : 0));
+      return;
+    }
+
+    // Sum of the residuals as signed bytes, the usual guide to which filter compresses best.
+    unsigned best_cost = ~0u;
+    for (int type = 1; type <= 4; type += type == 2 ? 2 : 1) {
+      unsigned cost = 0;
+      for (size_t i = 0; i != size; ++i) cost += (unsigned)std::abs((int)(int8_t)residual(type, row, prev, i, bpp));
+      if (cost < best_cost) {
+        best_cost = cost;
+        dest[0] = (uint8_t)type;
+      }
+    }
+    for (size_t i = 0; i != size; ++i) dest[i + 1] = residual(dest[0], row, prev, i, bpp);
+  }
+
+  static uint8_t residual(int type, const uint8_t *row, const uint8_t *prev, size_t i, int bpp) {
+    int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+    int b = prev[i];
+    switch (type) {
+      case 1: return (uint8_t)(row[i] - a);
+      case 2: return (uint8_t)(row[i] - b);
+      default: {
+        int c = i >= (size_t)bpp ? prev[i - bpp] : 0;
+        int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        return (uint8_t)(row[i] - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c));
+      }
+    }
+  }
+
+  static uint32_t adler32(const uint8_t *begin, const uint8_t *end) {
+    uint32_t a = 1, b = 0;
+    while (begin != end) {
+      // 5552 bytes is the most that can be summed before b could overflow.
+      const uint8_t *stop = begin + std::min((size_t)(end - begin), (size_t)5552);
+      for (; begin != stop; ++begin) {
+        a += *begin;
+        b += a;
+      }
+      a %= 65521;
+      b %= 65521;
+    }
+    return b << 16 | a;
+  }
+
+  andyzip::deflate_encoder deflate_;
+};
+
+}
+
+#endif
@@ -0,0 +1,115 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: read only memory mapped files
+//
+// Mapping a file costs nothing up front; pages are read by the OS
+// the first time they are touched.
+//
+
+#ifndef GILGAMESH_MAPPED_FILE_INCLUDED
+#define GILGAMESH_MAPPED_FILE_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+#else
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+namespace gilgamesh {
+
+  class mapped_file {
+  public:
+    mapped_file() {
+    }
+
+    /// Map a whole file for reading. Use is_open() to check for success.
+    mapped_file(const std::string &path) {
+      #ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return;
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(file, &size) && size.QuadPart != 0) {
+          HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+          if (mapping) {
+            data_ = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (data_) size_ = (size_t)size.QuadPart;
+            CloseHandle(mapping);
+          }
+        }
+        CloseHandle(file);
+      #else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size != 0) {
+          void *addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+          if (addr != MAP_FAILED) {
+            data_ = (const uint8_t *)addr;
+            size_ = (size_t)st.st_size;
+          }
+        }
+        ::close(fd);
+      #endif
+    }
+
+    mapped_file(mapped_file &&rhs) : data_(rhs.data_), size_(rhs.size_) {
+      rhs.data_ = nullptr;
+      rhs.size_ = 0;
+    }
+
+    mapped_file &operator=(mapped_file &&rhs) {
+      if (this != &rhs) {
+        close();
+        data_ = rhs.data_;
+        size_ = rhs.size_;
+        rhs.data_ = nullptr;
+        rhs.size_ = 0;
+      }
+      return *this;
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    ~mapped_file() {
+      close();
+    }
+
+    /// Unmap the file.
+    void close() {
+      if (data_) {
+        #ifdef _WIN32
+          UnmapViewOfFile(data_);
+        #else
+          munmap((void *)data_, size_);
+        #endif
+      }
+      data_ = nullptr;
+      size_ = 0;
+    }
+
+    bool is_open() const { return data_ != nullptr; }
+    const uint8_t *data() const { return data_; }
+    const uint8_t *begin() const { return data_; }
+    const uint8_t *end() const { return data_ + size_; }
+    size_t size() const { return size_; }
+
+  private:
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+  };
+}
+
+#endif
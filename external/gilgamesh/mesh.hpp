@@ -9,6 +9,8 @@
 #define MESHUTILS_MESH_INCLUDED
 
 #include <glm/glm.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <gilgamesh/zone_tracer.hpp>
 #include <vector>
 #include <cstdint>
 #include <cstdio>
@@ -267,185 +269,74 @@ public:
 
   // Generate an implicit basic_mesh from a function (ie. marching cubes).
   // Vertices will be generated where the function changes sign.
+  // With num_threads > 1, slabs of z are meshed at the same time, so fn and vertex_generator
+  // must be safe to call from several threads. The mesh is the same for any number of threads.
   template<class Function, class Generator>
-  basic_mesh(int xdim, int ydim, int zdim, Function fn, Generator vertex_generator) {
-    // Now build the marching cubes triangles.
-
-    // This reproduced the vertex order of Paul Bourke's (borrowed) table.
-    // The indices in edge_indices have the following offsets.
-    //
-    //     7 6   y   z
-    // 3 2 4 5   | /
-    // 0 1       0 - x
-    //
-
-    // We store three indices per cube for the edges closest to vertex 0
-    // All other indices can be derived from adjacent cubes.
-    // This gives a single index offset value for each edge.
-    // There are twelve edges here because we consider adjacent cubes also.
-    int dx = 3;
-    int dy = xdim * 3;
-    int dz = xdim * ydim * 3;
-    int vdz = xdim * ydim;
-    int vertex_index = (int)vertices_.size();
-        
-    // Each cube owns three edges 0->1 0->3 0->4
-    // We need two slices of cube edges to make all the cubes in a slice.
-    std::vector<int> edge_indices(dz*2);
-
-    // We need three slices in values[]
-    std::vector<float> values(vdz * 3);
-    float *valm1 = values.data() + vdz * 2;
-    float *val0 = values.data() + vdz * 0;
-    float *val1 = values.data() + vdz * 1;
-    //int offm1 = vdz * 2, off0 = vdz * 0, off1 = vdz * 1;
-
-    // fill first slices of edges and values
-    for (int i = 0; i != dz; ++i) {
-      edge_indices[dz+i] = -1;
-    }
-
-    for (int j = 0; j != ydim; ++j) {
-      for (int i = 0; i != xdim; ++i) {
-        int idx = j * xdim + i;
-        val0[idx] = fn(i, j, 0);
-      }
-    }
-
-    // Build the vertices first. One for each edge that changes sign.
-    for (int k = 0; k != zdim; ++k) {
-      int odd = k & 1, even = 1 - odd;
-      for (int i = 0; i != dz; ++i) {
-        edge_indices[dz*odd+i] = -1;
-      }
-
-      if (k != zdim-1) {
-        for (int j = 0; j != ydim; ++j) {
-          for (int i = 0; i != xdim; ++i) {
-            int idx = j * xdim + i;
-            val1[idx] = fn(i, j, k+1);
+  basic_mesh(int xdim, int ydim, int zdim, Function fn, Generator vertex_generator, unsigned num_threads = 1) {
+    GILGAMESH_ZONE("basic_mesh::marching_cubes");
+    GILGAMESH_ZONE_ITEMS((uint64_t)xdim * ydim * zdim);
+    // Each slab owns the vertices on the edges starting in its planes and
+    // the cubes between them. The cubes between the last plane of one slab and
+    // the first plane of the next are made once both slabs are done.
+    int num_slabs = num_threads <= 1 ? 1 : std::max(1, std::min(zdim, (int)num_threads * 4));
+    std::vector<mc_slab> slabs(num_slabs);
+    parallel_for(num_slabs, num_threads, [&](int s) {
+      mc_slab &slab = slabs[s];
+      int k0 = (int)((int64_t)zdim * s / num_slabs);
+      int k1 = (int)((int64_t)zdim * (s + 1) / num_slabs);
+      int plane = xdim * ydim;
+
+      // values and edge indices of the previous, current and next planes.
+      std::vector<float> vm1(plane), v0(plane), v1(plane);
+      std::vector<int> em1(plane * 3), e0(plane * 3);
+      auto evaluate = [&](std::vector<float> &values, int k) {
+        for (int j = 0, idx = 0; j != ydim; ++j) {
+          for (int i = 0; i != xdim; ++i, ++idx) {
+            values[idx] = fn(i, j, k);
           }
         }
-      }
-
-      for (int j = 0; j != ydim; ++j) {
-        for (int i = 0; i != xdim; ++i) {
-          int idx = j * xdim + i;
-          float v0 = val0[idx];
-          float fi = (float)i;
-          float fj = (float)j;
-          float fk = (float)k;
-
-          // x edges
-          if (i != xdim-1) {
-            float v1 = val0[idx + 1];
-            if ((v0 < 0) != (v1 < 0)) {
-              float lambda = v0 / (v0 - v1);
-              if (lambda >= 0 && lambda <= 1) {
-                edge_indices[odd*dz + idx*3+0] = vertex_index++;
-                vertices_.push_back(vertex_generator(fi + lambda, fj, fk));
-              }
-            }
-          }
-
-          // y edges
-          if (j != ydim-1) {
-            float v1 = val0[idx + xdim];
-            if ((v0 < 0) != (v1 < 0)) {
-              float lambda = v0 / (v0 - v1);
-              if (lambda >= 0 && lambda <= 1) {
-                edge_indices[odd*dz + idx*3+1] = vertex_index++;
-                vertices_.push_back(vertex_generator(fi, fj + lambda, fk));
-              }
-            }
-          }
-
-          // z edges
-          if (k != zdim-1) {
-            float v1 = val1[idx];
-            if ((v0 < 0) != (v1 < 0)) {
-              float lambda = v0 / (v0 - v1);
-              if (lambda >= 0 && lambda <= 1) {
-                edge_indices[odd*dz + idx*3+2] = vertex_index++;
-                vertices_.push_back(vertex_generator(fi, fj, fk + lambda));
-              }
-            }
-          }
+      };
+
+      if (k0 != k1) evaluate(v0, k0);
+      for (int k = k0; k != k1; ++k) {
+        if (k != zdim-1) evaluate(v1, k+1);
+        mc_edges(xdim, ydim, zdim, k, v0.data(), v1.data(), e0.data(), slab.vertices, vertex_generator);
+        if (k == k0) {
+          slab.first_values = v0;
+          slab.first_edges = e0;
+        } else {
+          mc_cubes(xdim, ydim, vm1.data(), v0.data(), em1.data(), e0.data(), 0, 0, slab.indices);
         }
+        vm1.swap(v0);
+        v0.swap(v1);
+        em1.swap(e0);
       }
+      slab.last_values.swap(vm1);
+      slab.last_edges.swap(em1);
+    });
 
-      // Build the indices. Use the mc_triangles table to choose triangles depending on sign.
-      if (k != 0) {
-        int edge_offsets[16] = {
-          0 * dx + 0 * dy + even * dz + 0,  // 0,1, (this cube, x component)
-          1 * dx + 0 * dy + even * dz + 1,  // 1,2,
-          0 * dx + 1 * dy + even * dz + 0,  // 2,3,
-          0 * dx + 0 * dy + even * dz + 1,  // 3,0, (this cube, y component)
-          0 * dx + 0 * dy + odd  * dz + 0,  // 4,5,
-          1 * dx + 0 * dy + odd  * dz + 1,  // 5,6,
-          0 * dx + 1 * dy + odd  * dz + 0,  // 6,7,
-          0 * dx + 0 * dy + odd  * dz + 1,  // 7,4,
-          0 * dx + 0 * dy + even * dz + 2,  // 0,4, (this cube, z component)
-          1 * dx + 0 * dy + even * dz + 2,  // 1,5,
-          1 * dx + 1 * dy + even * dz + 2,  // 2,6,
-          0 * dx + 1 * dy + even * dz + 2,  // 3,7
-          0, 0, 0, 0
-        };
+    std::vector<int> base(num_slabs + 1);
+    for (int s = 0; s != num_slabs; ++s) {
+      base[s+1] = base[s] + (int)slabs[s].vertices.size();
+    }
 
-        for (int j = 0; j != ydim-1; ++j) {
-          for (int i = 0; i != xdim-1; ++i) {
-            // Mask of vertices outside the isosurface (values are negative)
-            // Example:
-            //   00000001 means only vertex 0 is outside the surface.
-            //   10000000 means only vertex 7 is outside the surface.
-            //   11111111 all vertices are outside the surface.
-            // todo: the mask can be built incrementally.
-            int idx = j * xdim + i;
-            float v000 = valm1[idx];
-            float v100 = valm1[idx + 1];
-            float v010 = valm1[idx + xdim];
-            float v110 = valm1[idx + xdim + 1];
-            float v001 = val0[idx];
-            float v101 = val0[idx + 1];
-            float v011 = val0[idx + xdim];
-            float v111 = val0[idx + xdim + 1];
-
-            int mask = (v011 < 0);
-            mask = mask * 2 + (v111 < 0);
-            mask = mask * 2 + (v101 < 0);
-            mask = mask * 2 + (v001 < 0);
-            mask = mask * 2 + (v010 < 0);
-            mask = mask * 2 + (v110 < 0);
-            mask = mask * 2 + (v100 < 0);
-            mask = mask * 2 + (v000 < 0);
-
-            uint64_t triangles = mc_triangles()[mask];
-            while ((triangles >> 60) != 0xc) {
-              // t0, t1, t2 choose one of twelve cube edges.
-              int t0 = triangles >> 60;
-              triangles <<= 4;
-              int t1 = triangles >> 60;
-              triangles <<= 4;
-              int t2 = triangles >> 60;
-              triangles <<= 4;
-              int i0 = edge_indices [idx*3 + edge_offsets [t0]];
-              int i1 = edge_indices [idx*3 + edge_offsets [t1]];
-              int i2 = edge_indices [idx*3 + edge_offsets [t2]];
-              if (i0 >= 0 && i1 >= 0 && i2 >= 0) {
-                indices_.push_back((index_t)i0);
-                indices_.push_back((index_t)i1);
-                indices_.push_back((index_t)i2);
-              }
-            }
-          }
-        }
+    parallel_for(num_slabs - 1, num_threads, [&](int s) {
+      mc_slab &slab = slabs[s];
+      mc_slab &next = slabs[s+1];
+      if (!slab.last_values.empty() && !next.first_values.empty()) {
+        mc_cubes(xdim, ydim, slab.last_values.data(), next.first_values.data(), slab.last_edges.data(), next.first_edges.data(), base[s], base[s+1], slab.border_indices);
       }
-
-      // rotate value offsets
-      float *t = val0;
-      val0 = val1;
-      val1 = valm1;
-      valm1 = t;
+    });
+
+    // Join the slabs, in the order a single slab would have made them.
+    vertices_.reserve(base[num_slabs]);
+    for (int s = 0; s != num_slabs; ++s) {
+      mc_slab &slab = slabs[s];
+      vertices_.insert(vertices_.end(), slab.vertices.begin(), slab.vertices.end());
+      for (auto i : slab.indices) {
+        indices_.push_back((index_t)(i + base[s]));
+      }
+      indices_.insert(indices_.end(), slab.border_indices.begin(), slab.border_indices.end());
     }
   }
 
@@ -536,6 +427,152 @@ private:
     }
   }
 
+  // Marching cubes state for one slab of z planes.
+  struct mc_slab {
+    std::vector<vertex_t> vertices;
+    std::vector<index_t> indices;
+    std::vector<index_t> border_indices;
+    std::vector<float> first_values;
+    std::vector<int> first_edges;
+    std::vector<float> last_values;
+    std::vector<int> last_edges;
+  };
+
+  // Make a vertex for each edge of plane k that changes sign.
+  // Each grid point owns three edges (+x, +y, +z) whose vertex numbers go in edges[] (-1 for none).
+  // v0 are the values of plane k and v1 those of plane k+1.
+  template<class Generator>
+  static void mc_edges(int xdim, int ydim, int zdim, int k, const float *v0, const float *v1, int *edges, std::vector<vertex_t> &vertices, Generator &vertex_generator) {
+    for (int j = 0, idx = 0; j != ydim; ++j) {
+      for (int i = 0; i != xdim; ++i, ++idx) {
+        float value = v0[idx];
+        float fi = (float)i;
+        float fj = (float)j;
+        float fk = (float)k;
+        int *e = edges + idx * 3;
+        e[0] = e[1] = e[2] = -1;
+
+        // x edges
+        if (i != xdim-1) {
+          float value1 = v0[idx + 1];
+          if ((value < 0) != (value1 < 0)) {
+            float lambda = value / (value - value1);
+            if (lambda >= 0 && lambda <= 1) {
+              e[0] = (int)vertices.size();
+              vertices.push_back(vertex_generator(fi + lambda, fj, fk));
+            }
+          }
+        }
+
+        // y edges
+        if (j != ydim-1) {
+          float value1 = v0[idx + xdim];
+          if ((value < 0) != (value1 < 0)) {
+            float lambda = value / (value - value1);
+            if (lambda >= 0 && lambda <= 1) {
+              e[1] = (int)vertices.size();
+              vertices.push_back(vertex_generator(fi, fj + lambda, fk));
+            }
+          }
+        }
+
+        // z edges
+        if (k != zdim-1) {
+          float value1 = v1[idx];
+          if ((value < 0) != (value1 < 0)) {
+            float lambda = value / (value - value1);
+            if (lambda >= 0 && lambda <= 1) {
+              e[2] = (int)vertices.size();
+              vertices.push_back(vertex_generator(fi, fj, fk + lambda));
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Make the triangles of the cubes between two planes. Use the mc_triangles table to choose triangles depending on sign.
+  // vlo, elo are the values and edges of the lower plane and vhi, ehi of the upper one.
+  // lo_base and hi_base are added to the vertex numbers of each plane.
+  static void mc_cubes(int xdim, int ydim, const float *vlo, const float *vhi, const int *elo, const int *ehi, int lo_base, int hi_base, std::vector<index_t> &indices) {
+    // This reproduces the vertex order of Paul Bourke's (borrowed) table.
+    // The cube corners are numbered:
+    //
+    //     7 6   y   z
+    // 3 2 4 5   | /
+    // 0 1       0 - x
+    //
+    // For each of the twelve cube edges, the grid point that owns it (x, y and upper plane)
+    // and which of its three edges it is.
+    static const uint8_t edge_owner[12][4] = {
+      {0, 0, 0, 0}, // 0,1, (this cube, x component)
+      {1, 0, 0, 1}, // 1,2,
+      {0, 1, 0, 0}, // 2,3,
+      {0, 0, 0, 1}, // 3,0, (this cube, y component)
+      {0, 0, 1, 0}, // 4,5,
+      {1, 0, 1, 1}, // 5,6,
+      {0, 1, 1, 0}, // 6,7,
+      {0, 0, 1, 1}, // 7,4,
+      {0, 0, 0, 2}, // 0,4, (this cube, z component)
+      {1, 0, 0, 2}, // 1,5,
+      {1, 1, 0, 2}, // 2,6,
+      {0, 1, 0, 2}, // 3,7
+    };
+
+    for (int j = 0; j != ydim-1; ++j) {
+      for (int i = 0; i != xdim-1; ++i) {
+        // Mask of vertices outside the isosurface (values are negative)
+        // Example:
+        //   00000001 means only vertex 0 is outside the surface.
+        //   10000000 means only vertex 7 is outside the surface.
+        //   11111111 all vertices are outside the surface.
+        int idx = j * xdim + i;
+        float v000 = vlo[idx];
+        float v100 = vlo[idx + 1];
+        float v010 = vlo[idx + xdim];
+        float v110 = vlo[idx + xdim + 1];
+        float v001 = vhi[idx];
+        float v101 = vhi[idx + 1];
+        float v011 = vhi[idx + xdim];
+        float v111 = vhi[idx + xdim + 1];
+
+        int mask = (v011 < 0);
+        mask = mask * 2 + (v111 < 0);
+        mask = mask * 2 + (v101 < 0);
+        mask = mask * 2 + (v001 < 0);
+        mask = mask * 2 + (v010 < 0);
+        mask = mask * 2 + (v110 < 0);
+        mask = mask * 2 + (v100 < 0);
+        mask = mask * 2 + (v000 < 0);
+
+        auto edge_index = [=](int t) {
+          const uint8_t *o = edge_owner[t];
+          int e = (o[2] ? ehi : elo)[(idx + o[1] * xdim + o[0]) * 3 + o[3]];
+          return e < 0 ? -1 : e + (o[2] ? hi_base : lo_base);
+        };
+
+        uint64_t triangles = mc_triangles()[mask];
+        while ((triangles >> 60) != 0xc) {
+          // t0, t1, t2 choose one of twelve cube edges.
+          int t0 = triangles >> 60;
+          triangles <<= 4;
+          int t1 = triangles >> 60;
+          triangles <<= 4;
+          int t2 = triangles >> 60;
+          triangles <<= 4;
+          int i0 = edge_index(t0);
+          int i1 = edge_index(t1);
+          int i2 = edge_index(t2);
+          if (i0 >= 0 && i1 >= 0 && i2 >= 0) {
+            indices.push_back((index_t)i0);
+            indices.push_back((index_t)i1);
+            indices.push_back((index_t)i2);
+          }
+        }
+      }
+    }
+  }
+
   static const uint64_t *mc_triangles() {
     // marching cubes edge lists
     // see http://paulbourke.net/geometry/polygonise/marchingsource.cpp for original.
@@ -0,0 +1,268 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: molecular surface class
+//
+// The solvent excluded surface is the inner face of a probe sphere (a water
+// molecule, say) rolled over the atoms. It follows the atoms where the probe
+// can touch them and bridges the crevices where it cannot.
+//
+// We find it with two sparse distance fields. The probe radius contour of the
+// distance from the atoms is the solvent accessible surface, the path of the
+// probe's centre. Inside that, the probe radius contour of the distance from
+// the accessible surface is the excluded surface.
+//
+// When some atoms move, update() measures again only the bricks they touch
+// and mesh_chunk() remeshes the chunks of surface around those bricks.
+//
+
+#ifndef GILGAMESH_MOLECULAR_SURFACE_INCLUDED
+#define GILGAMESH_MOLECULAR_SURFACE_INCLUDED
+
+#include <gilgamesh/sparse_distance_field.hpp>
+#include <gilgamesh/mesh.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+namespace gilgamesh {
+
+  class molecular_surface {
+  public:
+    molecular_surface() {
+    }
+
+    /// Find the solvent excluded surface of a set of spheres over an xdim x ydim x zdim grid.
+    /// The grid should reach beyond the spheres by at least probe_radius plus two grid spacings.
+    molecular_surface(int xdim, int ydim, int zdim, float grid_spacing, glm::vec3 min, const std::vector<glm::vec3> &points, const std::vector<float> &radii, float probe_radius, unsigned num_threads = 1) :
+      probe_radius_(probe_radius),
+      atoms_(xdim, ydim, zdim, grid_spacing, min, points, radii, probe_radius + grid_spacing * 2, num_threads)
+    {
+      // Sample the accessible surface where it crosses the grid edges.
+      const std::vector<sparse_distance_field::brick> &bricks = atoms_.bricks();
+      std::vector<std::vector<glm::vec3> > crossings(bricks.size());
+      parallel_for((int)bricks.size(), num_threads, [&](int b) {
+        accessible_crossings(bricks[b], crossings[b]);
+      });
+      std::vector<glm::vec3> accessible_points;
+      for (size_t b = 0; b != bricks.size(); ++b) {
+        std::vector<int> &ids = crossings_[key(bricks[b].origin >> sparse_distance_field::brick_shift)];
+        for (auto &p : crossings[b]) {
+          ids.push_back((int)accessible_points.size());
+          accessible_points.push_back(p);
+        }
+      }
+
+      accessible_ = sparse_distance_field(xdim, ydim, zdim, grid_spacing, min, accessible_points, std::vector<float>(1, 0.0f), probe_radius + grid_spacing * 2, num_threads);
+    }
+
+    /// Move some of the spheres and measure again the parts of the fields they affect.
+    /// Returns the brick coordinates of the bricks where value() may have changed.
+    std::vector<glm::ivec3> update(const std::vector<int> &pindices, const std::vector<glm::vec3> &points, unsigned num_threads = 1) {
+      for (size_t i = 0; i != pindices.size(); ++i) {
+        atoms_.move(pindices[i], points[i]);
+      }
+      std::vector<glm::ivec3> changed = atoms_.update(num_threads);
+
+      // The crossings on the edges starting in a brick depend on that brick and the ones above it.
+      std::vector<glm::ivec3> resample;
+      glm::ivec3 bdims = atoms_.brick_dims();
+      for (auto &b : changed) {
+        resample.push_back(b);
+        if (b.x) resample.push_back(b - glm::ivec3(1, 0, 0));
+        if (b.y) resample.push_back(b - glm::ivec3(0, 1, 0));
+        if (b.z) resample.push_back(b - glm::ivec3(0, 0, 1));
+      }
+      std::sort(resample.begin(), resample.end(), [bdims](glm::ivec3 a, glm::ivec3 b) { return key(a, bdims) < key(b, bdims); });
+      resample.erase(std::unique(resample.begin(), resample.end()), resample.end());
+
+      std::vector<std::vector<glm::vec3> > crossings(resample.size());
+      parallel_for((int)resample.size(), num_threads, [&](int i) {
+        glm::ivec3 origin = resample[i] << sparse_distance_field::brick_shift;
+        const sparse_distance_field::brick *br = atoms_.find(origin.x, origin.y, origin.z);
+        if (br) accessible_crossings(*br, crossings[i]);
+      });
+
+      // Replace the crossings that moved.
+      const std::vector<glm::vec3> &accessible_points = accessible_.points();
+      for (size_t i = 0; i != resample.size(); ++i) {
+        std::vector<int> &ids = crossings_[key(resample[i])];
+        bool same = ids.size() == crossings[i].size();
+        for (size_t j = 0; same && j != ids.size(); ++j) {
+          same = accessible_points[ids[j]] == crossings[i][j];
+        }
+        if (same) continue;
+
+        for (int id : ids) {
+          accessible_.remove(id);
+        }
+        ids.clear();
+        for (auto &p : crossings[i]) {
+          ids.push_back(accessible_.add(p, 0.0f));
+        }
+      }
+
+      std::vector<glm::ivec3> accessible_changed = accessible_.update(num_threads);
+      changed.insert(changed.end(), accessible_changed.begin(), accessible_changed.end());
+      std::sort(changed.begin(), changed.end(), [bdims](glm::ivec3 a, glm::ivec3 b) { return key(a, bdims) < key(b, bdims); });
+      changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+      return changed;
+    }
+
+    /// Roughly the distance from the excluded surface at a grid point; negative inside.
+    float value(int x, int y, int z) const {
+      float accessible = accessible_.distance(x, y, z);
+      return atoms_.distance(x, y, z) < probe_radius_ ? probe_radius_ - accessible : probe_radius_ + accessible;
+    }
+
+    /// Index of the sphere nearest to a grid point, or -1 if it is beyond the probe.
+    int pindex(int x, int y, int z) const {
+      return atoms_.pindex(x, y, z);
+    }
+
+    /// Mesh the surface with marching cubes.
+    /// Normals follow the gradient of value() and colour(pindex) gives the colour of each vertex
+    /// from its nearest sphere (pindex is -1 if there is none).
+    template <class Mesh, class ColourFn>
+    Mesh mesh(ColourFn colour, unsigned num_threads = 1) const {
+      glm::ivec3 dims = atoms_.dims();
+      auto fn = [this](int x, int y, int z) {
+        return value(x, y, z);
+      };
+      auto generator = [this, &colour](float x, float y, float z) {
+        return vertex<Mesh>(glm::vec3(x, y, z), colour);
+      };
+      return Mesh(dims.x, dims.y, dims.z, fn, generator, num_threads);
+    }
+
+    /// Cubes along each side of a chunk.
+    static const int chunk_dim = 32;
+
+    /// Number of chunks along each axis.
+    glm::ivec3 chunk_dims() const {
+      return (atoms_.dims() + (chunk_dim - 2)) / chunk_dim;
+    }
+
+    /// Mesh the cubes of one chunk as mesh() would.
+    /// Chunks do not share vertices, but the vertices on their common faces are the same.
+    template <class Mesh, class ColourFn>
+    Mesh mesh_chunk(glm::ivec3 chunk, ColourFn colour) const {
+      glm::ivec3 lo = chunk * chunk_dim;
+      glm::ivec3 dims = glm::min(atoms_.dims() - lo, glm::ivec3(chunk_dim + 1));
+      auto fn = [this, lo](int x, int y, int z) {
+        return value(lo.x + x, lo.y + y, lo.z + z);
+      };
+      auto generator = [this, lo, &colour](float x, float y, float z) {
+        return vertex<Mesh>(glm::vec3(lo) + glm::vec3(x, y, z), colour);
+      };
+      return Mesh(dims.x, dims.y, dims.z, fn, generator);
+    }
+
+    /// The chunks whose meshes change when value() changes in these bricks.
+    /// A vertex depends on the values up to one grid point beyond its edge.
+    std::vector<glm::ivec3> chunks_touching(const std::vector<glm::ivec3> &bricks) const {
+      glm::ivec3 cdims = chunk_dims();
+      std::vector<glm::ivec3> result;
+      for (auto &b : bricks) {
+        glm::ivec3 lo = glm::max((b * sparse_distance_field::brick_dim - 2) / chunk_dim, glm::ivec3(0));
+        glm::ivec3 hi = glm::min((b * sparse_distance_field::brick_dim + sparse_distance_field::brick_dim) / chunk_dim, cdims - 1);
+        for (int z = lo.z; z <= hi.z; ++z) {
+          for (int y = lo.y; y <= hi.y; ++y) {
+            for (int x = lo.x; x <= hi.x; ++x) {
+              result.push_back(glm::ivec3(x, y, z));
+            }
+          }
+        }
+      }
+      std::sort(result.begin(), result.end(), [cdims](glm::ivec3 a, glm::ivec3 b) { return key(a, cdims) < key(b, cdims); });
+      result.erase(std::unique(result.begin(), result.end()), result.end());
+      return result;
+    }
+
+    /// Distances from the spheres, kept up to the probe radius and a little more.
+    const sparse_distance_field &atom_field() const { return atoms_; }
+
+    /// Distances from the accessible surface.
+    const sparse_distance_field &accessible_field() const { return accessible_; }
+
+    /// Points on the accessible surface, including any removed by update().
+    const std::vector<glm::vec3> &accessible_points() const { return accessible_.points(); }
+
+    float probe_radius() const { return probe_radius_; }
+
+  private:
+    static size_t key(glm::ivec3 b, glm::ivec3 dims) {
+      return ((size_t)b.z * dims.y + b.y) * dims.x + b.x;
+    }
+
+    size_t key(glm::ivec3 b) const {
+      return key(b, atoms_.brick_dims());
+    }
+
+    // the vertex on a grid edge at grid coordinates xyz.
+    template <class Mesh, class ColourFn>
+    typename Mesh::vertex_t vertex(glm::vec3 xyz, ColourFn &colour) const {
+      // The vertex lies on the grid edge from p0 to p0 + step, a fraction t of the way along.
+      glm::ivec3 p0 = glm::ivec3(glm::floor(xyz));
+      glm::vec3 frac = xyz - glm::vec3(p0);
+      glm::ivec3 step = frac.x > 0 ? glm::ivec3(1, 0, 0) : frac.y > 0 ? glm::ivec3(0, 1, 0) : glm::ivec3(0, 0, 1);
+      float t = frac.x + frac.y + frac.z;
+      glm::ivec3 p1 = p0 + step;
+
+      glm::vec3 normal = glm::mix(gradient(p0), gradient(p1), t);
+      float length = glm::length(normal);
+      normal = length > 0 ? normal / length : glm::vec3(0, 0, 1);
+
+      int pindex = t < 0.5f ? atoms_.pindex(p0.x, p0.y, p0.z) : atoms_.pindex(p1.x, p1.y, p1.z);
+      if (pindex == -1) pindex = t < 0.5f ? atoms_.pindex(p1.x, p1.y, p1.z) : atoms_.pindex(p0.x, p0.y, p0.z);
+
+      glm::vec3 pos = atoms_.min() + xyz * atoms_.grid_spacing();
+      return typename Mesh::vertex_t(pos, normal, glm::vec2(0, 0), colour(pindex));
+    }
+
+    // central difference of value() at a grid point.
+    glm::vec3 gradient(glm::ivec3 p) const {
+      return glm::vec3(
+        value(p.x+1, p.y, p.z) - value(p.x-1, p.y, p.z),
+        value(p.x, p.y+1, p.z) - value(p.x, p.y-1, p.z),
+        value(p.x, p.y, p.z+1) - value(p.x, p.y, p.z-1)
+      );
+    }
+
+    // add the points where the grid edges starting in a brick cross the accessible surface.
+    void accessible_crossings(const sparse_distance_field::brick &br, std::vector<glm::vec3> &result) const {
+      static const glm::ivec3 steps[] = { glm::ivec3(1, 0, 0), glm::ivec3(0, 1, 0), glm::ivec3(0, 0, 1) };
+      glm::ivec3 dims = atoms_.dims();
+      float spacing = atoms_.grid_spacing();
+      for (int z = 0, index = 0; z != sparse_distance_field::brick_dim; ++z) {
+        for (int y = 0; y != sparse_distance_field::brick_dim; ++y) {
+          for (int x = 0; x != sparse_distance_field::brick_dim; ++x, ++index) {
+            glm::ivec3 p = br.origin + glm::ivec3(x, y, z);
+            if (p.x >= dims.x || p.y >= dims.y || p.z >= dims.z) continue;
+            float d0 = br.distances[index];
+            for (auto &step : steps) {
+              glm::ivec3 q = p + step;
+              if (q.x >= dims.x || q.y >= dims.y || q.z >= dims.z) continue;
+              float d1 = atoms_.distance(q.x, q.y, q.z);
+              if ((d0 < probe_radius_) != (d1 < probe_radius_)) {
+                float t = (probe_radius_ - d0) / (d1 - d0);
+                result.push_back(atoms_.position(p.x, p.y, p.z) + glm::vec3(step) * (t * spacing));
+              }
+            }
+          }
+        }
+      }
+    }
+
+    float probe_radius_ = 0;
+    sparse_distance_field atoms_;
+    sparse_distance_field accessible_;
+
+    // accessible_ spheres from the grid edges starting in each brick position of atoms_.
+    std::unordered_map<size_t, std::vector<int> > crossings_;
+  };
+}
+
+#endif
@@ -0,0 +1,59 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: simple parallel loops
+//
+// Many of the algorithms here (decoding, distance fields, meshing) split
+// naturally into independent tasks. This header runs them over std::thread
+// without any external dependencies.
+//
+
+#ifndef GILGAMESH_PARALLEL_INCLUDED
+#define GILGAMESH_PARALLEL_INCLUDED
+
+#include <thread>
+#include <atomic>
+#include <vector>
+
+namespace gilgamesh {
+
+  /// Number of threads the hardware can run at once (at least one).
+  inline unsigned hardware_threads() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+  }
+
+  /// Call fn(task) for each task in [0, num_tasks) using up to num_threads threads.
+  /// Tasks are handed out one at a time so that uneven tasks balance out.
+  /// The calling thread does its share of the work.
+  template <class Fn>
+  void parallel_for(int num_tasks, unsigned num_threads, Fn fn) {
+    if (num_threads <= 1 || num_tasks <= 1) {
+      for (int task = 0; task != num_tasks; ++task) {
+        fn(task);
+      }
+      return;
+    }
+
+    std::atomic<int> next_task(0);
+    auto worker = [&next_task, num_tasks, &fn]() {
+      for (;;) {
+        int task = next_task++;
+        if (task >= num_tasks) break;
+        fn(task);
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < num_threads && i < (unsigned)num_tasks; ++i) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) {
+      t.join();
+    }
+  }
+}
+
+#endif
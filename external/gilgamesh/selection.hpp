@@ -0,0 +1,466 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: atom selection expressions
+//
+// A small selection language in the style of PyMOL, eg.
+//
+//   chain A and resi 10-50 and name CA
+//   byres within 5 of resn HEM
+//   not (hetatm or water)
+//
+// An expression is compiled once into a plan, a list of steps in postfix
+// order, which can then be run against an atom store as often as needed.
+// Each step makes a compressed bitset. The name and element tests compare
+// the interned columns sixteen atoms at a time, residue and chain tests set
+// whole ranges and "within" searches an atom grid from whichever side of the
+// set is smaller.
+//
+
+#ifndef GILGAMESH_SELECTION_INCLUDED
+#define GILGAMESH_SELECTION_INCLUDED
+
+#include <gilgamesh/atom_store.hpp>
+#include <gilgamesh/atom_bitset.hpp>
+#include <gilgamesh/atom_grid.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cctype>
+#include <atomic>
+
+#if defined(__SSE2__) || defined(_M_X64)
+  #include <emmintrin.h>
+#endif
+
+namespace gilgamesh {
+
+  class selection {
+  public:
+    selection() {
+    }
+
+    /// Compile an expression. Throws std::runtime_error if it is not valid.
+    ///
+    /// Terms:    all, none, hetatm, water,
+    ///           chain A+B, resn ALA+GLY, name CA+CB, elem C+N,
+    ///           resi 10-50+60, index 0-99 (atom indices from zero)
+    /// Prefixes: not X, byres X, bychain X, within 5 of X
+    /// Infixes:  X and Y, X or Y, with and binding tighter than or.
+    /// Names are not case sensitive.
+    explicit selection(const std::string &text) : text_(text) {
+      std::vector<std::string> tokens = tokenise(text);
+      size_t pos = 0;
+      parse_or(tokens, pos);
+      if (pos != tokens.size()) error("unexpected '" + tokens[pos] + "'");
+    }
+
+    const std::string &text() const { return text_; }
+
+    /// True if evaluate() will need an atom grid.
+    bool uses_grid() const {
+      for (auto &s : plan_) {
+        if (s.op == opcode::within) return true;
+      }
+      return false;
+    }
+
+    /// Run the plan. The grid must index store.pos() and is only used by "within".
+    atom_bitset evaluate(const atom_store &store, const atom_grid &grid, unsigned num_threads = 1) const {
+      return evaluate(store, store.pos(), grid, num_threads);
+    }
+
+    /// Run the plan with "within" measuring between pos, such as the atoms' positions after they have moved.
+    /// The grid must index pos.
+    atom_bitset evaluate(const atom_store &store, const std::vector<glm::vec3> &pos, const atom_grid &grid, unsigned num_threads = 1) const {
+      std::vector<atom_bitset> stack;
+      size_t num_atoms = store.size();
+      for (auto &step : plan_) {
+        switch (step.op) {
+          case opcode::op_not: {
+            stack.back() = ~stack.back();
+          } break;
+          case opcode::op_and:
+          case opcode::op_or: {
+            atom_bitset rhs = std::move(stack.back());
+            stack.pop_back();
+            stack.back() = step.op == opcode::op_and ? stack.back() & rhs : stack.back() | rhs;
+          } break;
+          case opcode::byres:
+          case opcode::bychain: {
+            stack.back() = expand(store, stack.back(), step.op == opcode::bychain);
+          } break;
+          case opcode::within: {
+            stack.back() = within(pos, grid, stack.back(), step.distance, num_threads);
+          } break;
+          case opcode::all:
+          case opcode::none: {
+            stack.emplace_back(num_atoms, step.op == opcode::all);
+          } break;
+          default: {
+            stack.push_back(term(store, step, num_threads));
+          } break;
+        }
+      }
+      return stack.empty() ? atom_bitset(num_atoms, false) : std::move(stack.back());
+    }
+
+  private:
+    enum class opcode {
+      all, none, hetatm, water, chain, resn, name, elem, resi, index,
+      op_not, op_and, op_or, byres, bychain, within,
+    };
+
+    struct step {
+      opcode op;
+      float distance;
+      std::vector<std::string> names;
+      std::vector<std::pair<int, int> > ranges;
+    };
+
+    typedef std::vector<uint64_t> words_t;
+
+    static void error(const std::string &what) {
+      throw std::runtime_error("selection: " + what);
+    }
+
+    static std::string lower(std::string str) {
+      for (auto &c : str) c = (char)std::tolower((unsigned char)c);
+      return str;
+    }
+
+    static std::string upper(std::string str) {
+      for (auto &c : str) c = (char)std::toupper((unsigned char)c);
+      return str;
+    }
+
+    // Words are runs of anything but spaces and brackets.
+    static std::vector<std::string> tokenise(const std::string &text) {
+      std::vector<std::string> result;
+      for (size_t i = 0; i != text.size(); ) {
+        char c = text[i];
+        if (std::isspace((unsigned char)c)) {
+          ++i;
+        } else if (c == '(' || c == ')') {
+          result.push_back(std::string(1, c));
+          ++i;
+        } else {
+          size_t j = i;
+          while (j != text.size() && !std::isspace((unsigned char)text[j]) && text[j] != '(' && text[j] != ')') ++j;
+          result.push_back(text.substr(i, j - i));
+          i = j;
+        }
+      }
+      return result;
+    }
+
+    static bool is(const std::vector<std::string> &tokens, size_t pos, const char *word) {
+      return pos < tokens.size() && lower(tokens[pos]) == word;
+    }
+
+    void add(opcode op) {
+      step s{};
+      s.op = op;
+      plan_.push_back(s);
+    }
+
+    void parse_or(const std::vector<std::string> &tokens, size_t &pos) {
+      parse_and(tokens, pos);
+      while (is(tokens, pos, "or") || is(tokens, pos, "|")) {
+        parse_and(tokens, ++pos);
+        add(opcode::op_or);
+      }
+    }
+
+    void parse_and(const std::vector<std::string> &tokens, size_t &pos) {
+      parse_unary(tokens, pos);
+      while (is(tokens, pos, "and") || is(tokens, pos, "&")) {
+        parse_unary(tokens, ++pos);
+        add(opcode::op_and);
+      }
+    }
+
+    void parse_unary(const std::vector<std::string> &tokens, size_t &pos) {
+      if (pos == tokens.size()) error(tokens.empty() ? "empty expression" : "expression ends too soon");
+      std::string word = lower(tokens[pos++]);
+      if (word == "(") {
+        parse_or(tokens, pos);
+        if (!is(tokens, pos, ")")) error("missing ')'");
+        ++pos;
+      } else if (word == "not" || word == "!" || word == "byres" || word == "bychain") {
+        parse_unary(tokens, pos);
+        add(word == "byres" ? opcode::byres : word == "bychain" ? opcode::bychain : opcode::op_not);
+      } else if (word == "within") {
+        if (pos == tokens.size()) error("within needs a distance");
+        char *end = nullptr;
+        float distance = std::strtof(tokens[pos].c_str(), &end);
+        if (*end || !(distance >= 0)) error("bad distance '" + tokens[pos] + "'");
+        if (!is(tokens, ++pos, "of")) error("within needs 'of'");
+        parse_unary(tokens, ++pos);
+        add(opcode::within);
+        plan_.back().distance = distance;
+      } else if (word == "all" || word == "none" || word == "hetatm" || word == "water") {
+        add(word == "all" ? opcode::all : word == "none" ? opcode::none : word == "hetatm" ? opcode::hetatm : opcode::water);
+      } else if (word == "chain" || word == "resn" || word == "name" || word == "elem") {
+        if (pos == tokens.size() || tokens[pos] == "(" || tokens[pos] == ")") error(word + " needs a value");
+        add(word == "chain" ? opcode::chain : word == "resn" ? opcode::resn : word == "name" ? opcode::name : opcode::elem);
+        plan_.back().names = split(tokens[pos++]);
+      } else if (word == "resi" || word == "index") {
+        if (pos == tokens.size()) error(word + " needs a value");
+        add(word == "resi" ? opcode::resi : opcode::index);
+        plan_.back().ranges = parse_ranges(tokens[pos++]);
+      } else {
+        error("unknown word '" + tokens[pos - 1] + "'");
+      }
+    }
+
+    // "A+B+C"
+    static std::vector<std::string> split(const std::string &value) {
+      std::vector<std::string> result;
+      size_t b = 0;
+      for (size_t e; (e = value.find('+', b)) != std::string::npos; b = e + 1) {
+        result.push_back(value.substr(b, e - b));
+      }
+      result.push_back(value.substr(b));
+      return result;
+    }
+
+    // "10-50+60", where numbers may be negative as in "-5--1".
+    static std::vector<std::pair<int, int> > parse_ranges(const std::string &value) {
+      std::vector<std::pair<int, int> > result;
+      for (auto &part : split(value)) {
+        const char *p = part.c_str();
+        char *end = nullptr;
+        long first = std::strtol(p, &end, 10);
+        if (end == p) error("bad range '" + part + "'");
+        long last = first;
+        if (*end == '-') {
+          p = end + 1;
+          last = std::strtol(p, &end, 10);
+          if (end == p) error("bad range '" + part + "'");
+        }
+        if (*end) error("bad range '" + part + "'");
+        result.emplace_back((int)std::min(first, last), (int)std::max(first, last));
+      }
+      return result;
+    }
+
+    static void set_range(words_t &words, size_t b, size_t e) {
+      for (; b != e && (b & 63); ++b) words[b / 64] |= (uint64_t)1 << (b & 63);
+      for (; e - b >= 64; b += 64) words[b / 64] = ~(uint64_t)0;
+      for (; b != e; ++b) words[b / 64] |= (uint64_t)1 << (b & 63);
+    }
+
+    static bool any_in_range(const words_t &words, size_t b, size_t e) {
+      for (; b != e; ++b) {
+        if (!(b & 63) && e - b >= 64) {
+          if (words[b / 64]) return true;
+          b += 63;
+        } else if (words[b / 64] >> (b & 63) & 1) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    static bool in_ranges(const std::vector<std::pair<int, int> > &ranges, int value) {
+      for (auto &r : ranges) {
+        if (value >= r.first && value <= r.second) return true;
+      }
+      return false;
+    }
+
+    // The indices of the entries of a table of packed names that match any of names.
+    template <class Name>
+    static std::vector<Name> find_names(const std::vector<std::string> &names, const std::vector<uint32_t> &table) {
+      std::vector<Name> result;
+      for (size_t i = 0; i != table.size(); ++i) {
+        std::string name = upper(pdb_decoder::nameString(table[i]));
+        for (auto &n : names) {
+          if (upper(n) == name) {
+            result.push_back((Name)i);
+            break;
+          }
+        }
+      }
+      return result;
+    }
+
+    // Set the bits of the atoms whose interned name is one of keys, 64 atoms per word.
+    template <class Name>
+    static words_t match(const std::vector<Name> &column, const std::vector<Name> &keys, unsigned num_threads) {
+      size_t n = column.size();
+      words_t words((n + 63) / 64);
+      if (keys.empty()) return words;
+      static const int words_per_task = 1024;
+      int num_tasks = (int)((words.size() + words_per_task - 1) / words_per_task);
+      parallel_for(num_tasks, num_threads, [&](int task) {
+        size_t wend = std::min(words.size(), (size_t)(task + 1) * words_per_task);
+        for (size_t w = (size_t)task * words_per_task; w != wend; ++w) {
+          size_t b = w * 64;
+          if (b + 64 <= n) {
+            words[w] = match64(column.data() + b, keys);
+          } else {
+            for (size_t i = b; i != n; ++i) {
+              if (std::find(keys.begin(), keys.end(), column[i]) != keys.end()) words[w] |= (uint64_t)1 << (i - b);
+            }
+          }
+        }
+      });
+      return words;
+    }
+
+    #if defined(__SSE2__) || defined(_M_X64)
+      static uint64_t match64(const uint16_t *src, const std::vector<uint16_t> &keys) {
+        uint64_t result = 0;
+        for (int i = 0; i != 64; i += 16) {
+          __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+          __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+          __m128i ea = _mm_setzero_si128(), eb = _mm_setzero_si128();
+          for (uint16_t k : keys) {
+            __m128i vk = _mm_set1_epi16((short)k);
+            ea = _mm_or_si128(ea, _mm_cmpeq_epi16(a, vk));
+            eb = _mm_or_si128(eb, _mm_cmpeq_epi16(b, vk));
+          }
+          result |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_packs_epi16(ea, eb)) << i;
+        }
+        return result;
+      }
+
+      static uint64_t match64(const uint8_t *src, const std::vector<uint8_t> &keys) {
+        uint64_t result = 0;
+        for (int i = 0; i != 64; i += 16) {
+          __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+          __m128i ea = _mm_setzero_si128();
+          for (uint8_t k : keys) {
+            ea = _mm_or_si128(ea, _mm_cmpeq_epi8(a, _mm_set1_epi8((char)k)));
+          }
+          result |= (uint64_t)(uint32_t)_mm_movemask_epi8(ea) << i;
+        }
+        return result;
+      }
+    #else
+      template <class Name>
+      static uint64_t match64(const Name *src, const std::vector<Name> &keys) {
+        uint64_t result = 0;
+        for (int i = 0; i != 64; ++i) {
+          if (std::find(keys.begin(), keys.end(), src[i]) != keys.end()) result |= (uint64_t)1 << i;
+        }
+        return result;
+      }
+    #endif
+
+    // The atoms selected by one of the terms.
+    static atom_bitset term(const atom_store &store, const step &s, unsigned num_threads) {
+      size_t num_atoms = store.size();
+      if (s.op == opcode::name) {
+        return atom_bitset(match(store.atom_names(), find_names<uint16_t>(s.names, store.name_table()), num_threads), num_atoms);
+      } else if (s.op == opcode::elem) {
+        const std::vector<uint16_t> &elements = store.element_table();
+        return atom_bitset(match(store.elements(), find_names<uint8_t>(s.names, std::vector<uint32_t>(elements.begin(), elements.end())), num_threads), num_atoms);
+      }
+
+      words_t words((num_atoms + 63) / 64);
+      if (s.op == opcode::index) {
+        for (auto &r : s.ranges) {
+          size_t b = (size_t)std::max(r.first, 0);
+          size_t e = (size_t)std::max(r.second + 1, 0);
+          if (b < num_atoms) set_range(words, b, std::min(e, num_atoms));
+        }
+      } else if (s.op == opcode::chain) {
+        for (int c = 0; c != (int)store.num_chains(); ++c) {
+          for (auto &n : s.names) {
+            if (n.size() == 1 && n[0] == store.chain_id(c)) {
+              atom_store::range atoms = store.chain_atoms(c);
+              set_range(words, atoms.begin, atoms.end);
+              break;
+            }
+          }
+        }
+      } else {
+        std::vector<uint16_t> keys;
+        if (s.op == opcode::resn) keys = find_names<uint16_t>(s.names, store.name_table());
+        const std::vector<uint16_t> &residue_names = store.residue_names();
+        for (int r = 0; r != (int)store.num_residues(); ++r) {
+          bool hit = false;
+          switch (s.op) {
+            case opcode::hetatm: hit = store.is_hetatom(r); break;
+            case opcode::water: hit = pdb_decoder::atom::isWater(store.residue_id(r)); break;
+            case opcode::resn: hit = std::find(keys.begin(), keys.end(), residue_names[r]) != keys.end(); break;
+            case opcode::resi: hit = in_ranges(s.ranges, store.res_seq(r)); break;
+            default: break;
+          }
+          if (hit) {
+            atom_store::range atoms = store.residue_atoms(r);
+            set_range(words, atoms.begin, atoms.end);
+          }
+        }
+      }
+      return atom_bitset(words, num_atoms);
+    }
+
+    // Whole residues or chains with any atom in the set.
+    static atom_bitset expand(const atom_store &store, const atom_bitset &set, bool chains) {
+      if (!set.count()) return set;
+      words_t in = set.words();
+      words_t out(in.size());
+      int num = (int)(chains ? store.num_chains() : store.num_residues());
+      for (int i = 0; i != num; ++i) {
+        atom_store::range atoms = chains ? store.chain_atoms(i) : store.residue_atoms(i);
+        if (any_in_range(in, atoms.begin, atoms.end)) set_range(out, atoms.begin, atoms.end);
+      }
+      return atom_bitset(out, set.size());
+    }
+
+    // Atoms no further than distance from any atom of the set.
+    // If the set is small, mark the atoms near each atom of the set.
+    // Otherwise look for an atom of the set near each atom outside it, stopping at the first.
+    static atom_bitset within(const std::vector<glm::vec3> &pos, const atom_grid &grid, const atom_bitset &set, float distance, unsigned num_threads) {
+      if (grid.order().size() != set.size() || pos.size() != set.size()) error("the grid does not match the atoms");
+      size_t count = set.count();
+      if (count == 0 || count == set.size()) return set;
+
+      words_t in = set.words();
+      static const int words_per_task = 256;
+      int num_tasks = (int)((in.size() + words_per_task - 1) / words_per_task);
+
+      if (count <= set.size() / 2) {
+        std::vector<std::atomic<uint64_t> > out(in.size());
+        parallel_for(num_tasks, num_threads, [&](int task) {
+          size_t wend = std::min(in.size(), (size_t)(task + 1) * words_per_task);
+          for (size_t w = (size_t)task * words_per_task; w != wend; ++w) {
+            for (uint64_t bits = in[w]; bits; bits &= bits - 1) {
+              grid.for_each_near(pos[w * 64 + atom_bitset::lowest_bit(bits)], distance, [&out](int i) {
+                out[i / 64].fetch_or((uint64_t)1 << (i & 63), std::memory_order_relaxed);
+              });
+            }
+          }
+        });
+        words_t result(in.size());
+        for (size_t w = 0; w != in.size(); ++w) result[w] = out[w].load(std::memory_order_relaxed);
+        return atom_bitset(result, set.size());
+      } else {
+        words_t result = in;
+        auto in_set = [&in](int i) { return (in[i / 64] >> (i & 63) & 1) != 0; };
+        parallel_for(num_tasks, num_threads, [&](int task) {
+          size_t wend = std::min(in.size(), (size_t)(task + 1) * words_per_task);
+          for (size_t w = (size_t)task * words_per_task; w != wend; ++w) {
+            size_t end = std::min(w * 64 + 64, set.size());
+            for (size_t i = w * 64; i != end; ++i) {
+              if (!in_set((int)i) && grid.any_near(pos[i], distance, in_set)) result[w] |= (uint64_t)1 << (i & 63);
+            }
+          }
+        });
+        return atom_bitset(result, set.size());
+      }
+    }
+
+    std::string text_;
+    std::vector<step> plan_;
+  };
+}
+
+#endif
@@ -0,0 +1,321 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: sparse distance field class
+//
+// Like distance_field, but only the grid points within a band around the
+// spheres are stored, in bricks of 8x8x8. A table with one entry per brick
+// position finds the brick holding a grid point, so a field over a large
+// hollow or elongated complex takes memory in proportion to its surface
+// rather than its bounding box.
+//
+// Each brick position keeps the spheres that can reach it, so when spheres
+// are moved, added or removed only the bricks they touch are measured again.
+//
+
+#ifndef GILGAMESH_SPARSE_DISTANCE_FIELD_INCLUDED
+#define GILGAMESH_SPARSE_DISTANCE_FIELD_INCLUDED
+
+#include <glm/glm.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+namespace gilgamesh {
+
+  class sparse_distance_field {
+  public:
+    static const int brick_shift = 3;
+    static const int brick_dim = 1 << brick_shift;
+    static const int brick_size = brick_dim * brick_dim * brick_dim;
+
+    /// 8x8x8 grid points, x fastest.
+    struct brick {
+      /// Grid coordinates of the first grid point.
+      glm::ivec3 origin;
+
+      /// Distance to the nearest sphere, or band() if it is further than that.
+      float distances[brick_size];
+
+      /// Index of the nearest sphere, or -1 if it is further than band().
+      int pindices[brick_size];
+    };
+
+    sparse_distance_field() {
+    }
+
+    /// Construct a sparse distance field over an xdim x ydim x zdim grid from a set of spheres.
+    /// Only bricks with a grid point within band of a sphere are kept.
+    /// If radii has one element, it is used for all the points.
+    sparse_distance_field(int xdim, int ydim, int zdim, float grid_spacing, glm::vec3 min, const std::vector<glm::vec3> &points, const std::vector<float> &radii, float band, unsigned num_threads = 1) :
+      xdim_(xdim), ydim_(ydim), zdim_(zdim), grid_spacing_(grid_spacing), min_(min), band_(band), points_(points)
+    {
+      bxdim_ = (xdim + brick_dim - 1) >> brick_shift;
+      bydim_ = (ydim + brick_dim - 1) >> brick_shift;
+      bzdim_ = (zdim + brick_dim - 1) >> brick_shift;
+      brick_table_.assign((size_t)bxdim_ * bydim_ * bzdim_, -1);
+
+      int rmask = radii.size() == 1 ? 0 : -1;
+      int num_points = (int)points.size();
+      radii_.resize(num_points);
+      for (int pindex = 0; pindex != num_points; ++pindex) {
+        radii_[pindex] = radii[pindex & rmask];
+      }
+
+      // List the spheres touching each brick position in point order, so that ties go the same way as in distance_field.
+      std::vector<int> brick_position;
+      for (int pindex = 0; pindex != num_points; ++pindex) {
+        for_each_brick_of(pindex, [&](int b) {
+          std::vector<int> &c = candidates_[b];
+          if (c.empty()) brick_position.push_back(b);
+          c.push_back(pindex);
+        });
+      }
+      std::sort(brick_position.begin(), brick_position.end());
+
+      // Measure every grid point of each brick against its spheres.
+      int num_bricks = (int)brick_position.size();
+      std::vector<brick> bricks(num_bricks);
+      std::vector<char> keep(num_bricks);
+      parallel_for(num_bricks, num_threads, [&](int i) {
+        keep[i] = measure(bricks[i], brick_position[i]);
+      });
+
+      // Drop bricks whose corners were touched but none of whose grid points are in the band.
+      int num_kept = 0;
+      for (int i = 0; i != num_bricks; ++i) {
+        if (keep[i]) {
+          if (num_kept != i) bricks[num_kept] = bricks[i];
+          brick_table_[brick_position[i]] = num_kept++;
+        }
+      }
+      bricks.resize(num_kept);
+      bricks_.swap(bricks);
+    }
+
+    /// Move sphere pindex to a new point. The bricks are brought up to date by update().
+    void move(int pindex, glm::vec3 point) {
+      touch(pindex, false);
+      points_[pindex] = point;
+      touch(pindex, true);
+    }
+
+    /// Add a sphere and return its index. The indices of removed spheres are reused.
+    int add(glm::vec3 point, float radius) {
+      int pindex = (int)points_.size();
+      if (free_.empty()) {
+        points_.push_back(point);
+        radii_.push_back(radius);
+      } else {
+        pindex = free_.back();
+        free_.pop_back();
+        points_[pindex] = point;
+        radii_[pindex] = radius;
+      }
+      touch(pindex, true);
+      return pindex;
+    }
+
+    /// Remove sphere pindex.
+    void remove(int pindex) {
+      touch(pindex, false);
+      free_.push_back(pindex);
+    }
+
+    /// Measure again the bricks touched by spheres moved, added or removed since the last update,
+    /// adding and dropping bricks as needed. The work is in proportion to the spheres that changed.
+    /// Returns the brick coordinates (grid coordinates >> brick_shift) of the bricks measured.
+    std::vector<glm::ivec3> update(unsigned num_threads = 1) {
+      std::sort(dirty_.begin(), dirty_.end());
+      dirty_.erase(std::unique(dirty_.begin(), dirty_.end()), dirty_.end());
+
+      int num_dirty = (int)dirty_.size();
+      std::vector<brick> bricks(num_dirty);
+      std::vector<char> keep(num_dirty);
+      parallel_for(num_dirty, num_threads, [&](int i) {
+        keep[i] = measure(bricks[i], dirty_[i]);
+      });
+
+      // Replace the bricks in the table, moving the last brick into any hole.
+      std::vector<glm::ivec3> result(num_dirty);
+      for (int i = 0; i != num_dirty; ++i) {
+        int b = dirty_[i];
+        int &index = brick_table_[b];
+        if (keep[i]) {
+          if (index == -1) {
+            index = (int)bricks_.size();
+            bricks_.push_back(bricks[i]);
+          } else {
+            bricks_[index] = bricks[i];
+          }
+        } else if (index != -1) {
+          const brick &last = bricks_.back();
+          brick_table_[table_index(last.origin >> brick_shift)] = index;
+          bricks_[index] = last;
+          bricks_.pop_back();
+          index = -1;
+        }
+        result[i] = bricks[i].origin >> brick_shift;
+      }
+      dirty_.clear();
+      return result;
+    }
+
+    /// Distance to the nearest sphere at a grid point, or band() if it is further than that or outside the grid.
+    float distance(int x, int y, int z) const {
+      const brick *br = find(x, y, z);
+      return br ? br->distances[offset(x, y, z)] : band_;
+    }
+
+    /// Index of the nearest sphere at a grid point, or -1 if it is further than band() or outside the grid.
+    int pindex(int x, int y, int z) const {
+      const brick *br = find(x, y, z);
+      return br ? br->pindices[offset(x, y, z)] : -1;
+    }
+
+    /// The brick holding grid point (x, y, z) or nullptr.
+    const brick *find(int x, int y, int z) const {
+      if ((unsigned)x >= (unsigned)xdim_ || (unsigned)y >= (unsigned)ydim_ || (unsigned)z >= (unsigned)zdim_) return nullptr;
+      int b = brick_table_[((size_t)(z >> brick_shift) * bydim_ + (y >> brick_shift)) * bxdim_ + (x >> brick_shift)];
+      return b == -1 ? nullptr : &bricks_[b];
+    }
+
+    /// The bricks, in brick table order (z slowest) until the first update().
+    /// Grid points of a brick outside the grid are left at band() and -1.
+    const std::vector<brick> &bricks() const { return bricks_; }
+
+    /// Position of a grid point.
+    glm::vec3 position(int x, int y, int z) const { return min_ + glm::vec3(x, y, z) * grid_spacing_; }
+
+    glm::ivec3 dims() const { return glm::ivec3(xdim_, ydim_, zdim_); }
+    glm::ivec3 brick_dims() const { return glm::ivec3(bxdim_, bydim_, bzdim_); }
+    float grid_spacing() const { return grid_spacing_; }
+    glm::vec3 min() const { return min_; }
+    float band() const { return band_; }
+
+    /// The spheres, including any removed ones.
+    const std::vector<glm::vec3> &points() const { return points_; }
+    const std::vector<float> &radii() const { return radii_; }
+
+    /// Bytes used by the bricks and the table.
+    size_t memory_used() const {
+      return bricks_.size() * sizeof(brick) + brick_table_.size() * sizeof(int);
+    }
+
+  private:
+    static int offset(int x, int y, int z) {
+      const int mask = brick_dim - 1;
+      return ((((z & mask) << brick_shift) + (y & mask)) << brick_shift) + (x & mask);
+    }
+
+    size_t table_index(glm::ivec3 b) const {
+      return ((size_t)b.z * bydim_ + b.y) * bxdim_ + b.x;
+    }
+
+    // grid points a sphere can reach, clipped to the grid.
+    void box(int pindex, glm::ivec3 &lo, glm::ivec3 &hi) const {
+      float reach = radii_[pindex] + band_;
+      glm::vec3 a = (points_[pindex] - reach - min_) * (1.0f / grid_spacing_);
+      glm::vec3 b = (points_[pindex] + reach - min_) * (1.0f / grid_spacing_);
+      lo = glm::max(glm::ivec3(glm::ceil(a)), glm::ivec3(0));
+      hi = glm::min(glm::ivec3(glm::floor(b)), glm::ivec3(xdim_-1, ydim_-1, zdim_-1));
+    }
+
+    // call fn(brick table index) for each brick position in a sphere's grid box.
+    template <class Fn>
+    void for_each_brick_of(int pindex, Fn fn) const {
+      glm::ivec3 lo, hi;
+      box(pindex, lo, hi);
+      if (hi.x < lo.x || hi.y < lo.y || hi.z < lo.z) return;
+      glm::ivec3 l = lo >> brick_shift;
+      glm::ivec3 h = hi >> brick_shift;
+      for (int z = l.z; z <= h.z; ++z) {
+        for (int y = l.y; y <= h.y; ++y) {
+          for (int x = l.x; x <= h.x; ++x) {
+            fn((int)table_index(glm::ivec3(x, y, z)));
+          }
+        }
+      }
+    }
+
+    // add a sphere to, or take it from, the candidates of the brick positions it touches and mark them for update.
+    void touch(int pindex, bool add) {
+      for_each_brick_of(pindex, [&](int b) {
+        std::vector<int> &c = candidates_[b];
+        auto i = std::lower_bound(c.begin(), c.end(), pindex);
+        if (add) {
+          c.insert(i, pindex);
+        } else if (i != c.end() && *i == pindex) {
+          c.erase(i);
+          if (c.empty()) candidates_.erase(b);
+        }
+        dirty_.push_back(b);
+      });
+    }
+
+    // measure the grid points of brick position b against its candidates. False if none are in the band.
+    bool measure(brick &br, int b) const {
+      br.origin = glm::ivec3(b % bxdim_, b / bxdim_ % bydim_, b / bxdim_ / bydim_) * brick_dim;
+      std::fill(std::begin(br.distances), std::end(br.distances), band_);
+      std::fill(std::begin(br.pindices), std::end(br.pindices), -1);
+      auto c = candidates_.find(b);
+      if (c == candidates_.end()) return false;
+      for (int pindex : c->second) {
+        glm::ivec3 lo, hi;
+        box(pindex, lo, hi);
+        splat(br, lo, hi, points_[pindex], radii_[pindex], pindex);
+      }
+      return std::any_of(std::begin(br.pindices), std::end(br.pindices), [](int p) { return p != -1; });
+    }
+
+    // lower the distances of the grid points of br within the box [lo, hi] that are nearer to this sphere.
+    void splat(brick &br, glm::ivec3 lo, glm::ivec3 hi, glm::vec3 point, float radius, int pindex) const {
+      glm::ivec3 l = glm::max(lo, br.origin);
+      glm::ivec3 h = glm::min(hi, br.origin + (brick_dim - 1));
+      for (int z = l.z; z <= h.z; ++z) {
+        for (int y = l.y; y <= h.y; ++y) {
+          int index = offset(l.x, y, z);
+          for (int x = l.x; x <= h.x; ++x, ++index) {
+            float d = glm::length(point - position(x, y, z)) - radius;
+            if (d < br.distances[index]) {
+              br.distances[index] = d;
+              br.pindices[index] = pindex;
+            }
+          }
+        }
+      }
+    }
+
+    int xdim_ = 0;
+    int ydim_ = 0;
+    int zdim_ = 0;
+    int bxdim_ = 0;
+    int bydim_ = 0;
+    int bzdim_ = 0;
+    float grid_spacing_ = 1;
+    glm::vec3 min_;
+    float band_ = 0;
+
+    // brick index for each brick position, or -1.
+    std::vector<int> brick_table_;
+    std::vector<brick> bricks_;
+
+    std::vector<glm::vec3> points_;
+    std::vector<float> radii_;
+
+    // spheres whose grid box touches each brick position, in point order.
+    std::unordered_map<int, std::vector<int> > candidates_;
+
+    // indices of removed spheres.
+    std::vector<int> free_;
+
+    // brick positions touched since the last update.
+    std::vector<int> dirty_;
+  };
+}
+
+#endif
@@ -0,0 +1,155 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: space-filling curve orders
+//
+// Points sorted along a Morton (Z order) or Hilbert curve are near their
+// neighbours in memory as well as in space, so loops that visit the points
+// near a place touch fewer cache lines.
+//
+// spatial_order keeps the permutation both ways so that arrays can be put
+// in curve order and indices into them mapped back to the original order.
+//
+
+#ifndef GILGAMESH_SPATIAL_ORDER_INCLUDED
+#define GILGAMESH_SPATIAL_ORDER_INCLUDED
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+namespace gilgamesh {
+
+  /// Put two zeros between each of the low ten bits of v (clamped to [0, 1023]).
+  inline uint32_t morton_spread(int v) {
+    uint32_t x = (uint32_t)std::min(std::max(v, 0), 1023);
+    x = (x | x << 16) & 0x030000ff;
+    x = (x | x << 8) & 0x0300f00f;
+    x = (x | x << 4) & 0x030c30c3;
+    x = (x | x << 2) & 0x09249249;
+    return x;
+  }
+
+  /// 30 bit Morton code of a point on a 1024^3 grid.
+  inline uint32_t morton_code(glm::ivec3 q) {
+    return morton_spread(q.x) | morton_spread(q.y) << 1 | morton_spread(q.z) << 2;
+  }
+
+  /// 30 bit Hilbert code of a point on a 1024^3 grid
+  /// (Skilling, "Programming the Hilbert curve", 2004).
+  inline uint32_t hilbert_code(glm::ivec3 q) {
+    uint32_t x[3] = {
+      (uint32_t)std::min(std::max(q.x, 0), 1023),
+      (uint32_t)std::min(std::max(q.y, 0), 1023),
+      (uint32_t)std::min(std::max(q.z, 0), 1023),
+    };
+
+    // Axes to transposed Hilbert index.
+    for (uint32_t bit = 1 << 9; bit > 1; bit >>= 1) {
+      uint32_t mask = bit - 1;
+      for (int i = 0; i != 3; ++i) {
+        if (x[i] & bit) {
+          x[0] ^= mask;
+        } else {
+          uint32_t t = (x[0] ^ x[i]) & mask;
+          x[0] ^= t;
+          x[i] ^= t;
+        }
+      }
+    }
+    x[1] ^= x[0];
+    x[2] ^= x[1];
+    uint32_t t = 0;
+    for (uint32_t bit = 1 << 9; bit > 1; bit >>= 1) {
+      if (x[2] & bit) t ^= bit - 1;
+    }
+    for (int i = 0; i != 3; ++i) x[i] ^= t;
+
+    // Interleave the transposed bits, most significant first.
+    uint32_t code = 0;
+    for (int b = 9; b >= 0; --b) {
+      for (int i = 0; i != 3; ++i) code = code << 1 | (x[i] >> b & 1);
+    }
+    return code;
+  }
+
+  class spatial_order {
+  public:
+    enum class curve { morton, hilbert };
+
+    spatial_order() {
+    }
+
+    /// Sort points along a curve. If group_start is given, points [group_start[g], group_start[g+1])
+    /// are sorted among themselves and the groups (eg. chains) stay in order.
+    explicit spatial_order(const std::vector<glm::vec3> &points, curve kind = curve::hilbert, const std::vector<int> &group_start = std::vector<int>()) {
+      int n = (int)points.size();
+      glm::vec3 min(1e38f), max(-1e38f);
+      for (auto &p : points) {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+      }
+      glm::vec3 scale = 1023.0f / glm::max(glm::vec3(glm::max(max.x - min.x, glm::max(max.y - min.y, max.z - min.z))), glm::vec3(1e-6f));
+
+      std::vector<uint32_t> code(n), sorted_code(n);
+      for (int i = 0; i != n; ++i) {
+        glm::ivec3 q = glm::ivec3((points[i] - min) * scale);
+        code[i] = kind == curve::hilbert ? hilbert_code(q) : morton_code(q);
+      }
+
+      // Three ten bit radix passes, then a stable pass by group.
+      order_.resize(n);
+      for (int i = 0; i != n; ++i) order_[i] = i;
+      std::vector<int> sorted(n);
+      for (int shift = 0; shift != 30; shift += 10) {
+        std::vector<int> start(1025);
+        for (int i = 0; i != n; ++i) start[(code[i] >> shift & 1023) + 1]++;
+        for (int d = 0; d != 1024; ++d) start[d + 1] += start[d];
+        for (int i = 0; i != n; ++i) {
+          int s = start[code[i] >> shift & 1023]++;
+          sorted_code[s] = code[i];
+          sorted[s] = order_[i];
+        }
+        code.swap(sorted_code);
+        order_.swap(sorted);
+      }
+      if (group_start.size() > 2) {
+        std::vector<int> fill(group_start.begin(), group_start.end() - 1);
+        for (int i = 0; i != n; ++i) {
+          int g = (int)(std::upper_bound(group_start.begin(), group_start.end(), order_[i]) - group_start.begin()) - 1;
+          sorted[fill[g]++] = order_[i];
+        }
+        order_.swap(sorted);
+      }
+
+      rank_.resize(n);
+      for (int i = 0; i != n; ++i) rank_[order_[i]] = i;
+    }
+
+    /// Original index of the point at position i in curve order.
+    int original(int i) const { return order_[i]; }
+
+    /// Position in curve order of original point i.
+    int rank(int i) const { return rank_[i]; }
+
+    const std::vector<int> &order() const { return order_; }
+    const std::vector<int> &ranks() const { return rank_; }
+
+    /// An array indexed in the original order put into curve order.
+    template <class Type>
+    std::vector<Type> gather(const std::vector<Type> &original) const {
+      std::vector<Type> result;
+      result.reserve(order_.size());
+      for (int i : order_) result.push_back(original[i]);
+      return result;
+    }
+
+  private:
+    std::vector<int> order_;
+    std::vector<int> rank_;
+  };
+}
+
+#endif
@@ -0,0 +1,514 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: bounding volume hierarchy of spheres
+//
+// A linear BVH (Karras, "Maximizing parallelism in the construction of BVHs,
+// octrees and k-d trees", 2012). The spheres are sorted by the Morton code of
+// their centres and each internal node is found from the codes alone, so the
+// nodes can be built in any order on any number of threads. The boxes are then
+// filled in from the leaves up; the second child to arrive at a node does its
+// parent.
+//
+// Moving some spheres only needs the boxes above them to be refitted. The tree
+// gets worse as spheres move far from where they started, so build it again
+// after big changes.
+//
+
+#ifndef GILGAMESH_SPHERE_BVH_INCLUDED
+#define GILGAMESH_SPHERE_BVH_INCLUDED
+
+#include <gilgamesh/parallel.hpp>
+#include <gilgamesh/spatial_order.hpp>
+#include <glm/glm.hpp>
+#include <vector>
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#if defined(__SSE2__) || defined(_M_X64)
+  #include <emmintrin.h>
+#endif
+
+namespace gilgamesh {
+
+  class sphere_bvh {
+  public:
+    sphere_bvh() {
+    }
+
+    /// Build the tree of spheres (centres[i], radii[i]).
+    sphere_bvh(const std::vector<glm::vec3> &centres, const std::vector<float> &radii, unsigned num_threads = 1) {
+      int n = (int)centres.size();
+      num_leaves_ = n;
+      if (n == 0) return;
+
+      glm::vec3 min(1e38f), max(-1e38f);
+      for (auto &c : centres) {
+        min = glm::min(min, c);
+        max = glm::max(max, c);
+      }
+      glm::vec3 scale = 1023.0f / glm::max(max - min, glm::vec3(1e-6f));
+
+      // Sort the spheres by Morton code with three ten bit radix passes.
+      std::vector<uint32_t> code(n), sorted_code(n);
+      std::vector<int> index(n);
+      parallel_for(num_tasks(n, num_threads), num_threads, [&](int task) {
+        int end = task_end(n, num_threads, task);
+        for (int i = task_begin(n, num_threads, task); i != end; ++i) {
+          glm::ivec3 q = glm::ivec3((centres[i] - min) * scale);
+          code[i] = morton_code(q);
+        }
+      });
+      for (int i = 0; i != n; ++i) index[i] = i;
+      std::vector<int> sorted_index(n);
+      for (int shift = 0; shift != 30; shift += 10) {
+        std::vector<int> start(1025);
+        for (int i = 0; i != n; ++i) start[(code[i] >> shift & 1023) + 1]++;
+        for (int d = 0; d != 1024; ++d) start[d + 1] += start[d];
+        for (int i = 0; i != n; ++i) {
+          int s = start[code[i] >> shift & 1023]++;
+          sorted_code[s] = code[i];
+          sorted_index[s] = index[i];
+        }
+        code.swap(sorted_code);
+        index.swap(sorted_index);
+      }
+
+      order_ = index;
+      leaf_of_.resize(n);
+      centre_.resize(n);
+      radius_.resize(n);
+      for (int i = 0; i != n; ++i) {
+        leaf_of_[order_[i]] = i;
+        centre_[i] = centres[order_[i]];
+        radius_[i] = radii[order_[i]];
+      }
+
+      // Internal node i has children child_[i][0..1]; node numbers n - 1 and up are leaves.
+      child_.resize(n - 1);
+      parent_.assign(2 * n - 1, -1);
+      lo_.resize(n - 1);
+      hi_.resize(n - 1);
+      parallel_for(num_tasks(n - 1, num_threads), num_threads, [&](int task) {
+        int end = task_end(n - 1, num_threads, task);
+        for (int i = task_begin(n - 1, num_threads, task); i != end; ++i) {
+          split(code, i);
+        }
+      });
+
+      refit_all(num_threads);
+    }
+
+    /// Number of spheres.
+    int size() const { return num_leaves_; }
+
+    /// Sphere i as it is now.
+    glm::vec3 centre(int i) const { return centre_[leaf_of_[i]]; }
+    float radius(int i) const { return radius_[leaf_of_[i]]; }
+
+    /// Move sphere i. Call refit() when all the spheres have moved.
+    void move(int i, glm::vec3 centre) {
+      int leaf = leaf_of_[i];
+      centre_[leaf] = centre;
+      moved_.push_back(leaf);
+    }
+
+    /// Move sphere i and change its radius.
+    void move(int i, glm::vec3 centre, float radius) {
+      radius_[leaf_of_[i]] = radius;
+      move(i, centre);
+    }
+
+    /// Fix the boxes above the spheres given to move().
+    void refit() {
+      // Stop going up when a box does not change as the boxes above it are still good.
+      for (int leaf : moved_) {
+        for (int node = parent_[leaf + num_leaves_ - 1]; node != -1; node = parent_[node]) {
+          glm::vec3 lo, hi;
+          box(child_[node][0], lo, hi);
+          glm::vec3 lo1, hi1;
+          box(child_[node][1], lo1, hi1);
+          lo = glm::min(lo, lo1);
+          hi = glm::max(hi, hi1);
+          if (lo == lo_[node] && hi == hi_[node]) break;
+          lo_[node] = lo;
+          hi_[node] = hi;
+        }
+      }
+      moved_.clear();
+    }
+
+    /// The first sphere hit by a ray. dir must be normalised. Returns -1 if the ray misses.
+    /// distance is the distance along the ray to the hit.
+    int pick(glm::vec3 start, glm::vec3 dir, float &distance) const {
+      int best = -1;
+      float best_t = 1e38f;
+      if (num_leaves_ == 0) return best;
+      glm::vec3 inv_dir = 1.0f / dir;
+      int stack[128];
+      int sp = 0;
+      stack[sp++] = root();
+      while (sp) {
+        int node = stack[--sp];
+        if (is_leaf(node)) {
+          int leaf = node - (num_leaves_ - 1);
+          float t;
+          if (ray_sphere(start, dir, centre_[leaf], radius_[leaf], t) && t < best_t) {
+            best_t = t;
+            best = order_[leaf];
+          }
+          continue;
+        }
+        // Visit the nearer child first so that the further one is more likely to be culled.
+        float t0 = ray_box(start, inv_dir, child_[node][0], best_t);
+        float t1 = ray_box(start, inv_dir, child_[node][1], best_t);
+        int c0 = child_[node][0], c1 = child_[node][1];
+        if (t0 > t1) {
+          std::swap(t0, t1);
+          std::swap(c0, c1);
+        }
+        if (t1 < best_t) stack[sp++] = c1;
+        if (t0 < best_t) stack[sp++] = c0;
+      }
+      distance = best_t;
+      return best;
+    }
+
+    /// The first sphere hit by each of four rays from a common start, as pick() does for one.
+    /// hit[lane] is -1 where a ray misses.
+    void pick4(glm::vec3 start, const glm::vec3 dir[4], int hit[4], float distance[4]) const {
+      float max_t[4] = { 1e38f, 1e38f, 1e38f, 1e38f };
+      for (int lane = 0; lane != 4; ++lane) hit[lane] = -1;
+      #if defined(__SSE2__) || defined(_M_X64)
+        __m128 dx = _mm_setr_ps(dir[0].x, dir[1].x, dir[2].x, dir[3].x);
+        __m128 dy = _mm_setr_ps(dir[0].y, dir[1].y, dir[2].y, dir[3].y);
+        __m128 dz = _mm_setr_ps(dir[0].z, dir[1].z, dir[2].z, dir[3].z);
+        trace4(start, dir, max_t, [&](int index, glm::vec3 centre, float radius) {
+          glm::vec3 c = centre - start;
+          __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_set1_ps(c.x)), _mm_mul_ps(dy, _mm_set1_ps(c.y))), _mm_mul_ps(dz, _mm_set1_ps(c.z)));
+          __m128 px = _mm_sub_ps(_mm_set1_ps(c.x), _mm_mul_ps(b, dx));
+          __m128 py = _mm_sub_ps(_mm_set1_ps(c.y), _mm_mul_ps(b, dy));
+          __m128 pz = _mm_sub_ps(_mm_set1_ps(c.z), _mm_mul_ps(b, dz));
+          __m128 q = _mm_sub_ps(_mm_set1_ps(radius * radius), _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), _mm_mul_ps(pz, pz)));
+          __m128 t = _mm_sub_ps(b, _mm_sqrt_ps(_mm_max_ps(q, _mm_setzero_ps())));
+          __m128 ok = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(q, _mm_setzero_ps()), _mm_cmpgt_ps(t, _mm_setzero_ps())), _mm_cmplt_ps(t, _mm_loadu_ps(max_t)));
+          int mask = _mm_movemask_ps(ok);
+          if (!mask) return;
+          float ts[4];
+          _mm_storeu_ps(ts, t);
+          for (int lane = 0; lane != 4; ++lane) {
+            if (mask >> lane & 1) {
+              max_t[lane] = ts[lane];
+              hit[lane] = index;
+            }
+          }
+        });
+      #else
+        trace4(start, dir, max_t, [&](int index, glm::vec3 centre, float radius) {
+          for (int lane = 0; lane != 4; ++lane) {
+            float t;
+            if (ray_sphere(start, dir[lane], centre, radius, t) && t < max_t[lane]) {
+              max_t[lane] = t;
+              hit[lane] = index;
+            }
+          }
+        });
+      #endif
+      for (int lane = 0; lane != 4; ++lane) distance[lane] = max_t[lane];
+    }
+
+    /// Trace a packet of four rays from a common start, such as the rays through a 2x2 block of pixels.
+    /// The rays go down the tree together while any of them reaches a box before its max_t.
+    /// hit(i, centre, radius) is called for the spheres at the bottom and should test the rays
+    /// against whatever sphere i stands for, lowering max_t[lane] for each ray that hits.
+    template <class Hit>
+    void trace4(glm::vec3 start, const glm::vec3 dir[4], float max_t[4], Hit hit) const {
+      if (num_leaves_ == 0) return;
+      float inv_dir[3][4];
+      for (int lane = 0; lane != 4; ++lane) {
+        for (int axis = 0; axis != 3; ++axis) {
+          inv_dir[axis][lane] = 1.0f / dir[lane][axis];
+        }
+      }
+      int stack[128];
+      int sp = 0;
+      stack[sp++] = root();
+      while (sp) {
+        int node = stack[--sp];
+        if (is_leaf(node)) {
+          int leaf = node - (num_leaves_ - 1);
+          hit(order_[leaf], centre_[leaf], radius_[leaf]);
+          continue;
+        }
+        float t0 = ray_box4(start, inv_dir, child_[node][0], max_t);
+        float t1 = ray_box4(start, inv_dir, child_[node][1], max_t);
+        int c0 = child_[node][0], c1 = child_[node][1];
+        if (t0 > t1) {
+          std::swap(t0, t1);
+          std::swap(c0, c1);
+        }
+        if (t1 != 1e38f) stack[sp++] = c1;
+        if (t0 != 1e38f) stack[sp++] = c0;
+      }
+    }
+
+    /// Call fn(i) for each sphere whose centre is no further than radius from p.
+    template <class Fn>
+    void for_each_in_sphere(glm::vec3 p, float radius, Fn fn) const {
+      float r2 = radius * radius;
+      traverse(
+        [p, r2](glm::vec3 lo, glm::vec3 hi) { glm::vec3 d = p - glm::clamp(p, lo, hi); return glm::dot(d, d) <= r2; },
+        [&](int leaf) { glm::vec3 d = centre_[leaf] - p; if (glm::dot(d, d) <= r2) fn(order_[leaf]); }
+      );
+    }
+
+    /// Call fn(i) for each sphere whose centre is in the box [lo, hi].
+    template <class Fn>
+    void for_each_in_box(glm::vec3 lo, glm::vec3 hi, Fn fn) const {
+      traverse(
+        [lo, hi](glm::vec3 nlo, glm::vec3 nhi) { return glm::all(glm::lessThanEqual(nlo, hi)) && glm::all(glm::lessThanEqual(lo, nhi)); },
+        [&](int leaf) { glm::vec3 c = centre_[leaf]; if (glm::all(glm::lessThanEqual(lo, c)) && glm::all(glm::lessThanEqual(c, hi))) fn(order_[leaf]); }
+      );
+    }
+
+    /// The sphere with the centre nearest to p and no further than max_distance, or -1.
+    int nearest(glm::vec3 p, float max_distance, float &distance) const {
+      int best = -1;
+      float best_d2 = max_distance * max_distance;
+      if (num_leaves_ == 0) return best;
+      int stack[128];
+      int sp = 0;
+      stack[sp++] = root();
+      while (sp) {
+        int node = stack[--sp];
+        if (is_leaf(node)) {
+          int leaf = node - (num_leaves_ - 1);
+          glm::vec3 d = centre_[leaf] - p;
+          float d2 = glm::dot(d, d);
+          if (d2 <= best_d2) {
+            best_d2 = d2;
+            best = order_[leaf];
+          }
+          continue;
+        }
+        int c0 = child_[node][0], c1 = child_[node][1];
+        float d0 = box_distance2(c0, p), d1 = box_distance2(c1, p);
+        if (d0 > d1) {
+          std::swap(d0, d1);
+          std::swap(c0, c1);
+        }
+        if (d1 <= best_d2) stack[sp++] = c1;
+        if (d0 <= best_d2) stack[sp++] = c0;
+      }
+      distance = std::sqrt(best_d2);
+      return best;
+    }
+
+  private:
+    static int num_tasks(int n, unsigned num_threads) { return std::max(std::min(n, (int)num_threads * 8), 1); }
+    static int task_begin(int n, unsigned num_threads, int task) { return (int)((int64_t)n * task / num_tasks(n, num_threads)); }
+    static int task_end(int n, unsigned num_threads, int task) { return (int)((int64_t)n * (task + 1) / num_tasks(n, num_threads)); }
+
+    static int clz(uint32_t x) {
+      #if defined(__GNUC__)
+        return x ? __builtin_clz(x) : 32;
+      #else
+        int n = 0;
+        for (uint32_t bit = 0x80000000; bit && !(x & bit); bit >>= 1) ++n;
+        return n;
+      #endif
+    }
+
+    // Length of the common prefix of the keys of leaves i and j, with the index breaking ties.
+    int delta(const std::vector<uint32_t> &code, int i, int j) const {
+      if (j < 0 || j >= num_leaves_) return -1;
+      uint32_t x = code[i] ^ code[j];
+      return x ? clz(x) : 32 + clz((uint32_t)(i ^ j));
+    }
+
+    // Find the range and split of internal node i.
+    void split(const std::vector<uint32_t> &code, int i) {
+      int d = delta(code, i, i + 1) > delta(code, i, i - 1) ? 1 : -1;
+      int delta_min = delta(code, i, i - d);
+      int l_max = 2;
+      while (delta(code, i, i + l_max * d) > delta_min) l_max *= 2;
+      int l = 0;
+      for (int t = l_max / 2; t >= 1; t /= 2) {
+        if (delta(code, i, i + (l + t) * d) > delta_min) l += t;
+      }
+      int j = i + l * d;
+      int delta_node = delta(code, i, j);
+      int s = 0;
+      for (int div = 2, t; ; div *= 2) {
+        t = (l + div - 1) / div;
+        if (delta(code, i, i + (s + t) * d) > delta_node) s += t;
+        if (t <= 1) break;
+      }
+      int gamma = i + s * d + std::min(d, 0);
+      int first = std::min(i, j), last = std::max(i, j);
+      int left = first == gamma ? gamma + num_leaves_ - 1 : gamma;
+      int right = last == gamma + 1 ? gamma + 1 + num_leaves_ - 1 : gamma + 1;
+      child_[i][0] = left;
+      child_[i][1] = right;
+      parent_[left] = i;
+      parent_[right] = i;
+    }
+
+    void refit_all(unsigned num_threads) {
+      int n = num_leaves_;
+      std::vector<std::atomic<int> > arrivals(n - 1);
+      for (auto &a : arrivals) a.store(0, std::memory_order_relaxed);
+      parallel_for(num_tasks(n, num_threads), num_threads, [&](int task) {
+        int end = task_end(n, num_threads, task);
+        for (int leaf = task_begin(n, num_threads, task); leaf != end; ++leaf) {
+          for (int node = parent_[leaf + n - 1]; node != -1; node = parent_[node]) {
+            // The first child to arrive leaves the node to the second.
+            if (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+            glm::vec3 lo, hi, lo1, hi1;
+            box(child_[node][0], lo, hi);
+            box(child_[node][1], lo1, hi1);
+            lo_[node] = glm::min(lo, lo1);
+            hi_[node] = glm::max(hi, hi1);
+          }
+        }
+      });
+    }
+
+    // Internal node 0, or leaf 0 if there is only one sphere.
+    int root() const { return 0; }
+    bool is_leaf(int node) const { return node >= num_leaves_ - 1; }
+
+    void box(int node, glm::vec3 &lo, glm::vec3 &hi) const {
+      if (is_leaf(node)) {
+        int leaf = node - (num_leaves_ - 1);
+        lo = centre_[leaf] - radius_[leaf];
+        hi = centre_[leaf] + radius_[leaf];
+      } else {
+        lo = lo_[node];
+        hi = hi_[node];
+      }
+    }
+
+    float box_distance2(int node, glm::vec3 p) const {
+      glm::vec3 lo, hi;
+      box(node, lo, hi);
+      glm::vec3 d = p - glm::clamp(p, lo, hi);
+      return glm::dot(d, d);
+    }
+
+    // Distance along the ray to the box of a node, or 1e38 if it misses or is beyond max_t.
+    // Where inv_dir is infinite the ray runs parallel to that slab and is either in it all the way
+    // or never; working it out would give 0 * inf = NaN for a ray that starts on a face.
+    float ray_box(glm::vec3 start, glm::vec3 inv_dir, int node, float max_t) const {
+      glm::vec3 lo, hi;
+      box(node, lo, hi);
+      float enter = 0, leave = max_t;
+      for (int axis = 0; axis != 3; ++axis) {
+        if (std::isinf(inv_dir[axis])) {
+          if (start[axis] < lo[axis] || start[axis] > hi[axis]) return 1e38f;
+          continue;
+        }
+        float t0 = (lo[axis] - start[axis]) * inv_dir[axis];
+        float t1 = (hi[axis] - start[axis]) * inv_dir[axis];
+        enter = std::max(enter, std::min(t0, t1));
+        leave = std::min(leave, std::max(t0, t1));
+      }
+      return enter <= leave ? enter : 1e38f;
+    }
+
+    // The nearest entry of any of four rays into the box of a node, or 1e38 if they all miss it
+    // or reach it beyond their max_t. Rays parallel to a slab are dealt with as in ray_box().
+    float ray_box4(glm::vec3 start, const float inv_dir[3][4], int node, const float max_t[4]) const {
+      glm::vec3 lo, hi;
+      box(node, lo, hi);
+      #if defined(__SSE2__) || defined(_M_X64)
+        __m128 enter = _mm_setzero_ps();
+        __m128 leave = _mm_loadu_ps(max_t);
+        __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+        for (int axis = 0; axis != 3; ++axis) {
+          __m128 inv = _mm_loadu_ps(inv_dir[axis]);
+          __m128 t0 = _mm_mul_ps(_mm_set1_ps(lo[axis] - start[axis]), inv);
+          __m128 t1 = _mm_mul_ps(_mm_set1_ps(hi[axis] - start[axis]), inv);
+          // A parallel lane in the slab gets (-inf, inf) and one outside it (inf, inf), which misses.
+          __m128 parallel = _mm_cmpeq_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), inv), inf);
+          bool inside = lo[axis] <= start[axis] && start[axis] <= hi[axis];
+          t0 = _mm_or_ps(_mm_and_ps(parallel, inside ? _mm_set1_ps(-std::numeric_limits<float>::infinity()) : inf), _mm_andnot_ps(parallel, t0));
+          t1 = _mm_or_ps(_mm_and_ps(parallel, inf), _mm_andnot_ps(parallel, t1));
+          enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+          leave = _mm_min_ps(leave, _mm_max_ps(t0, t1));
+        }
+        __m128 ok = _mm_cmple_ps(enter, leave);
+        __m128 t = _mm_or_ps(_mm_and_ps(ok, enter), _mm_andnot_ps(ok, _mm_set1_ps(1e38f)));
+        t = _mm_min_ps(t, _mm_shuffle_ps(t, t, _MM_SHUFFLE(2, 3, 0, 1)));
+        t = _mm_min_ps(t, _mm_shuffle_ps(t, t, _MM_SHUFFLE(1, 0, 3, 2)));
+        return _mm_cvtss_f32(t);
+      #else
+        float result = 1e38f;
+        for (int lane = 0; lane != 4; ++lane) {
+          float enter = 0, leave = max_t[lane];
+          for (int axis = 0; axis != 3; ++axis) {
+            if (std::isinf(inv_dir[axis][lane])) {
+              if (start[axis] < lo[axis] || start[axis] > hi[axis]) leave = -1;
+              continue;
+            }
+            float t0 = (lo[axis] - start[axis]) * inv_dir[axis][lane];
+            float t1 = (hi[axis] - start[axis]) * inv_dir[axis][lane];
+            enter = std::max(enter, std::min(t0, t1));
+            leave = std::min(leave, std::max(t0, t1));
+          }
+          if (enter <= leave) result = std::min(result, enter);
+        }
+        return result;
+      #endif
+    }
+
+    // The nearer hit in front of the start.
+    // The distance of the centre from the ray is found directly as b * b - c.c loses precision far from the start.
+    static bool ray_sphere(glm::vec3 start, glm::vec3 dir, glm::vec3 centre, float radius, float &t) {
+      glm::vec3 c = centre - start;
+      float b = glm::dot(c, dir);
+      glm::vec3 perp = c - dir * b;
+      float q = radius * radius - glm::dot(perp, perp);
+      if (q < 0) return false;
+      t = b - std::sqrt(q);
+      return t > 0;
+    }
+
+    template <class Overlaps, class Leaf>
+    void traverse(Overlaps overlaps, Leaf leaf_fn) const {
+      if (num_leaves_ == 0) return;
+      int stack[128];
+      int sp = 0;
+      stack[sp++] = root();
+      while (sp) {
+        int node = stack[--sp];
+        if (is_leaf(node)) {
+          leaf_fn(node - (num_leaves_ - 1));
+          continue;
+        }
+        for (int c : child_[node]) {
+          glm::vec3 lo, hi;
+          box(c, lo, hi);
+          if (overlaps(lo, hi)) stack[sp++] = c;
+        }
+      }
+    }
+
+    int num_leaves_ = 0;
+    std::vector<int> order_;                  // sphere index of each leaf
+    std::vector<int> leaf_of_;                // leaf of each sphere
+    std::vector<glm::vec3> centre_;           // by leaf
+    std::vector<float> radius_;               // by leaf
+    std::vector<std::array<int, 2> > child_;  // by internal node
+    std::vector<int> parent_;                 // by node, -1 for the root
+    std::vector<glm::vec3> lo_;               // box of each internal node
+    std::vector<glm::vec3> hi_;
+    std::vector<int> moved_;
+  };
+}
+
+#endif
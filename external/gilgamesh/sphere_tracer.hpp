@@ -0,0 +1,165 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: CPU ray tracer for spheres and cylinders
+//
+// Draws ball and stick models without a GPU. The image is cut into tiles
+// which the threads take one at a time, so tiles with many atoms do not hold
+// up the others. Each tile is traced as 2x2 blocks of pixels, whose four rays
+// go down a sphere_bvh together.
+//
+// The shading follows atoms.frag: ambient and diffuse light from one
+// direction, with a highlight in place of the cube map reflection.
+//
+
+#ifndef GILGAMESH_SPHERE_TRACER_INCLUDED
+#define GILGAMESH_SPHERE_TRACER_INCLUDED
+
+#include <gilgamesh/sphere_bvh.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+namespace gilgamesh {
+
+  class sphere_tracer {
+  public:
+    /// A pinhole camera. The ray through the centre of pixel (x, y) goes from start
+    /// along corner + dx * (x + 0.5) + dy * (y + 0.5).
+    struct camera {
+      glm::vec3 start;
+      glm::vec3 corner;
+      glm::vec3 dx;
+      glm::vec3 dy;
+    };
+
+    /// What to draw. Arrays are indexed as the spheres in the trees are.
+    /// Cylinders are optional; their tree holds a sphere around each one.
+    struct scene {
+      const sphere_bvh *spheres = nullptr;
+      const glm::vec3 *sphere_colours = nullptr;
+      const sphere_bvh *cylinders = nullptr;
+      const glm::vec3 *cylinder_ends = nullptr;     // two per cylinder
+      const float *cylinder_radii = nullptr;
+      const glm::vec3 *cylinder_colours = nullptr;
+      glm::vec3 light_dir = glm::normalize(glm::vec3(1, 1, 1));
+      glm::vec3 background = glm::vec3(0.75f);
+    };
+
+    sphere_tracer() {
+    }
+
+    sphere_tracer(int width, int height) : width_(width), height_(height), pixels_((size_t)width * height) {
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    /// RGBA pixels, one byte each, top row first. Valid until the next render().
+    const uint32_t *pixels() const { return pixels_.data(); }
+    size_t bytes() const { return pixels_.size() * sizeof(uint32_t); }
+
+    /// Trace every pixel.
+    void render(const camera &cam, const scene &scn, unsigned num_threads) {
+      int tiles_x = (width_ + tile_size - 1) / tile_size;
+      int tiles_y = (height_ + tile_size - 1) / tile_size;
+      parallel_for(tiles_x * tiles_y, num_threads, [&](int tile) {
+        int x0 = tile % tiles_x * tile_size, y0 = tile / tiles_x * tile_size;
+        int x1 = std::min(x0 + tile_size, width_), y1 = std::min(y0 + tile_size, height_);
+        for (int y = y0; y < y1; y += 2) {
+          for (int x = x0; x < x1; x += 2) {
+            trace_block(cam, scn, x, y);
+          }
+        }
+      });
+    }
+
+  private:
+    static const int tile_size = 32;
+
+    // Trace pixels (x, y) to (x + 1, y + 1), leaving out any beyond the image.
+    void trace_block(const camera &cam, const scene &scn, int x, int y) {
+      glm::vec3 dir[4];
+      for (int lane = 0; lane != 4; ++lane) {
+        dir[lane] = glm::normalize(cam.corner + cam.dx * (x + (lane & 1) + 0.5f) + cam.dy * (y + (lane >> 1) + 0.5f));
+      }
+
+      int sphere[4] = { -1, -1, -1, -1 };
+      float t[4] = { 1e38f, 1e38f, 1e38f, 1e38f };
+      if (scn.spheres) scn.spheres->pick4(cam.start, dir, sphere, t);
+
+      int cylinder[4] = { -1, -1, -1, -1 };
+      glm::vec3 cylinder_normal[4];
+      if (scn.cylinders) {
+        scn.cylinders->trace4(cam.start, dir, t, [&](int index, glm::vec3, float) {
+          glm::vec3 a = scn.cylinder_ends[index * 2], b = scn.cylinder_ends[index * 2 + 1];
+          float radius = scn.cylinder_radii[index];
+          for (int lane = 0; lane != 4; ++lane) {
+            float tc;
+            glm::vec3 normal;
+            if (ray_cylinder(cam.start, dir[lane], a, b, radius, tc, normal) && tc < t[lane]) {
+              t[lane] = tc;
+              cylinder[lane] = index;
+              cylinder_normal[lane] = normal;
+            }
+          }
+        });
+      }
+
+      for (int lane = 0; lane != 4; ++lane) {
+        int px = x + (lane & 1), py = y + (lane >> 1);
+        if (px >= width_ || py >= height_) continue;
+        glm::vec3 colour = scn.background;
+        if (cylinder[lane] != -1) {
+          colour = shade(scn, dir[lane], cylinder_normal[lane], scn.cylinder_colours[cylinder[lane]]);
+        } else if (sphere[lane] != -1) {
+          glm::vec3 centre = scn.spheres->centre(sphere[lane]);
+          glm::vec3 normal = glm::normalize(cam.start + dir[lane] * t[lane] - centre);
+          colour = shade(scn, dir[lane], normal, scn.sphere_colours[sphere[lane]]);
+        }
+        pixels_[(size_t)py * width_ + px] = pack(colour);
+      }
+    }
+
+    static glm::vec3 shade(const scene &scn, glm::vec3 dir, glm::vec3 normal, glm::vec3 colour) {
+      float diffuse = std::max(0.0f, glm::dot(normal, scn.light_dir));
+      float highlight = std::max(0.0f, glm::dot(glm::reflect(dir, normal), scn.light_dir));
+      highlight *= highlight;
+      highlight *= highlight;
+      highlight *= highlight;
+      return colour * 0.1f + colour * (0.9f * diffuse) + glm::vec3(0.3f * highlight);
+    }
+
+    static uint32_t pack(glm::vec3 colour) {
+      glm::ivec3 c = glm::ivec3(glm::clamp(colour, 0.0f, 1.0f) * 255.0f + 0.5f);
+      return (uint32_t)c.r | (uint32_t)c.g << 8 | (uint32_t)c.b << 16 | 0xff000000u;
+    }
+
+    // The nearer hit in front of the start on the side of the cylinder from a to b. dir must be normalised.
+    static bool ray_cylinder(glm::vec3 start, glm::vec3 dir, glm::vec3 a, glm::vec3 b, float radius, float &t, glm::vec3 &normal) {
+      glm::vec3 axis = b - a, oc = start - a;
+      float aa = glm::dot(axis, axis), ad = glm::dot(axis, dir), ao = glm::dot(axis, oc);
+      float k2 = aa - ad * ad;
+      if (k2 < 1e-12f) return false;
+      float k1 = aa * glm::dot(oc, dir) - ao * ad;
+      float k0 = aa * glm::dot(oc, oc) - ao * ao - radius * radius * aa;
+      float h = k1 * k1 - k2 * k0;
+      if (h < 0) return false;
+      t = (-k1 - std::sqrt(h)) / k2;
+      float along = ao + t * ad;
+      if (t <= 0 || along < 0 || along > aa) return false;
+      normal = (oc + dir * t - axis * (along / aa)) / radius;
+      return true;
+    }
+
+    int width_ = 0;
+    int height_ = 0;
+    std::vector<uint32_t> pixels_;
+  };
+}
+
+#endif
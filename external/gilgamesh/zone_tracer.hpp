@@ -0,0 +1,224 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gilgamesh: zone tracer
+//
+// Times scoped zones of code on every thread for viewing in chrome://tracing
+// or Perfetto:
+//
+//   void decode(...) {
+//     GILGAMESH_ZONE("pdb_decoder::feed");
+//     GILGAMESH_ZONE_ITEMS(end - begin);   // optional: bytes, atoms etc. done in the zone
+//     ...
+//   }
+//
+// Zones are only recorded when GILGAMESH_TRACE is defined; otherwise the
+// macros are empty and cost nothing.
+//
+// Each thread writes to a buffer of its own without locks. Buffers of
+// threads that have finished are handed to new threads, as parallel_for
+// starts threads for every loop. Zone names must be string literals.
+//
+
+#ifndef GILGAMESH_ZONE_TRACER_INCLUDED
+#define GILGAMESH_ZONE_TRACER_INCLUDED
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <map>
+#include <cstdio>
+#include <cstdint>
+
+#ifdef GILGAMESH_TRACE
+  #define GILGAMESH_ZONE(name) gilgamesh::trace_zone gilgamesh_zone_(name)
+  #define GILGAMESH_ZONE_ITEMS(n) gilgamesh_zone_.items(n)
+#else
+  #define GILGAMESH_ZONE(name)
+  #define GILGAMESH_ZONE_ITEMS(n)
+#endif
+
+// The andyzip decoders time themselves with ANDYZIP_ZONE.
+#ifndef ANDYZIP_ZONE
+  #define ANDYZIP_ZONE(name) GILGAMESH_ZONE(name)
+  #define ANDYZIP_ZONE_ITEMS(n) GILGAMESH_ZONE_ITEMS(n)
+#endif
+
+namespace gilgamesh {
+
+  class zone_tracer {
+  public:
+    /// A zone that has finished.
+    struct event {
+      const char *name;
+      uint64_t start_ns;
+      uint64_t duration_ns;
+      uint64_t items;
+    };
+
+    /// Totals for zones of one name.
+    struct stats {
+      uint64_t calls = 0;
+      uint64_t total_ns = 0;
+      uint64_t items = 0;
+    };
+
+    /// The tracer used by the zone macros.
+    static zone_tracer &instance() {
+      static zone_tracer tracer;
+      return tracer;
+    }
+
+    static bool enabled() {
+      #ifdef GILGAMESH_TRACE
+        return true;
+      #else
+        return false;
+      #endif
+    }
+
+    /// Nanoseconds since the tracer started.
+    uint64_t now() const {
+      return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch_).count();
+    }
+
+    /// Add an event on the calling thread. Events beyond the buffer's capacity are counted and dropped.
+    void record(const char *name, uint64_t start_ns, uint64_t duration_ns, uint64_t items) {
+      thread_buffer &buf = local();
+      size_t n = buf.size.load(std::memory_order_relaxed);
+      size_t chunk = n / chunk_size;
+      if (chunk == max_chunks) {
+        dropped_++;
+        return;
+      }
+      if (!buf.chunks[chunk]) buf.chunks[chunk].reset(new event[chunk_size]);
+      buf.chunks[chunk][n % chunk_size] = event{ name, start_ns, duration_ns, items };
+      // If clear() emptied the buffer since the load, drop this event rather than
+      // bring back the ones before it.
+      buf.size.compare_exchange_strong(n, n + 1, std::memory_order_release, std::memory_order_relaxed);
+    }
+
+    /// Forget the events so far. Zones open on other threads may still be recorded.
+    void clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto &buf : buffers_) buf->size.store(0, std::memory_order_release);
+      dropped_ = 0;
+    }
+
+    /// Events dropped because a thread's buffer was full.
+    uint64_t dropped() const { return dropped_; }
+
+    /// Call fn(thread, event) for each event recorded so far.
+    template <class Fn>
+    void for_each(Fn fn) const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t t = 0; t != buffers_.size(); ++t) {
+        const thread_buffer &buf = *buffers_[t];
+        size_t n = buf.size.load(std::memory_order_acquire);
+        for (size_t i = 0; i != n; ++i) {
+          fn((int)t, buf.chunks[i / chunk_size][i % chunk_size]);
+        }
+      }
+    }
+
+    /// Totals by zone name.
+    std::map<std::string, stats> totals() const {
+      std::map<std::string, stats> result;
+      for_each([&result](int, const event &e) {
+        stats &s = result[e.name];
+        s.calls++;
+        s.total_ns += e.duration_ns;
+        s.items += e.items;
+      });
+      return result;
+    }
+
+    /// The events in Chrome's trace event format, which chrome://tracing and Perfetto load.
+    std::string chrome_json() const {
+      std::string result = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+      bool first = true;
+      char text[256];
+      for_each([&](int thread, const event &e) {
+        snprintf(
+          text, sizeof(text),
+          "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"items\":%llu}}",
+          first ? "" : ",\n", e.name, thread, e.start_ns * 1e-3, e.duration_ns * 1e-3, (unsigned long long)e.items
+        );
+        result += text;
+        first = false;
+      });
+      result += "\n]}\n";
+      return result;
+    }
+
+  private:
+    static const size_t chunk_size = 4096;
+    static const size_t max_chunks = 256;
+
+    struct thread_buffer {
+      std::unique_ptr<event[]> chunks[max_chunks];
+      std::atomic<size_t> size{0};
+      std::atomic<bool> in_use{false};
+    };
+
+    // Gives the thread's buffer back when the thread finishes.
+    struct thread_slot {
+      thread_buffer *buffer = nullptr;
+      ~thread_slot() { if (buffer) buffer->in_use.store(false, std::memory_order_release); }
+    };
+
+    zone_tracer() : epoch_(std::chrono::steady_clock::now()) {
+    }
+
+    thread_buffer &local() {
+      static thread_local thread_slot slot;
+      if (!slot.buffer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto &buf : buffers_) {
+          bool expected = false;
+          if (buf->in_use.compare_exchange_strong(expected, true)) {
+            slot.buffer = buf.get();
+            break;
+          }
+        }
+        if (!slot.buffer) {
+          buffers_.emplace_back(new thread_buffer());
+          buffers_.back()->in_use = true;
+          slot.buffer = buffers_.back().get();
+        }
+      }
+      return *slot.buffer;
+    }
+
+    std::chrono::steady_clock::time_point epoch_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<thread_buffer> > buffers_;
+    std::atomic<uint64_t> dropped_{0};
+  };
+
+  /// Records the time from its construction to its destruction. Use GILGAMESH_ZONE.
+  class trace_zone {
+  public:
+    explicit trace_zone(const char *name) : name_(name), start_(zone_tracer::instance().now()) {
+    }
+
+    ~trace_zone() {
+      zone_tracer &tracer = zone_tracer::instance();
+      tracer.record(name_, start_, tracer.now() - start_, items_);
+    }
+
+    /// Count things done in the zone, such as bytes or atoms, for rates.
+    void items(uint64_t n) { items_ += n; }
+
+  private:
+    const char *name_;
+    uint64_t start_;
+    uint64_t items_ = 0;
+  };
+}
+
+#endif
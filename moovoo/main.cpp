@@ -7,6 +7,9 @@
 
 #include <Python.h>
 
+// First, so that the andyzip decoders see its ANDYZIP_ZONE.
+#include <gilgamesh/zone_tracer.hpp>
+
 #include <vku/vku_framework.hpp>
 
 #include <glm/glm.hpp>
@@ -16,11 +19,37 @@
 #include <glm/ext.hpp>
 
 #include <gilgamesh/mesh.hpp>
-#include <gilgamesh/distance_field.hpp>
+#include <gilgamesh/molecular_surface.hpp>
+#include <gilgamesh/bond_finder.hpp>
+#include <gilgamesh/spatial_order.hpp>
 #include <gilgamesh/decoders/pdb_decoder.hpp>
+#include <gilgamesh/mapped_file.hpp>
+#include <gilgamesh/array_file.hpp>
+#include <gilgamesh/atom_store.hpp>
+#include <gilgamesh/selection.hpp>
+#include <gilgamesh/sphere_bvh.hpp>
+#include <gilgamesh/sphere_tracer.hpp>
+#include <gilgamesh/encoders/frame_encoder.hpp>
+#include <gilgamesh/buffer_ring.hpp>
+#include <andyzip/gzip_decoder.hpp>
+#include <andyzip/brotli_decoder.hpp>
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <deque>
+#include <chrono>
+#include <unordered_map>
 #include <boost/python.hpp>
 
+#ifdef _WIN32
+  #include <direct.h>
+#else
+  #include <sys/stat.h>
+#endif
+
 #define STB_TRUETYPE_IMPLEMENTATION
 #include <stb/stb_truetype.h>
 
@@ -59,11 +88,9 @@ struct Connection {
   float springConstant;
 };
   
-struct Pick {
-  static constexpr uint fifoSize = 4;
-  uint atom;
-  uint distance;
-};
+// Triangles of the molecular surface.
+// The vertices are read by solvent.vert as twelve floats: pos, normal, uv, colour.
+typedef gilgamesh::color_mesh SurfaceMesh;
 
 struct Instance {
   mat4 modelToWorld;
@@ -103,12 +130,11 @@ public:
     vku::DescriptorSetLayoutMaker dslm{};
     dslm.buffer(0U, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eAll, 1); // Atoms
     dslm.buffer(1U, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eAll, 1); // Fount glyphs
-    dslm.buffer(2U, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute, 1); // Pick
     dslm.buffer(3U, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eAll, 1); // Connections
     dslm.buffer(4U, vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eAll, 1); // Cube map
     dslm.buffer(5U, vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eAll, 1); // Fount map
     dslm.buffer(6U, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eAll, 1); // Instances
-    dslm.buffer(7U, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eAll, 1); // Solvent Acessible
+    dslm.buffer(7U, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eAll, 1); // Surface vertices
     layout_ = dslm.createUnique(device);
 
     vku::PipelineLayoutMaker plm{};
@@ -296,7 +322,13 @@ class View;
 
 class Context {
 public:
-  Context() {
+  /// mode is "Headless" to run without a GPU or windows. Views then only render on the CPU.
+  explicit Context(const std::string &mode = "Vulkan") {
+    if (mode == "Headless") {
+      headless_ = true;
+      return;
+    }
+
     // Initialise the GLFW framework.
     glfwInit();
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
@@ -321,6 +353,7 @@ public:
 
   // Forward declared
   void mainloop();
+  void waitForFrames();
 
   vk::Instance instance() const { return fw_.instance(); }
   const vk::PhysicalDeviceMemoryProperties &memprops() { return fw_.memprops(); }
@@ -332,18 +365,899 @@ public:
   vk::PipelineCache pipelineCache() { return fw_.pipelineCache(); }
   vk::DescriptorPool descriptorPool() { return fw_.descriptorPool(); }
   void addView(View *view) { views_.push_back(view); }
+  bool headless() const { return headless_; }
 private:
+  bool headless_ = false;
   vku::Framework fw_;
   vk::Device device_;
   vk::UniqueCommandPool commandPool_;
   std::vector<View*> views_;
 };
 
+// The molecular surface of a set of atoms, mean centred.
+// The grid reaches the probe radius beyond the atoms and a little further to close the surface.
+inline gilgamesh::molecular_surface buildSurface(const std::vector<glm::vec3> &pos, const std::vector<float> &radii, unsigned numThreads) {
+  GILGAMESH_ZONE("buildSurface");
+  GILGAMESH_ZONE_ITEMS(pos.size());
+  float probeRadius = 1.4f;
+  float gridSpacing = 1.0f;
+  glm::vec3 min(1e38f);
+  glm::vec3 max(-1e38f);
+  for (auto &p : pos) {
+    min = glm::min(min, p);
+    max = glm::max(max, p);
+  }
+  float maxRadius = radii.empty() ? 0.0f : *std::max_element(radii.begin(), radii.end());
+  glm::vec3 pad(maxRadius + probeRadius + gridSpacing * 3);
+  min -= pad;
+  max += pad;
+  glm::vec3 extent = max - min;
+  int xdim = int(extent.x / gridSpacing) + 1;
+  int ydim = int(extent.y / gridSpacing) + 1;
+  int zdim = int(extent.z / gridSpacing) + 1;
+
+  return gilgamesh::molecular_surface(xdim, ydim, zdim, gridSpacing, min, pos, radii, probeRadius, numThreads);
+}
+
+// Keeps the molecular surface in step with atoms moved by the views.
+// The surface is measured and meshed in chunks on a thread of its own, started
+// by the first move. After that, each move measures again the parts of the
+// surface near the moved atoms and remeshes only the chunks there. The render
+// thread takes the remeshed chunks between frames.
+class SurfaceUpdater {
+public:
+  SurfaceUpdater(const Atom *atoms, const gilgamesh::atom_store &store) {
+    // Waters are left out of the surface, as in Model::buildCache.
+    surfaceIndex_.assign(store.size(), -1);
+    for (int r = 0; r != (int)store.num_residues(); ++r) {
+      if (gilgamesh::pdb_decoder::atom::isWater(store.residue_id(r))) continue;
+      auto range = store.residue_atoms(r);
+      for (int i = range.begin; i != range.end; ++i) {
+        surfaceIndex_[i] = (int)pos_.size();
+        pos_.push_back(atoms[i].pos);
+        radii_.push_back(gilgamesh::pdb_decoder::atom::vanDerVaalsRadius(store.element_id(i)));
+        colours_.push_back(glm::vec4(atoms[i].colour, 1));
+      }
+    }
+  }
+
+  ~SurfaceUpdater() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    if (thread_.joinable()) thread_.join();
+  }
+
+  /// Queue the new positions of atoms [begin, end).
+  void move(const Atom *atoms, int begin, int end) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (int i = begin; i != end; ++i) {
+        if (surfaceIndex_[i] == -1) continue;
+        moved_.push_back(surfaceIndex_[i]);
+        movedPos_.push_back(atoms[i].pos);
+      }
+      if (moved_.empty()) return;
+      if (!thread_.joinable()) thread_ = std::thread([this]() { run(); });
+    }
+    wake_.notify_one();
+  }
+
+  /// Move out the chunks meshed since the last call as (chunk, mesh) pairs, and the number
+  /// of chunks. The first time, every chunk is there. Only the moves are made under the
+  /// updater's lock, so the caller may take its time writing the meshes to the GPU.
+  bool takeChanges(std::vector<std::pair<int, SurfaceMesh> > &changes, size_t &numChunks) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (changes_.empty()) return false;
+    for (auto &c : changes_) changeIndex_[c.first] = -1;
+    changes.clear();
+    changes.swap(changes_);
+    numChunks = changeIndex_.size();
+    return true;
+  }
+
+private:
+  void run() {
+    unsigned numThreads = gilgamesh::hardware_threads();
+    gilgamesh::molecular_surface ses = buildSurface(pos_, radii_, numThreads);
+    if (stop_) return;
+    auto colour = [this](int pindex) { return pindex == -1 ? glm::vec4(1) : colours_[pindex]; };
+
+    glm::ivec3 cdims = ses.chunk_dims();
+    std::vector<SurfaceMesh> chunks(cdims.x * cdims.y * cdims.z);
+    gilgamesh::parallel_for((int)chunks.size(), numThreads, [&](int c) {
+      if (stop_) return;
+      chunks[c] = ses.mesh_chunk<SurfaceMesh>(glm::ivec3(c % cdims.x, c / cdims.x % cdims.y, c / cdims.x / cdims.y), colour);
+    });
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_) return;
+      changeIndex_.assign(chunks.size(), -1);
+      for (size_t c = 0; c != chunks.size(); ++c) queueChunk((int)c, std::move(chunks[c]));
+    }
+
+    for (;;) {
+      std::vector<int> moved;
+      std::vector<glm::vec3> movedPos;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this]() { return stop_ || !moved_.empty(); });
+        if (stop_) return;
+        moved.swap(moved_);
+        movedPos.swap(movedPos_);
+      }
+
+      std::vector<glm::ivec3> dirty = ses.chunks_touching(ses.update(moved, movedPos, numThreads));
+      if (stop_) return;
+      std::vector<SurfaceMesh> meshes(dirty.size());
+      gilgamesh::parallel_for((int)dirty.size(), numThreads, [&](int i) {
+        if (stop_) return;
+        meshes[i] = ses.mesh_chunk<SurfaceMesh>(dirty[i], colour);
+      });
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_) return;
+      for (size_t i = 0; i != dirty.size(); ++i) {
+        queueChunk((dirty[i].z * cdims.y + dirty[i].y) * cdims.x + dirty[i].x, std::move(meshes[i]));
+      }
+    }
+  }
+
+  // Queue a chunk's new mesh for takeChanges, replacing one not yet taken. Call under the lock.
+  void queueChunk(int c, SurfaceMesh &&mesh) {
+    int &index = changeIndex_[c];
+    if (index == -1) {
+      index = (int)changes_.size();
+      changes_.emplace_back(c, std::move(mesh));
+    } else {
+      changes_[index].second = std::move(mesh);
+    }
+  }
+
+  std::vector<int> surfaceIndex_;
+  std::vector<glm::vec3> pos_;
+  std::vector<float> radii_;
+  std::vector<glm::vec4> colours_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  // Read without the lock between the stages of run().
+  std::atomic<bool> stop_{false};
+  std::vector<int> moved_;
+  std::vector<glm::vec3> movedPos_;
+  std::vector<std::pair<int, SurfaceMesh> > changes_;
+  std::vector<int> changeIndex_;         // where each chunk is in changes_, or -1
+  std::thread thread_;
+};
+
+// The atoms chosen by Model.select.
+class Selection {
+public:
+  Selection() {}
+  Selection(gilgamesh::atom_bitset &&bits) : bits_(std::move(bits)) {}
+
+  size_t count() const { return bits_.count(); }
+  bool contains(int atom) const { return atom >= 0 && (size_t)atom < bits_.size() && bits_.test(atom); }
+
+  /// The indices of the selected atoms as a list.
+  bp::list indices() const {
+    bp::list result;
+    bits_.for_each([&result](size_t i) { result.append(i); });
+    return result;
+  }
+
+  const gilgamesh::atom_bitset &bits() const { return bits_; }
+
+private:
+  gilgamesh::atom_bitset bits_;
+};
+
+// A column of an array of structs as a Python buffer, so that memoryview and NumPy
+// use it in place. The column keeps its owner alive.
+struct ColumnBuffer {
+  PyObject_HEAD
+  PyObject *owner;
+  char *data;
+  const char *format;
+  Py_ssize_t shape[2];
+  Py_ssize_t strides[2];
+  Py_ssize_t itemsize;
+  int ndim;
+  bool readonly;
+
+  /// A memoryview of count rows of width items, rows stride bytes apart. width 1 makes a flat column.
+  static bp::object view(bp::object owner, void *data, const char *format, size_t itemsize, size_t count, int width, size_t stride, bool readonly) {
+    ColumnBuffer *col = PyObject_New(ColumnBuffer, type());
+    if (!col) bp::throw_error_already_set();
+    Py_INCREF(owner.ptr());
+    col->owner = owner.ptr();
+    col->data = (char*)data;
+    col->format = format;
+    col->itemsize = (Py_ssize_t)itemsize;
+    col->ndim = width == 1 ? 1 : 2;
+    col->shape[0] = (Py_ssize_t)count;
+    col->shape[1] = width;
+    col->strides[0] = (Py_ssize_t)stride;
+    col->strides[1] = (Py_ssize_t)itemsize;
+    col->readonly = readonly;
+    bp::handle<> handle((PyObject*)col);
+    return bp::object(bp::handle<>(PyMemoryView_FromObject(handle.get())));
+  }
+
+private:
+  static PyTypeObject *type() {
+    static PyBufferProcs procs = { getBuffer, nullptr };
+    static PyTypeObject type = { PyVarObject_HEAD_INIT(nullptr, 0) "moovoo.ColumnBuffer" };
+    if (!type.tp_basicsize) {
+      type.tp_basicsize = sizeof(ColumnBuffer);
+      type.tp_dealloc = dealloc;
+      type.tp_as_buffer = &procs;
+      type.tp_flags = Py_TPFLAGS_DEFAULT;
+      type.tp_doc = "A column of moovoo atoms";
+      if (PyType_Ready(&type) < 0) bp::throw_error_already_set();
+    }
+    return &type;
+  }
+
+  static void dealloc(PyObject *self) {
+    Py_DECREF(((ColumnBuffer*)self)->owner);
+    PyObject_Del(self);
+  }
+
+  static int getBuffer(PyObject *self, Py_buffer *view, int flags) {
+    ColumnBuffer *col = (ColumnBuffer*)self;
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE && col->readonly) {
+      PyErr_SetString(PyExc_BufferError, "this column is read only");
+      return -1;
+    }
+    if ((flags & PyBUF_STRIDES) != PyBUF_STRIDES && col->strides[0] != col->itemsize * (col->ndim == 2 ? col->shape[1] : 1)) {
+      PyErr_SetString(PyExc_BufferError, "this column is strided");
+      return -1;
+    }
+    view->obj = self;
+    Py_INCREF(self);
+    view->buf = col->data;
+    view->len = col->shape[0] * (col->ndim == 2 ? col->shape[1] : 1) * col->itemsize;
+    view->readonly = col->readonly;
+    view->itemsize = col->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char*)col->format : nullptr;
+    view->ndim = col->ndim;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? col->shape : nullptr;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? col->strides : nullptr;
+    view->suboffsets = nullptr;
+    view->internal = nullptr;
+    return 0;
+  }
+};
+
+// Lets other Python threads run while this one waits or works without Python objects.
+struct ReleaseGil {
+  PyThreadState *state = PyEval_SaveThread();
+  ~ReleaseGil() { PyEval_RestoreThread(state); }
+};
+
+// How far a model load has got, and a way to stop it.
+// The loading thread reports each stage, which throws once the load is cancelled.
+class LoadProgress {
+public:
+  void report(const char *stage, float fraction) {
+    if (cancelled_) {
+      throw std::runtime_error("Model load cancelled");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    stage_ = stage;
+    fraction_ = fraction;
+  }
+
+  void cancel() { cancelled_ = true; }
+  bool cancelled() const { return cancelled_; }
+
+  std::string stage() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stage_;
+  }
+
+  float fraction() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fraction_;
+  }
+
+private:
+  mutable std::mutex mutex_;
+  const char *stage_ = "queued";
+  float fraction_ = 0;
+  std::atomic<bool> cancelled_{false};
+};
+
 class Model {
 public:
   Model() {}
 
-  Model(Context &inst, boost::python::object bytes) {
+  /// Load a molecule from a bytes-like object or a binary file object.
+  /// File objects are read and decoded a window at a time so the text is never held in full.
+  /// gzip and brotli compressed sources are decompressed as they are decoded.
+  Model(Context &inst, boost::python::object source) {
+    if (PyObject_HasAttrString(source.ptr(), "read")) {
+      loadFile(source);
+    } else {
+      loadBytes(source);
+    }
+    prepare();
+    upload(inst);
+  }
+
+  /// Decode a source held in memory, or take it from the cache, without touching Python.
+  /// progress, if given, hears of each stage and can cancel the load.
+  void load(const uint8_t *b, const uint8_t *e, LoadProgress *progress) {
+    progress_ = progress;
+    loadBytes(b, e);
+    prepare();
+    progress_ = nullptr;
+  }
+
+  /// Put the loaded model on the GPU, or in memory for a headless context.
+  /// This uses the context's queue, so call it on the thread that draws.
+  void upload(Context &inst) {
+    size_t numAtoms, numConnections, numInstances, numSurfaceVertices, numSurfaceIndices;
+    const Atom *atoms = cache_.get<Atom>(cacheAtoms, numAtoms);
+    const Connection *conns = cache_.get<Connection>(cacheConnections, numConnections);
+    const Instance *instances = cache_.get<Instance>(cacheInstances, numInstances);
+    const SurfaceMesh::vertex_t *surfaceVertices = cache_.get<SurfaceMesh::vertex_t>(cacheSurfaceVertices, numSurfaceVertices);
+    const uint32_t *surfaceIndices = cache_.get<uint32_t>(cacheSurfaceIndices, numSurfaceIndices);
+
+    // Without a GPU the atoms live in memory and there is no surface to draw.
+    if (inst.headless()) {
+      hostAtoms_.assign(atoms, atoms + numAtoms_);
+      pAtoms_ = hostAtoms_.data();
+      return;
+    }
+
+    auto memprops = inst.memprops();
+    auto device = inst.device();
+    auto commandPool = inst.commandPool();
+    auto queue = inst.queue();
+
+    using buf = vk::BufferUsageFlagBits;
+    atoms_ = vku::GenericBuffer(device, memprops, buf::eStorageBuffer|buf::eTransferDst, (numAtoms_+1) * sizeof(Atom), vk::MemoryPropertyFlagBits::eHostVisible);
+    conns_ = vku::GenericBuffer(device, memprops, buf::eStorageBuffer|buf::eTransferDst, sizeof(Connection) * (numConnections_+1), vk::MemoryPropertyFlagBits::eHostVisible);
+    instances_ = vku::GenericBuffer(device, memprops, buf::eStorageBuffer|buf::eTransferDst, sizeof(Context) * numContexts_, vk::MemoryPropertyFlagBits::eHostVisible);
+    surfaceVertices_ = vku::GenericBuffer(device, memprops, buf::eStorageBuffer|buf::eTransferDst, sizeof(SurfaceMesh::vertex_t) * (numSurfaceVertices_+1), vk::MemoryPropertyFlagBits::eHostVisible);
+    surfaceIndices_ = vku::GenericBuffer(device, memprops, buf::eIndexBuffer|buf::eTransferDst, sizeof(uint32_t) * (numSurfaceIndices_+1), vk::MemoryPropertyFlagBits::eHostVisible);
+    GILGAMESH_ZONE("GenericBuffer::upload");
+    GILGAMESH_ZONE_ITEMS(numAtoms_ * sizeof(Atom) + numConnections_ * sizeof(Connection) + numContexts_ * sizeof(Instance) + numSurfaceVertices_ * sizeof(SurfaceMesh::vertex_t) + numSurfaceIndices_ * sizeof(uint32_t));
+    atoms_.upload(device, memprops, commandPool, queue, atoms, numAtoms_ * sizeof(Atom));
+    conns_.upload(device, memprops, commandPool, queue, conns, numConnections_ * sizeof(Connection));
+    instances_.upload(device, memprops, commandPool, queue, instances, numContexts_ * sizeof(Instance));
+    surfaceVertices_.upload(device, memprops, commandPool, queue, surfaceVertices, numSurfaceVertices_ * sizeof(SurfaceMesh::vertex_t));
+    surfaceIndices_.upload(device, memprops, commandPool, queue, surfaceIndices, numSurfaceIndices_ * sizeof(uint32_t));
+    pAtoms_ = (Atom*)atoms_.map(device);
+    surfaceUpdater_.reset(new SurfaceUpdater(atoms, atomStore_));
+  }
+
+  void updateDescriptorSet(vk::Device device, vk::DescriptorSetLayout layout, vk::DescriptorPool descriptorPool, vk::Sampler cubeSampler, vk::ImageView cubeImageView, vk::Sampler fountSampler, vk::ImageView fountImageView, vk::Buffer glyphs, int maxGlyphs) {
+    vku::DescriptorSetMaker dsm{};
+    dsm.layout(layout);
+    auto StandardLayout = dsm.create(device, descriptorPool);
+    descriptorSet_ = StandardLayout[0];
+
+    vku::DescriptorSetUpdater update;
+    update.beginDescriptorSet(descriptorSet_);
+
+    // Point the descriptor set at the storage buffer.
+    update.beginBuffers(0, 0, vk::DescriptorType::eStorageBuffer);
+    update.buffer(atoms_.buffer(), 0, numAtoms_ * sizeof(Atom));
+    update.beginBuffers(1, 0, vk::DescriptorType::eStorageBuffer);
+    update.buffer(glyphs, 0, maxGlyphs * sizeof(Glyph));
+    update.beginBuffers(3, 0, vk::DescriptorType::eStorageBuffer);
+    update.buffer(conns_.buffer(), 0, sizeof(Connection) * numConnections_);
+    update.beginImages(4, 0, vk::DescriptorType::eCombinedImageSampler);
+    update.image(cubeSampler, cubeImageView, vk::ImageLayout::eShaderReadOnlyOptimal);
+    update.beginImages(5, 0, vk::DescriptorType::eCombinedImageSampler);
+    update.image(fountSampler, fountImageView, vk::ImageLayout::eShaderReadOnlyOptimal);
+    update.beginBuffers(6, 0, vk::DescriptorType::eStorageBuffer);
+    update.buffer(instances_.buffer(), 0, numContexts_ * sizeof(Context));
+    update.beginBuffers(7, 0, vk::DescriptorType::eStorageBuffer);
+    update.buffer(surfaceVertices_.buffer(), 0, surfaceVertices_.size());
+
+    update.update(device);
+  }
+
+  /// Select atoms with an expression such as "chain A and resi 10-50 and name CA".
+  /// Distances are measured between the atoms where they are now, after any moves.
+  Selection select(const std::string &expression) {
+    gilgamesh::selection sel(expression);
+    if (!sel.uses_grid()) {
+      static const gilgamesh::atom_grid noGrid;
+      return Selection(sel.evaluate(atomStore_, noGrid, gilgamesh::hardware_threads()));
+    }
+    if (!atomGrid_) {
+      // Before upload() there are only the atoms as loaded.
+      if (pAtoms_) {
+        atomGridPos_.resize(numAtoms_);
+        for (size_t i = 0; i != numAtoms_; ++i) atomGridPos_[i] = pAtoms_[i].pos;
+      } else {
+        atomGridPos_ = atomStore_.pos();
+      }
+      atomGrid_.reset(new gilgamesh::atom_grid(atomGridPos_));
+    }
+    return Selection(sel.evaluate(atomStore_, atomGridPos_, *atomGrid_, gilgamesh::hardware_threads()));
+  }
+
+  /// The atom hit by a ray in model space, or -1. distance is how far along the ray it is.
+  int pick(glm::vec3 rayStart, glm::vec3 rayDir, float &distance) const {
+    return atomBvh_.pick(rayStart, glm::normalize(rayDir), distance);
+  }
+
+  /// Atoms as spheres of their drawn radius for spatial queries.
+  const gilgamesh::sphere_bvh &atomBvh() const { return atomBvh_; }
+
+  /// Ray trace the atoms, and the connections between them as cylinders, on the CPU.
+  /// This may run on any thread. The trees and colours it reads are locked for the frame,
+  /// so atoms_changed() and moves wait for it to finish.
+  void trace(gilgamesh::sphere_tracer &tracer, const gilgamesh::sphere_tracer::camera &camera, glm::vec3 lightDir, bool connections, unsigned numThreads) const {
+    std::lock_guard<std::mutex> lock(traceMutex_);
+    gilgamesh::sphere_tracer::scene scene;
+    scene.spheres = &atomBvh_;
+    scene.sphere_colours = atomColours_.data();
+    if (connections && numConnections_) {
+      scene.cylinders = &connBvh_;
+      scene.cylinder_ends = connEnds_.data();
+      scene.cylinder_radii = connRadii_.data();
+      scene.cylinder_colours = connColours_.data();
+    }
+    scene.light_dir = lightDir;
+    tracer.render(camera, scene, numThreads);
+  }
+
+  /// Views of the atoms' columns that share their memory (the GPU's mapped buffer when there is one).
+  /// positions and colours are n x 3 float32, radii float32 and selected int32, all writable;
+  /// call atoms_changed() after writing to them. The CPU renderer only sees the writes then,
+  /// so they are safe while a FrameStream is running. The per atom residue indices, residue
+  /// numbers and chain IDs are read only.
+  static bp::object positions(bp::object self) { return atomColumn(self, offsetof(Atom, pos), "f", 3); }
+  static bp::object radii(bp::object self) { return atomColumn(self, offsetof(Atom, radius), "f", 1); }
+  static bp::object colours(bp::object self) { return atomColumn(self, offsetof(Atom, colour), "f", 3); }
+  static bp::object selected(bp::object self) { return atomColumn(self, offsetof(Atom, selected), "i", 1); }
+
+  static bp::object residueIndices(bp::object self) {
+    Model &model = bp::extract<Model&>(self);
+    model.buildAtomResidues();
+    return ColumnBuffer::view(self, model.atomResidue_.data(), "i", sizeof(int), model.numAtoms_, 1, sizeof(int), true);
+  }
+
+  static bp::object residueNumbers(bp::object self) {
+    Model &model = bp::extract<Model&>(self);
+    model.buildAtomResidues();
+    return ColumnBuffer::view(self, model.atomResSeq_.data(), "i", sizeof(int), model.numAtoms_, 1, sizeof(int), true);
+  }
+
+  static bp::object chainIds(bp::object self) {
+    Model &model = bp::extract<Model&>(self);
+    model.buildAtomResidues();
+    return ColumnBuffer::view(self, model.atomChain_.data(), "c", 1, model.numAtoms_, 1, 1, true);
+  }
+
+  /// Bring the picking and tracing trees up to date with positions, radii and colours
+  /// written to atoms [begin, end). end of -1 means the last atom.
+  /// If a FrameStream is tracing a frame, this waits for it to finish.
+  void atomsChanged(int begin, int end) {
+    if (end < 0 || end > (int)numAtoms_) end = (int)numAtoms_;
+    if (begin < 0 || begin >= end) return;
+    updateAtoms(begin, end, true);
+  }
+
+  /// Tell the picking tree, the connection tree and the surface that atoms [begin, end) have moved.
+  void moveAtoms(int begin, int end) {
+    updateAtoms(begin, end, false);
+  }
+
+  /// Write the surface chunks remeshed since the last call to the surface buffers. Call between frames.
+  /// Each chunk has a range of each buffer with room to grow; only when a chunk outgrows
+  /// its range are the buffers laid out again and every chunk written.
+  bool updateSurface(Context &ctxt) {
+    if (!surfaceUpdater_) return false;
+    std::vector<std::pair<int, SurfaceMesh> > changes;
+    size_t numChunks = 0;
+    if (!surfaceUpdater_->takeChanges(changes, numChunks)) return false;
+
+    surfaceChunks_.resize(numChunks);
+    std::vector<bool> dirty(numChunks);
+    for (auto &c : changes) {
+      surfaceChunks_[c.first] = std::move(c.second);
+      dirty[c.first] = true;
+    }
+
+    bool fits = surfaceRanges_.size() == numChunks;
+    for (size_t c = 0; fits && c != numChunks; ++c) {
+      const SurfaceRange &r = surfaceRanges_[c];
+      fits = !dirty[c] || (surfaceChunks_[c].vertices().size() <= r.maxVertices && surfaceChunks_[c].indices().size() <= r.maxIndices);
+    }
+
+    // Frames in flight may still be reading the old mesh.
+    ctxt.waitForFrames();
+    if (!fits) layoutSurface(ctxt, surfaceChunks_);
+    writeSurfaceChunks(ctxt.device(), surfaceChunks_, dirty, !fits);
+    return true;
+  }
+
+  vk::DescriptorSet descriptorSet() const { return descriptorSet_; }
+  uint32_t numAtoms() const { return numAtoms_; }
+  uint32_t numConnections() const { return numConnections_; }
+  uint32_t numContexts() const { return numContexts_; }
+  uint32_t numSurfaceVertices() const { return numSurfaceVertices_; }
+  uint32_t numSurfaceIndices() const { return numSurfaceIndices_; }
+  const vku::GenericBuffer &atoms() const { return atoms_; }
+  Atom *pAtoms() const { return pAtoms_; }
+  const vku::GenericBuffer &conns() const { return conns_; }
+  const vku::GenericBuffer &surfaceVertices() const { return surfaceVertices_; }
+  const vku::GenericBuffer &surfaceIndices() const { return surfaceIndices_; }
+  const gilgamesh::atom_store &atomStore() const { return atomStore_; }
+
+  Model(const Model &rhs) {}
+  void operator=(const Model &rhs) {}
+
+  Model(Model &&rhs) = default;
+  Model &operator=(Model &&rhs) = default;
+
+private:
+  static bp::object atomColumn(bp::object self, size_t offset, const char *format, int width) {
+    Model &model = bp::extract<Model&>(self);
+    return ColumnBuffer::view(self, (char*)model.pAtoms_ + offset, format, 4, model.numAtoms_, width, sizeof(Atom), false);
+  }
+
+  // The atom store keeps residues and chains as ranges; Python wants a value per atom.
+  void buildAtomResidues() {
+    if (atomResidue_.size() == numAtoms_) return;
+    atomResidue_.resize(numAtoms_);
+    atomResSeq_.resize(numAtoms_);
+    atomChain_.resize(numAtoms_);
+    for (int c = 0; c != (int)atomStore_.num_chains(); ++c) {
+      auto residues = atomStore_.chain_residues(c);
+      for (int r = residues.begin; r != residues.end; ++r) {
+        auto range = atomStore_.residue_atoms(r);
+        for (int i = range.begin; i != range.end; ++i) {
+          atomResidue_[i] = r;
+          atomResSeq_[i] = atomStore_.res_seq(r);
+          atomChain_[i] = atomStore_.chain_id(c);
+        }
+      }
+    }
+  }
+
+  void report(const char *stage, float fraction = 0) {
+    if (progress_) progress_->report(stage, fraction);
+  }
+
+  // Move atoms [begin, end) and their connections in the trees and tell the surface.
+  // If styled is set, the radii and colours may have changed too, and with them
+  // the radius and colour of each connection, as in conns.vert.
+  void updateAtoms(int begin, int end, bool styled) {
+    // The selection grid is built again from the new positions when next needed.
+    atomGrid_.reset();
+    std::lock_guard<std::mutex> lock(traceMutex_);
+    for (int i = begin; i != end; ++i) {
+      const Atom &atom = pAtoms_[i];
+      if (styled) {
+        atomBvh_.move(i, atom.pos, atom.radius);
+        atomColours_[i] = atom.colour;
+      } else {
+        atomBvh_.move(i, atom.pos);
+      }
+      for (int j = atomConnStart_[i]; j != atomConnStart_[i+1]; ++j) {
+        int c = atomConns_[j];
+        const Atom &fromAtom = pAtoms_[connAtoms_[c * 2]], &toAtom = pAtoms_[connAtoms_[c * 2 + 1]];
+        glm::vec3 &from = connEnds_[c * 2], &to = connEnds_[c * 2 + 1];
+        (i == (int)connAtoms_[c * 2] ? from : to) = atom.pos;
+        if (styled) {
+          connRadii_[c] = std::min(fromAtom.radius, toAtom.radius) * 0.5f;
+          connColours_[c] = fromAtom.colour;
+        }
+        connBvh_.move(c, (from + to) * 0.5f, glm::length(to - from) * 0.5f + connRadii_[c]);
+      }
+    }
+    atomBvh_.refit();
+    connBvh_.refit();
+    if (surfaceUpdater_) surfaceUpdater_->move(pAtoms_, begin, end);
+  }
+
+  // Give each chunk a range of the surface buffers with a quarter as much again to grow into,
+  // making the buffers bigger if need be. Chunks that are empty get no room.
+  void layoutSurface(Context &ctxt, const std::vector<SurfaceMesh> &chunks) {
+    surfaceRanges_.resize(chunks.size());
+    uint32_t numVertices = 0, numIndices = 0;
+    for (size_t c = 0; c != chunks.size(); ++c) {
+      uint32_t v = (uint32_t)chunks[c].vertices().size(), i = (uint32_t)chunks[c].indices().size();
+      SurfaceRange &r = surfaceRanges_[c];
+      r.firstVertex = numVertices;
+      r.maxVertices = v ? v + v / 4 + 16 : 0;
+      r.firstIndex = numIndices;
+      r.maxIndices = i ? (i + i / 4) / 3 * 3 + 48 : 0;
+      numVertices += r.maxVertices;
+      numIndices += r.maxIndices;
+    }
+
+    auto device = ctxt.device();
+    size_t vertexBytes = (numVertices + 1) * sizeof(SurfaceMesh::vertex_t);
+    size_t indexBytes = (numIndices + 1) * sizeof(uint32_t);
+    if (vertexBytes > surfaceVertices_.size() || indexBytes > surfaceIndices_.size()) {
+      using buf = vk::BufferUsageFlagBits;
+      auto memprops = ctxt.memprops();
+      surfaceVertices_ = vku::GenericBuffer(device, memprops, buf::eStorageBuffer|buf::eTransferDst, vertexBytes, vk::MemoryPropertyFlagBits::eHostVisible);
+      surfaceIndices_ = vku::GenericBuffer(device, memprops, buf::eIndexBuffer|buf::eTransferDst, indexBytes, vk::MemoryPropertyFlagBits::eHostVisible);
+
+      vku::DescriptorSetUpdater update;
+      update.beginDescriptorSet(descriptorSet_);
+      update.beginBuffers(7, 0, vk::DescriptorType::eStorageBuffer);
+      update.buffer(surfaceVertices_.buffer(), 0, surfaceVertices_.size());
+      update.update(device);
+    }
+    numSurfaceVertices_ = numVertices;
+    numSurfaceIndices_ = numIndices;
+  }
+
+  // Write the dirty chunks, or all of them, to their ranges of the surface buffers.
+  void writeSurfaceChunks(vk::Device device, const std::vector<SurfaceMesh> &chunks, const std::vector<bool> &dirty, bool all) {
+    GILGAMESH_ZONE("Model::writeSurfaceChunks");
+    auto *vertices = (SurfaceMesh::vertex_t*)surfaceVertices_.map(device);
+    auto *indices = (uint32_t*)surfaceIndices_.map(device);
+    for (size_t c = 0; c != chunks.size(); ++c) {
+      if (!all && !dirty[c]) continue;
+      const SurfaceRange &r = surfaceRanges_[c];
+      const SurfaceMesh &mesh = chunks[c];
+      GILGAMESH_ZONE_ITEMS(mesh.vertices().size() * sizeof(SurfaceMesh::vertex_t) + r.maxIndices * sizeof(uint32_t));
+      std::copy(mesh.vertices().begin(), mesh.vertices().end(), vertices + r.firstVertex);
+      uint32_t *dest = indices + r.firstIndex;
+      for (uint32_t i : mesh.indices()) *dest++ = r.firstVertex + i;
+      // The rest of the range is degenerate triangles, which draw nothing.
+      std::fill(dest, indices + r.firstIndex + r.maxIndices, r.firstVertex);
+    }
+    surfaceVertices_.flush(device);
+    surfaceIndices_.flush(device);
+    surfaceVertices_.unmap(device);
+    surfaceIndices_.unmap(device);
+  }
+
+  // Read the arrays back from the cache and build the trees for picking and tracing.
+  void prepare() {
+    report("index");
+    size_t numAtoms, numConnections, numInstances, numSurfaceVertices, numSurfaceIndices;
+    const Atom *atoms = cache_.get<Atom>(cacheAtoms, numAtoms);
+    const Connection *conns = cache_.get<Connection>(cacheConnections, numConnections);
+    cache_.get<Instance>(cacheInstances, numInstances);
+    cache_.get<SurfaceMesh::vertex_t>(cacheSurfaceVertices, numSurfaceVertices);
+    cache_.get<uint32_t>(cacheSurfaceIndices, numSurfaceIndices);
+
+    numAtoms_ = (uint32_t)numAtoms;
+    numConnections_ = (uint32_t)numConnections;
+    numContexts_ = (uint32_t)numInstances;
+    numSurfaceVertices_ = (uint32_t)numSurfaceVertices;
+    numSurfaceIndices_ = (uint32_t)numSurfaceIndices;
+
+    buildBvh(atoms, conns);
+  }
+
+  void buildBvh(const Atom *atoms, const Connection *conns) {
+    GILGAMESH_ZONE("Model::buildBvh");
+    GILGAMESH_ZONE_ITEMS(numAtoms_);
+    std::vector<glm::vec3> centres(numAtoms_);
+    std::vector<float> radii(numAtoms_);
+    atomColours_.resize(numAtoms_);
+    for (uint32_t i = 0; i != numAtoms_; ++i) {
+      centres[i] = atoms[i].pos;
+      radii[i] = atoms[i].radius;
+      atomColours_[i] = atoms[i].colour;
+    }
+    atomBvh_ = gilgamesh::sphere_bvh(centres, radii, gilgamesh::hardware_threads());
+
+    // Connections are drawn as in conns.vert: half the radius of the smaller atom in the colour of the first.
+    // Each is bounded by a sphere around its middle.
+    connAtoms_.resize(numConnections_ * 2);
+    connEnds_.resize(numConnections_ * 2);
+    connRadii_.resize(numConnections_);
+    connColours_.resize(numConnections_);
+    centres.resize(numConnections_);
+    radii.resize(numConnections_);
+    atomConnStart_.assign(numAtoms_ + 1, 0);
+    for (uint32_t c = 0; c != numConnections_; ++c) {
+      const Atom &from = atoms[conns[c].from], &to = atoms[conns[c].to];
+      connAtoms_[c * 2] = conns[c].from;
+      connAtoms_[c * 2 + 1] = conns[c].to;
+      connEnds_[c * 2] = from.pos;
+      connEnds_[c * 2 + 1] = to.pos;
+      connRadii_[c] = std::min(from.radius, to.radius) * 0.5f;
+      connColours_[c] = from.colour;
+      centres[c] = (from.pos + to.pos) * 0.5f;
+      radii[c] = glm::length(to.pos - from.pos) * 0.5f + connRadii_[c];
+      atomConnStart_[conns[c].from + 1]++;
+      atomConnStart_[conns[c].to + 1]++;
+    }
+    connBvh_ = gilgamesh::sphere_bvh(centres, radii, gilgamesh::hardware_threads());
+
+    // The connections of each atom, so that moving an atom can move them.
+    for (uint32_t i = 0; i != numAtoms_; ++i) {
+      atomConnStart_[i + 1] += atomConnStart_[i];
+    }
+    atomConns_.resize(numConnections_ * 2);
+    std::vector<int> fill(atomConnStart_.begin(), atomConnStart_.end() - 1);
+    for (uint32_t c = 0; c != numConnections_ * 2; ++c) {
+      atomConns_[fill[connAtoms_[c]]++] = (int)(c / 2);
+    }
+  }
+
+  // Change this when the layout or meaning of the cached arrays changes.
+  static const uint32_t cacheVersion = 5;
+
+  enum CacheTag : uint32_t {
+    cacheAtoms = 1,
+    cacheConnections,
+    cacheInstances,
+    cacheSurfaceVertices,
+    cacheSurfaceIndices,
+    cacheAtomStore,
+    // The atom store uses atom_store::num_tags tags from cacheAtomStore.
+  };
+
+  // The cache lives in $MOOVOO_CACHE_DIR, or in a moovoo directory in the user's cache:
+  // %LOCALAPPDATA% on Windows, ~/Library/Caches on macOS and $XDG_CACHE_HOME or ~/.cache elsewhere.
+  // Other users cannot write to it, so they cannot plant a cache for a file we load.
+  static std::string cacheDir() {
+    if (const char *dir = getenv("MOOVOO_CACHE_DIR")) return dir;
+    std::string base;
+    #if defined(_WIN32)
+      if (const char *dir = getenv("LOCALAPPDATA")) base = dir;
+    #elif defined(__APPLE__)
+      if (const char *home = getenv("HOME")) base = std::string(home) + "/Library/Caches";
+    #else
+      if (const char *dir = getenv("XDG_CACHE_HOME")) base = dir;
+      else if (const char *home = getenv("HOME")) base = std::string(home) + "/.cache";
+    #endif
+    // With nowhere to put it, the cache is not written and models are kept in memory.
+    if (base.empty()) return "";
+    makeDir(base);
+    base += "/moovoo";
+    makeDir(base);
+    return base;
+  }
+
+  static void makeDir(const std::string &path) {
+    #if defined(_WIN32)
+      _mkdir(path.c_str());
+    #else
+      mkdir(path.c_str(), 0700);
+    #endif
+  }
+
+  static std::string cacheFileName(uint64_t key) {
+    std::string path = cacheDir();
+    if (path.empty()) return path;
+    if (path.back() != '/' && path.back() != '\\') path += '/';
+    char name[64];
+    snprintf(name, sizeof(name), "moovoo-%016llx.bin", (unsigned long long)key);
+    return path + name;
+  }
+
+  // Decoding, finding bonds and building the surface are slow for big molecules,
+  // so the results are kept in a file named after a hash of the source.
+  bool openCache(uint64_t key) {
+    std::string fileName = cacheFileName(key);
+    if (fileName.empty()) return false;
+    cacheFile_ = gilgamesh::mapped_file(fileName);
+    cache_ = gilgamesh::array_file(cacheFile_.begin(), cacheFile_.end(), cacheVersion, key);
+    return cache_.valid() && checkCache();
+  }
+
+  // A cache file may be damaged or stale, so check that every array is there with
+  // sizes that agree and that every index is in range before using any of it.
+  // This also reads the atom store. A file that fails is rebuilt.
+  bool checkCache() {
+    size_t numAtoms, numConnections, numInstances, numSurfaceVertices, numSurfaceIndices;
+    const Atom *atoms = cache_.get<Atom>(cacheAtoms, numAtoms);
+    const Connection *conns = cache_.get<Connection>(cacheConnections, numConnections);
+    const Instance *instances = cache_.get<Instance>(cacheInstances, numInstances);
+    const SurfaceMesh::vertex_t *surfaceVertices = cache_.get<SurfaceMesh::vertex_t>(cacheSurfaceVertices, numSurfaceVertices);
+    const uint32_t *surfaceIndices = cache_.get<uint32_t>(cacheSurfaceIndices, numSurfaceIndices);
+    if (!atoms || !conns || !instances || !surfaceVertices || !surfaceIndices) return false;
+
+    const size_t maxCount = 0x7fffffff;
+    if (numAtoms > maxCount || numConnections > maxCount || numInstances > maxCount) return false;
+    if (numSurfaceVertices > maxCount || numSurfaceIndices > maxCount || numSurfaceIndices % 3) return false;
+
+    for (size_t c = 0; c != numConnections; ++c) {
+      if (conns[c].from >= numAtoms || conns[c].to >= numAtoms) return false;
+    }
+    for (size_t i = 0; i != numSurfaceIndices; ++i) {
+      if (surfaceIndices[i] >= numSurfaceVertices) return false;
+    }
+    return atomStore_.read(cache_, cacheAtomStore) && atomStore_.size() == numAtoms;
+  }
+
+  enum Compression {
+    uncompressed,
+    gzip,
+    brotli,
+  };
+
+  // gzip has a magic number but brotli does not, so a source is taken to be
+  // text if it starts like a PDB or mmCIF file and brotli otherwise.
+  static Compression compression(const uint8_t *b, const uint8_t *e) {
+    if (andyzip::gzip_decoder::is_gzip(b, e)) return gzip;
+    return looksLikeText(b, e) ? uncompressed : brotli;
+  }
+
+  // True if the source starts, after any UTF-8 BOM and blank space, with a PDB record name,
+  // an mmCIF data block or a comment.
+  static bool looksLikeText(const uint8_t *b, const uint8_t *e) {
+    if (e - b >= 3 && b[0] == 0xef && b[1] == 0xbb && b[2] == 0xbf) b += 3;
+    while (b != e && (*b == ' ' || *b == '\t' || *b == '\r' || *b == '\n')) ++b;
+    if (b == e) return true;
+    if (*b == '#' || (e - b >= 5 && !memcmp(b, "data_", 5))) return true;
+
+    static const char *records[] = {
+      "HEADER", "OBSLTE", "TITLE", "SPLIT", "CAVEAT", "COMPND", "SOURCE", "KEYWDS", "EXPDTA",
+      "NUMMDL", "MDLTYP", "AUTHOR", "REVDAT", "SPRSDE", "JRNL", "REMARK", "DBREF", "SEQADV",
+      "SEQRES", "MODRES", "HET", "HETNAM", "HETSYN", "FORMUL", "HELIX", "SHEET", "SSBOND",
+      "LINK", "CISPEP", "SITE", "CRYST1", "ORIGX", "SCALE", "MTRIX", "MODEL", "ATOM", "ANISOU",
+      "TER", "HETATM", "ENDMDL", "CONECT", "MASTER", "END",
+    };
+    for (const char *record : records) {
+      size_t len = strlen(record);
+      if ((size_t)(e - b) < len || memcmp(b, record, len)) continue;
+      // The name must end there, or be followed by a digit as in ORIGX1.
+      const uint8_t *p = b + len;
+      if (p == e || *p == ' ' || *p == '\r' || *p == '\n' || (*p >= '1' && *p <= '3')) return true;
+    }
+    return false;
+  }
+
+  // Decompress on a second thread while this one decodes the text.
+  // The threads meet in a small ring of buffers, so the whole text is never in memory.
+  // Some text files do not start with a known record. If the stream fails before it gives
+  // any text, the source is taken to be text after all.
+  static void decodeCompressed(Compression kind, const uint8_t *b, const uint8_t *e, gilgamesh::pdb_decoder &pdb) {
+    if (kind == brotli && (size_t)(e - b) > andyzip::brotli_decoder_state::max_src_bytes) {
+      throw std::runtime_error("Model cannot decompress brotli sources of 512MB or more");
+    }
+
+    gilgamesh::buffer_ring ring;
+    std::thread decompressor([kind, b, e, &ring]() {
+      auto write = [&ring](const uint8_t *b, const uint8_t *e) { return ring.write(b, e); };
+      bool ok = false;
+      try {
+        if (kind == gzip) {
+          andyzip::gzip_decoder decoder;
+          ok = decoder.decode_stream(b, e, write);
+        } else {
+          andyzip::brotli_decoder_state state;
+          state.src = (const char *)b;
+          state.bitptr_max = (uint32_t)((e - b) * 8);
+          andyzip::brotli_decoder decoder;
+          ok = decoder.decode_stream(state, write) == andyzip::brotli_decoder_state::error_code::end;
+        }
+      } catch (...) {
+      }
+      ring.close(ok);
+    });
+
+    bool ok;
+    bool decoded = false;
+    try {
+      ok = ring.read([&pdb, &decoded](const uint8_t *b, const uint8_t *e) { decoded |= b != e; pdb.feed(b, e); return true; });
+    } catch (...) {
+      ring.stop();
+      decompressor.join();
+      throw;
+    }
+    decompressor.join();
+    if (!ok && kind == brotli && !decoded) {
+      pdb.feed(b, e);
+    } else if (!ok) {
+      throw std::runtime_error("Model could not decompress the source");
+    }
+  }
+
+  void loadBytes(bp::object bytes) {
     Py_buffer pybuf;
     if (PyObject_GetBuffer(bytes.ptr(), &pybuf, PyBUF_SIMPLE) < 0) {
       throw std::runtime_error("Model expects buffer object");
@@ -351,113 +1265,235 @@ public:
 
     const uint8_t *b = (const uint8_t *)pybuf.buf;
     const uint8_t *e = b + pybuf.len;
-    pdb_ = gilgamesh::pdb_decoder(b, e);
+    try {
+      loadBytes(b, e);
+    } catch (...) {
+      PyBuffer_Release(&pybuf);
+      throw;
+    }
     PyBuffer_Release(&pybuf);
+  }
+
+  void loadBytes(const uint8_t *b, const uint8_t *e) {
+    GILGAMESH_ZONE("Model::loadBytes");
+    GILGAMESH_ZONE_ITEMS(e - b);
+    report("hash");
+    uint64_t key = gilgamesh::hash_bytes(b, e - b);
+    if (openCache(key)) return;
+
+    gilgamesh::pdb_decoder pdb(gilgamesh::hardware_threads());
+    Compression kind = compression(b, e);
+    if (kind == uncompressed) {
+      // A window at a time, to report progress and notice cancellation.
+      static const size_t windowSize = 1 << 22;
+      for (const uint8_t *p = b; p != e; ) {
+        report("decode", (float)(p - b) / (e - b));
+        const uint8_t *q = p + std::min((size_t)(e - p), windowSize);
+        pdb.feed(p, q);
+        p = q;
+      }
+    } else {
+      report("decode");
+      decodeCompressed(kind, b, e, pdb);
+    }
+    pdb.finish();
+    buildCache(pdb, key);
+  }
+
+  // Call fn(begin, end) for each window of a file object until it is empty.
+  template <class Fn>
+  static void readWindows(bp::object &file, Fn fn) {
+    static const int windowSize = 1 << 20;
+    for (;;) {
+      bp::object window = file.attr("read")(windowSize);
+      Py_buffer pybuf;
+      if (PyObject_GetBuffer(window.ptr(), &pybuf, PyBUF_SIMPLE) < 0) {
+        throw std::runtime_error("Model expects a file opened in binary mode");
+      }
+      const uint8_t *b = (const uint8_t *)pybuf.buf;
+      const uint8_t *e = b + pybuf.len;
+      if (b != e) fn(b, e);
+      PyBuffer_Release(&pybuf);
+      if (b == e) break;
+    }
+  }
+
+  // If the file can seek, hash it first so that a cached model is not decoded at all.
+  // Otherwise hash and decode in one pass.
+  // Text windows go straight to the decoder. Compressed files are much smaller,
+  // so they are collected and decompressed alongside decoding at the end.
+  void loadFile(bp::object file) {
+    gilgamesh::byte_hasher hasher;
+    gilgamesh::pdb_decoder pdb(gilgamesh::hardware_threads());
+    std::vector<uint8_t> compressed;
+    Compression kind = uncompressed;
+    bool first = true;
+    auto decode = [&pdb, &compressed, &kind, &first](const uint8_t *b, const uint8_t *e) {
+      if (first) kind = compression(b, e);
+      first = false;
+      if (kind == uncompressed) {
+        pdb.feed(b, e);
+      } else {
+        compressed.insert(compressed.end(), b, e);
+      }
+    };
+    auto finish = [&]() {
+      if (kind != uncompressed) {
+        decodeCompressed(kind, compressed.data(), compressed.data() + compressed.size(), pdb);
+      }
+      pdb.finish();
+    };
+
+    bool seekable = PyObject_HasAttrString(file.ptr(), "seekable") && bp::extract<bool>(file.attr("seekable")());
+    if (seekable) {
+      bp::object start = file.attr("tell")();
+      readWindows(file, [&hasher](const uint8_t *b, const uint8_t *e) { hasher.update(b, e - b); });
+      uint64_t key = hasher.digest();
+      if (openCache(key)) return;
+
+      file.attr("seek")(start);
+      readWindows(file, decode);
+      finish();
+      buildCache(pdb, key);
+    } else {
+      readWindows(file, [&hasher, &decode](const uint8_t *b, const uint8_t *e) {
+        hasher.update(b, e - b);
+        decode(b, e);
+      });
+      uint64_t key = hasher.digest();
+      if (!openCache(key)) {
+        finish();
+        buildCache(pdb, key);
+      }
+    }
+  }
+
+  // Add the bonds of the standard residues from the templates.
+  static void addImplicitConnections(const gilgamesh::atom_store &store, std::vector<std::pair<int, int>> &pairs) {
+    using gilgamesh::pdb_decoder;
+    GILGAMESH_ZONE("Model::addImplicitConnections");
+    GILGAMESH_ZONE_ITEMS(store.size());
+    auto atomId = [&store](size_t i) { return store.atom_id((int)i); };
+    for (int c = 0; c != (int)store.num_chains(); ++c) {
+      int prevC = -1;
+      auto residues = store.chain_residues(c);
+      for (int r = residues.begin; r != residues.end; ++r) {
+        // iCode is 'A' etc. for alternates.
+        // The templates only know the standard residues; ligands and the like are left to findBonds.
+        char iCode = store.i_code(r);
+        if (!store.is_hetatom(r) && (iCode == ' ' || iCode == '?')) {
+          auto range = store.residue_atoms(r);
+          prevC = pdb_decoder::connectResidue(atomId, store.residue_id(r), pairs, range.begin, range.end, prevC, false);
+        }
+      }
+    }
+  }
+
+  // Add bonds between atoms near enough to be bonded and from CONECT records to the template bonds,
+  // leaving each pair once with the lower index first.
+  // The store must have its cold columns for the serial and model numbers.
+  static void findBonds(const gilgamesh::pdb_decoder &pdb, const gilgamesh::atom_store &store, std::vector<std::pair<int, int>> &pairs) {
+    GILGAMESH_ZONE("Model::findBonds");
+    GILGAMESH_ZONE_ITEMS(store.size());
+    std::vector<float> radii;
+    std::unordered_map<int, int> serials;
+    for (int i = 0; i != (int)store.size(); ++i) {
+      serials.emplace(store.serial(i), i);
+      radii.push_back(gilgamesh::pdb_decoder::atom::covalentRadius(store.element_id(i)));
+    }
+
+    // The bond finder gets the atoms in Hilbert order, so that files with many overlapping models
+    // or chains far apart in the file do not scatter its neighbour searches; its indices are mapped back.
+    // Alternate positions of a residue are not bonded to each other, nor are atoms of different models.
+    gilgamesh::spatial_order order(store.pos());
+    gilgamesh::bond_finder finder(order.gather(store.pos()), order.gather(radii), 0.4f, 0.4f, gilgamesh::hardware_threads());
+    for (auto &b : finder.bonds()) {
+      int from = order.original(b.first);
+      int to = order.original(b.second);
+      if (store.model(from) != store.model(to)) continue;
+      char alt0 = store.alt_loc(from);
+      char alt1 = store.alt_loc(to);
+      auto isAlt = [](char c) { return c != ' ' && c != '.' && c != '?' && c != 0; };
+      if (!isAlt(alt0) || !isAlt(alt1) || alt0 == alt1) pairs.emplace_back(from, to);
+    }
+
+    for (auto &c : pdb.connections()) {
+      auto from = serials.find(c.first);
+      auto to = serials.find(c.second);
+      if (from != serials.end() && to != serials.end() && from->second != to->second) {
+        pairs.emplace_back(from->second, to->second);
+      }
+    }
+
+    for (auto &p : pairs) {
+      if (p.first > p.second) std::swap(p.first, p.second);
+    }
+    std::sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+  }
 
-    std::string chains = pdb_.chains();
-    pdbAtoms_ = pdb_.atoms(chains);
+  // Build the GPU arrays from the decoded molecule and write them to the cache.
+  void buildCache(const gilgamesh::pdb_decoder &pdb, uint64_t key) {
+    GILGAMESH_ZONE("Model::buildCache");
+    using gilgamesh::pdb_decoder;
+    gilgamesh::atom_store store(pdb.allAtoms(), true);
 
     glm::vec3 mean(0);
-    glm::vec3 min(1e38f);
-    glm::vec3 max(-1e38f);
-    for (auto &atom : pdbAtoms_) {
-      glm::vec3 pos = atom.pos();
-      min = glm::min(min, pos);
-      max = glm::max(max, pos);
-      mean += pos;
+    for (auto &p : store.pos()) {
+      mean += p;
     }
-    mean /= (float)pdbAtoms_.size();
+    mean /= (float)store.size();
 
+    // Waters are left out of the surface.
     std::vector<Atom> atoms;
     std::vector<glm::vec3> pos;
     std::vector<float> radii;
-    for (auto &atom : pdbAtoms_) {
-      glm::vec3 colour = atom.colorByElement();
-      colour.r = colour.r * 0.75f + 0.25f;
-      colour.g = colour.g * 0.75f + 0.25f;
-      colour.b = colour.b * 0.75f + 0.25f;
-      Atom a{};
-      a.pos = a.prevPos = atom.pos() - mean;
-      pos.push_back(a.pos);
-      float scale = 0.1f;
-      if (atom.atomNameIs("N") || atom.atomNameIs("CA") || atom.atomNameIs("C") || atom.atomNameIs("P")) scale = 0.4f;
-      float radius = atom.vanDerVaalsRadius();
-      radii.push_back(radius);
-      a.radius = radius * scale;
-      a.colour = colour;
-      a.acc = glm::vec3(0, 0, 0);
-      a.mass = 1.0f;
-      std::fill(std::begin(a.connections), std::end(a.connections), -1);
-      atoms.push_back(a);
-    }
-
-    min -= mean;
-    max -= mean;
-    glm::vec3 extent = max - min;
-    float grid_spacing = 1.0f;
-    int xdim = int(extent.x / grid_spacing) + 1;
-    int ydim = int(extent.y / grid_spacing) + 1;
-    int zdim = int(extent.z / grid_spacing) + 1;
-
-    printf("%dx%dx%d\n", xdim, ydim, zdim);
-    gilgamesh::distance_field df(xdim, ydim, zdim, grid_spacing, min, pos, radii);
-
-    auto &distance = df.distances();
-
-    auto idx = [xdim, ydim, zdim](int x, int y, int z) { return (z * ydim + y) + xdim + x; };
-
-    std::vector<glm::vec3> solventAcessible;
-    for (int z = 0; z != zdim; ++z) {
-      for (int y = 0; y != ydim; ++y) {
-        for (int x = 0; x != xdim; ++x) {
-          int i = idx(x, y, z);
-          float d000 = distance[i];
-          float d100 = distance[i + idx(1, 0, 0)];
-          float d010 = distance[i + idx(0, 1, 0)];
-          float d001 = distance[i + idx(0, 0, 1)];
-          glm::vec3 pos = min + glm::vec3(x, y, z) * grid_spacing;
-          if (d000 * d100 < 0) {
-            float d = grid_spacing + d000 / (d000 - d100);
-            solventAcessible.push_back(glm::vec3(pos.x + d, pos.y, pos.z));
-          }
-          if (d000 * d010 < 0) {
-            float d = grid_spacing + d000 / (d000 - d010);
-            solventAcessible.push_back(glm::vec3(pos.x, pos.y + d, pos.z));
-          }
-          if (d000 * d001 < 0) {
-            float d = grid_spacing + d000 / (d000 - d001);
-            solventAcessible.push_back(glm::vec3(pos.x, pos.y, pos.z + d));
-          }
+    std::vector<int> surfaceAtoms;
+    for (int r = 0; r != (int)store.num_residues(); ++r) {
+      bool water = pdb_decoder::atom::isWater(store.residue_id(r));
+      auto range = store.residue_atoms(r);
+      for (int i = range.begin; i != range.end; ++i) {
+        uint16_t element = store.element_id(i);
+        uint32_t name = store.atom_id(i);
+        glm::vec3 colour = pdb_decoder::atom::colorByElement(element);
+        colour.r = colour.r * 0.75f + 0.25f;
+        colour.g = colour.g * 0.75f + 0.25f;
+        colour.b = colour.b * 0.75f + 0.25f;
+        Atom a{};
+        a.pos = a.prevPos = store.pos(i) - mean;
+        float scale = 0.1f;
+        if (name == pdb_decoder::name_id("N") || name == pdb_decoder::name_id("CA") || name == pdb_decoder::name_id("C") || name == pdb_decoder::name_id("P")) scale = 0.4f;
+        float radius = pdb_decoder::atom::vanDerVaalsRadius(element);
+        if (!water) {
+          surfaceAtoms.push_back((int)atoms.size());
+          pos.push_back(a.pos);
+          radii.push_back(radius);
         }
+        a.radius = radius * scale;
+        a.colour = colour;
+        a.acc = glm::vec3(0, 0, 0);
+        a.mass = 1.0f;
+        std::fill(std::begin(a.connections), std::end(a.connections), -1);
+        atoms.push_back(a);
       }
     }
-    numSolventAcessible_ = (uint32_t)solventAcessible.size();
 
-    std::vector<std::pair<int, int>> pairs;
-    int prevC = -1;
-    char prevChainID = '?';
-    for (size_t bidx = 0; bidx != pdbAtoms_.size(); ) {
-      // At the start of every Amino Acid, connect the atoms.
-      char chainID = pdbAtoms_[bidx].chainID();
-      char iCode = pdbAtoms_[bidx].iCode();
-      size_t eidx = pdb_.nextResidue(pdbAtoms_, bidx);
-      if (prevChainID != chainID) prevC = -1;
-
-      // iCode is 'A' etc. for alternates.
-      if (iCode == ' ' || iCode == '?') {
-        /*for (size_t i = bidx; i != eidx; ++i) {
-          for (size_t j = i+1; j <= eidx; ++j) {
-            if (length(atoms[i].pos - atoms[j].pos) < vdv[i] + vdv[j]) {
-              pairs.emplace_back((int)i, (int)j);
-            }
-          }
-        }*/
-        prevC = pdb_.addImplicitConnections(pdbAtoms_, pairs, bidx, eidx, prevC, false);
-        prevChainID = chainID;
-      }
-      bidx = eidx;
+    report("surface");
+    SurfaceMesh surface;
+    if (!pos.empty()) {
+      unsigned numThreads = gilgamesh::hardware_threads();
+      gilgamesh::molecular_surface ses = buildSurface(pos, radii, numThreads);
+      surface = ses.mesh<SurfaceMesh>(
+        [&atoms, &surfaceAtoms](int pindex) { return pindex == -1 ? glm::vec4(1) : glm::vec4(atoms[surfaceAtoms[pindex]].colour, 1); },
+        numThreads
+      );
     }
 
+    report("bonds");
+    std::vector<std::pair<int, int>> pairs;
+    addImplicitConnections(store, pairs);
+    findBonds(pdb, store, pairs);
+
     for (auto &p : pairs) {
       Atom &from = atoms[p.first];
       Atom &to = atoms[p.second];
@@ -514,7 +1550,7 @@ public:
     }
 
     std::vector<Instance> instances;
-    for (auto &mat : pdb_.instanceMatrices()) {
+    for (auto &mat : pdb.instanceMatrices()) {
       Instance ins{};
       ins.modelToWorld = mat;
       instances.push_back(ins);
@@ -525,94 +1561,225 @@ public:
       instances.push_back(ins);
     }
 
-    numAtoms_ = (uint32_t)atoms.size();
-    numConnections_ = (uint32_t)conns.size();
-    numContexts_ = (uint32_t)instances.size();
-
-    auto memprops = inst.memprops();
-    auto device = inst.device();
-    auto commandPool = inst.commandPool();
-    auto queue = inst.queue();
+    report("cache");
+    gilgamesh::array_file_writer writer(cacheVersion, key);
+    writer.add(cacheAtoms, atoms);
+    writer.add(cacheConnections, conns);
+    writer.add(cacheInstances, instances);
+    writer.add(cacheSurfaceVertices, surface.vertices());
+    writer.add(cacheSurfaceIndices, surface.indices());
+    store.write(writer, cacheAtomStore);
+    std::string fileName = cacheFileName(key);
+    if (fileName.empty() || !writer.write(fileName) || !openCache(key)) {
+      // We could not write or map the file, so keep the arrays in memory.
+      cacheFile_.close();
+      cacheImage_ = writer.bytes();
+      cache_ = gilgamesh::array_file(cacheImage_.data(), cacheImage_.data() + cacheImage_.size(), cacheVersion, key);
+      if (!checkCache()) {
+        throw std::runtime_error("Model could not build its arrays");
+      }
+    }
+  }
 
-    using buf = vk::BufferUsageFlagBits;
-    atoms_ = vku::GenericBuffer(device, memprops, buf::eStorageBuffer|buf::eTransferDst, (numAtoms_+1) * sizeof(Atom), vk::MemoryPropertyFlagBits::eHostVisible);
-    pick_ = vku::GenericBuffer(device, memprops, buf::eStorageBuffer, sizeof(Pick) * Pick::fifoSize, vk::MemoryPropertyFlagBits::eHostVisible);
-    conns_ = vku::GenericBuffer(device, memprops, buf::eStorageBuffer|buf::eTransferDst, sizeof(Connection) * (numConnections_+1), vk::MemoryPropertyFlagBits::eHostVisible);
-    instances_ = vku::GenericBuffer(device, memprops, buf::eStorageBuffer|buf::eTransferDst, sizeof(Context) * numContexts_, vk::MemoryPropertyFlagBits::eHostVisible);
-    solventAcessible_ = vku::GenericBuffer(device, memprops, buf::eStorageBuffer|buf::eTransferDst, sizeof(glm::vec3) * (solventAcessible.size()+1), vk::MemoryPropertyFlagBits::eHostVisible);
+  uint32_t numAtoms_;
+  uint32_t numConnections_;
+  uint32_t numContexts_;
+  uint32_t numSurfaceVertices_;
+  uint32_t numSurfaceIndices_;
+  vku::GenericBuffer atoms_;
+  vku::GenericBuffer conns_;
+  vku::GenericBuffer instances_;
+  vku::GenericBuffer surfaceVertices_;
+  vku::GenericBuffer surfaceIndices_;
+  vk::DescriptorSet descriptorSet_;
+  gilgamesh::mapped_file cacheFile_;
+  std::vector<uint8_t> cacheImage_;
+  gilgamesh::array_file cache_;
+  gilgamesh::atom_store atomStore_;
+  std::unique_ptr<gilgamesh::atom_grid> atomGrid_;
+  std::vector<glm::vec3> atomGridPos_;   // the positions atomGrid_ was built from
+  mutable std::mutex traceMutex_;        // held by trace() and by changes to the trees and colours below
+  gilgamesh::sphere_bvh atomBvh_;
+  std::vector<glm::vec3> atomColours_;
+  gilgamesh::sphere_bvh connBvh_;
+  std::vector<uint32_t> connAtoms_;      // from, to
+  std::vector<glm::vec3> connEnds_;      // from, to
+  std::vector<float> connRadii_;
+  std::vector<glm::vec3> connColours_;
+  std::vector<int> atomConnStart_;       // atom i has connections atomConns_[atomConnStart_[i], atomConnStart_[i+1])
+  std::vector<int> atomConns_;
+  std::vector<int> atomResidue_;         // per atom columns for Python, made when first asked for
+  std::vector<int> atomResSeq_;
+  std::vector<char> atomChain_;
+  std::vector<Atom> hostAtoms_;          // the atoms when there is no GPU
+  Atom *pAtoms_ = nullptr;
+  std::unique_ptr<SurfaceUpdater> surfaceUpdater_;
+  std::vector<SurfaceMesh> surfaceChunks_;  // the mesh of each chunk, as last written
+
+  // Where each surface chunk lives in surfaceVertices_ and surfaceIndices_.
+  struct SurfaceRange {
+    uint32_t firstVertex;
+    uint32_t maxVertices;
+    uint32_t firstIndex;
+    uint32_t maxIndices;
+  };
+  std::vector<SurfaceRange> surfaceRanges_;
+  LoadProgress *progress_ = nullptr;
+};
 
-    atoms_.upload(device, memprops, commandPool, queue, atoms);
-    conns_.upload(device, memprops, commandPool, queue, conns);
-    instances_.upload(device, memprops, commandPool, queue, instances);
-    solventAcessible_.upload(device, memprops, commandPool, queue, solventAcessible);
-    pAtoms_ = (Atom*)atoms_.map(device);
+// Loads a model on a thread of its own so that Python carries on meanwhile,
+// and several models can load at once. Decoding, bonding, the surface and the
+// trees are built without the GIL. The upload is left to result(), on the
+// thread that draws, so it never races the render loop for the queue.
+class ModelLoader {
+public:
+  /// source is a bytes-like object, a path or a binary file object.
+  /// A file object is read on the loading thread, which takes the GIL for each window it reads.
+  ModelLoader(bp::object pyCtxt, bp::object source) : pyCtxt_(pyCtxt), model_(new Model()) {
+    bp::extract<std::string> path(source);
+    if (path.check()) {
+      path_ = path();
+    } else if (PyObject_HasAttrString(source.ptr(), "read")) {
+      file_ = source;
+      haveFile_ = true;
+    } else {
+      if (PyObject_GetBuffer(source.ptr(), &buffer_, PyBUF_SIMPLE) < 0) {
+        throw std::runtime_error("Model.load_async expects a path, a buffer object or a binary file");
+      }
+      haveBuffer_ = true;
+    }
+    thread_ = std::thread([this]() { run(); });
+  }
 
-    printf("done\n");
+  ~ModelLoader() {
+    progress_.cancel();
+    {
+      ReleaseGil unlocked;
+      thread_.join();
+    }
+    if (haveBuffer_) PyBuffer_Release(&buffer_);
   }
 
-  void updateDescriptorSet(vk::Device device, vk::DescriptorSetLayout layout, vk::DescriptorPool descriptorPool, vk::Sampler cubeSampler, vk::ImageView cubeImageView, vk::Sampler fountSampler, vk::ImageView fountImageView, vk::Buffer glyphs, int maxGlyphs) {
-    vku::DescriptorSetMaker dsm{};
-    dsm.layout(layout);
-    auto StandardLayout = dsm.create(device, descriptorPool);
-    descriptorSet_ = StandardLayout[0];
+  /// The stage the load is at: queued, read, hash, decode, surface, bonds, cache, index, upload or done.
+  std::string stage() const { return progress_.stage(); }
 
-    vku::DescriptorSetUpdater update;
-    update.beginDescriptorSet(descriptorSet_);
+  /// How far through the stage the load is, from 0 to 1, where the stage can tell.
+  float fraction() const { return progress_.fraction(); }
 
-    // Point the descriptor set at the storage buffer.
-    update.beginBuffers(0, 0, vk::DescriptorType::eStorageBuffer);
-    update.buffer(atoms_.buffer(), 0, numAtoms_ * sizeof(Atom));
-    update.beginBuffers(1, 0, vk::DescriptorType::eStorageBuffer);
-    update.buffer(glyphs, 0, maxGlyphs * sizeof(Glyph));
-    update.beginBuffers(2, 0, vk::DescriptorType::eStorageBuffer);
-    update.buffer(pick_.buffer(), 0, sizeof(Pick) * Pick::fifoSize);
-    update.beginBuffers(3, 0, vk::DescriptorType::eStorageBuffer);
-    update.buffer(conns_.buffer(), 0, sizeof(Connection) * numConnections_);
-    update.beginImages(4, 0, vk::DescriptorType::eCombinedImageSampler);
-    update.image(cubeSampler, cubeImageView, vk::ImageLayout::eShaderReadOnlyOptimal);
-    update.beginImages(5, 0, vk::DescriptorType::eCombinedImageSampler);
-    update.image(fountSampler, fountImageView, vk::ImageLayout::eShaderReadOnlyOptimal);
-    update.beginBuffers(6, 0, vk::DescriptorType::eStorageBuffer);
-    update.buffer(instances_.buffer(), 0, numContexts_ * sizeof(Context));
-    update.beginBuffers(7, 0, vk::DescriptorType::eStorageBuffer);
-    update.buffer(solventAcessible_.buffer(), 0, solventAcessible_.size());
+  /// Stop the load at the next stage. result() then raises an error.
+  void cancel() { progress_.cancel(); }
 
-    update.update(device);
+  /// Wait up to timeout seconds for the load to finish. Returns true if it has.
+  bool wait(double timeout) {
+    ReleaseGil unlocked;
+    std::unique_lock<std::mutex> lock(mutex_);
+    return finished_.wait_for(lock, std::chrono::duration<double>(timeout), [this]() { return done_; });
   }
 
-  vk::DescriptorSet descriptorSet() const { return descriptorSet_; }
-  uint32_t numAtoms() const { return numAtoms_; }
-  uint32_t numConnections() const { return numConnections_; }
-  uint32_t numContexts() const { return numContexts_; }
-  uint32_t numSolventAcessible() const { return numSolventAcessible_; }
-  const vku::GenericBuffer &atoms() const { return atoms_; }
-  Atom *pAtoms() const { return pAtoms_; }
-  const vku::GenericBuffer &pick() const { return pick_; }
-  const vku::GenericBuffer &conns() const { return conns_; }
-  const vku::GenericBuffer &solventAcessible() const { return solventAcessible_; }
-  const std::vector<gilgamesh::pdb_decoder::atom> &pdbAtoms() { return pdbAtoms_; }
-
-  Model(const Model &rhs) {}
-  void operator=(const Model &rhs) {}
+  bool done() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return done_;
+  }
 
-  Model(Model &&rhs) = default;
-  Model &operator=(Model &&rhs) = default;
+  /// Wait for the load, upload the model and return it.
+  /// A signal such as Ctrl-C while waiting raises its exception; the load carries on.
+  bp::object result() {
+    while (!wait(0.1)) {
+      if (PyErr_CheckSignals() < 0) throw bp::error_already_set();
+    }
+    if (!error_.empty()) {
+      throw std::runtime_error(error_);
+    }
+    if (!pyModel_) {
+      progress_.report("upload", 0);
+      model_->upload(bp::extract<Context&>(pyCtxt_));
+      pyModel_ = bp::object(model_);
+      progress_.report("done", 1);
+    }
+    return pyModel_;
+  }
 
 private:
-  uint32_t numAtoms_;
-  uint32_t numConnections_;
-  uint32_t numContexts_;
-  uint32_t numSolventAcessible_;
-  vku::GenericBuffer atoms_;
-  vku::GenericBuffer pick_;
-  vku::GenericBuffer conns_;
-  vku::GenericBuffer instances_;
-  vku::GenericBuffer solventAcessible_;
-  vk::DescriptorSet descriptorSet_;
-  gilgamesh::pdb_decoder pdb_;
-  std::vector<uint8_t> pdb_text_;
-  std::vector<gilgamesh::pdb_decoder::atom> pdbAtoms_;
-  Atom *pAtoms_;
+  void run() {
+    try {
+      if (!path_.empty()) {
+        gilgamesh::mapped_file file(path_);
+        if (!file.is_open()) {
+          throw std::runtime_error("Model could not open " + path_);
+        }
+        model_->load(file.begin(), file.end(), &progress_);
+      } else if (haveFile_) {
+        std::vector<uint8_t> bytes = readFile();
+        model_->load(bytes.data(), bytes.data() + bytes.size(), &progress_);
+      } else {
+        const uint8_t *b = (const uint8_t *)buffer_.buf;
+        model_->load(b, b + buffer_.len, &progress_);
+      }
+    } catch (std::exception &e) {
+      error_ = e.what();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+    finished_.notify_all();
+  }
+
+  // Read the file object a window at a time on this thread. The GIL is only held
+  // for each read, so Python runs in between, and a cancel stops at the next window.
+  std::vector<uint8_t> readFile() {
+    static const int windowSize = 1 << 20;
+    std::vector<uint8_t> bytes;
+    for (;;) {
+      progress_.report("read", 0);
+      PyGILState_STATE gil = PyGILState_Ensure();
+      std::string error;
+      size_t size = 0;
+      try {
+        bp::object window = file_.attr("read")(windowSize);
+        Py_buffer pybuf;
+        if (PyObject_GetBuffer(window.ptr(), &pybuf, PyBUF_SIMPLE) < 0) {
+          PyErr_Clear();
+          error = "Model.load_async expects a file opened in binary mode";
+        } else {
+          size = (size_t)pybuf.len;
+          bytes.insert(bytes.end(), (const uint8_t *)pybuf.buf, (const uint8_t *)pybuf.buf + size);
+          PyBuffer_Release(&pybuf);
+        }
+      } catch (bp::error_already_set &) {
+        // The Python error is given to result() as a message, as errors from the other stages are.
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        PyObject *text = value ? PyObject_Str(value) : nullptr;
+        const char *utf8 = text ? PyUnicode_AsUTF8(text) : nullptr;
+        error = std::string("Model.load_async could not read the file: ") + (utf8 ? utf8 : "unknown error");
+        Py_XDECREF(text);
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(traceback);
+        PyErr_Clear();
+      } catch (std::exception &e) {
+        error = e.what();
+      }
+      PyGILState_Release(gil);
+      if (!error.empty()) throw std::runtime_error(error);
+      if (size == 0) return bytes;
+    }
+  }
+
+  bp::object pyCtxt_;
+  bp::object pyModel_;
+  boost::shared_ptr<Model> model_;
+  std::string path_;
+  bp::object file_;                  // a file object to read on the loading thread
+  bool haveFile_ = false;
+  Py_buffer buffer_;
+  bool haveBuffer_ = false;
+  LoadProgress progress_;
+  std::string error_;
+  bool done_ = false;
+  mutable std::mutex mutex_;
+  std::condition_variable finished_;
+  std::thread thread_;
 };
 
 /// One person's view of the world.
@@ -632,6 +1799,10 @@ public:
     ctxt.addView(this);
     width_ = width;
     height_ = height;
+    cameraState_.cameraToPerspective = cameraToPerspective(width_, height_);
+
+    // Headless views only render on the CPU.
+    if (ctxt.headless()) return;
 
     if (mode == "Window") {
       // Make a window
@@ -689,17 +1860,6 @@ public:
     */
 
     //modelToWorld = glm::rotate(modelToWorld, glm::radians(90.0f), glm::vec3(1, 0, 0));
-    // This matrix converts between OpenGL perspective and Vulkan perspective.
-    // It flips the Y axis and shrinks the Z value to [0,1]
-    glm::mat4 leftHandCorrection(
-      1.0f,  0.0f, 0.0f, 0.0f,
-      0.0f, -1.0f, 0.0f, 0.0f,
-      0.0f,  0.0f, 0.5f, 0.0f,
-      0.0f,  0.0f, 0.5f, 1.0f
-    );
-
-    float fieldOfView = glm::radians(45.0f);
-    cameraState_.cameraToPerspective = leftHandCorrection * glm::perspective(fieldOfView, (float)width_/height_, 0.1f, 10000.0f);
 
     auto cubeBytes = vku::loadFile(SOURCE_DIR "textures/okretnica.ktx");
     vku::KTXFileLayout ktx(cubeBytes.data(), cubeBytes.data()+cubeBytes.size());
@@ -724,7 +1884,7 @@ public:
     fountPipeline_ = FountPipeline(device, ctxt.pipelineCache(), renderPass_, width_, height_, standardLayout_.pipelineLayout());
 
     vku::PipelineMaker pm{width, height};
-    pm.topology(vk::PrimitiveTopology::ePointList);
+    pm.topology(vk::PrimitiveTopology::eTriangleList);
     pm.depthTestEnable(VK_TRUE);
     solventPipeline_ = GraphicsPipeline(
       device, ctxt.pipelineCache(), renderPass_, standardLayout_.pipelineLayout(),
@@ -752,11 +1912,6 @@ public:
 
     //moleculeModel_.updateDescriptorSet(device, standardLayout_.descriptorSetLayout(), ctxt.descriptorPool(), *cubeSampler_, cubeMap_.imageView(), textModel_.sampler(), textModel_.imageView(), textModel_.glyphs(), textModel_.maxGlyphs());
 
-    for (int i = 0; i != Pick::fifoSize; ++i) {
-      vk::EventCreateInfo eci{};
-      pickEvents_.push_back(ctxt.device().createEventUnique(eci));
-    }
-
     model_.updateDescriptorSet(device, standardLayout_.descriptorSetLayout(), ctxt.descriptorPool(), *cubeSampler_, cubeMap_.imageView(), textModel_.sampler(), textModel_.imageView(), textModel_.glyphs(), textModel_.maxGlyphs());
 
     glfwSetWindowUserPointer(glfwwindow_, (void*)this);
@@ -765,8 +1920,55 @@ public:
     glfwSetKeyCallback(glfwwindow_, keyHandler);
   }
 
+  /// Ray trace the model on the CPU and return the RGBA pixels, top row first, as a memoryview.
+  /// The memoryview shares the view's image, which the next render() overwrites.
   boost::python::object render(Context &ctxt, Model &model) {
-    return bp::object();
+    if (tracer_.width() != (int)width_ || tracer_.height() != (int)height_) {
+      tracer_ = gilgamesh::sphere_tracer(width_, height_);
+    }
+    trace(model, tracer_, gilgamesh::hardware_threads());
+    return bp::object(bp::handle<>(PyMemoryView_FromMemory((char*)tracer_.pixels(), (Py_ssize_t)tracer_.bytes(), PyBUF_READ)));
+  }
+
+  /// Ray trace the model from this view's camera into tracer, which should be the size of the view.
+  /// This may run on any thread; it takes a copy of the camera, which the window and Python
+  /// can go on moving, and the model locks what it reads.
+  void trace(Model &model, gilgamesh::sphere_tracer &tracer, unsigned numThreads) const {
+    CameraState cameraState;
+    glm::mat4 modelToWorld;
+    bool showConnections;
+    {
+      std::lock_guard<std::mutex> lock(cameraMutex_);
+      cameraState = cameraState_;
+      modelToWorld = moleculeState_.modelToWorld;
+      showConnections = showConnections_;
+    }
+
+    // The camera as in draw(): pixel (x, y) looks along
+    // ((x * 2 / width - 1) * tanfovX, (y * 2 / height - 1) * tanfovY, -1) in camera space.
+    glm::mat4 cameraToWorld = glm::translate(glm::mat4{}, glm::vec3(0, 0, cameraState.cameraDistance));
+    glm::mat4 worldToModel = glm::inverse(modelToWorld);
+    glm::mat4 cameraToModel = worldToModel * cameraToWorld;
+    float tanfovX = 1.0f / cameraState.cameraToPerspective[0][0];
+    float tanfovY = 1.0f / cameraState.cameraToPerspective[1][1];
+    gilgamesh::sphere_tracer::camera camera;
+    camera.start = glm::vec3(cameraToModel[3]);
+    camera.corner = glm::vec3(cameraToModel * glm::vec4(-tanfovX, -tanfovY, -1, 0));
+    camera.dx = glm::vec3(cameraToModel * glm::vec4(tanfovX * 2 / width_, 0, 0, 0));
+    camera.dy = glm::vec3(cameraToModel * glm::vec4(0, tanfovY * 2 / height_, 0, 0));
+
+    // atoms.frag lights from (1, 1, 1) in world space.
+    glm::vec3 lightDir = glm::normalize(glm::vec3(worldToModel * glm::vec4(1, 1, 1, 0)));
+    model.trace(tracer, camera, lightDir, showConnections, numThreads);
+  }
+
+  uint32_t width() const { return width_; }
+  uint32_t height() const { return height_; }
+
+  /// Draw the connections as cylinders in render().
+  void showConnections(bool show) {
+    std::lock_guard<std::mutex> lock(cameraMutex_);
+    showConnections_ = show;
   }
 
   void simulate(Context &ctxt) {
@@ -806,6 +2008,7 @@ public:
         dx *= (1.0f - tail);
         dy *= (1.0f - tail);
       }
+      std::lock_guard<std::mutex> lock(cameraMutex_);
       glm::mat4 worldToModel = glm::inverse(moleculeState_.modelToWorld);
       glm::vec3 xaxis = worldToModel[0];
       glm::vec3 yaxis = worldToModel[1];
@@ -830,20 +2033,6 @@ public:
 
     auto gfi = graphicsQueueFamilyIndex;
 
-    vk::Event event = *pickEvents_[pickReadIndex_ & (Pick::fifoSize-1)];
-    while (device.getEventStatus(event) == vk::Result::eEventSet) {
-      Pick *pick = (Pick*)model_.pick().map(device);
-      Pick &p = pick[pickReadIndex_ & (Pick::fifoSize-1)];
-      moleculeState_.mouseAtom = p.atom;
-      moleculeState_.mouseDistance = p.distance / 10000.0f;
-      //printf("pick %d %d\n", p.atom, p.distance);
-      model_.pick().unmap(device);
-      p.distance = ~0;
-      p.atom = ~0;
-      device.resetEvent(event);
-      pickReadIndex_++;
-    }
-
     {
       Atom *atoms = model_.pAtoms();
 
@@ -873,13 +2062,15 @@ public:
     glm::vec4 cameraMouseDir = glm::vec4(xscreen * tanfovX, yscreen * tanfovY, -1, 0);
     glm::vec3 modelMouseDir = worldToModel * (cameraToWorld * cameraMouseDir);
 
+    // Pick on the CPU so the result is ready this frame.
+    moleculeState_.mouseAtom = model_.pick(modelCameraPos, modelMouseDir, moleculeState_.mouseDistance);
+
     static int z = 0;
     float c = std::cos(z++ * 0.1f);
     PushConstants cu;
     //cu.timeStep = timeStep;
     cu.numAtoms = model_.numAtoms();
     cu.numConnections = model_.numConnections();
-    cu.pickIndex = (pickWriteIndex_++) & (Pick::fifoSize-1);
     //cu.forceAtom = moleculeState_.selectedAtom;
 
     cu.rayStart = modelCameraPos;
@@ -898,14 +2089,14 @@ public:
     vk::CommandBufferBeginInfo bi{};
     cb.begin(bi);
 
-    // Do the physics velocity update on the GPU and the first pick pass
+    // Do the physics velocity update on the GPU
     cu.pass = 0;
     cb.pushConstants(standardLayout_.pipelineLayout(), vk::ShaderStageFlagBits::eAll, 0, sizeof(PushConstants), &cu);
     cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, standardLayout_.pipelineLayout(), 0, model_.descriptorSet(), nullptr);
     cb.bindPipeline(vk::PipelineBindPoint::eCompute, dynamicsPipeline_.pipeline());
     cb.dispatch(cu.numAtoms, ninst, 1);
 
-    // Do the physics position update on the GPU and the second pick pass
+    // Do the physics position update on the GPU
     cu.pass = 1;
     cb.pushConstants(standardLayout_.pipelineLayout(), vk::ShaderStageFlagBits::eAll, 0, sizeof(PushConstants), &cu);
     cb.dispatch(cu.numAtoms, ninst, 1);
@@ -917,9 +2108,6 @@ public:
     );
     */
 
-    // Signal the CPU that a pick event has occurred
-    cb.setEvent(*pickEvents_[cu.pickIndex], vk::PipelineStageFlagBits::eComputeShader);
-
     std::array<float, 4> clearColorValue{0.75f, 0.75f, 0.75f, 1};
     vk::ClearDepthStencilValue clearDepthValue{ 1.0f, 0 };
     std::array<vk::ClearValue, 2> clearColours{vk::ClearValue{clearColorValue}, clearDepthValue};
@@ -948,7 +2136,10 @@ public:
     */
 
     cb.bindPipeline(vk::PipelineBindPoint::eGraphics, solventPipeline_.pipeline());
-    if (model_.numSolventAcessible()) cb.draw(model_.numSolventAcessible(), 1, 0, 0);
+    if (model_.numSurfaceIndices()) {
+      cb.bindIndexBuffer(model_.surfaceIndices().buffer(), 0, vk::IndexType::eUint32);
+      cb.drawIndexed(model_.numSurfaceIndices(), ninst, 0, 0, 0);
+    }
 
     cb.endRenderPass();
 
@@ -977,6 +2168,7 @@ public:
 
   static void scrollHandler(GLFWwindow *window, double dx, double dy) {
     View &app = *(View*)glfwGetWindowUserPointer(window);
+    std::lock_guard<std::mutex> lock(app.cameraMutex_);
     app.cameraState_.cameraDistance -= (float)dy * 4.0f;
   }
   static void mouseButtonHandlerHook(GLFWwindow *window, int button, int action, int mods) {
@@ -995,10 +2187,10 @@ public:
             newStart = newEnd = -1;
           } else if (mods & GLFW_MOD_SHIFT) {
             if (moleculeState_.startAtom != -1) {
-              auto startAtom = model_.pdbAtoms()[moleculeState_.startAtom];
-              auto endAtom = model_.pdbAtoms()[moleculeState_.mouseAtom];
-              //printf("%c %c\n", startAtom.chainID(), endAtom.chainID());
-              if (startAtom.chainID() != endAtom.chainID()) {
+              auto &store = model_.atomStore();
+              char startChain = store.chain_id(store.chain_of(moleculeState_.startAtom));
+              char endChain = store.chain_id(store.chain_of(moleculeState_.mouseAtom));
+              if (startChain != endChain) {
                 newStart = moleculeState_.startAtom;
                 newEnd = moleculeState_.endAtom;
               } else {
@@ -1059,6 +2251,7 @@ public:
     auto &cam = app.cameraState_.cameraRotation;
     // move the molecule along the camera x and y axis.
     if (action != GLFW_PRESS && action != GLFW_REPEAT) return;
+    std::lock_guard<std::mutex> lock(app.cameraMutex_);
     switch (key) {
       case GLFW_KEY_W: {
         app.cameraState_.cameraDistance -= 4;
@@ -1106,6 +2299,7 @@ public:
       for (int i = moleculeState_.startAtom; i <= moleculeState_.endAtom; ++i) {
         atoms[i].pos = vec3(rotate * vec4(atoms[i].pos - pos1, 1)) + pos1;
       }
+      model_.moveAtoms(moleculeState_.startAtom, moleculeState_.endAtom + 1);
     }
   }
   void translateSelected(int dir) {
@@ -1114,6 +2308,7 @@ public:
       for (int i = moleculeState_.startAtom; i <= moleculeState_.endAtom; ++i) {
         atoms[i].pos.x += dir;
       }
+      model_.moveAtoms(moleculeState_.startAtom, moleculeState_.endAtom + 1);
     }
   }
 
@@ -1123,11 +2318,16 @@ public:
   View(View &&rhs) = default;
   View &operator=(View &&rhs) = default;
 
+  /// The fences of the frames the window may have in flight; none for headless views.
+  const std::vector<vk::Fence> &frameFences() const { return window_.commandBufferFences(); }
+
   bool poll(Context &ctxt) {
     if (glfwWindowShouldClose(glfwwindow_)) {
       return false;
     }
 
+    model_.updateSurface(ctxt);
+
     auto device = ctxt.device();
     auto queue = ctxt.queue();
     window_.draw(
@@ -1139,6 +2339,20 @@ public:
     return true;
   }
 private:
+  // This matrix converts between OpenGL perspective and Vulkan perspective.
+  // It flips the Y axis and shrinks the Z value to [0,1]
+  static glm::mat4 cameraToPerspective(uint32_t width, uint32_t height) {
+    glm::mat4 leftHandCorrection(
+      1.0f,  0.0f, 0.0f, 0.0f,
+      0.0f, -1.0f, 0.0f, 0.0f,
+      0.0f,  0.0f, 0.5f, 0.0f,
+      0.0f,  0.0f, 0.5f, 1.0f
+    );
+
+    float fieldOfView = glm::radians(45.0f);
+    return leftHandCorrection * glm::perspective(fieldOfView, (float)width/height, 0.1f, 10000.0f);
+  }
+
   vk::RenderPass renderPass_;
   vku::DepthStencilImage depthStencilImage_;
   vku::ColorAttachmentImage colorAttachmentImage_;
@@ -1164,6 +2378,13 @@ private:
 
   TextModel textModel_;
 
+  gilgamesh::sphere_tracer tracer_;
+  bool showConnections_ = true;
+
+  // Held by trace() while it copies the camera, and while anything changes
+  // showConnections_, moleculeState_.modelToWorld or cameraState_.
+  mutable std::mutex cameraMutex_;
+
   vku::TextureImageCube cubeMap_;
   vk::UniqueSampler cubeSampler_;
 
@@ -1196,15 +2417,212 @@ private:
   };
   CameraState cameraState_;
 
-  uint32_t pickWriteIndex_ = 0;
-  uint32_t pickReadIndex_ = 0;
+  Model &model_;
+};
+
+// Renders a view on the CPU and encodes the frames for a thin client.
+// The render thread traces frame N+1 into a ring of images while the encode
+// thread compresses frame N, sending only what changed since the last frame.
+// Encoded frames wait in a short queue for next(), which lets go of the GIL
+// while it waits. When the client falls behind, the queue and then the ring
+// fill up and the render thread waits too.
+//
+// While a stream runs, other Python threads and the window may go on using the
+// view and the model. The render thread copies the camera at the start of each
+// frame, so turning, zooming and show_connections() take effect on the next frame.
+// Writes to the positions, radii and colours columns are not seen until
+// atoms_changed(), which waits for the frame being traced; moves from the window
+// wait in the same way. The stream holds on to the view and the model, so
+// they live at least as long as it does.
+class FrameStream {
+public:
+  /// format is "jpeg" or "png" and quality the JPEG quality or PNG deflate level.
+  /// Frames are parts of a multipart/x-mixed-replace stream, or if tiles is set,
+  /// records of the tiles that changed (see gilgamesh/encoders/frame_encoder.hpp).
+  FrameStream(bp::object pyView, bp::object pyModel, const std::string &format = "jpeg", int quality = 80, bool tiles = false, double fps = 30) :
+    pyView_(pyView), pyModel_(pyModel), view_(bp::extract<View&>(pyView)), model_(bp::extract<Model&>(pyModel)),
+    encoder_(format == "png" ? gilgamesh::frame_encoder::format::png : gilgamesh::frame_encoder::format::jpeg, quality),
+    tiles_(tiles), frameTime_(1.0 / std::max(fps, 1.0))
+  {
+    if (format != "jpeg" && format != "png") {
+      throw std::runtime_error("FrameStream: format must be jpeg or png");
+    }
+    for (auto &frame : frames_) frame = gilgamesh::sphere_tracer(view_.width(), view_.height());
+    renderThread_ = std::thread([this]() { render(); });
+    encodeThread_ = std::thread([this]() { encode(); });
+  }
+
+  ~FrameStream() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    renderThread_.join();
+    encodeThread_.join();
+  }
 
-  std::vector<vk::UniqueEvent> pickEvents_;
+  /// Wait up to timeout seconds for the next encoded frame and return it as bytes, empty if there was none.
+  bp::object next(double timeout) {
+    std::vector<uint8_t> chunk;
+    {
+      ReleaseGil unlocked;
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (wake_.wait_for(lock, std::chrono::duration<double>(timeout), [this]() { return !chunks_.empty(); })) {
+        chunk.swap(chunks_.front());
+        chunks_.pop_front();
+        wake_.notify_all();
+      }
+    }
+    return bp::object(bp::handle<>(PyBytes_FromStringAndSize((const char*)chunk.data(), (Py_ssize_t)chunk.size())));
+  }
+
+  /// The next frame is sent whole, for instance to a new client.
+  void keyFrame() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    keyFrame_ = true;
+  }
+
+  /// The HTTP Content-Type of the stream.
+  std::string contentType() const {
+    return tiles_ ? "application/octet-stream" : "multipart/x-mixed-replace; boundary=frame";
+  }
+
+private:
+  void render() {
+    unsigned numThreads = gilgamesh::hardware_threads();
+    auto due = std::chrono::steady_clock::now();
+    for (;;) {
+      uint64_t frame;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this]() { return stop_ || rendered_ - encoded_ != numFrames; });
+        if (stop_) return;
+        frame = rendered_;
+      }
+
+      // The encode thread does not look at this frame until rendered_ passes it.
+      view_.trace(model_, frames_[frame % numFrames], numThreads);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++rendered_;
+      }
+      wake_.notify_all();
 
+      due += std::chrono::duration_cast<std::chrono::steady_clock::duration>(frameTime_);
+      due = std::max(due, std::chrono::steady_clock::now());
+      std::this_thread::sleep_until(due);
+    }
+  }
+
+  void encode() {
+    unsigned numThreads = gilgamesh::hardware_threads();
+    for (;;) {
+      uint64_t frame;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this]() { return stop_ || (encoded_ != rendered_ && chunks_.size() < maxChunks); });
+        if (stop_) return;
+        frame = encoded_;
+        if (keyFrame_) encoder_.key_frame();
+        keyFrame_ = false;
+      }
+
+      const gilgamesh::sphere_tracer &image = frames_[frame % numFrames];
+      std::vector<uint8_t> chunk;
+      if (tiles_) {
+        encoder_.encode_tiles(chunk, image.pixels(), image.width(), image.height(), numThreads);
+      } else {
+        std::vector<uint8_t> data;
+        if (encoder_.encode_frame(data, image.pixels(), image.width(), image.height(), numThreads)) {
+          char header[128];
+          const char *type = encoder_.image_format() == gilgamesh::frame_encoder::format::png ? "image/png" : "image/jpeg";
+          int length = snprintf(header, sizeof(header), "--frame\r\nContent-Type: %s\r\nContent-Length: %d\r\n\r\n", type, (int)data.size());
+          chunk.assign(header, header + length);
+          chunk.insert(chunk.end(), data.begin(), data.end());
+          chunk.insert(chunk.end(), { '\r', '\n' });
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++encoded_;
+        // Frames with nothing new are not sent at all.
+        if (!chunk.empty()) chunks_.push_back(std::move(chunk));
+      }
+      wake_.notify_all();
+    }
+  }
+
+  static const int numFrames = 3;
+  static const size_t maxChunks = 2;
+
+  bp::object pyView_;
+  bp::object pyModel_;
+  View &view_;
   Model &model_;
+  gilgamesh::frame_encoder encoder_;
+  bool tiles_;
+  std::chrono::duration<double> frameTime_;
+
+  // frames_[n % numFrames] holds frame n.
+  gilgamesh::sphere_tracer frames_[numFrames];
+  uint64_t rendered_ = 0;
+  uint64_t encoded_ = 0;
+  std::deque<std::vector<uint8_t> > chunks_;
+  bool keyFrame_ = false;
+  bool stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::thread renderThread_;
+  std::thread encodeThread_;
 };
 
+// Python's view of the zone tracer. Zones are only recorded in builds with MOOVOO_TRACE on.
+inline bool traceEnabled() {
+  return gilgamesh::zone_tracer::enabled();
+}
+
+// chrome://tracing and Perfetto load this.
+inline std::string traceJson() {
+  ReleaseGil unlocked;
+  return gilgamesh::zone_tracer::instance().chrome_json();
+}
+
+inline void traceClear() {
+  gilgamesh::zone_tracer::instance().clear();
+}
+
+// For each zone: calls, seconds, items (bytes, atoms and so on) and items per second.
+inline bp::dict traceStats() {
+  bp::dict result;
+  for (auto &zone : gilgamesh::zone_tracer::instance().totals()) {
+    const gilgamesh::zone_tracer::stats &s = zone.second;
+    double seconds = s.total_ns * 1e-9;
+    bp::dict entry;
+    entry["calls"] = s.calls;
+    entry["seconds"] = seconds;
+    entry["items"] = s.items;
+    entry["items_per_second"] = seconds ? s.items / seconds : 0.0;
+    result[zone.first] = entry;
+  }
+  return result;
+}
+
+// Wait for the frames every window has submitted, so that the buffers they read can be written.
+// This waits on each window's per-frame fences rather than for the whole device to go idle.
+inline void Context::waitForFrames() {
+  std::vector<vk::Fence> fences;
+  for (auto v : views_) {
+    const std::vector<vk::Fence> &f = v->frameFences();
+    fences.insert(fences.end(), f.begin(), f.end());
+  }
+  if (!fences.empty()) device().waitForFences(fences, VK_TRUE, std::numeric_limits<uint64_t>::max());
+}
+
 inline void Context::mainloop() {
+  if (headless_) return;
   for (;;) {
     for (auto v : views_) {
       if (!v->poll(*this)) {
@@ -1226,13 +2644,46 @@ BOOST_PYTHON_MODULE(moovoo)
   namespace bp = boost::python;
   using namespace boost::python;
   using namespace moovoo;
-  class_<Context>("Context", init<>())
+  def("trace_enabled", &traceEnabled);
+  def("trace_json", &traceJson);
+  def("trace_clear", &traceClear);
+  def("trace_stats", &traceStats);
+  class_<Context>("Context", init<bp::optional<std::string>>())
     .def("mainloop", &Context::mainloop)
   ;
   class_<View>("View", init<Context &, const std::string &, bp::object&, const bp::object&>())
     .def("render", &View::render)
+    .def("show_connections", &View::showConnections)
+  ;
+  class_<FrameStream, boost::noncopyable>("FrameStream", init<bp::object, bp::object, bp::optional<std::string, int, bool, double>>())
+    .def("next", &FrameStream::next)
+    .def("key_frame", &FrameStream::keyFrame)
+    .def("content_type", &FrameStream::contentType)
+  ;
+  bp::object model = class_<Model, boost::shared_ptr<Model>, boost::noncopyable>("Model", init<Context &, bp::object &>())
+    .def("select", &Model::select)
+    .def("positions", &Model::positions)
+    .def("radii", &Model::radii)
+    .def("colours", &Model::colours)
+    .def("selected", &Model::selected)
+    .def("residue_indices", &Model::residueIndices)
+    .def("residue_numbers", &Model::residueNumbers)
+    .def("chain_ids", &Model::chainIds)
+    .def("atoms_changed", &Model::atomsChanged, (bp::arg("begin") = 0, bp::arg("end") = -1))
+  ;
+  // Model.load_async(ctxt, source) makes a ModelLoader.
+  model.attr("load_async") = class_<ModelLoader, boost::noncopyable>("ModelLoader", init<bp::object, bp::object>())
+    .def("stage", &ModelLoader::stage)
+    .def("fraction", &ModelLoader::fraction)
+    .def("cancel", &ModelLoader::cancel)
+    .def("wait", &ModelLoader::wait)
+    .def("done", &ModelLoader::done)
+    .def("result", &ModelLoader::result)
   ;
-  class_<Model>("Model", init<Context &, bp::object &>())
+  class_<Selection>("Selection", init<>())
+    .def("__len__", &Selection::count)
+    .def("__contains__", &Selection::contains)
+    .def("indices", &Selection::indices)
   ;
 }
 
@@ -1,8 +1,17 @@
 #version 450
 
+layout(location = 0) in vec3 inNormal;
+layout(location = 1) in vec4 inColour;
+
 layout(location = 0) out vec4 outColour;
 
 void main() {
-  outColour = vec4(1, 0, 0, 1);
-}
+  vec3 normal = normalize(inNormal);
+  vec3 lightDir = normalize(vec3(1, 1, 1));
 
+  vec3 ambient = inColour.xyz * 0.2;
+  vec3 diffuse = inColour.xyz * 0.8;
+
+  float diffuseFactor = max(0.0, dot(normal, lightDir));
+  outColour = vec4(ambient + diffuse * diffuseFactor, inColour.w);
+}
@@ -1,5 +1,8 @@
 #version 450
 
+layout(location = 0) out vec3 outNormal;
+layout(location = 1) out vec4 outColour;
+
 layout (push_constant) uniform Uniform {
   mat4 worldToPerspective;
   mat4 modelToWorld;
@@ -14,13 +17,28 @@ layout (push_constant) uniform Uniform {
   uint pass;
 } u;
 
-layout(std430, binding=1) buffer Solvent {
-  vec3 pos[];
+struct Instance {
+  mat4 modelToWorld;
+};
+
+layout(std430, binding=6) buffer Instances {
+  Instance instances[];
+} i;
+
+// Twelve floats per vertex (pos, normal, uv, colour) as in gilgamesh::color_mesh.
+// A struct of vec3s would be padded to sixteen bytes per member in std430.
+layout(std430, binding=7) buffer Surface {
+  float v[];
 } s;
 
 void main() {
-  vec3 worldPos = s.pos[gl_VertexIndex];
-  gl_Position = u.worldToPerspective * vec4(worldPos, 1.0);
-  gl_PointSize = 100;
-}
+  int base = gl_VertexIndex * 12;
+  vec3 pos = vec3(s.v[base+0], s.v[base+1], s.v[base+2]);
+  vec3 normal = vec3(s.v[base+3], s.v[base+4], s.v[base+5]);
+  vec4 colour = vec4(s.v[base+8], s.v[base+9], s.v[base+10], s.v[base+11]);
 
+  mat4 modelToWorld = u.modelToWorld * i.instances[gl_InstanceIndex].modelToWorld;
+  gl_Position = u.worldToPerspective * (modelToWorld * vec4(pos, 1.0));
+  outNormal = normalize(mat3(modelToWorld) * normal);
+  outColour = colour;
+}
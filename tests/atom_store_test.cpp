@@ -0,0 +1,73 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// atom_store tests: columns read back from an array file must be checked,
+// as the file may be damaged.
+//
+
+#include <gilgamesh/atom_store.hpp>
+#include "test.hpp"
+
+using gilgamesh::atom_store;
+
+static const uint32_t version = 1, key = 1234, first_tag = 10;
+
+// The array with the given tag in an array file image.
+template <class Type>
+static Type *find_array(std::vector<uint8_t> &image, uint32_t tag, size_t &count) {
+  gilgamesh::detail::array_file_header header;
+  memcpy(&header, image.data(), sizeof(header));
+  auto *entries = (gilgamesh::detail::array_file_entry *)(image.data() + sizeof(header));
+  for (uint32_t i = 0; i != header.num_arrays; ++i) {
+    if (entries[i].tag == tag) {
+      count = (size_t)entries[i].count;
+      return (Type *)(image.data() + entries[i].offset);
+    }
+  }
+  count = 0;
+  return nullptr;
+}
+
+static bool read_image(const std::vector<uint8_t> &image) {
+  gilgamesh::array_file file(image.data(), image.data() + image.size(), version, key);
+  atom_store store;
+  return file.valid() && store.read(file, first_tag);
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  std::vector<uint8_t> pdb = test_read_file(dir + "/5wsn.pdb");
+  gilgamesh::pdb_decoder decoded(pdb.data(), pdb.data() + pdb.size());
+  atom_store store(decoded.allAtoms());
+  TEST_CHECK(store.consistent());
+
+  gilgamesh::array_file_writer writer(version, key);
+  store.write(writer, first_tag);
+  std::vector<uint8_t> image = writer.bytes();
+  TEST_CHECK(read_image(image));
+
+  // Tags from first_tag in the order of atom_store::write.
+  const uint32_t atom_name_tag = first_tag + 1, residue_start_tag = first_tag + 4, chain_start_tag = first_tag + 9;
+  size_t count;
+
+  std::vector<uint8_t> bad = image;
+  uint16_t *names = find_array<uint16_t>(bad, atom_name_tag, count);
+  TEST_CHECK(names && count);
+  if (names) names[count / 2] = 0xffff;
+  TEST_CHECK(!read_image(bad));
+
+  bad = image;
+  int *residue_start = find_array<int>(bad, residue_start_tag, count);
+  TEST_CHECK(residue_start && count > 2);
+  if (residue_start) residue_start[1] = 1 << 30;
+  TEST_CHECK(!read_image(bad));
+
+  bad = image;
+  int *chain_start = find_array<int>(bad, chain_start_tag, count);
+  TEST_CHECK(chain_start && count);
+  if (chain_start) chain_start[count - 1] += 1;
+  TEST_CHECK(!read_image(bad));
+
+  return test_result();
+}
@@ -0,0 +1,120 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// brotli_decoder tests: round trips through the reference encoder on both
+// output paths, then truncated and bit-flipped streams, which must fail
+// cleanly. Build with MOOVOO_SANITIZE to catch stray reads and writes.
+//
+
+#include <andyzip/brotli_decoder.hpp>
+#include <brotli/encode.h>
+#include <random>
+#include "test.hpp"
+
+using andyzip::brotli_decoder;
+using andyzip::brotli_decoder_state;
+
+static std::vector<uint8_t> encode(const std::vector<uint8_t> &text, int quality, int window) {
+  size_t size = BrotliEncoderMaxCompressedSize(text.size());
+  std::vector<uint8_t> result(size ? size : 64);
+  size = result.size();
+  bool ok = BrotliEncoderCompress(quality, window, BROTLI_MODE_GENERIC, text.size(), text.data(), &size, result.data()) != 0;
+  TEST_CHECK(ok);
+  result.resize(ok ? size : 0);
+  return result;
+}
+
+// Decode into a buffer of exactly dest_size bytes, so that ASan sees any write past it.
+static brotli_decoder_state::error_code decode_flat(std::vector<uint8_t> &dest, const std::vector<uint8_t> &src, size_t dest_size) {
+  std::unique_ptr<uint8_t[]> buffer(new uint8_t[dest_size + 1]);
+  brotli_decoder_state state;
+  state.src = (const char *)src.data();
+  state.bitptr_max = (uint32_t)(src.size() * 8);
+  state.dest = (char *)buffer.get();
+  state.dest_max = (char *)buffer.get() + dest_size;
+  brotli_decoder decoder;
+  brotli_decoder_state::error_code result = decoder.decode(state);
+  TEST_CHECK(state.bytes_written <= dest_size);
+  dest.assign(buffer.get(), buffer.get() + std::min((size_t)state.bytes_written, dest_size));
+  return result;
+}
+
+static brotli_decoder_state::error_code decode_stream(std::vector<uint8_t> &dest, const std::vector<uint8_t> &src, size_t chunk_size) {
+  brotli_decoder_state state;
+  state.src = (const char *)src.data();
+  state.bitptr_max = (uint32_t)(src.size() * 8);
+  brotli_decoder decoder;
+  dest.clear();
+  return decoder.decode_stream(state, [&dest](const uint8_t *b, const uint8_t *e) {
+    dest.insert(dest.end(), b, e);
+    return true;
+  }, chunk_size);
+}
+
+static void test_round_trip(const std::vector<uint8_t> &text, int quality, int window) {
+  std::vector<uint8_t> encoded = encode(text, quality, window), decoded;
+  TEST_CHECK(decode_flat(decoded, encoded, text.size()) == brotli_decoder_state::error_code::end);
+  TEST_CHECK(decoded == text);
+  for (size_t chunk_size : { (size_t)7, (size_t)4096, (size_t)1 << 20 }) {
+    TEST_CHECK(decode_stream(decoded, encoded, chunk_size) == brotli_decoder_state::error_code::end);
+    TEST_CHECK(decoded == text);
+  }
+}
+
+// A damaged stream may decode to anything or fail, but must stay in its buffers.
+static void decode_damaged(const std::vector<uint8_t> &stream, size_t text_size) {
+  std::vector<uint8_t> decoded;
+  decode_flat(decoded, stream, text_size);
+  decode_stream(decoded, stream, 4096);
+}
+
+static void test_damaged(const std::vector<uint8_t> &text, int quality, int window, std::mt19937 &gen) {
+  std::vector<uint8_t> encoded = encode(text, quality, window);
+
+  // Every truncation of short streams, and a spread of them in long ones.
+  size_t step = std::max((size_t)1, encoded.size() / 200);
+  for (size_t size = 0; size < encoded.size(); size += size < 64 ? 1 : step) {
+    std::vector<uint8_t> truncated(encoded.begin(), encoded.begin() + size);
+    decode_damaged(truncated, text.size());
+  }
+
+  for (int i = 0; i != 400; ++i) {
+    std::vector<uint8_t> flipped = encoded;
+    for (int j = 0, n = 1 + (int)(gen() % 3); j != n && !flipped.empty(); ++j) {
+      flipped[gen() % flipped.size()] ^= (uint8_t)(1 << (gen() % 8));
+    }
+    decode_damaged(flipped, text.size());
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  std::vector<uint8_t> pdb = test_read_file(dir + "/5wsn.pdb");
+  std::vector<uint8_t> cif = test_read_file(dir + "/2tgt.cif");
+
+  for (int quality : { 1, 5, 9, 11 }) {
+    for (int window : { 10, 16, 22 }) {
+      test_round_trip(cif, quality, window);
+    }
+  }
+  test_round_trip(pdb, 9, 22);
+  test_round_trip(std::vector<uint8_t>(), 9, 22);
+
+  // Small samples so that many damaged copies can be decoded.
+  std::mt19937 gen(1);
+  std::vector<std::vector<uint8_t> > samples = {
+    std::vector<uint8_t>(pdb.begin(), pdb.begin() + std::min(pdb.size(), (size_t)16384)),
+    std::vector<uint8_t>(cif.begin(), cif.begin() + std::min(cif.size(), (size_t)16384)),
+    std::vector<uint8_t>{ 'a', 'b', 'c', 'd' },
+  };
+  for (auto &sample : samples) {
+    for (int quality : { 1, 5, 11 }) {
+      for (int window : { 10, 22 }) {
+        test_damaged(sample, quality, window, gen);
+      }
+    }
+  }
+
+  return test_result();
+}
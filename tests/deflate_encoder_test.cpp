@@ -0,0 +1,83 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// deflate_encoder tests: text, repeats and random bytes of sizes around the
+// window and chunk boundaries, encoded on 1, 2, 4 and 8 threads, must decode
+// to themselves, and every thread count must give the same stream.
+//
+
+#include <andyzip/deflate_decoder.hpp>
+#include <andyzip/deflate_encoder.hpp>
+#include <random>
+#include "test.hpp"
+
+static const andyzip::deflate_decoder decoder;
+
+static bool round_trip(const std::vector<uint8_t> &text, const std::vector<uint8_t> &encoded) {
+  // All at once into a buffer of the known size.
+  std::vector<uint8_t> decoded(text.size());
+  bool ok = false;
+  try {
+    ok = decoder.decode(decoded.data(), decoded.data() + decoded.size(), encoded.data(), encoded.data() + encoded.size());
+  } catch (const std::exception &) {
+  }
+  if (!ok || decoded != text) return false;
+
+  // In pieces, finding the end of the stream.
+  decoded.clear();
+  const uint8_t *end = decoder.decode_stream(encoded.data(), encoded.data() + encoded.size(), [&decoded](const uint8_t *b, const uint8_t *e) {
+    decoded.insert(decoded.end(), b, e);
+    return true;
+  });
+  return end == encoded.data() + encoded.size() && decoded == text;
+}
+
+static void test_sizes(const char *name, const std::vector<uint8_t> &source) {
+  const size_t window = 0x8000, chunk = 0x20000;
+  std::vector<size_t> sizes = { 0, 1, 2, 3, 258, 259, window - 1, window, window + 1, 0xffff, 0x10000, 0x10001, chunk - 1, chunk, chunk + 1, chunk * 3 + 7, source.size() };
+  for (int level : { 1, 9 }) {
+    andyzip::deflate_encoder encoder(level);
+    for (size_t size : sizes) {
+      if (size > source.size()) continue;
+      std::vector<uint8_t> text(source.begin(), source.begin() + size);
+      std::vector<uint8_t> one_thread;
+      encoder.encode(one_thread, text.data(), text.data() + text.size(), 1);
+      bool ok = round_trip(text, one_thread);
+      ok &= one_thread.size() <= encoder.max_encoded_size(size);
+      for (unsigned threads : { 2, 4, 8 }) {
+        std::vector<uint8_t> encoded;
+        encoder.encode(encoded, text.data(), text.data() + text.size(), threads);
+        ok &= encoded == one_thread;
+      }
+
+      // The fixed buffer form, with room and without.
+      std::vector<uint8_t> buffer(one_thread.size());
+      uint8_t *end = encoder.encode(buffer.data(), buffer.data() + buffer.size(), text.data(), text.data() + text.size(), 4);
+      ok &= end == buffer.data() + buffer.size() && buffer == one_thread;
+      ok &= encoder.encode(buffer.data(), buffer.data() + buffer.size() - 1, text.data(), text.data() + text.size(), 4) == nullptr;
+      if (!ok) printf("%s: level %d, %d bytes\n", name, level, (int)size);
+      TEST_CHECK(ok);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  std::vector<uint8_t> cif = test_read_file(dir + "/2tgt.cif");
+
+  // Text, several chunks of it.
+  std::vector<uint8_t> text;
+  while (text.size() < 0x64000) text.insert(text.end(), cif.begin(), cif.end());
+  test_sizes("text", text);
+
+  // Incompressible bytes, which must still fit max_encoded_size.
+  std::mt19937 rng(1);
+  std::vector<uint8_t> random(0x70000);
+  for (auto &b : random) b = (uint8_t)rng();
+  test_sizes("random", random);
+
+  // One byte repeated, all long matches at distance one.
+  test_sizes("repeated", std::vector<uint8_t>(0x70000, 'a'));
+  return test_result();
+}
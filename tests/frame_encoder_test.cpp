@@ -0,0 +1,278 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// frame_encoder tests: images from sphere_tracer encoded as whole JPEG and
+// PNG frames and as tile records, decoded again with libjpeg and libpng,
+// over a sequence of frames where a sphere moves and then nothing changes.
+//
+
+#include <gilgamesh/encoders/frame_encoder.hpp>
+#include <gilgamesh/sphere_bvh.hpp>
+#include <gilgamesh/sphere_tracer.hpp>
+#include <cstdio>
+#include <jpeglib.h>
+#include <png.h>
+#include "test.hpp"
+
+using gilgamesh::frame_encoder;
+using gilgamesh::sphere_tracer;
+
+struct image {
+  int width = 0, height = 0;
+  std::vector<uint8_t> rgb;
+};
+
+// The RGB of the tracer's RGBA pixels.
+static image rgb_of(const sphere_tracer &tracer) {
+  image result;
+  result.width = tracer.width();
+  result.height = tracer.height();
+  const uint8_t *rgba = (const uint8_t*)tracer.pixels();
+  for (size_t i = 0; i != (size_t)tracer.width() * tracer.height(); ++i) {
+    result.rgb.insert(result.rgb.end(), rgba + i * 4, rgba + i * 4 + 3);
+  }
+  return result;
+}
+
+static image decode_jpeg(const uint8_t *data, size_t size) {
+  jpeg_decompress_struct info;
+  jpeg_error_mgr error;
+  info.err = jpeg_std_error(&error);
+  jpeg_create_decompress(&info);
+  jpeg_mem_src(&info, (unsigned char*)data, (unsigned long)size);
+  jpeg_read_header(&info, TRUE);
+  info.out_color_space = JCS_RGB;
+  jpeg_start_decompress(&info);
+  image result;
+  result.width = (int)info.output_width;
+  result.height = (int)info.output_height;
+  result.rgb.resize((size_t)result.width * result.height * 3);
+  while (info.output_scanline < info.output_height) {
+    JSAMPROW row = result.rgb.data() + (size_t)info.output_scanline * result.width * 3;
+    jpeg_read_scanlines(&info, &row, 1);
+  }
+  jpeg_finish_decompress(&info);
+  jpeg_destroy_decompress(&info);
+  return result;
+}
+
+// An empty image if libpng will not read it.
+static image decode_png(const uint8_t *data, size_t size) {
+  png_image png;
+  memset(&png, 0, sizeof(png));
+  png.version = PNG_IMAGE_VERSION;
+  image result;
+  if (!png_image_begin_read_from_memory(&png, data, size)) return result;
+  png.format = PNG_FORMAT_RGB;
+  result.rgb.resize(PNG_IMAGE_SIZE(png));
+  if (!png_image_finish_read(&png, nullptr, result.rgb.data(), 0, nullptr)) return image();
+  result.width = (int)png.width;
+  result.height = (int)png.height;
+  return result;
+}
+
+static image decode(frame_encoder::format fmt, const uint8_t *data, size_t size) {
+  return fmt == frame_encoder::format::jpeg ? decode_jpeg(data, size) : decode_png(data, size);
+}
+
+// libjpeg's own encoder at a quality, with the same 4:2:0 sampling and tables.
+static std::vector<uint8_t> encode_jpeg(const image &img, int quality) {
+  jpeg_compress_struct info;
+  jpeg_error_mgr error;
+  info.err = jpeg_std_error(&error);
+  jpeg_create_compress(&info);
+  unsigned char *buffer = nullptr;
+  unsigned long size = 0;
+  jpeg_mem_dest(&info, &buffer, &size);
+  info.image_width = img.width;
+  info.image_height = img.height;
+  info.input_components = 3;
+  info.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&info);
+  jpeg_set_quality(&info, quality, TRUE);
+  jpeg_start_compress(&info, TRUE);
+  while (info.next_scanline < info.image_height) {
+    JSAMPROW row = (JSAMPROW)&img.rgb[(size_t)info.next_scanline * img.width * 3];
+    jpeg_write_scanlines(&info, &row, 1);
+  }
+  jpeg_finish_compress(&info);
+  std::vector<uint8_t> result(buffer, buffer + size);
+  jpeg_destroy_compress(&info);
+  free(buffer);
+  return result;
+}
+
+static void errors(const image &decoded, const image &expected, double &mean, int &worst) {
+  double total = 0;
+  worst = 0;
+  for (size_t i = 0; i != expected.rgb.size(); ++i) {
+    int error = std::abs((int)decoded.rgb[i] - (int)expected.rgb[i]);
+    total += error;
+    worst = std::max(worst, error);
+  }
+  mean = total / expected.rgb.size();
+}
+
+// PNG must give back the pixels exactly. JPEG must be about as close as libjpeg gets at the same quality.
+static bool close_to(const image &decoded, const image &expected, frame_encoder::format fmt, int quality) {
+  if (decoded.width != expected.width || decoded.height != expected.height || decoded.rgb.size() != expected.rgb.size()) return false;
+  if (fmt == frame_encoder::format::png) return decoded.rgb == expected.rgb;
+  std::vector<uint8_t> reference = encode_jpeg(expected, quality);
+  double mean, reference_mean;
+  int worst, reference_worst;
+  errors(decoded, expected, mean, worst);
+  errors(decode_jpeg(reference.data(), reference.size()), expected, reference_mean, reference_worst);
+  return mean <= reference_mean * 1.1 + 0.1 && worst <= reference_worst + 16;
+}
+
+// Reads a tile record (see frame_encoder.hpp) and pastes the tiles onto canvas.
+class tile_reader {
+public:
+  tile_reader(const std::vector<uint8_t> &record) : p_(record.data()), end_(record.data() + record.size()) {
+  }
+
+  bool paste(image &canvas, frame_encoder::format fmt, int &num_tiles) {
+    if (end_ - p_ < 12 || memcmp(p_, "MVTL", 4)) return false;
+    p_ += 4;
+    int width = get16(), height = get16();
+    num_tiles = get16();
+    if (get16() != (fmt == frame_encoder::format::jpeg ? 0 : 1)) return false;
+    if (canvas.rgb.empty()) {
+      canvas.width = width;
+      canvas.height = height;
+      canvas.rgb.resize((size_t)width * height * 3);
+    }
+    if (width != canvas.width || height != canvas.height) return false;
+    for (int t = 0; t != num_tiles; ++t) {
+      if (end_ - p_ < 12) return false;
+      int x = get16(), y = get16(), w = get16(), h = get16();
+      size_t size = get16();
+      size |= (size_t)get16() << 16;
+      if ((size_t)(end_ - p_) < size || x + w > width || y + h > height) return false;
+      image tile = decode(fmt, p_, size);
+      p_ += size;
+      if (tile.width != w || tile.height != h) return false;
+      for (int row = 0; row != h; ++row) {
+        memcpy(&canvas.rgb[((size_t)(y + row) * width + x) * 3], &tile.rgb[(size_t)row * w * 3], (size_t)w * 3);
+      }
+    }
+    return p_ == end_;
+  }
+
+private:
+  int get16() {
+    int v = p_[0] | p_[1] << 8;
+    p_ += 2;
+    return v;
+  }
+
+  const uint8_t *p_;
+  const uint8_t *end_;
+};
+
+// A few coloured spheres seen by a camera looking down z.
+struct scene {
+  std::vector<glm::vec3> centres;
+  std::vector<float> radii;
+  std::vector<glm::vec3> colours;
+  gilgamesh::sphere_bvh bvh;
+
+  scene() {
+    for (int i = 0; i != 24; ++i) {
+      centres.emplace_back((i % 6) * 3.0f - 7.5f, (i / 6) * 3.0f - 4.5f, (float)(i % 5));
+      radii.push_back(1.0f + (i % 3) * 0.3f);
+      colours.emplace_back((i % 2) * 0.8f + 0.1f, (i % 3) * 0.4f, (i % 5) * 0.2f + 0.1f);
+    }
+    bvh = gilgamesh::sphere_bvh(centres, radii, 1);
+  }
+
+  void render(sphere_tracer &tracer) const {
+    sphere_tracer::camera cam;
+    float aspect = (float)tracer.width() / tracer.height();
+    cam.start = glm::vec3(0, 0, 30);
+    cam.corner = glm::vec3(-0.4f * aspect, -0.4f, -1);
+    cam.dx = glm::vec3(0.8f * aspect / tracer.width(), 0, 0);
+    cam.dy = glm::vec3(0, 0.8f / tracer.height(), 0);
+    sphere_tracer::scene scn;
+    scn.spheres = &bvh;
+    scn.sphere_colours = colours.data();
+    tracer.render(cam, scn, 2);
+  }
+};
+
+// A sequence of frames: the first, one with a sphere moved, and the same again.
+static void test_sequence(frame_encoder::format fmt, int quality, bool tiles, unsigned num_threads) {
+  // Not a whole number of JPEG strips or tiles, so the edges are partly filled.
+  const int width = 150, height = 100;
+  scene s;
+  sphere_tracer tracer(width, height);
+  frame_encoder encoder(fmt, quality);
+  image canvas;
+
+  // Encode the tracer's image, then decode it and compare with what was traced.
+  // Returns the number of tiles sent, or 1 for a whole frame, or 0 if nothing was sent.
+  auto send = [&]() {
+    std::vector<uint8_t> dest = { 'x' };
+    bool sent = tiles ? encoder.encode_tiles(dest, tracer.pixels(), width, height, num_threads) : encoder.encode_frame(dest, tracer.pixels(), width, height, num_threads);
+    TEST_CHECK(dest[0] == 'x' && sent == (dest.size() > 1));
+    if (!sent) return 0;
+    std::vector<uint8_t> data(dest.begin() + 1, dest.end());
+    int num_tiles = 1;
+    if (tiles) {
+      TEST_CHECK(tile_reader(data).paste(canvas, fmt, num_tiles));
+    } else {
+      canvas = decode(fmt, data.data(), data.size());
+    }
+    TEST_CHECK(close_to(canvas, rgb_of(tracer), fmt, quality));
+    return num_tiles;
+  };
+
+  s.render(tracer);
+  int first = send();
+  TEST_CHECK(first == (tiles ? 3 * 2 : 1));
+
+  // Move one sphere; with tiles only those around it are sent again.
+  s.bvh.move(7, s.centres[7] + glm::vec3(0.5f, 0.3f, 0));
+  s.bvh.refit();
+  s.render(tracer);
+  int moved = send();
+  TEST_CHECK(moved >= 1 && (!tiles || moved < first));
+
+  // Nothing changed, so nothing is sent until a key frame.
+  s.render(tracer);
+  TEST_CHECK(send() == 0);
+  encoder.key_frame();
+  TEST_CHECK(send() == first);
+}
+
+// Several threads make the same bytes as one.
+static void test_threads(frame_encoder::format fmt) {
+  scene s;
+  sphere_tracer tracer(200, 130);
+  s.render(tracer);
+  for (bool tiles : { false, true }) {
+    std::vector<uint8_t> expected;
+    frame_encoder one(fmt, 80);
+    tiles ? one.encode_tiles(expected, tracer.pixels(), 200, 130, 1) : one.encode_frame(expected, tracer.pixels(), 200, 130, 1);
+    for (unsigned threads : { 2, 4 }) {
+      std::vector<uint8_t> dest;
+      frame_encoder many(fmt, 80);
+      tiles ? many.encode_tiles(dest, tracer.pixels(), 200, 130, threads) : many.encode_frame(dest, tracer.pixels(), 200, 130, threads);
+      TEST_CHECK(dest == expected);
+    }
+  }
+}
+
+int main() {
+  for (bool tiles : { false, true }) {
+    for (unsigned threads : { 1, 4 }) {
+      test_sequence(frame_encoder::format::jpeg, 90, tiles, threads);
+      test_sequence(frame_encoder::format::png, 6, tiles, threads);
+    }
+  }
+  test_sequence(frame_encoder::format::jpeg, 30, false, 1);
+  test_threads(frame_encoder::format::jpeg);
+  test_threads(frame_encoder::format::png);
+  return test_result();
+}
@@ -0,0 +1,193 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// gzip_decoder tests: members made by zlib with every header flag, several
+// members one after another, and damaged CRCs, sizes and headers, which must
+// fail. Then 5wsn.pdb.gz is loaded as Model::decodeCompressed does, through
+// a buffer_ring into the PDB decoder.
+//
+
+#include <andyzip/gzip_decoder.hpp>
+#include <gilgamesh/buffer_ring.hpp>
+#include <gilgamesh/decoders/pdb_decoder.hpp>
+#include <zlib.h>
+#include <thread>
+#include "test.hpp"
+
+using andyzip::gzip_decoder;
+
+enum { FTEXT = 1, FHCRC = 2, FEXTRA = 4, FNAME = 8, FCOMMENT = 16 };
+
+// A zlib stream of text: raw deflate if window_bits is negative, gzip if it is 31.
+static std::vector<uint8_t> zlib_encode(const std::vector<uint8_t> &text, int level, int window_bits) {
+  z_stream z = {};
+  TEST_CHECK(deflateInit2(&z, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  std::vector<uint8_t> result(deflateBound(&z, (uLong)text.size()) + 32);
+  z.next_in = (Bytef *)text.data();
+  z.avail_in = (uInt)text.size();
+  z.next_out = result.data();
+  z.avail_out = (uInt)result.size();
+  TEST_CHECK(deflate(&z, Z_FINISH) == Z_STREAM_END);
+  result.resize(z.total_out);
+  deflateEnd(&z);
+  return result;
+}
+
+static void put32(std::vector<uint8_t> &dest, uint32_t v) {
+  for (int i = 0; i != 32; i += 8) dest.push_back((uint8_t)(v >> i));
+}
+
+// A gzip member built by hand around a raw deflate stream, with the given header flags.
+static std::vector<uint8_t> member(const std::vector<uint8_t> &text, int flags, int level = 6) {
+  std::vector<uint8_t> result = { 0x1f, 0x8b, 8, (uint8_t)flags, 1, 2, 3, 4, 0, 3 };
+  if (flags & FEXTRA) {
+    result.insert(result.end(), { 6, 0, 'A', 'B', 2, 0, 'x', 'y' });
+  }
+  if (flags & FNAME) {
+    std::string name = "5wsn.pdb";
+    result.insert(result.end(), name.c_str(), name.c_str() + name.size() + 1);
+  }
+  if (flags & FCOMMENT) {
+    std::string comment = "a comment";
+    result.insert(result.end(), comment.c_str(), comment.c_str() + comment.size() + 1);
+  }
+  if (flags & FHCRC) {
+    uint32_t crc = (uint32_t)crc32(0, result.data(), (uInt)result.size());
+    result.push_back((uint8_t)crc);
+    result.push_back((uint8_t)(crc >> 8));
+  }
+  std::vector<uint8_t> deflated = zlib_encode(text, level, -15);
+  result.insert(result.end(), deflated.begin(), deflated.end());
+  put32(result, (uint32_t)crc32(0, text.data(), (uInt)text.size()));
+  put32(result, (uint32_t)text.size());
+  return result;
+}
+
+// Decode a whole file. Damaged streams may throw from the deflate decoder; that counts as failing.
+static bool decode(std::vector<uint8_t> &dest, const std::vector<uint8_t> &src) {
+  gzip_decoder decoder;
+  dest.clear();
+  try {
+    return decoder.decode_stream(src.data(), src.data() + src.size(), [&dest](const uint8_t *b, const uint8_t *e) {
+      dest.insert(dest.end(), b, e);
+      return true;
+    });
+  } catch (const std::exception &) {
+    return false;
+  }
+}
+
+static std::vector<uint8_t> join(std::initializer_list<std::vector<uint8_t> > parts) {
+  std::vector<uint8_t> result;
+  for (auto &p : parts) result.insert(result.end(), p.begin(), p.end());
+  return result;
+}
+
+static void test_members(const std::vector<uint8_t> &text) {
+  std::vector<uint8_t> decoded;
+  for (int flags = 0; flags != 32; ++flags) {
+    TEST_CHECK(decode(decoded, member(text, flags)) && decoded == text);
+  }
+  for (int level : { 0, 1, 9 }) {
+    TEST_CHECK(decode(decoded, member(text, FNAME, level)) && decoded == text);
+    TEST_CHECK(decode(decoded, zlib_encode(text, level, 31)) && decoded == text);
+  }
+  std::vector<uint8_t> empty;
+  TEST_CHECK(decode(decoded, member(empty, 0)) && decoded.empty());
+  TEST_CHECK(decode(decoded, zlib_encode(empty, 6, 31)) && decoded.empty());
+
+  // Members one after another decode to their texts one after another, as gzip -d does.
+  size_t half = text.size() / 2;
+  std::vector<uint8_t> first(text.begin(), text.begin() + half), second(text.begin() + half, text.end());
+  TEST_CHECK(decode(decoded, join({ member(first, FNAME), member(second, 0) })) && decoded == text);
+  TEST_CHECK(decode(decoded, join({ member(first, 0), member(empty, FCOMMENT), zlib_encode(second, 9, 31) })) && decoded == text);
+}
+
+static void test_damaged(const std::vector<uint8_t> &text) {
+  std::vector<uint8_t> decoded;
+  std::vector<uint8_t> good = member(text, FNAME);
+  size_t size = good.size();
+
+  // Each bit of the CRC and size in the trailer.
+  for (size_t i = size - 8; i != size; ++i) {
+    for (int bit = 0; bit != 8; ++bit) {
+      std::vector<uint8_t> bad = good;
+      bad[i] ^= (uint8_t)(1 << bit);
+      TEST_CHECK(!decode(decoded, bad));
+    }
+  }
+
+  // A bad CRC in the second of two members fails the whole file.
+  std::vector<uint8_t> two = join({ good, good });
+  two[two.size() - 6] ^= 1;
+  TEST_CHECK(!decode(decoded, two));
+
+  // Not deflate, and headers cut short.
+  std::vector<uint8_t> bad = good;
+  bad[2] = 7;
+  TEST_CHECK(!decode(decoded, bad));
+  std::vector<uint8_t> all_flags = member(text, FHCRC | FEXTRA | FNAME | FCOMMENT);
+  for (size_t cut = 0; cut != 40; ++cut) {
+    TEST_CHECK(!decode(decoded, std::vector<uint8_t>(all_flags.begin(), all_flags.begin() + cut)));
+  }
+
+  // Every truncation of a short member, and a spread of them in a long one.
+  for (size_t cut = 0; cut < size; cut += cut < 256 ? 1 : size / 97 + 1) {
+    TEST_CHECK(!decode(decoded, std::vector<uint8_t>(good.begin(), good.begin() + cut)));
+  }
+}
+
+// Decompress on another thread into the PDB decoder, as Model::decodeCompressed does.
+static bool load_gzip(gilgamesh::pdb_decoder &pdb, const std::vector<uint8_t> &src) {
+  gilgamesh::buffer_ring ring;
+  std::thread decompressor([&src, &ring]() {
+    bool ok = false;
+    try {
+      gzip_decoder decoder;
+      ok = decoder.decode_stream(src.data(), src.data() + src.size(), [&ring](const uint8_t *b, const uint8_t *e) { return ring.write(b, e); });
+    } catch (...) {
+    }
+    ring.close(ok);
+  });
+  bool ok = ring.read([&pdb](const uint8_t *b, const uint8_t *e) { pdb.feed(b, e); return true; });
+  decompressor.join();
+  pdb.finish();
+  return ok;
+}
+
+static void test_load(const std::vector<uint8_t> &pdb_text) {
+  gilgamesh::pdb_decoder expected(pdb_text.data(), pdb_text.data() + pdb_text.size());
+  TEST_CHECK(!expected.allAtoms().empty());
+
+  // One member, and two split in the middle of a line.
+  size_t cut = pdb_text.size() / 3 + 17;
+  std::vector<uint8_t> first(pdb_text.begin(), pdb_text.begin() + cut), second(pdb_text.begin() + cut, pdb_text.end());
+  for (auto &gz : { zlib_encode(pdb_text, 6, 31), join({ member(first, FNAME), member(second, FNAME) }) }) {
+    gilgamesh::pdb_decoder pdb(1);
+    TEST_CHECK(load_gzip(pdb, gz));
+    const std::vector<gilgamesh::pdb_decoder::atom> &a = expected.allAtoms(), &b = pdb.allAtoms();
+    TEST_CHECK(a.size() == b.size() && !memcmp(a.data(), b.data(), a.size() * sizeof(a[0])));
+    TEST_CHECK(expected.connections() == pdb.connections());
+  }
+
+  // A damaged file is reported after what was decoded has been fed.
+  std::vector<uint8_t> bad = zlib_encode(pdb_text, 6, 31);
+  bad[bad.size() - 8] ^= 1;
+  gilgamesh::pdb_decoder pdb(1);
+  TEST_CHECK(!load_gzip(pdb, bad));
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  std::vector<uint8_t> pdb = test_read_file(dir + "/5wsn.pdb");
+  std::vector<uint8_t> cif = test_read_file(dir + "/2tgt.cif");
+
+  test_members(cif);
+  test_members(std::vector<uint8_t>{ 'a' });
+  test_damaged(std::vector<uint8_t>(pdb.begin(), pdb.begin() + std::min(pdb.size(), (size_t)20000)));
+  test_damaged(std::vector<uint8_t>{ 'a', 'b', 'c' });
+  test_load(pdb);
+
+  return test_result();
+}
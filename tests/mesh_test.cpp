@@ -0,0 +1,92 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// Marching cubes on several threads must make exactly the mesh that one
+// thread makes, for small grids where some slabs are empty and for the
+// molecular surface of 2tgt.
+//
+
+#include <gilgamesh/mesh.hpp>
+#include <gilgamesh/molecular_surface.hpp>
+#include <gilgamesh/decoders/pdb_decoder.hpp>
+#include "test.hpp"
+
+typedef gilgamesh::color_mesh mesh_t;
+
+static const unsigned thread_counts[] = { 2, 3, 8 };
+
+// The same vertices, bit for bit, and the same indices, all in range.
+static bool same_mesh(const mesh_t &a, const mesh_t &b) {
+  bool ok = a.vertices().size() == b.vertices().size() && a.indices() == b.indices();
+  ok = ok && !memcmp(a.vertices().data(), b.vertices().data(), a.vertices().size() * sizeof(mesh_t::vertex_t));
+  for (auto i : b.indices()) ok &= i < b.vertices().size();
+  return ok && b.indices().size() % 3 == 0;
+}
+
+// A sphere of radius r in a grid of dims, which some grids cut off.
+static mesh_t sphere(glm::ivec3 dims, float r, unsigned num_threads) {
+  glm::vec3 centre = glm::vec3(dims - 1) * 0.5f;
+  auto fn = [=](int x, int y, int z) {
+    return glm::length(glm::vec3(x, y, z) - centre) - r;
+  };
+  auto generator = [](float x, float y, float z) {
+    return mesh_t::vertex_t(glm::vec3(x, y, z), glm::vec3(0, 0, 1), glm::vec2(x, y), glm::vec4(z));
+  };
+  return mesh_t(dims.x, dims.y, dims.z, fn, generator, num_threads);
+}
+
+static void test_small_grids() {
+  struct grid { glm::ivec3 dims; float r; };
+  for (grid g : { grid{ glm::ivec3(5, 6, 1), 2.0f }, grid{ glm::ivec3(5, 6, 2), 2.0f }, grid{ glm::ivec3(9, 9, 3), 3.0f }, grid{ glm::ivec3(12, 11, 10), 4.5f }, grid{ glm::ivec3(16, 16, 40), 9.0f } }) {
+    mesh_t expected = sphere(g.dims, g.r, 1);
+    TEST_CHECK(g.dims.z < 3 || !expected.indices().empty());
+    for (unsigned threads : thread_counts) {
+      TEST_CHECK(same_mesh(expected, sphere(g.dims, g.r, threads)));
+    }
+  }
+}
+
+// The surface as Model builds it: atoms other than water, van der Waals radii, a 1.4A probe on a 1A grid.
+static gilgamesh::molecular_surface build_surface(const std::vector<glm::vec3> &pos, const std::vector<float> &radii, unsigned num_threads) {
+  float probe_radius = 1.4f, grid_spacing = 1.0f;
+  glm::vec3 min(1e38f), max(-1e38f);
+  for (auto &p : pos) {
+    min = glm::min(min, p);
+    max = glm::max(max, p);
+  }
+  glm::vec3 pad(*std::max_element(radii.begin(), radii.end()) + probe_radius + grid_spacing * 3);
+  glm::ivec3 dims = glm::ivec3((max - min + pad * 2.0f) / grid_spacing) + 1;
+  return gilgamesh::molecular_surface(dims.x, dims.y, dims.z, grid_spacing, min - pad, pos, radii, probe_radius, num_threads);
+}
+
+static void test_surface(const std::vector<uint8_t> &text) {
+  gilgamesh::pdb_decoder cif(text.data(), text.data() + text.size());
+  std::vector<glm::vec3> pos;
+  std::vector<float> radii;
+  for (auto &a : cif.allAtoms()) {
+    if (a.isWater()) continue;
+    pos.push_back(a.pos());
+    radii.push_back(a.vanDerVaalsRadius());
+  }
+  TEST_CHECK(pos.size() > 1000);
+
+  auto colour = [&pos](int pindex) { return pindex == -1 ? glm::vec4(1) : glm::vec4(pos[pindex], 1); };
+  gilgamesh::molecular_surface ses = build_surface(pos, radii, 1);
+  mesh_t expected = ses.mesh<mesh_t>(colour, 1);
+  TEST_CHECK(expected.indices().size() > 10000);
+  for (unsigned threads : thread_counts) {
+    TEST_CHECK(same_mesh(expected, ses.mesh<mesh_t>(colour, threads)));
+
+    // The fields built on several threads give the same mesh too.
+    gilgamesh::molecular_surface threaded = build_surface(pos, radii, threads);
+    TEST_CHECK(same_mesh(expected, threaded.mesh<mesh_t>(colour, threads)));
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  test_small_grids();
+  test_surface(test_read_file(dir + "/2tgt.cif"));
+  return test_result();
+}
@@ -0,0 +1,141 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// pdb_decoder tests: the threaded decoder must give the serial decoder's
+// output byte for byte, short lines must not be read past their end and
+// atoms must know their model.
+//
+
+#include <gilgamesh/decoders/pdb_decoder.hpp>
+#include "test.hpp"
+
+using gilgamesh::pdb_decoder;
+
+static bool same_atoms(const std::vector<pdb_decoder::atom> &a, const std::vector<pdb_decoder::atom> &b) {
+  return a.size() == b.size() && (a.empty() || !memcmp(a.data(), b.data(), a.size() * sizeof(pdb_decoder::atom)));
+}
+
+static void check_same(const pdb_decoder &expected, const pdb_decoder &actual) {
+  TEST_CHECK(same_atoms(expected.allAtoms(), actual.allAtoms()));
+  TEST_CHECK(expected.connections() == actual.connections());
+  TEST_CHECK(expected.instanceMatrices() == actual.instanceMatrices());
+}
+
+static void test_threads(const std::vector<uint8_t> &text) {
+  pdb_decoder serial(text.data(), text.data() + text.size(), 1);
+  TEST_CHECK(!serial.allAtoms().empty());
+  for (unsigned threads : { 2, 3, 8 }) {
+    pdb_decoder parallel(text.data(), text.data() + text.size(), threads);
+    check_same(serial, parallel);
+  }
+}
+
+// Decode text fed a few bytes at a time.
+static void feed_in_pieces(pdb_decoder &decoder, const std::vector<uint8_t> &text) {
+  size_t size = 1;
+  for (size_t i = 0; i < text.size(); i += size, size = size % 7 + 1) {
+    // Copy each piece so that reading past it shows up under ASan.
+    size_t n = std::min(size, text.size() - i);
+    std::vector<uint8_t> piece(text.begin() + i, text.begin() + i + n);
+    decoder.feed(piece.data(), piece.data() + n);
+  }
+  decoder.finish();
+}
+
+// ATOM and HETATM lines cut short at every column up to 80.
+static void test_short_lines(const std::vector<uint8_t> &pdb) {
+  std::string text = "HEADER    SHORT LINES\n";
+  std::vector<std::string> full;
+  for (size_t p = 0; p < pdb.size(); ) {
+    size_t eol = std::find(pdb.begin() + p, pdb.end(), '\n') - pdb.begin();
+    std::string line(pdb.begin() + p, pdb.begin() + eol);
+    if ((!line.compare(0, 6, "ATOM  ") || !line.compare(0, 6, "HETATM")) && line.size() >= 80) {
+      full.push_back(line);
+      line.resize(6 + full.size() % 75);
+      text += line + "\n";
+    }
+    p = eol + 1;
+  }
+  // The last line has no newline and ends the buffer.
+  text += full.front().substr(0, 60);
+
+  std::vector<uint8_t> bytes(text.begin(), text.end());
+  pdb_decoder whole(bytes.data(), bytes.data() + bytes.size());
+  pdb_decoder pieces(1);
+  feed_in_pieces(pieces, bytes);
+  check_same(whole, pieces);
+  TEST_CHECK(whole.allAtoms().size() == full.size() + 1);
+
+  // CRLF line ends give the same atoms.
+  std::vector<uint8_t> crlf;
+  for (uint8_t c : bytes) {
+    if (c == '\n') crlf.push_back('\r');
+    crlf.push_back(c);
+  }
+  pdb_decoder crlf_pieces(1);
+  feed_in_pieces(crlf_pieces, crlf);
+  check_same(whole, crlf_pieces);
+
+  // A line cut after the coordinates still has them.
+  std::string cut = "HEADER\n" + full.front().substr(0, 54);
+  std::string line = "HEADER\n" + full.front();
+  pdb_decoder short_atom((const uint8_t *)cut.data(), (const uint8_t *)cut.data() + cut.size());
+  pdb_decoder full_atom((const uint8_t *)line.data(), (const uint8_t *)line.data() + line.size());
+  TEST_CHECK(short_atom.allAtoms().size() == 1 && full_atom.allAtoms().size() == 1);
+  if (short_atom.allAtoms().size() == 1 && full_atom.allAtoms().size() == 1) {
+    TEST_CHECK(short_atom.allAtoms()[0].pos() == full_atom.allAtoms()[0].pos());
+    TEST_CHECK(short_atom.allAtoms()[0].serial() == full_atom.allAtoms()[0].serial());
+  }
+}
+
+// Two models of the same atoms, as in NMR files, then atoms outside any model.
+static void test_models(const std::vector<uint8_t> &pdb) {
+  std::string atoms;
+  size_t num_atoms = 0;
+  for (size_t p = 0; p < pdb.size(); ) {
+    size_t eol = std::find(pdb.begin() + p, pdb.end(), '\n') - pdb.begin();
+    std::string line(pdb.begin() + p, pdb.begin() + eol);
+    if (!line.compare(0, 6, "ATOM  ") || !line.compare(0, 6, "HETATM")) {
+      atoms += line + "\n";
+      ++num_atoms;
+    }
+    p = eol + 1;
+  }
+  std::string text = "HEADER    MODELS\nMODEL        1\n" + atoms + "ENDMDL\nMODEL        2\n" + atoms + "ENDMDL\n" + atoms;
+  std::vector<uint8_t> bytes(text.begin(), text.end());
+  test_threads(bytes);
+
+  pdb_decoder decoded(bytes.data(), bytes.data() + bytes.size(), 4);
+  const std::vector<pdb_decoder::atom> &all = decoded.allAtoms();
+  TEST_CHECK(all.size() == num_atoms * 3);
+  if (all.size() == num_atoms * 3) {
+    bool ok = true;
+    for (size_t i = 0; i != all.size(); ++i) {
+      ok &= all[i].model() == (i < num_atoms ? 1 : i < num_atoms * 2 ? 2 : 0);
+    }
+    TEST_CHECK(ok);
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  std::vector<uint8_t> pdb = test_read_file(dir + "/5wsn.pdb");
+  std::vector<uint8_t> cif = test_read_file(dir + "/2tgt.cif");
+
+  test_threads(pdb);
+  test_threads(cif);
+  test_short_lines(pdb);
+  test_models(pdb);
+
+  // 2tgt has one model, numbered in the pdbx_PDB_model_num column.
+  pdb_decoder cif_decoded(cif.data(), cif.data() + cif.size());
+  TEST_CHECK(!cif_decoded.allAtoms().empty() && cif_decoded.allAtoms().front().model() == 1);
+
+  // 5wsn has BIOMT records and CONECT records.
+  pdb_decoder decoded(pdb.data(), pdb.data() + pdb.size(), 4);
+  TEST_CHECK(!decoded.instanceMatrices().empty());
+  TEST_CHECK(!decoded.connections().empty());
+
+  return test_result();
+}
@@ -0,0 +1,247 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// selection tests: expressions against the same tests made atom by atom,
+// operator precedence, the error messages, byres and bychain, negative
+// residue numbers, and both ways "within" searches against brute force.
+//
+
+#include <gilgamesh/selection.hpp>
+#include <gilgamesh/decoders/pdb_decoder.hpp>
+#include "test.hpp"
+
+using gilgamesh::selection;
+using gilgamesh::atom_store;
+using gilgamesh::pdb_decoder;
+
+typedef std::vector<bool> atoms_t;
+
+// A molecule with a grid over its atoms and the atoms' own columns to test against.
+struct molecule {
+  std::vector<pdb_decoder::atom> atoms;
+  atom_store store;
+  gilgamesh::atom_grid grid;
+
+  molecule(const std::vector<uint8_t> &text) {
+    pdb_decoder pdb(text.data(), text.data() + text.size());
+    atoms = pdb.allAtoms();
+    store = atom_store(atoms);
+    grid = gilgamesh::atom_grid(store.pos());
+  }
+
+  size_t size() const { return atoms.size(); }
+
+  template <class Fn>
+  atoms_t where(Fn fn) const {
+    atoms_t result(size());
+    for (size_t i = 0; i != size(); ++i) result[i] = fn(atoms[i]);
+    return result;
+  }
+
+  // Whole residues, or chains, with any atom in set.
+  atoms_t expand(const atoms_t &set, bool chains) const {
+    atoms_t result(size());
+    int num = (int)(chains ? store.num_chains() : store.num_residues());
+    for (int r = 0; r != num; ++r) {
+      atom_store::range range = chains ? store.chain_atoms(r) : store.residue_atoms(r);
+      bool any = false;
+      for (int i = range.begin; i != range.end; ++i) any = any || set[i];
+      for (int i = range.begin; i != range.end; ++i) result[i] = any;
+    }
+    return result;
+  }
+
+  // The atoms of set and those within distance of any of them.
+  atoms_t within(const std::vector<glm::vec3> &pos, const atoms_t &set, float distance) const {
+    atoms_t result = set;
+    for (size_t j = 0; j != size(); ++j) {
+      if (!set[j]) continue;
+      for (size_t i = 0; i != size(); ++i) {
+        glm::vec3 d = pos[i] - pos[j];
+        if (glm::dot(d, d) <= distance * distance) result[i] = true;
+      }
+    }
+    return result;
+  }
+};
+
+static atoms_t operator&(const atoms_t &a, const atoms_t &b) { atoms_t r(a.size()); for (size_t i = 0; i != a.size(); ++i) r[i] = a[i] && b[i]; return r; }
+static atoms_t operator|(const atoms_t &a, const atoms_t &b) { atoms_t r(a.size()); for (size_t i = 0; i != a.size(); ++i) r[i] = a[i] || b[i]; return r; }
+static atoms_t operator~(const atoms_t &a) { atoms_t r(a.size()); for (size_t i = 0; i != a.size(); ++i) r[i] = !a[i]; return r; }
+
+static size_t count(const atoms_t &a) { return (size_t)std::count(a.begin(), a.end(), true); }
+
+static bool selects(const molecule &m, const std::string &text, const atoms_t &expected, unsigned num_threads = 1) {
+  gilgamesh::atom_bitset bits = selection(text).evaluate(m.store, m.grid, num_threads);
+  bool ok = bits.size() == expected.size() && bits.count() == count(expected);
+  for (size_t i = 0; ok && i != expected.size(); ++i) ok = bits.test(i) == expected[i];
+  if (!ok) printf("'%s' selects %d atoms, not %d\n", text.c_str(), (int)bits.count(), (int)count(expected));
+  return ok;
+}
+
+static std::string error_of(const std::string &text) {
+  try {
+    selection s(text);
+  } catch (const std::runtime_error &e) {
+    return e.what();
+  }
+  return "";
+}
+
+static std::string name(uint32_t id) { return pdb_decoder::nameString(id); }
+
+static void test_terms(const molecule &m) {
+  atoms_t chain_a = m.where([](const pdb_decoder::atom &a) { return a.chainID() == 'A'; });
+  atoms_t ca = m.where([](const pdb_decoder::atom &a) { return name(a.atomId()) == "CA"; });
+  atoms_t carbon = m.where([](const pdb_decoder::atom &a) { return name(a.elementId()) == "C"; });
+  atoms_t water = m.where([](const pdb_decoder::atom &a) { return a.isWater(); });
+  atoms_t het = m.where([](const pdb_decoder::atom &a) { return a.is_hetatom(); });
+  atoms_t gly = m.where([](const pdb_decoder::atom &a) { return name(a.resId()) == "GLY"; });
+  atoms_t resi = m.where([](const pdb_decoder::atom &a) { return (a.resSeq() >= 10 && a.resSeq() <= 50) || a.resSeq() == 60; });
+  TEST_CHECK(count(chain_a) && count(ca) && count(water) && count(het) && count(gly) && count(resi));
+
+  TEST_CHECK(selects(m, "all", ~atoms_t(m.size())));
+  TEST_CHECK(selects(m, "none", atoms_t(m.size())));
+  TEST_CHECK(selects(m, "chain A", chain_a));
+  TEST_CHECK(selects(m, "name ca", ca));
+  TEST_CHECK(selects(m, "ELEM c", carbon));
+  TEST_CHECK(selects(m, "water", water));
+  TEST_CHECK(selects(m, "hetatm", het));
+  TEST_CHECK(selects(m, "resn Gly+XYZ", gly));
+  TEST_CHECK(selects(m, "resi 10-50+60", resi));
+  TEST_CHECK(selects(m, "resi 50-10+60", resi));
+  atoms_t first = atoms_t(m.size());
+  for (size_t i = 0; i != 100 && i != m.size(); ++i) first[i] = true;
+  first[m.size() - 1] = true;
+  TEST_CHECK(selects(m, "index 0-99+" + std::to_string(m.size() - 1) + "+" + std::to_string(m.size() + 5), first));
+
+  // and binds tighter than or, and prefixes tighter than both.
+  TEST_CHECK(selects(m, "chain A or name CA and elem C", chain_a | (ca & carbon)));
+  TEST_CHECK(selects(m, "name CA and elem C or chain A", (ca & carbon) | chain_a));
+  TEST_CHECK(selects(m, "(chain A or name CA) and water", (chain_a | ca) & water));
+  TEST_CHECK(selects(m, "not chain A and name CA", ~chain_a & ca));
+  TEST_CHECK(selects(m, "not (chain A and name CA)", ~(chain_a & ca)));
+  TEST_CHECK(selects(m, "! chain A | water & hetatm", ~chain_a | (water & het)));
+  TEST_CHECK(selects(m, "byres name CA and resn GLY", m.expand(ca, false) & gly));
+  TEST_CHECK(selects(m, "within 2 of water or name CA", m.within(m.store.pos(), water, 2.0f) | ca));
+
+  // byres and bychain.
+  TEST_CHECK(selects(m, "byres resi 10-50+60 and name CA", m.expand(resi, false) & ca));
+  TEST_CHECK(selects(m, "byres (resi 10-50+60 and name CA)", m.expand(resi & ca, false)));
+  TEST_CHECK(selects(m, "bychain index 0", m.expand(m.where([&](const pdb_decoder::atom &a) { return &a == &m.atoms[0]; }), true)));
+  TEST_CHECK(selects(m, "bychain water", m.expand(water, true)));
+  TEST_CHECK(selects(m, "byres none", atoms_t(m.size())));
+}
+
+static void test_errors() {
+  struct error { const char *text, *what; };
+  for (error e : {
+    error{ "", "selection: empty expression" },
+    error{ "name CA and", "selection: expression ends too soon" },
+    error{ "not", "selection: expression ends too soon" },
+    error{ "(chain A", "selection: missing ')'" },
+    error{ "chain A)", "selection: unexpected ')'" },
+    error{ "chain A B", "selection: unexpected 'B'" },
+    error{ "frobnicate", "selection: unknown word 'frobnicate'" },
+    error{ "chain", "selection: chain needs a value" },
+    error{ "name (", "selection: name needs a value" },
+    error{ "resi", "selection: resi needs a value" },
+    error{ "resi 1-", "selection: bad range '1-'" },
+    error{ "index 4+x", "selection: bad range 'x'" },
+    error{ "resi 1-2z", "selection: bad range '1-2z'" },
+    error{ "within", "selection: within needs a distance" },
+    error{ "within far of all", "selection: bad distance 'far'" },
+    error{ "within -1 of all", "selection: bad distance '-1'" },
+    error{ "within 5 all", "selection: within needs 'of'" },
+  }) {
+    std::string what = error_of(e.text);
+    if (what != e.what) printf("'%s' gives '%s'\n", e.text, what.c_str());
+    TEST_CHECK(what == e.what);
+  }
+  TEST_CHECK(error_of("within 0 of (all)") == "");
+}
+
+// Residues -5 to 3 of chain A and 1 to 2 of chain B, two atoms each.
+static std::vector<uint8_t> negative_residues() {
+  std::string text = "HEADER    TEST\n";
+  int serial = 1;
+  char line[96];
+  for (int r = -5; r <= 3; ++r) {
+    for (const char *atom : { " N  ", " CA " }) {
+      snprintf(line, sizeof(line), "ATOM  %5d %-4s ALA A%4d    %8.3f%8.3f%8.3f%6.2f%6.2f          %2s\n", serial, atom, r, serial * 1.5f, 0.0f, 0.0f, 1.0f, 0.0f, atom[1] == 'N' ? " N" : " C");
+      text += line;
+      ++serial;
+    }
+  }
+  for (int r = 1; r <= 2; ++r) {
+    snprintf(line, sizeof(line), "ATOM  %5d  CA  GLY B%4d    %8.3f%8.3f%8.3f%6.2f%6.2f           C\n", serial, r, serial * 1.5f, 5.0f, 0.0f, 1.0f, 0.0f);
+    text += line;
+    ++serial;
+  }
+  text += "END\n";
+  return std::vector<uint8_t>(text.begin(), text.end());
+}
+
+static void test_negative_resi() {
+  molecule m(negative_residues());
+  TEST_CHECK(m.size() == 20 && m.store.num_residues() == 11);
+  auto res = [&m](int lo, int hi) {
+    return m.where([=](const pdb_decoder::atom &a) { return a.resSeq() >= lo && a.resSeq() <= hi; });
+  };
+  TEST_CHECK(res(-5, -5) != atoms_t(m.size()));
+  TEST_CHECK(selects(m, "resi -3--1", res(-3, -1)));
+  TEST_CHECK(selects(m, "resi -1-2", res(-1, 2)));
+  TEST_CHECK(selects(m, "resi 2--2", res(-2, 2)));
+  TEST_CHECK(selects(m, "resi -5+3", res(-5, -5) | res(3, 3)));
+  TEST_CHECK(selects(m, "resi -5 and chain B", atoms_t(m.size())));
+  TEST_CHECK(selects(m, "chain A and resi -2-1", res(-2, 1) & m.where([](const pdb_decoder::atom &a) { return a.chainID() == 'A'; })));
+}
+
+// Sets smaller than half the atoms mark the atoms near each member; larger ones look for a member near each atom outside.
+static void test_within(const molecule &m) {
+  atoms_t ca = m.where([](const pdb_decoder::atom &a) { return name(a.atomId()) == "CA"; });
+  atoms_t water = m.where([](const pdb_decoder::atom &a) { return a.isWater(); });
+  TEST_CHECK(count(ca) < m.size() / 2 && count(~water) > m.size() / 2);
+  for (unsigned threads : { 1, 4 }) {
+    TEST_CHECK(selects(m, "within 3.5 of name CA", m.within(m.store.pos(), ca, 3.5f), threads));
+    TEST_CHECK(selects(m, "within 3.5 of not water", m.within(m.store.pos(), ~water, 3.5f), threads));
+    TEST_CHECK(selects(m, "within 0 of name CA", ca, threads));
+    TEST_CHECK(selects(m, "within 8 of index 7", m.within(m.store.pos(), m.where([&](const pdb_decoder::atom &a) { return &a == &m.atoms[7]; }), 8.0f), threads));
+    TEST_CHECK(selects(m, "within 50 of all", ~atoms_t(m.size()), threads));
+  }
+
+  // Positions other than the store's, as after atoms have moved.
+  std::vector<glm::vec3> moved = m.store.pos();
+  for (size_t i = 0; i < moved.size(); i += 3) moved[i] += glm::vec3(1.5f, -0.5f, 2.0f);
+  gilgamesh::atom_grid grid(moved);
+  struct query { const char *text; atoms_t set; };
+  for (const query &q : { query{ "within 4 of name CA", ca }, query{ "within 4 of not water", ~water } }) {
+    atoms_t expected = m.within(moved, q.set, 4.0f);
+    gilgamesh::atom_bitset bits = selection(q.text).evaluate(m.store, moved, grid, 2);
+    bool ok = bits.count() == count(expected);
+    for (size_t i = 0; ok && i != expected.size(); ++i) ok = bits.test(i) == expected[i];
+    TEST_CHECK(ok);
+  }
+
+  // A grid over other atoms is refused.
+  bool threw = false;
+  try {
+    selection("within 3 of name CA").evaluate(m.store, gilgamesh::atom_grid(std::vector<glm::vec3>(3)));
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  TEST_CHECK(threw);
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  molecule m(test_read_file(dir + "/2tgt.cif"));
+  TEST_CHECK(m.size() > 1000);
+
+  test_terms(m);
+  test_errors();
+  test_negative_resi();
+  test_within(m);
+  return test_result();
+}
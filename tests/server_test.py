@@ -0,0 +1,235 @@
+#
+# (C) Andy Thomason 2017
+#
+# Runs the server of examples/server.py headless on a free local port, reads
+# a few frames of its multipart JPEG stream and decodes them.
+#
+# Needs the moovoo module on PYTHONPATH; ctest sets it when built from the
+# top level with -DMOOVOO_TESTS=ON.
+#
+
+import os
+import sys
+import threading
+import http.client
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(here, "..", "examples"))
+
+import server
+
+NUM_FRAMES = 3
+TIMEOUT = 60
+
+class jpeg_error(Exception):
+  pass
+
+class bit_reader:
+  def __init__(s, data, pos):
+    s.data = data
+    s.pos = pos
+    s.acc = 0
+    s.num_bits = 0
+
+  def bit(s):
+    if s.num_bits == 0:
+      if s.pos >= len(s.data):
+        raise jpeg_error("entropy coded data runs off the end")
+      byte = s.data[s.pos]
+      if byte == 0xff:
+        if s.data[s.pos + 1] != 0:
+          raise jpeg_error("marker ff%02x inside a restart interval" % s.data[s.pos + 1])
+        s.pos += 1
+      s.pos += 1
+      s.acc = byte
+      s.num_bits = 8
+    s.num_bits -= 1
+    return s.acc >> s.num_bits & 1
+
+  def bits(s, n):
+    v = 0
+    for i in range(n):
+      v = v << 1 | s.bit()
+    return v
+
+  # Skip the padding ones and return the position of the marker that follows.
+  def align(s):
+    s.num_bits = 0
+    return s.pos
+
+def make_huffman(counts, values):
+  # (length, code) -> value, canonical codes as in Annex C.
+  table = {}
+  code = 0
+  k = 0
+  for length in range(1, 17):
+    for i in range(counts[length - 1]):
+      table[(length, code)] = values[k]
+      code += 1
+      k += 1
+    code <<= 1
+  return table
+
+def read_symbol(reader, table):
+  code = 0
+  for length in range(1, 17):
+    code = code << 1 | reader.bit()
+    value = table.get((length, code))
+    if value is not None:
+      return value
+  raise jpeg_error("bad huffman code")
+
+def extend(v, size):
+  return v - (1 << size) + 1 if size and v < 1 << (size - 1) else v
+
+# Decode a baseline JPEG to its DC coefficients, checking every block of the
+# entropy coded data. Returns (width, height, luma DC values).
+def decode_jpeg(data):
+  if data[0:2] != b"\xff\xd8":
+    raise jpeg_error("no SOI")
+  pos = 2
+  huffman = {}
+  components = []
+  width = height = 0
+  restart_interval = 0
+  while True:
+    if data[pos] != 0xff:
+      raise jpeg_error("expected a marker at %d" % pos)
+    marker = data[pos + 1]
+    length = data[pos + 2] << 8 | data[pos + 3]
+    segment = data[pos + 4 : pos + 2 + length]
+    pos += 2 + length
+    if marker == 0xc0:
+      height = segment[1] << 8 | segment[2]
+      width = segment[3] << 8 | segment[4]
+      for i in range(segment[5]):
+        c = segment[6 + i * 3 : 9 + i * 3]
+        components.append({ "id": c[0], "h": c[1] >> 4, "v": c[1] & 15 })
+    elif marker in (0xc1, 0xc2, 0xc3):
+      raise jpeg_error("not baseline")
+    elif marker == 0xc4:
+      p = 0
+      while p < len(segment):
+        counts = segment[p + 1 : p + 17]
+        n = sum(counts)
+        huffman[segment[p]] = make_huffman(counts, segment[p + 17 : p + 17 + n])
+        p += 17 + n
+    elif marker == 0xdd:
+      restart_interval = segment[0] << 8 | segment[1]
+    elif marker == 0xda:
+      for i in range(segment[0]):
+        cid, tables = segment[1 + i * 2], segment[2 + i * 2]
+        for c in components:
+          if c["id"] == cid:
+            c["dc"] = huffman[tables >> 4]
+            c["ac"] = huffman[0x10 | tables & 15]
+      break
+
+  hmax = max(c["h"] for c in components)
+  vmax = max(c["v"] for c in components)
+  mcus_x = (width + 8 * hmax - 1) // (8 * hmax)
+  mcus_y = (height + 8 * vmax - 1) // (8 * vmax)
+  num_mcus = mcus_x * mcus_y
+  reader = bit_reader(data, pos)
+  prev_dc = [0] * len(components)
+  luma_dc = []
+  for mcu in range(num_mcus):
+    if restart_interval and mcu and mcu % restart_interval == 0:
+      p = reader.align()
+      if data[p] != 0xff or data[p + 1] != 0xd0 + (mcu // restart_interval - 1) % 8:
+        raise jpeg_error("missing RST%d before MCU %d" % ((mcu // restart_interval - 1) % 8, mcu))
+      reader.pos = p + 2
+      prev_dc = [0] * len(components)
+    for ci, c in enumerate(components):
+      for b in range(c["h"] * c["v"]):
+        size = read_symbol(reader, c["dc"])
+        prev_dc[ci] += extend(reader.bits(size), size)
+        if ci == 0:
+          luma_dc.append(prev_dc[ci])
+        k = 1
+        while k < 64:
+          symbol = read_symbol(reader, c["ac"])
+          run, size = symbol >> 4, symbol & 15
+          if size == 0:
+            if run != 15:
+              break
+            k += 16
+          else:
+            k += run
+            reader.bits(size)
+            k += 1
+        if k > 64:
+          raise jpeg_error("too many coefficients in a block")
+  p = reader.align()
+  if data[p : p + 2] != b"\xff\xd9":
+    raise jpeg_error("no EOI after the last MCU")
+  return width, height, luma_dc
+
+# Read one part of a multipart/x-mixed-replace stream with boundary "frame".
+def read_part(response):
+  line = response.fp.readline()
+  if line == b"\r\n":
+    line = response.fp.readline()
+  if line.strip() != b"--frame":
+    raise jpeg_error("expected a boundary, got %r" % line)
+  headers = {}
+  while True:
+    line = response.fp.readline().strip()
+    if not line:
+      break
+    name, value = line.split(b":", 1)
+    headers[name.strip().lower()] = value.strip()
+  data = response.fp.read(int(headers[b"content-length"]))
+  return headers[b"content-type"], data
+
+def main():
+  httpd = server.moovoo_server(("127.0.0.1", 0), server.moovoo_handler)
+  port = httpd.server_address[1]
+  thread = threading.Thread(target=httpd.serve_forever)
+  thread.start()
+
+  failures = 0
+  try:
+    client = http.client.HTTPConnection("127.0.0.1", port, timeout=TIMEOUT)
+    client.request("GET", "/")
+    page = client.getresponse()
+    if page.status != 200 or b"<img" not in page.read():
+      print("the page has no image")
+      failures += 1
+    client.close()
+
+    client = http.client.HTTPConnection("127.0.0.1", port, timeout=TIMEOUT)
+    client.request("GET", "/1.jpg")
+    response = client.getresponse()
+    content_type = response.getheader("Content-Type")
+    if response.status != 200 or content_type != "multipart/x-mixed-replace; boundary=frame":
+      print("bad stream response: %d %s" % (response.status, content_type))
+      failures += 1
+    else:
+      for i in range(NUM_FRAMES):
+        part_type, data = read_part(response)
+        try:
+          if part_type != b"image/jpeg":
+            raise jpeg_error("part type is %r" % part_type)
+          width, height, luma_dc = decode_jpeg(data)
+          if (width, height) != server.SIZE:
+            raise jpeg_error("frame is %dx%d" % (width, height))
+          if min(luma_dc) == max(luma_dc):
+            raise jpeg_error("frame is blank")
+          print("frame %d: %d bytes, %dx%d" % (i, len(data), width, height))
+        except (jpeg_error, IndexError, KeyError) as e:
+          print("frame %d: %s" % (i, e))
+          failures += 1
+    # The server stops streaming when it finds the connection closed.
+    response.close()
+    client.close()
+  finally:
+    httpd.shutdown()
+    thread.join()
+    httpd.server_close()
+
+  print("%d checks failed" % failures if failures else "ok")
+  return 1 if failures else 0
+
+if __name__ == "__main__":
+  sys.exit(main())
@@ -0,0 +1,199 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// sparse_distance_field tests: inside the band the sparse field must agree
+// with the dense distance_field and with brute force, and after move(),
+// add(), remove() and update() it must agree with a fresh build.
+//
+
+#include <gilgamesh/sparse_distance_field.hpp>
+#include <gilgamesh/distance_field.hpp>
+#include <gilgamesh/decoders/pdb_decoder.hpp>
+#include <random>
+#include "test.hpp"
+
+using gilgamesh::sparse_distance_field;
+using gilgamesh::distance_field;
+
+struct scene {
+  glm::ivec3 dims;
+  float spacing;
+  glm::vec3 min;
+  std::vector<glm::vec3> points;
+  std::vector<float> radii;
+};
+
+// The nearest live sphere to a grid point if it is nearer than band, with ties to the lower index.
+static void brute_force(const sparse_distance_field &field, const std::vector<glm::vec3> &points, const std::vector<float> &radii, const std::vector<bool> &live, glm::ivec3 g, float &distance, int &pindex) {
+  glm::vec3 pos = field.position(g.x, g.y, g.z);
+  distance = field.band();
+  pindex = -1;
+  for (int i = 0; i != (int)points.size(); ++i) {
+    float d = glm::length(points[i] - pos) - radii[i];
+    if (live[i] && d < distance) {
+      distance = d;
+      pindex = i;
+    }
+  }
+}
+
+// Every grid point of field against brute force, and every brick kept has a grid point in the band.
+static bool same_as_brute_force(const sparse_distance_field &field, const std::vector<bool> &live) {
+  glm::ivec3 dims = field.dims();
+  bool ok = true;
+  for (int z = 0; z != dims.z; ++z) {
+    for (int y = 0; y != dims.y; ++y) {
+      for (int x = 0; x != dims.x; ++x) {
+        float d;
+        int p;
+        brute_force(field, field.points(), field.radii(), live, glm::ivec3(x, y, z), d, p);
+        ok &= field.distance(x, y, z) == d && field.pindex(x, y, z) == p;
+      }
+    }
+  }
+  for (auto &br : field.bricks()) {
+    ok &= std::any_of(std::begin(br.pindices), std::end(br.pindices), [](int p) { return p != -1; });
+  }
+  ok &= field.distance(-1, 0, 0) == field.band() && field.pindex(0, dims.y, 0) == -1;
+  return ok;
+}
+
+// The same values at every grid point, and the same number of bricks.
+static bool same_field(const sparse_distance_field &a, const sparse_distance_field &b) {
+  glm::ivec3 dims = a.dims();
+  bool ok = dims == b.dims() && a.bricks().size() == b.bricks().size();
+  for (int z = 0; z != dims.z && ok; ++z) {
+    for (int y = 0; y != dims.y; ++y) {
+      for (int x = 0; x != dims.x; ++x) {
+        ok &= a.distance(x, y, z) == b.distance(x, y, z) && a.pindex(x, y, z) == b.pindex(x, y, z);
+      }
+    }
+  }
+  return ok;
+}
+
+// Spheres of one radius on grid points, where the dense exact transform finds the true nearest sphere.
+static void test_against_dense() {
+  const int dim = 40;
+  const float spacing = 0.5f, radius = 1.5f, band = 2.0f;
+  glm::vec3 min(-3, 2, 7);
+  std::mt19937 rng(1);
+  std::vector<glm::vec3> points;
+  for (int i = 0; i != 60; ++i) {
+    glm::ivec3 g(rng() % dim, rng() % dim, rng() % dim);
+    points.push_back(min + glm::vec3(g) * spacing);
+  }
+  std::vector<float> radii(1, radius);
+
+  distance_field dense(dim, dim, dim, spacing, min, points, radii, distance_field::method::exact);
+  for (unsigned threads : { 1, 4 }) {
+    sparse_distance_field sparse(dim, dim, dim, spacing, min, points, radii, band, threads);
+    bool ok = true;
+    int in_band = 0;
+    for (int z = 0; z != dim; ++z) {
+      for (int y = 0; y != dim; ++y) {
+        for (int x = 0; x != dim; ++x) {
+          int index = (z * dim + y) * dim + x;
+          float d = dense.distances()[index];
+          int p = sparse.pindex(x, y, z);
+          if (d < band) {
+            // The same distance; on a tie either sphere will do.
+            ok &= sparse.distance(x, y, z) == d && p != -1;
+            ok &= p == dense.pindices()[index] || glm::length(points[p] - sparse.position(x, y, z)) == glm::length(points[dense.pindices()[index]] - sparse.position(x, y, z));
+            ++in_band;
+          } else {
+            ok &= sparse.distance(x, y, z) == band && p == -1;
+          }
+        }
+      }
+    }
+    TEST_CHECK(ok && in_band > 1000);
+    TEST_CHECK(sparse.memory_used() < dense.distances().size() * (sizeof(float) + sizeof(int)));
+  }
+}
+
+static scene molecule_scene(const std::vector<uint8_t> &text, int num_atoms) {
+  gilgamesh::pdb_decoder pdb(text.data(), text.data() + text.size());
+  scene s;
+  glm::vec3 lo(1e9f), hi(-1e9f);
+  for (auto &a : pdb.allAtoms()) {
+    if ((int)s.points.size() == num_atoms) break;
+    s.points.push_back(a.pos());
+    s.radii.push_back(a.vanDerVaalsRadius());
+    lo = glm::min(lo, a.pos());
+    hi = glm::max(hi, a.pos());
+  }
+  s.spacing = 0.7f;
+  s.min = lo - 3.0f;
+  s.dims = glm::ivec3((hi - lo + 6.0f) / s.spacing) + 1;
+  return s;
+}
+
+// Atoms of a molecule with their own radii, then moved, added and removed.
+static void test_edits(const scene &s) {
+  const float band = 1.5f;
+  std::vector<bool> live(s.points.size(), true);
+  sparse_distance_field field(s.dims.x, s.dims.y, s.dims.z, s.spacing, s.min, s.points, s.radii, band, 1);
+  TEST_CHECK(same_as_brute_force(field, live));
+  sparse_distance_field threaded(s.dims.x, s.dims.y, s.dims.z, s.spacing, s.min, s.points, s.radii, band, 4);
+  TEST_CHECK(same_field(field, threaded));
+
+  // Move every tenth atom, some out of the grid, and compare with a build from the moved atoms.
+  std::vector<glm::vec3> moved = s.points;
+  std::mt19937 rng(2);
+  std::uniform_real_distribution<float> step(-2.0f, 2.0f);
+  for (size_t i = 0; i < moved.size(); i += 10) {
+    moved[i] += glm::vec3(step(rng), step(rng), step(rng));
+    if (i % 100 == 0) moved[i] = s.min - 20.0f;
+    field.move((int)i, moved[i]);
+  }
+  sparse_distance_field before_update = field;
+  std::vector<glm::ivec3> measured = field.update(4);
+  sparse_distance_field fresh(s.dims.x, s.dims.y, s.dims.z, s.spacing, s.min, moved, s.radii, band, 1);
+  TEST_CHECK(same_field(field, fresh));
+
+  // Each brick that changed is one of those update() returned.
+  bool listed = true;
+  glm::ivec3 dims = field.dims();
+  for (int z = 0; z != dims.z; ++z) {
+    for (int y = 0; y != dims.y; ++y) {
+      for (int x = 0; x != dims.x; ++x) {
+        if (field.pindex(x, y, z) != before_update.pindex(x, y, z) || field.distance(x, y, z) != before_update.distance(x, y, z)) {
+          glm::ivec3 b = glm::ivec3(x, y, z) >> sparse_distance_field::brick_shift;
+          listed &= std::find(measured.begin(), measured.end(), b) != measured.end();
+        }
+      }
+    }
+  }
+  TEST_CHECK(listed);
+
+  // An update with nothing changed measures nothing.
+  TEST_CHECK(field.update().empty() && same_field(field, fresh));
+
+  // Remove some atoms and add others, which reuse the removed indices.
+  for (int i = 5; i < (int)moved.size(); i += 7) {
+    field.remove(i);
+    live[i] = false;
+  }
+  field.update();
+  TEST_CHECK(same_as_brute_force(field, live));
+
+  int added = field.add(s.points[0] + glm::vec3(1.0f, 0, 0), 1.2f);
+  TEST_CHECK(!live[added]);
+  live[added] = true;
+  int another = field.add(s.points[1] + glm::vec3(0, 1.0f, 0), 1.7f);
+  TEST_CHECK(another != added && !live[another]);
+  live[another] = true;
+  field.update(2);
+  TEST_CHECK(same_as_brute_force(field, live));
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  std::vector<uint8_t> text = test_read_file(dir + "/5wsn.pdb");
+
+  test_against_dense();
+  test_edits(molecule_scene(text, 400));
+  return test_result();
+}
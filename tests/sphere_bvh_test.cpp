@@ -0,0 +1,272 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// sphere_bvh tests: pick, pick4, nearest, for_each_in_sphere and
+// for_each_in_box against brute force, on random spheres, on spheres that
+// share centres and on the atoms of 5wsn, with rays along the axes that
+// start on the faces of boxes, and again after move() and refit().
+//
+
+#include <gilgamesh/sphere_bvh.hpp>
+#include <gilgamesh/decoders/pdb_decoder.hpp>
+#include <random>
+#include "test.hpp"
+
+using gilgamesh::sphere_bvh;
+
+struct spheres {
+  std::vector<glm::vec3> centres;
+  std::vector<float> radii;
+};
+
+// The nearer hit of a ray in front of its start, worked out as sphere_bvh does.
+static bool ray_sphere(glm::vec3 start, glm::vec3 dir, glm::vec3 centre, float radius, float &t) {
+  glm::vec3 c = centre - start;
+  float b = glm::dot(c, dir);
+  glm::vec3 perp = c - dir * b;
+  float q = radius * radius - glm::dot(perp, perp);
+  if (q < 0) return false;
+  t = b - std::sqrt(q);
+  return t > 0;
+}
+
+static float brute_pick(const spheres &s, glm::vec3 start, glm::vec3 dir) {
+  float best = 1e38f;
+  for (size_t i = 0; i != s.centres.size(); ++i) {
+    float t;
+    if (ray_sphere(start, dir, s.centres[i], s.radii[i], t)) best = std::min(best, t);
+  }
+  return best;
+}
+
+// A hit at the nearest distance; where spheres tie, any of them will do.
+// pick4 finds the distance with SSE2, so allow a little rounding there.
+static bool same_hit(const spheres &s, glm::vec3 start, glm::vec3 dir, int hit, float distance, float tolerance) {
+  float expected = brute_pick(s, start, dir);
+  if (expected == 1e38f) return hit == -1;
+  float t;
+  if (hit < 0 || hit >= (int)s.centres.size() || !ray_sphere(start, dir, s.centres[hit], s.radii[hit], t)) return false;
+  float slack = tolerance * (1 + expected);
+  return std::abs(distance - expected) <= slack && std::abs(t - expected) <= slack;
+}
+
+// Rays in random directions and along each axis, from random points and from
+// points on the faces of the spheres' boxes, where 0 * inf makes a NaN if the
+// slab test is careless.
+static std::vector<std::pair<glm::vec3, glm::vec3> > make_rays(const spheres &s, std::mt19937 &rng, int count) {
+  std::vector<std::pair<glm::vec3, glm::vec3> > rays;
+  std::uniform_real_distribution<float> unit(-1, 1);
+  glm::vec3 lo(1e38f), hi(-1e38f);
+  for (size_t i = 0; i != s.centres.size(); ++i) {
+    lo = glm::min(lo, s.centres[i] - s.radii[i]);
+    hi = glm::max(hi, s.centres[i] + s.radii[i]);
+  }
+  glm::vec3 pad = (hi - lo) * 0.25f + 1.0f;
+  auto point = [&]() {
+    glm::vec3 f(unit(rng), unit(rng), unit(rng));
+    return (lo + hi) * 0.5f + f * ((hi - lo) * 0.5f + pad);
+  };
+  for (int i = 0; i != count; ++i) {
+    glm::vec3 dir(unit(rng), unit(rng), unit(rng));
+    if (glm::dot(dir, dir) < 1e-4f) dir = glm::vec3(0, 0, 1);
+    rays.emplace_back(point(), glm::normalize(dir));
+
+    int axis = i % 3;
+    glm::vec3 along(0);
+    along[axis] = i % 2 ? 1.0f : -1.0f;
+    int k = (int)(rng() % s.centres.size());
+    glm::vec3 start = point();
+    // On the faces of sphere k's box in the other two axes, so 0 * inf happens at the leaf and above.
+    start[(axis + 1) % 3] = s.centres[k][(axis + 1) % 3] - s.radii[k];
+    start[(axis + 2) % 3] = s.centres[k][(axis + 2) % 3] + (i % 4 < 2 ? 0.0f : s.radii[k]);
+    rays.emplace_back(start, along);
+  }
+  return rays;
+}
+
+static bool check_picks(const sphere_bvh &bvh, const spheres &s, std::mt19937 &rng, int count) {
+  bool ok = true;
+  std::vector<std::pair<glm::vec3, glm::vec3> > rays = make_rays(s, rng, count);
+  for (auto &r : rays) {
+    float distance = 0;
+    int hit = bvh.pick(r.first, r.second, distance);
+    ok &= same_hit(s, r.first, r.second, hit, distance, 0);
+  }
+
+  // Packets of four rays from one start, as the sphere tracer sends them, from a
+  // random start and from one on a face.
+  for (size_t i = 0; i + 4 <= rays.size(); i += 2) {
+    glm::vec3 start = rays[i % 4 ? i + 1 : i].first;
+    glm::vec3 dir[4] = { rays[i].second, rays[i + 1].second, rays[i + 2].second, rays[i + 3].second };
+    int hit[4];
+    float distance[4];
+    bvh.pick4(start, dir, hit, distance);
+    for (int lane = 0; lane != 4; ++lane) {
+      ok &= same_hit(s, start, dir[lane], hit[lane], distance[lane], 1e-5f);
+    }
+  }
+  return ok;
+}
+
+static bool check_queries(const sphere_bvh &bvh, const spheres &s, std::mt19937 &rng, int count) {
+  bool ok = bvh.size() == (int)s.centres.size();
+  for (int i = 0; i != bvh.size(); ++i) {
+    ok &= bvh.centre(i) == s.centres[i] && bvh.radius(i) == s.radii[i];
+  }
+  std::uniform_real_distribution<float> unit(-1, 1);
+  std::uniform_real_distribution<float> size(0, 6);
+  for (int q = 0; q != count; ++q) {
+    // Around a sphere, often exactly at a centre, or anywhere.
+    glm::vec3 p = s.centres[rng() % s.centres.size()];
+    if (q % 3) p += glm::vec3(unit(rng), unit(rng), unit(rng)) * 4.0f;
+    float radius = q % 5 ? size(rng) : 0.0f;
+
+    std::vector<int> expected, found;
+    for (int i = 0; i != (int)s.centres.size(); ++i) {
+      glm::vec3 d = s.centres[i] - p;
+      if (glm::dot(d, d) <= radius * radius) expected.push_back(i);
+    }
+    bvh.for_each_in_sphere(p, radius, [&found](int i) { found.push_back(i); });
+    std::sort(found.begin(), found.end());
+    ok &= found == expected;
+
+    glm::vec3 lo = p - glm::vec3(size(rng), size(rng), size(rng)) * 0.5f;
+    glm::vec3 hi = p + glm::vec3(size(rng), size(rng), size(rng)) * 0.5f;
+    if (q % 7 == 0) hi = lo;
+    expected.clear();
+    found.clear();
+    for (int i = 0; i != (int)s.centres.size(); ++i) {
+      glm::vec3 c = s.centres[i];
+      if (glm::all(glm::lessThanEqual(lo, c)) && glm::all(glm::lessThanEqual(c, hi))) expected.push_back(i);
+    }
+    bvh.for_each_in_box(lo, hi, [&found](int i) { found.push_back(i); });
+    std::sort(found.begin(), found.end());
+    ok &= found == expected;
+
+    // The nearest centre; on a tie any of them will do.
+    float max_distance = q % 4 ? 1e30f : size(rng);
+    float best_d2 = max_distance * max_distance;
+    for (auto &c : s.centres) best_d2 = std::min(best_d2, glm::dot(c - p, c - p));
+    float distance = -1;
+    int nearest = bvh.nearest(p, max_distance, distance);
+    bool in_range = false;
+    for (auto &c : s.centres) in_range |= glm::dot(c - p, c - p) <= max_distance * max_distance;
+    if (!in_range) {
+      ok &= nearest == -1;
+    } else {
+      ok &= nearest >= 0 && nearest < (int)s.centres.size();
+      ok &= nearest >= 0 && glm::dot(s.centres[nearest] - p, s.centres[nearest] - p) == best_d2 && distance == std::sqrt(best_d2);
+    }
+  }
+  return ok;
+}
+
+// Move some spheres, some a long way and some to the centre of another, then refit.
+static void move_some(sphere_bvh &bvh, spheres &s, std::mt19937 &rng, int count) {
+  std::uniform_real_distribution<float> step(-3, 3);
+  int n = (int)s.centres.size();
+  for (int m = 0; m != count; ++m) {
+    int i = (int)(rng() % n);
+    glm::vec3 to = s.centres[i] + glm::vec3(step(rng), step(rng), step(rng));
+    if (m % 10 == 0) to *= 3.0f;
+    if (m % 10 == 1) to = s.centres[rng() % n];
+    s.centres[i] = to;
+    if (m % 2) {
+      s.radii[i] = 0.5f + std::abs(step(rng));
+      bvh.move(i, to, s.radii[i]);
+    } else {
+      bvh.move(i, to);
+    }
+  }
+  bvh.refit();
+}
+
+static void test_spheres(const char *name, spheres s, unsigned seed) {
+  std::mt19937 rng(seed);
+  int n = (int)s.centres.size();
+  sphere_bvh bvh(s.centres, s.radii, 1);
+  bool picks = check_picks(bvh, s, rng, 300), queries = check_queries(bvh, s, rng, 300);
+  TEST_CHECK(picks && queries);
+  if (!picks || !queries) printf("  %s: %s\n", name, picks ? "queries" : "picks");
+
+  // Built on several threads, the tree gives the same answers.
+  sphere_bvh threaded(s.centres, s.radii, 4);
+  TEST_CHECK(check_picks(threaded, s, rng, 100) && check_queries(threaded, s, rng, 100));
+
+  if (n == 0) return;
+  for (int round = 0; round != 3; ++round) {
+    move_some(bvh, s, rng, std::max(n / 20, 1));
+    picks = check_picks(bvh, s, rng, 200);
+    queries = check_queries(bvh, s, rng, 200);
+    TEST_CHECK(picks && queries);
+    if (!picks || !queries) printf("  %s after move %d: %s\n", name, round, picks ? "queries" : "picks");
+  }
+}
+
+static spheres random_spheres(int n, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> coord(-20, 20), radius(0.5f, 2.0f);
+  spheres s;
+  for (int i = 0; i != n; ++i) {
+    s.centres.emplace_back(coord(rng), coord(rng), coord(rng));
+    s.radii.push_back(radius(rng));
+  }
+  return s;
+}
+
+// Spheres on whole numbers, many of them at the same centre as others, so
+// that boxes share faces and Morton codes are equal.
+static spheres duplicate_spheres(int n, unsigned seed) {
+  std::mt19937 rng(seed);
+  spheres s;
+  for (int i = 0; i != n; ++i) {
+    if (i && rng() % 3 == 0) {
+      s.centres.push_back(s.centres[rng() % i]);
+    } else {
+      s.centres.emplace_back((float)(rng() % 12), (float)(rng() % 12), (float)(rng() % 12));
+    }
+    s.radii.push_back(i % 2 ? 0.5f : 1.0f);
+  }
+  return s;
+}
+
+static spheres molecule_spheres(const std::vector<uint8_t> &text) {
+  gilgamesh::pdb_decoder pdb(text.data(), text.data() + text.size());
+  spheres s;
+  for (auto &a : pdb.allAtoms()) {
+    s.centres.push_back(a.pos());
+    s.radii.push_back(a.vanDerVaalsRadius());
+  }
+  return s;
+}
+
+static void test_empty() {
+  sphere_bvh empty(std::vector<glm::vec3>(), std::vector<float>(), 1);
+  float distance = 0;
+  TEST_CHECK(empty.size() == 0);
+  TEST_CHECK(empty.pick(glm::vec3(0), glm::vec3(0, 0, 1), distance) == -1);
+  TEST_CHECK(empty.nearest(glm::vec3(0), 1e30f, distance) == -1);
+  int calls = 0;
+  empty.for_each_in_sphere(glm::vec3(0), 1e30f, [&calls](int) { ++calls; });
+  empty.for_each_in_box(glm::vec3(-1e30f), glm::vec3(1e30f), [&calls](int) { ++calls; });
+  TEST_CHECK(calls == 0);
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+
+  test_empty();
+  for (int n : { 1, 2, 3, 17 }) test_spheres("small", random_spheres(n, n), n);
+  test_spheres("random", random_spheres(3000, 1), 1);
+  test_spheres("duplicates", duplicate_spheres(2000, 2), 2);
+
+  // All at one centre, where every Morton code is the same.
+  spheres same;
+  same.centres.assign(100, glm::vec3(1, 2, 3));
+  same.radii.assign(100, 1.5f);
+  test_spheres("one centre", same, 3);
+
+  test_spheres("5wsn", molecule_spheres(test_read_file(dir + "/5wsn.pdb")), 4);
+  return test_result();
+}
@@ -0,0 +1,39 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// Helpers shared by the tests.
+//
+
+#ifndef MOOVOO_TEST_INCLUDED
+#define MOOVOO_TEST_INCLUDED
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+
+static int test_failures = 0;
+
+// Report a failed check and carry on, so that one run shows every failure.
+#define TEST_CHECK(cond) \
+  do { if (!(cond)) { ++test_failures; printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); } } while (0)
+
+// The exit code of a test program.
+inline int test_result() {
+  printf(test_failures ? "%d checks failed\n" : "ok\n", test_failures);
+  return test_failures ? 1 : 0;
+}
+
+inline std::vector<uint8_t> test_read_file(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    ++test_failures;
+    printf("could not read %s\n", path.c_str());
+  }
+  return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+#endif
@@ -0,0 +1,215 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// zipfile_reader tests: a zip with stored, deflated, empty and data
+// descriptor entries, and some damaged ones, read with read(), read_entry(),
+// extract_all() and extract_all_into() on several threads.
+//
+
+#include <andyzip/zipfile_reader.hpp>
+#include <andyzip/deflate_encoder.hpp>
+#include <map>
+#include "test.hpp"
+
+// Builds a zip in memory.
+class zip_writer {
+public:
+  enum { stored = 0, deflated = 8 };
+
+  // Add a file. With descriptor, the local header has no CRC or sizes and a
+  // data descriptor follows the data, as a streaming zipper writes.
+  // bad_crc stores a wrong CRC in both headers, and truncate drops bytes from the data.
+  void add(const std::string &name, const std::vector<uint8_t> &text, int method, bool descriptor = false, bool bad_crc = false, size_t truncate = 0) {
+    std::vector<uint8_t> data = text;
+    if (method == deflated) {
+      data.clear();
+      andyzip::deflate_encoder(6).encode(data, text.data(), text.data() + text.size());
+    }
+    data.resize(data.size() - truncate);
+    uint32_t crc = andyzip::crc32(text.data(), text.data() + text.size()) ^ (bad_crc ? 1 : 0);
+    uint32_t offset = (uint32_t)zip_.size();
+    uint16_t flags = descriptor ? 8 : 0;
+
+    put4(zip_, 0x04034b50);
+    put2(zip_, 20);
+    put2(zip_, flags);
+    put2(zip_, method);
+    put4(zip_, 0);
+    put4(zip_, descriptor ? 0 : crc);
+    put4(zip_, descriptor ? 0 : (uint32_t)data.size());
+    put4(zip_, descriptor ? 0 : (uint32_t)text.size());
+    put2(zip_, name.size());
+    put2(zip_, 0);
+    zip_.insert(zip_.end(), name.begin(), name.end());
+    zip_.insert(zip_.end(), data.begin(), data.end());
+    if (descriptor) {
+      put4(zip_, 0x08074b50);
+      put4(zip_, crc);
+      put4(zip_, (uint32_t)data.size());
+      put4(zip_, (uint32_t)text.size());
+    }
+
+    put4(dir_, 0x02014b50);
+    put2(dir_, 20);
+    put2(dir_, 20);
+    put2(dir_, flags);
+    put2(dir_, method);
+    put4(dir_, 0);
+    put4(dir_, crc);
+    put4(dir_, (uint32_t)data.size());
+    put4(dir_, (uint32_t)text.size());
+    put2(dir_, name.size());
+    put2(dir_, 0);
+    put2(dir_, 0);
+    put2(dir_, 0);
+    put2(dir_, 0);
+    put4(dir_, 0);
+    put4(dir_, offset);
+    dir_.insert(dir_.end(), name.begin(), name.end());
+    ++num_files_;
+  }
+
+  // The zip with its central directory and end record.
+  std::vector<uint8_t> finish() const {
+    std::vector<uint8_t> result = zip_;
+    result.insert(result.end(), dir_.begin(), dir_.end());
+    put4(result, 0x06054b50);
+    put2(result, 0);
+    put2(result, 0);
+    put2(result, num_files_);
+    put2(result, num_files_);
+    put4(result, (uint32_t)dir_.size());
+    put4(result, (uint32_t)zip_.size());
+    put2(result, 0);
+    return result;
+  }
+private:
+  static void put2(std::vector<uint8_t> &dest, size_t v) {
+    dest.push_back((uint8_t)v);
+    dest.push_back((uint8_t)(v >> 8));
+  }
+
+  static void put4(std::vector<uint8_t> &dest, uint32_t v) {
+    put2(dest, v & 0xffff);
+    put2(dest, v >> 16);
+  }
+
+  std::vector<uint8_t> zip_;
+  std::vector<uint8_t> dir_;
+  size_t num_files_ = 0;
+};
+
+static bool read_throws(const zipfile_reader &reader, const std::string &name) {
+  try {
+    reader.read(name);
+  } catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  std::string dir = argc > 1 ? argv[1] : "molecules";
+  std::vector<uint8_t> pdb = test_read_file(dir + "/5wsn.pdb");
+  std::vector<uint8_t> cif = test_read_file(dir + "/2tgt.cif");
+  std::vector<uint8_t> small(cif.begin(), cif.begin() + 1000);
+  std::vector<uint8_t> empty;
+
+  zip_writer writer;
+  writer.add("stored.cif", small, zip_writer::stored);
+  writer.add("deflated.cif", cif, zip_writer::deflated);
+  writer.add("empty", empty, zip_writer::stored);
+  writer.add("empty.deflated", empty, zip_writer::deflated);
+  writer.add("descriptor.pdb", pdb, zip_writer::deflated, true);
+  writer.add("descriptor.stored", small, zip_writer::stored, true);
+  writer.add("bad_crc.cif", cif, zip_writer::deflated, false, true);
+  writer.add("truncated.pdb", pdb, zip_writer::deflated, false, false, 1000);
+  writer.add("bad_method", small, 12);
+  std::vector<uint8_t> zip = writer.finish();
+
+  std::map<std::string, std::vector<uint8_t> > expected = {
+    { "stored.cif", small }, { "deflated.cif", cif }, { "empty", empty }, { "empty.deflated", empty },
+    { "descriptor.pdb", pdb }, { "descriptor.stored", small },
+  };
+  std::vector<std::string> expected_failed = { "bad_crc.cif", "bad_method", "truncated.pdb" };
+
+  zipfile_reader reader(zip.data(), zip.data() + zip.size());
+  std::vector<std::string> names = reader.filenames();
+  TEST_CHECK(names.size() == 9 && names[0] == "stored.cif" && names[8] == "bad_method");
+
+  // The central directory as entries.
+  std::vector<zipfile_reader::entry> entries = reader.entries();
+  TEST_CHECK(entries.size() == 9);
+  TEST_CHECK(entries[1].name == "deflated.cif" && entries[1].method == 8 && entries[1].size == cif.size());
+  TEST_CHECK(entries[1].crc == andyzip::crc32(cif.data(), cif.data() + cif.size()));
+  TEST_CHECK(entries[4].local_header == reader.get_dir_entry("descriptor.pdb"));
+  TEST_CHECK(reader.get_dir_entry("missing") == nullptr);
+
+  // read() and read_entry(), which take the sizes from the central directory.
+  for (auto &f : expected) {
+    TEST_CHECK(reader.read(f.first) == f.second);
+  }
+  std::vector<const uint8_t *> dir_entries = reader.dir_entries();
+  TEST_CHECK(dir_entries.size() == 9 && reader.read_entry(dir_entries[4]) == pdb);
+  for (auto &name : expected_failed) {
+    TEST_CHECK(read_throws(reader, name));
+  }
+  TEST_CHECK(read_throws(reader, "missing"));
+
+  for (unsigned threads : { 1, 2, 4, 8 }) {
+    // Every file, into the reader's buffers.
+    std::map<std::string, std::vector<uint8_t> > extracted;
+    std::mutex mutex;
+    std::vector<std::string> failed = reader.extract_all(
+      [](const zipfile_reader::entry &) { return true; },
+      [&](const zipfile_reader::entry &e, const uint8_t *b, const uint8_t *end) {
+        std::lock_guard<std::mutex> lock(mutex);
+        extracted[e.name].assign(b, end);
+      },
+      threads
+    );
+    std::sort(failed.begin(), failed.end());
+    TEST_CHECK(failed == expected_failed);
+    TEST_CHECK(extracted == expected);
+
+    // The .cif and .pdb files, into buffers of our own.
+    std::map<std::string, std::vector<uint8_t> > buffers;
+    for (auto &e : entries) buffers[e.name].resize(e.size);
+    std::atomic<int> calls(0);
+    failed = reader.extract_all_into(
+      [](const zipfile_reader::entry &e) { return e.name.find('.') != std::string::npos && e.name != "empty.deflated"; },
+      [&](const zipfile_reader::entry &e) { return buffers[e.name].data(); },
+      [&](const zipfile_reader::entry &e, const uint8_t *b, const uint8_t *end) {
+        calls += b == buffers[e.name].data() && end == b + e.size;
+      },
+      threads
+    );
+    std::sort(failed.begin(), failed.end());
+    TEST_CHECK(failed == std::vector<std::string>({ "bad_crc.cif", "truncated.pdb" }));
+    TEST_CHECK(calls == 4);
+    for (auto name : { "stored.cif", "deflated.cif", "descriptor.pdb", "descriptor.stored" }) {
+      TEST_CHECK(buffers[name] == expected[name]);
+    }
+  }
+
+  // A file that is not a zip.
+  bool threw = false;
+  try {
+    zipfile_reader bad(cif.data(), cif.data() + cif.size());
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  TEST_CHECK(threw);
+
+  // crc32 against known values, and in pieces.
+  const char *check = "123456789";
+  TEST_CHECK(andyzip::crc32((const uint8_t *)check, (const uint8_t *)check + 9) == 0xcbf43926u);
+  TEST_CHECK(andyzip::crc32(nullptr, nullptr) == 0);
+  uint32_t whole = andyzip::crc32(pdb.data(), pdb.data() + pdb.size());
+  for (size_t cut : { (size_t)1, (size_t)7, pdb.size() / 2, pdb.size() - 3 }) {
+    TEST_CHECK(andyzip::crc32(pdb.data() + cut, pdb.data() + pdb.size(), andyzip::crc32(pdb.data(), pdb.data() + cut)) == whole);
+  }
+
+  return test_result();
+}
@@ -0,0 +1,124 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2017
+//
+// zone_tracer tests: zones on many threads are all recorded and exported,
+// and clear() is not undone by threads recording at the same time.
+//
+
+#define GILGAMESH_TRACE
+#include <gilgamesh/zone_tracer.hpp>
+#include <gilgamesh/parallel.hpp>
+#include <thread>
+#include <cstring>
+#include "test.hpp"
+
+using gilgamesh::zone_tracer;
+
+static size_t count_events(const char *name) {
+  size_t n = 0;
+  zone_tracer::instance().for_each([&](int, const zone_tracer::event &e) { n += !strcmp(e.name, name); });
+  return n;
+}
+
+static size_t count(const std::string &text, const std::string &what) {
+  size_t n = 0;
+  for (size_t p = text.find(what); p != std::string::npos; p = text.find(what, p + 1)) ++n;
+  return n;
+}
+
+static void outer(int i) {
+  GILGAMESH_ZONE("outer");
+  GILGAMESH_ZONE_ITEMS(i);
+  {
+    GILGAMESH_ZONE("inner");
+    GILGAMESH_ZONE_ITEMS(1);
+  }
+}
+
+static void test_zones() {
+  zone_tracer &tracer = zone_tracer::instance();
+  tracer.clear();
+  const int num_tasks = 1000;
+  gilgamesh::parallel_for(num_tasks, 4, outer);
+
+  auto totals = tracer.totals();
+  TEST_CHECK(totals["outer"].calls == num_tasks);
+  TEST_CHECK(totals["outer"].items == (uint64_t)num_tasks * (num_tasks - 1) / 2);
+  TEST_CHECK(totals["inner"].calls == num_tasks);
+  TEST_CHECK(totals["inner"].items == num_tasks);
+  TEST_CHECK(totals["outer"].total_ns >= totals["inner"].total_ns);
+  TEST_CHECK(tracer.dropped() == 0);
+
+  // Each inner zone lies within an outer zone on the same thread.
+  bool nested = true;
+  std::vector<std::pair<int, zone_tracer::event> > events;
+  tracer.for_each([&](int thread, const zone_tracer::event &e) { events.emplace_back(thread, e); });
+  for (size_t i = 0; i != events.size(); ++i) {
+    const zone_tracer::event &e = events[i].second;
+    if (strcmp(e.name, "inner")) continue;
+    // Zones finish inner first, so the outer zone is the next event on the thread.
+    nested &= i + 1 != events.size() && events[i + 1].first == events[i].first && !strcmp(events[i + 1].second.name, "outer");
+    if (i + 1 != events.size()) {
+      const zone_tracer::event &o = events[i + 1].second;
+      nested &= o.start_ns <= e.start_ns && e.start_ns + e.duration_ns <= o.start_ns + o.duration_ns;
+    }
+  }
+  TEST_CHECK(nested);
+
+  std::string json = tracer.chrome_json();
+  TEST_CHECK(!json.compare(0, 38, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":"));
+  TEST_CHECK(json.size() > 4 && !json.compare(json.size() - 4, 4, "\n]}\n"));
+  TEST_CHECK(count(json, "\"ph\":\"X\"") == num_tasks * 2);
+  TEST_CHECK(count(json, "\"name\":\"outer\"") == num_tasks);
+  TEST_CHECK(count(json, "\"name\":\"inner\"") == num_tasks);
+  TEST_CHECK(count(json, "\"args\":{\"items\":1}}") >= num_tasks);
+  TEST_CHECK(count(json, "{") == count(json, "}"));
+
+  tracer.clear();
+  TEST_CHECK(tracer.totals().empty());
+  TEST_CHECK(tracer.chrome_json() == "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n\n]}\n");
+}
+
+// Threads record all the time while the main thread clears. Each event holds the
+// phase it was made in, so after a clear at most one event per thread, the one
+// it was recording at the time, may be from an earlier phase.
+static void test_clear_while_recording() {
+  zone_tracer &tracer = zone_tracer::instance();
+  const int num_threads = 3;
+  std::atomic<uint64_t> phase(1);
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> threads;
+  for (int t = 0; t != num_threads; ++t) {
+    threads.emplace_back([&]() {
+      for (int i = 0; !stop; ++i) {
+        uint64_t p = phase.load();
+        tracer.record("race", 0, 0, p);
+        if (i % 256 == 0) std::this_thread::yield();
+      }
+    });
+  }
+
+  // A clear() lost between another thread's load and store of the event count is rare, so keep at it for a while.
+  bool ok = true;
+  auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(300);
+  for (uint64_t p = 2; std::chrono::steady_clock::now() < end; ++p) {
+    phase.store(p);
+    tracer.clear();
+    size_t stale = 0;
+    tracer.for_each([&](int, const zone_tracer::event &e) { stale += e.items < p; });
+    ok &= stale <= num_threads;
+  }
+  stop = true;
+  for (auto &t : threads) t.join();
+  TEST_CHECK(ok);
+  tracer.clear();
+  TEST_CHECK(count_events("race") == 0);
+}
+
+int main(int argc, char **argv) {
+  TEST_CHECK(zone_tracer::enabled());
+  test_zones();
+  test_clear_while_recording();
+  return test_result();
+}